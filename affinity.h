@@ -0,0 +1,255 @@
+/*
+ * affinity.h
+ *
+ * Pinning of search threads and input/output helper threads to CPUs
+ * (see --cpu-affinity).
+ */
+
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __linux__
+# include <pthread.h>
+# include <sched.h>
+#endif
+#include "assert_helpers.h"
+
+/**
+ * Decides which CPUs each thread may run on and pins threads as they
+ * start.  Search thread i (1-based) is pinned to a single CPU; helper
+ * threads (input readahead, output writers, and the BGZF threads that
+ * inflate BAM input and deflate output) share the CPUs no search thread
+ * was given, or all chosen CPUs if the search threads use them all.
+ * The plan is one of:
+ *
+ *   compact   fill each core's hardware threads, then the next core,
+ *             then the next socket, so search threads share caches
+ *   scatter   one search thread per core, alternating sockets, before
+ *             any core gets a second one, for the most cache per thread
+ *   <list>    CPU ids such as "0,2,4-7", handed to search threads in
+ *             the order given (wrapping around if there are fewer CPUs
+ *             than threads)
+ *
+ * Only CPUs the process is already allowed to run on are used with
+ * compact and scatter.  Pinning is only implemented on Linux; elsewhere
+ * the option is accepted and ignored with a warning.
+ */
+class CpuAffinity {
+
+	/// Topology of one CPU, for sorting
+	struct Cpu {
+		int id;
+		int pkg;  /// physical package (socket)
+		int core; /// core id within the package
+		int smt;  /// index among the core's hardware threads
+		int rank; /// index of the core within its package
+	};
+
+	struct CompactOrder {
+		bool operator()(const Cpu& a, const Cpu& b) const {
+			if(a.pkg != b.pkg) return a.pkg < b.pkg;
+			if(a.core != b.core) return a.core < b.core;
+			return a.id < b.id;
+		}
+	};
+
+	struct ScatterOrder {
+		bool operator()(const Cpu& a, const Cpu& b) const {
+			if(a.smt != b.smt) return a.smt < b.smt;
+			if(a.rank != b.rank) return a.rank < b.rank;
+			if(a.pkg != b.pkg) return a.pkg < b.pkg;
+			return a.id < b.id;
+		}
+	};
+
+public:
+
+	CpuAffinity() : enabled_(false) { }
+
+	/**
+	 * Plan CPUs for 'nthreads' search threads according to 'spec'.
+	 * Prints an error and throws if 'spec' is malformed.
+	 */
+	void plan(const std::string& spec, int nthreads) {
+		std::vector<int> order;
+		if(spec == "compact" || spec == "scatter") {
+			std::vector<Cpu> cpus = topology();
+			if(spec == "compact") {
+				std::sort(cpus.begin(), cpus.end(), CompactOrder());
+			} else {
+				std::sort(cpus.begin(), cpus.end(), ScatterOrder());
+			}
+			for(size_t i = 0; i < cpus.size(); i++) order.push_back(cpus[i].id);
+		} else {
+			order = parseList(spec);
+		}
+		if(order.empty()) {
+			std::cerr << "Error: --cpu-affinity found no CPUs to use" << std::endl;
+			throw 1;
+		}
+		workers_.clear();
+		helpers_.clear();
+		for(int i = 0; i < nthreads; i++) {
+			workers_.push_back(order[i % order.size()]);
+		}
+		for(size_t i = (size_t)nthreads; i < order.size(); i++) {
+			helpers_.push_back(order[i]);
+		}
+		if(helpers_.empty()) helpers_ = order;
+		enabled_ = true;
+#ifndef __linux__
+		std::cerr << "Warning: --cpu-affinity is only supported on Linux; ignoring" << std::endl;
+		enabled_ = false;
+#endif
+	}
+
+	/**
+	 * Pin the calling thread, search thread 'tid' (1-based).
+	 */
+	void pinWorker(int tid) const {
+		if(!enabled_) return;
+		assert_gt(tid, 0);
+		std::vector<int> one(1, workers_[(tid - 1) % workers_.size()]);
+		pin(one);
+	}
+
+	/**
+	 * Pin the calling thread, a helper thread, to the helper CPUs.
+	 */
+	void pinHelper() const {
+		if(!enabled_) return;
+		pin(helpers_);
+	}
+
+	/**
+	 * Print the CPUs chosen for search and helper threads.
+	 */
+	void printPlan(std::ostream& os) const {
+		if(!enabled_) return;
+		os << "CPU affinity: search threads on";
+		for(size_t i = 0; i < workers_.size(); i++) os << " " << workers_[i];
+		os << "; helper threads on";
+		for(size_t i = 0; i < helpers_.size(); i++) os << " " << helpers_[i];
+		os << std::endl;
+	}
+
+private:
+
+	/**
+	 * Parse a list such as "0,2,4-7".
+	 */
+	static std::vector<int> parseList(const std::string& spec) {
+		std::vector<int> ret;
+		std::istringstream ss(spec);
+		std::string tok;
+		while(std::getline(ss, tok, ',')) {
+			int lo, hi;
+			char dash;
+			std::istringstream ts(tok);
+			if(!(ts >> lo) || lo < 0) badList(spec);
+			hi = lo;
+			if(ts >> dash) {
+				if(dash != '-' || !(ts >> hi) || hi < lo) badList(spec);
+			}
+			if(ts >> dash) badList(spec);
+			for(int i = lo; i <= hi; i++) ret.push_back(i);
+		}
+		return ret;
+	}
+
+	static void badList(const std::string& spec) {
+		std::cerr << "Error: --cpu-affinity must be compact, scatter, or a list of CPUs "
+		          << "such as 0,2,4-7; got \"" << spec << "\"" << std::endl;
+		throw 1;
+	}
+
+	/**
+	 * Return the CPUs this process may run on, with their topology.
+	 */
+	static std::vector<Cpu> topology() {
+		std::vector<Cpu> cpus;
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if(sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+		for(int i = 0; i < CPU_SETSIZE; i++) {
+			if(!CPU_ISSET(i, &set)) continue;
+			Cpu c;
+			c.id = i;
+			c.pkg = readTopology(i, "physical_package_id");
+			c.core = readTopology(i, "core_id");
+			c.smt = c.rank = 0;
+			cpus.push_back(c);
+		}
+		// Number hardware threads within cores and cores within packages
+		std::sort(cpus.begin(), cpus.end(), CompactOrder());
+		for(size_t i = 0; i < cpus.size(); i++) {
+			if(i == 0 || cpus[i].pkg != cpus[i-1].pkg) {
+				cpus[i].rank = 0;
+				cpus[i].smt = 0;
+			} else if(cpus[i].core != cpus[i-1].core) {
+				cpus[i].rank = cpus[i-1].rank + 1;
+				cpus[i].smt = 0;
+			} else {
+				cpus[i].rank = cpus[i-1].rank;
+				cpus[i].smt = cpus[i-1].smt + 1;
+			}
+		}
+#endif
+		return cpus;
+	}
+
+	/**
+	 * Read a topology attribute of CPU 'cpu' from sysfs; 0 if absent.
+	 */
+	static int readTopology(int cpu, const char *attr) {
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, attr);
+		FILE *f = fopen(path, "r");
+		if(f == NULL) return 0;
+		int v = 0;
+		if(fscanf(f, "%d", &v) != 1) v = 0;
+		fclose(f);
+		return v;
+	}
+
+	/**
+	 * Restrict the calling thread to 'cpus'.  Failure (e.g. a CPU that
+	 * doesn't exist) only earns a warning, printed once.
+	 */
+	static void pin(const std::vector<int>& cpus) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(size_t i = 0; i < cpus.size(); i++) {
+			if(cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+		}
+		static volatile bool warned = false;
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 && !warned) {
+			warned = true;
+			std::cerr << "Warning: could not set CPU affinity of a thread; check --cpu-affinity\n";
+		}
+#endif
+	}
+
+	bool enabled_;
+	std::vector<int> workers_; /// CPU for each search thread
+	std::vector<int> helpers_; /// CPUs for helper threads
+};
+
+/**
+ * The process-wide affinity plan.
+ */
+inline CpuAffinity& gCpuAffinity() {
+	static CpuAffinity a;
+	return a;
+}
+
+#endif /* AFFINITY_H_ */
@@ -20,6 +20,7 @@
 #include "ref_aligner.h"
 #include "reference.h"
 #include "aligner_metrics.h"
+#include "insert_size.h"
 #include "search_globals.h"
 
 /**
@@ -389,6 +390,12 @@ public:
 			sinkPt_->finishRead(*patsrc_, true, true);
 			return;
 		}
+		if(sinkPt_->checkCache(*patsrc)) {
+			// Duplicate of an already-aligned read
+			this->done = true;
+			sinkPt_->finishRead(*patsrc_, true, true);
+			return;
+		}
 		driver_->setQuery(patsrc, NULL);
 		this->done = driver_->done;
 		doneFirst_ = false;
@@ -416,10 +423,10 @@ public:
 		params_->setFw(ra.fw);
 		assert_eq(bufa_->color, color);
 		return params_->reportHit(
-				ra.fw ? (ebwtFw? bufa_->patFw    : bufa_->patFwRev) :
-				        (ebwtFw? bufa_->patRc    : bufa_->patRcRev),
-				ra.fw ? (ebwtFw? &bufa_->qual    : &bufa_->qualRev) :
-				        (ebwtFw? &bufa_->qualRev : &bufa_->qual),
+				ra.fw ? (ebwtFw? bufa_->patFw    : bufa_->getPatFwRev()) :
+				        (ebwtFw? bufa_->getPatRc() : bufa_->getPatRcRev()),
+				ra.fw ? (ebwtFw? &bufa_->qual    : &bufa_->getQualRev()) :
+				        (ebwtFw? &bufa_->getQualRev() : &bufa_->qual),
 				&bufa_->name,
 				bufa_->color,
 				bufa_->primer,
@@ -680,6 +687,7 @@ public:
 		delete[] btCnt_;   btCnt_     = NULL;
 		delete refAligner_; refAligner_ = NULL;
 		sinkPtFactory_.destroy(sinkPt_); sinkPt_ = NULL;
+		gInsertModel().addStats(insStats_);
 	}
 
 	/**
@@ -831,10 +839,10 @@ protected:
 		assert_eq(bufL->color, color);
 		// Print upstream mate first
 		ret = params_->reportHit(
-				rL.fw ? (ebwtFwL?  bufL->patFw  :  bufL->patFwRev) :
-					    (ebwtFwL?  bufL->patRc  :  bufL->patRcRev),
-				rL.fw ? (ebwtFwL? &bufL->qual    : &bufL->qualRev) :
-				        (ebwtFwL? &bufL->qualRev : &bufL->qual),
+				rL.fw ? (ebwtFwL?  bufL->patFw  :  bufL->getPatFwRev()) :
+					    (ebwtFwL?  bufL->getPatRc() :  bufL->getPatRcRev()),
+				rL.fw ? (ebwtFwL? &bufL->qual    : &bufL->getQualRev()) :
+				        (ebwtFwL? &bufL->getQualRev() : &bufL->qual),
 				&bufL->name,
 				bufL->color,
 				bufL->primer,
@@ -866,10 +874,10 @@ protected:
 		params_->setFw(rR.fw);
 		assert_eq(bufR->color, color);
 		ret = params_->reportHit(
-				rR.fw ? (ebwtFwR?  bufR->patFw  :  bufR->patFwRev) :
-					    (ebwtFwR?  bufR->patRc  :  bufR->patRcRev),
-				rR.fw ? (ebwtFwR? &bufR->qual    : &bufR->qualRev) :
-				        (ebwtFwR? &bufR->qualRev : &bufR->qual),
+				rR.fw ? (ebwtFwR?  bufR->patFw  :  bufR->getPatFwRev()) :
+					    (ebwtFwR?  bufR->getPatRc() :  bufR->getPatRcRev()),
+				rR.fw ? (ebwtFwR? &bufR->qual    : &bufR->getQualRev()) :
+				        (ebwtFwR? &bufR->getQualRev() : &bufR->qual),
 				&bufR->name,
 				bufR->color,
 				bufR->primer,
@@ -913,60 +921,17 @@ protected:
 	}
 
 	/**
-	 * Given a vector of reference positions where one of the two mates
-	 * (the "anchor" mate) has aligned, look directly at the reference
-	 * sequence for instances where the other mate (the "outstanding"
-	 * mate) aligns such that mating constraint is satisfied.
+	 * Set begin/end to be a range of all reference positions that are
+	 * legally permitted to be involved in the alignment of the
+	 * outstanding mate, given an anchor of length alen at toff and
+	 * insert lengths minins-maxins.  Return false if the outstanding
+	 * mate can't fit.
 	 */
-	bool resolveOutstandingInRef(const bool off1,
-	                             const UPair& off,
-	                             const TIndexOffU tlen,
-	                             const Range& range)
+	bool mateWindow(int minins, int maxins, bool matchRight,
+	                TIndexOffU tidx, TIndexOffU toff,
+	                uint32_t alen, uint32_t qlen,
+	                TIndexOffU& begin, TIndexOffU& end) const
 	{
-		assert(refs_->loaded());
-		assert_lt(off.first, refs_->numRefs());
-		// If matchRight is true, then we're trying to align the other
-		// mate to the right of the already-aligned mate.  Otherwise,
-		// to the left.
-		bool matchRight = (off1 ? !doneFw_ : doneFw_);
-		// Sequence and quals for mate to be matched
-		bool fw = off1 ? fw2_ : fw1_; // whether outstanding mate is fw/rc
-		if(doneFw_) fw = !fw;
-		// 'seq' gets sequence of outstanding mate w/r/t the forward
-		// reference strand
-		const String<Dna5>& seq  = fw ? (off1 ? patsrc_->bufb().patFw   :
-		                                        patsrc_->bufa().patFw)  :
-		                                (off1 ? patsrc_->bufb().patRc   :
-		                                        patsrc_->bufa().patRc);
-		// 'seq' gets qualities of outstanding mate w/r/t the forward
-		// reference strand
-		const String<char>& qual = fw ? (off1 ? patsrc_->bufb().qual  :
-		                                        patsrc_->bufa().qual) :
-		                                (off1 ? patsrc_->bufb().qualRev  :
-		                                        patsrc_->bufa().qualRev);
-		uint32_t qlen = (uint32_t)seqan::length(seq);  // length of outstanding mate
-		uint32_t alen = (off1 ? patsrc_->bufa().length() :
-		                        patsrc_->bufb().length());
-		int minins = minInsert_;
-		int maxins = maxInsert_;
-		// Let minins and maxins be the minimum and maximum insert
-		// lengths once we account for the trimming applied to the
-		// mates.  The idea is that the insert constraint placed by
-		// the user applies to the raw reads, not the trimmed reads.
-		if(fw1_) {
-			minins = max<int>(0, minins - patsrc_->bufa().trimmed5);
-			maxins = max<int>(0, maxins - patsrc_->bufa().trimmed5);
-		} else {
-			minins = max<int>(0, minins - patsrc_->bufa().trimmed3);
-			maxins = max<int>(0, maxins - patsrc_->bufa().trimmed3);
-		}
-		if(fw2_) {
-			minins = max<int>(0, minins - patsrc_->bufb().trimmed3);
-			maxins = max<int>(0, maxins - patsrc_->bufb().trimmed3);
-		} else {
-			minins = max<int>(0, minins - patsrc_->bufb().trimmed5);
-			maxins = max<int>(0, maxins - patsrc_->bufb().trimmed5);
-		}
 		// Sanity check minins and maxins
 		assert_geq(minins, 0);
 		assert_geq(maxins, 0);
@@ -976,16 +941,9 @@ protected:
 		if((uint32_t)maxins <= max(qlen, alen)) {
 			return false;
 		}
-		const TIndexOffU tidx = off.first;
-		const TIndexOffU toff = off.second;
-		// Set begin/end to be a range of all reference
-		// positions that are legally permitted to be involved in
-		// the alignment of the outstanding mate.
-		//
 		// Note that one of the constraints imposed on which positions
 		// go into this range is that the opposite mate cannot be
 		// contained entirely within the anchor mate, or vice versa.
-		TIndexOffU begin, end;
 		TIndexOffU insDiff = maxins - minins;
 		if(matchRight) {
 			end = toff + maxins;
@@ -1021,11 +979,105 @@ protected:
 		// Check if there's not enough space in the range to fit an
 		// alignment for the outstanding mate.
 		if(end - begin < qlen) return false;
+		return true;
+	}
+
+	/**
+	 * If the library's insert sizes have been learned (--learn-ins)
+	 * and they narrow the window begin-end, set nbegin/nend to the
+	 * narrower window and return true.
+	 */
+	bool narrowWindow(int trim, int minins, int maxins, bool matchRight,
+	                  TIndexOffU tidx, TIndexOffU toff,
+	                  uint32_t alen, uint32_t qlen,
+	                  TIndexOffU begin, TIndexOffU end,
+	                  TIndexOffU& nbegin, TIndexOffU& nend) const
+	{
+		uint32_t lo, hi;
+		if(!gInsertModel().window(lo, hi)) return false;
+		int nminins = max<int>(minins, (int)lo - trim);
+		int nmaxins = min<int>(maxins, (int)hi - trim);
+		if(nminins >= nmaxins) return false;
+		if(nminins == minins && nmaxins == maxins) return false;
+		if(!mateWindow(nminins, nmaxins, matchRight, tidx, toff, alen, qlen, nbegin, nend)) {
+			return false;
+		}
+		nbegin = max<TIndexOffU>(nbegin, begin);
+		nend = min<TIndexOffU>(nend, end);
+		return nend > nbegin;
+	}
+
+	/**
+	 * Given a vector of reference positions where one of the two mates
+	 * (the "anchor" mate) has aligned, look directly at the reference
+	 * sequence for instances where the other mate (the "outstanding"
+	 * mate) aligns such that mating constraint is satisfied.
+	 */
+	bool resolveOutstandingInRef(const bool off1,
+	                             const UPair& off,
+	                             const TIndexOffU tlen,
+	                             const Range& range)
+	{
+		assert(refs_->loaded());
+		assert_lt(off.first, refs_->numRefs());
+		// If matchRight is true, then we're trying to align the other
+		// mate to the right of the already-aligned mate.  Otherwise,
+		// to the left.
+		bool matchRight = (off1 ? !doneFw_ : doneFw_);
+		// Sequence and quals for mate to be matched
+		bool fw = off1 ? fw2_ : fw1_; // whether outstanding mate is fw/rc
+		if(doneFw_) fw = !fw;
+		// 'seq' gets sequence of outstanding mate w/r/t the forward
+		// reference strand
+		const String<Dna5>& seq  = fw ? (off1 ? patsrc_->bufb().patFw   :
+		                                        patsrc_->bufa().patFw)  :
+		                                (off1 ? patsrc_->bufb().getPatRc() :
+		                                        patsrc_->bufa().getPatRc());
+		// 'seq' gets qualities of outstanding mate w/r/t the forward
+		// reference strand
+		const String<char>& qual = fw ? (off1 ? patsrc_->bufb().qual  :
+		                                        patsrc_->bufa().qual) :
+		                                (off1 ? patsrc_->bufb().getQualRev() :
+		                                        patsrc_->bufa().getQualRev());
+		uint32_t qlen = (uint32_t)seqan::length(seq);  // length of outstanding mate
+		uint32_t alen = (off1 ? patsrc_->bufa().length() :
+		                        patsrc_->bufb().length());
+		// Let minins and maxins be the minimum and maximum insert
+		// lengths once we account for the trimming applied to the
+		// mates.  The idea is that the insert constraint placed by
+		// the user applies to the raw reads, not the trimmed reads.
+		int trim = (fw1_ ? patsrc_->bufa().trimmed5 : patsrc_->bufa().trimmed3) +
+		           (fw2_ ? patsrc_->bufb().trimmed3 : patsrc_->bufb().trimmed5);
+		int minins = max<int>(0, (int)minInsert_ - trim);
+		int maxins = max<int>(0, (int)maxInsert_ - trim);
+		const TIndexOffU tidx = off.first;
+		const TIndexOffU toff = off.second;
+		TIndexOffU begin, end;
+		if(!mateWindow(minins, maxins, matchRight, tidx, toff, alen, qlen, begin, end)) {
+			return false;
+		}
 		std::vector<Range> ranges;
 		std::vector<TIndexOffU> offs;
-		refAligner_->find(1, tidx, refs_, seq, qual, begin, end, ranges,
-		                  offs, doneFw_ ? &pairs_rc_ : &pairs_fw_,
-		                  toff, fw);
+		TSetPairs* pairs = doneFw_ ? &pairs_rc_ : &pairs_fw_;
+		TIndexOffU nbegin, nend;
+		if(narrowWindow(trim, minins, maxins, matchRight, tidx, toff, alen,
+		                qlen, begin, end, nbegin, nend))
+		{
+			int where = refAligner_->findNarrowFirst(1, tidx, refs_, seq, qual,
+			                                         begin, end, nbegin, nend,
+			                                         ranges, offs, pairs, toff, fw);
+			insStats_.narrowed++;
+			if(where == 1) insStats_.narrowHits++;
+			if(where == 2) insStats_.wideHits++;
+		} else {
+			refAligner_->find(1, tidx, refs_, seq, qual, begin, end, ranges,
+			                  offs, pairs, toff, fw);
+			if(!ranges.empty() && range.bot - range.top == 1) {
+				// Anchor is unique; learn from this pair's insert size
+				TIndexOffU ins = matchRight ? (offs[0] + qlen - toff) : (toff + alen - offs[0]);
+				gInsertModel().add((uint32_t)ins + trim);
+			}
+		}
 		assert_eq(ranges.size(), offs.size());
 		for(size_t i = 0; i < ranges.size(); i++) {
 			Range& r = ranges[i];
@@ -1330,6 +1382,9 @@ protected:
 	const uint32_t minInsert_;
 	const uint32_t maxInsert_;
 
+	// Counts of mate searches using the learned insert-size window
+	InsertSearchStats insStats_;
+
 	// Don't attempt pairwise all-versus-all style of mate
 	// reconciliation; just rely on mixed mode
 	const bool dontReconcile_;
@@ -1533,6 +1588,7 @@ public:
 			sinkPtFactory_.destroy(sinkPtSe1_); sinkPtSe1_ = NULL;
 			sinkPtFactory_.destroy(sinkPtSe2_); sinkPtSe2_ = NULL;
 		}
+		gInsertModel().addStats(insStats_);
 	}
 
 	/**
@@ -1710,10 +1766,10 @@ protected:
 		assert_eq(bufL->color, color);
 		// Print upstream mate first
 		ret = params_->reportHit(
-				rL.fw ? (ebwtFwL?  bufL->patFw  :  bufL->patFwRev) :
-				        (ebwtFwL?  bufL->patRc  :  bufL->patRcRev),
-				rL.fw ? (ebwtFwL? &bufL->qual    : &bufL->qualRev) :
-				        (ebwtFwL? &bufL->qualRev : &bufL->qual),
+				rL.fw ? (ebwtFwL?  bufL->patFw  :  bufL->getPatFwRev()) :
+				        (ebwtFwL?  bufL->getPatRc() :  bufL->getPatRcRev()),
+				rL.fw ? (ebwtFwL? &bufL->qual    : &bufL->getQualRev()) :
+				        (ebwtFwL? &bufL->getQualRev() : &bufL->qual),
 				&bufL->name,
 				bufL->color,
 				bufL->primer,
@@ -1745,10 +1801,10 @@ protected:
 		params_->setFw(rR.fw);
 		assert_eq(bufR->color, color);
 		ret = params_->reportHit(
-				rR.fw ? (ebwtFwR?  bufR->patFw  :  bufR->patFwRev) :
-				        (ebwtFwR?  bufR->patRc  :  bufR->patRcRev),
-				rR.fw ? (ebwtFwR? &bufR->qual    : &bufR->qualRev) :
-				        (ebwtFwR? &bufR->qualRev : &bufR->qual),
+				rR.fw ? (ebwtFwR?  bufR->patFw  :  bufR->getPatFwRev()) :
+				        (ebwtFwR?  bufR->getPatRc() :  bufR->getPatRcRev()),
+				rR.fw ? (ebwtFwR? &bufR->qual    : &bufR->getQualRev()) :
+				        (ebwtFwR? &bufR->getQualRev() : &bufR->qual),
 				&bufR->name,
 				bufR->color,
 				bufR->primer,
@@ -1792,10 +1848,10 @@ protected:
 		assert_eq(buf->color, color);
 		// Print upstream mate first
 		if(params->reportHit(
-			r.fw ? (ebwtFw?  buf->patFw   :  buf->patFwRev) :
-			       (ebwtFw?  buf->patRc   :  buf->patRcRev),
-			r.fw ? (ebwtFw? &buf->qual    : &buf->qualRev) :
-			       (ebwtFw? &buf->qualRev : &buf->qual),
+			r.fw ? (ebwtFw?  buf->patFw   :  buf->getPatFwRev()) :
+			       (ebwtFw?  buf->getPatRc() :  buf->getPatRcRev()),
+			r.fw ? (ebwtFw? &buf->qual    : &buf->getQualRev()) :
+			       (ebwtFw? &buf->getQualRev() : &buf->qual),
 			&buf->name,
 			buf->color,
 			buf->primer,
@@ -1857,76 +1913,24 @@ protected:
 	}
 
 	/**
-	 * Given a vector of reference positions where one of the two mates
-	 * (the "anchor" mate) has aligned, look directly at the reference
-	 * sequence for instances where the other mate (the "outstanding"
-	 * mate) aligns such that mating constraint is satisfied.
-	 *
-	 * This function picks up to 'pick' anchors at random from the
-	 * 'offs' array.  It returns the number that it actually picked.
+	 * Set begin/end to the range of reference positions where the
+	 * outstanding mate may align while fulfilling insert-length
+	 * constraints minins-maxins, given an anchor of length alen at
+	 * toff.  Return false if the outstanding mate can't fit.
 	 */
-	bool resolveOutstandingInRef(const UPair& off,
-	                             const TIndexOffU tlen,
-	                             const Range& range)
+	bool mateWindow(int minins, int maxins, bool matchRight,
+	                TIndexOffU tidx, TIndexOffU toff,
+	                uint32_t alen, uint32_t qlen,
+	                TIndexOffU& begin, TIndexOffU& end) const
 	{
-		assert(!donePe_);
-		assert(refs_->loaded());
-		assert_lt(off.first, refs_->numRefs());
-		// pairFw = true if the anchor indicates that the pair will
-		// align in its forward orientation (i.e. with mate1 to the
-		// left of mate2)
-		bool pairFw = (range.mate1)? (range.fw == fw1_) : (range.fw == fw2_);
-		// matchRight = true, if the opposite mate will be to the right
-		// of the anchor mate
-		bool matchRight = (pairFw ? range.mate1 : !range.mate1);
-		// fw = orientation of the opposite mate
-		bool fw = range.mate1 ? fw2_ : fw1_; // whether outstanding mate is fw/rc
-		if(!pairFw) fw = !fw;
-		// 'seq' = sequence for opposite mate
-		const String<Dna5>& seq  =
-			fw ? (range.mate1 ? patsrc_->bufb().patFw   :
-		                        patsrc_->bufa().patFw)  :
-		         (range.mate1 ? patsrc_->bufb().patRc   :
-		                        patsrc_->bufa().patRc);
-		// 'qual' = qualities for opposite mate
-		const String<char>& qual =
-			fw ? (range.mate1 ? patsrc_->bufb().qual  :
-			                    patsrc_->bufa().qual) :
-			     (range.mate1 ? patsrc_->bufb().qualRev :
-			                    patsrc_->bufa().qualRev);
-		uint32_t qlen = (uint32_t)seqan::length(seq);  // length of outstanding mate
-		uint32_t alen = (range.mate1 ? patsrc_->bufa().length() :
-		                               patsrc_->bufb().length());
-		int minins = minInsert_;
-		int maxins = maxInsert_;
-		if(fw1_) {
-			minins = max<int>(0, minins - patsrc_->bufa().trimmed5);
-			maxins = max<int>(0, maxins - patsrc_->bufa().trimmed5);
-		} else {
-			minins = max<int>(0, minins - patsrc_->bufa().trimmed3);
-			maxins = max<int>(0, maxins - patsrc_->bufa().trimmed3);
-		}
-		if(fw2_) {
-			minins = max<int>(0, minins - patsrc_->bufb().trimmed3);
-			maxins = max<int>(0, maxins - patsrc_->bufb().trimmed3);
-		} else {
-			minins = max<int>(0, minins - patsrc_->bufb().trimmed5);
-			maxins = max<int>(0, maxins - patsrc_->bufb().trimmed5);
-		}
 		assert_geq(minins, 0);
 		assert_geq(maxins, 0);
+		assert_geq(maxins, minins);
 		// Don't even try if either of the mates is longer than the
 		// maximum insert size.
 		if((uint32_t)maxins <= max(qlen, alen)) {
 			return false;
 		}
-		const TIndexOffU tidx = off.first;  // text id where anchor mate hit
-		const TIndexOffU toff = off.second; // offset where anchor mate hit
-		// Set begin/end to the range of reference positions where
-		// outstanding mate may align while fulfilling insert-length
-		// constraints.
-		TIndexOffU begin, end;
-		assert_geq(maxins, minins);
 		TIndexOffU insDiff = maxins - minins;
 		if(matchRight) {
 			end = toff + maxins;
@@ -1962,11 +1966,107 @@ protected:
 		// Check if there's not enough space in the range to fit an
 		// alignment for the outstanding mate.
 		if(end - begin < qlen) return false;
+		return true;
+	}
+
+	/**
+	 * If the library's insert sizes have been learned (--learn-ins)
+	 * and they narrow the window begin-end, set nbegin/nend to the
+	 * narrower window and return true.
+	 */
+	bool narrowWindow(int trim, int minins, int maxins, bool matchRight,
+	                  TIndexOffU tidx, TIndexOffU toff,
+	                  uint32_t alen, uint32_t qlen,
+	                  TIndexOffU begin, TIndexOffU end,
+	                  TIndexOffU& nbegin, TIndexOffU& nend) const
+	{
+		uint32_t lo, hi;
+		if(!gInsertModel().window(lo, hi)) return false;
+		int nminins = max<int>(minins, (int)lo - trim);
+		int nmaxins = min<int>(maxins, (int)hi - trim);
+		if(nminins >= nmaxins) return false;
+		if(nminins == minins && nmaxins == maxins) return false;
+		if(!mateWindow(nminins, nmaxins, matchRight, tidx, toff, alen, qlen, nbegin, nend)) {
+			return false;
+		}
+		nbegin = max<TIndexOffU>(nbegin, begin);
+		nend = min<TIndexOffU>(nend, end);
+		return nend > nbegin;
+	}
+
+	/**
+	 * Given a vector of reference positions where one of the two mates
+	 * (the "anchor" mate) has aligned, look directly at the reference
+	 * sequence for instances where the other mate (the "outstanding"
+	 * mate) aligns such that mating constraint is satisfied.
+	 *
+	 * This function picks up to 'pick' anchors at random from the
+	 * 'offs' array.  It returns the number that it actually picked.
+	 */
+	bool resolveOutstandingInRef(const UPair& off,
+	                             const TIndexOffU tlen,
+	                             const Range& range)
+	{
+		assert(!donePe_);
+		assert(refs_->loaded());
+		assert_lt(off.first, refs_->numRefs());
+		// pairFw = true if the anchor indicates that the pair will
+		// align in its forward orientation (i.e. with mate1 to the
+		// left of mate2)
+		bool pairFw = (range.mate1)? (range.fw == fw1_) : (range.fw == fw2_);
+		// matchRight = true, if the opposite mate will be to the right
+		// of the anchor mate
+		bool matchRight = (pairFw ? range.mate1 : !range.mate1);
+		// fw = orientation of the opposite mate
+		bool fw = range.mate1 ? fw2_ : fw1_; // whether outstanding mate is fw/rc
+		if(!pairFw) fw = !fw;
+		// 'seq' = sequence for opposite mate
+		const String<Dna5>& seq  =
+			fw ? (range.mate1 ? patsrc_->bufb().patFw   :
+		                        patsrc_->bufa().patFw)  :
+		         (range.mate1 ? patsrc_->bufb().getPatRc() :
+		                        patsrc_->bufa().getPatRc());
+		// 'qual' = qualities for opposite mate
+		const String<char>& qual =
+			fw ? (range.mate1 ? patsrc_->bufb().qual  :
+			                    patsrc_->bufa().qual) :
+			     (range.mate1 ? patsrc_->bufb().getQualRev() :
+			                    patsrc_->bufa().getQualRev());
+		uint32_t qlen = (uint32_t)seqan::length(seq);  // length of outstanding mate
+		uint32_t alen = (range.mate1 ? patsrc_->bufa().length() :
+		                               patsrc_->bufb().length());
+		int trim = (fw1_ ? patsrc_->bufa().trimmed5 : patsrc_->bufa().trimmed3) +
+		           (fw2_ ? patsrc_->bufb().trimmed3 : patsrc_->bufb().trimmed5);
+		int minins = max<int>(0, (int)minInsert_ - trim);
+		int maxins = max<int>(0, (int)maxInsert_ - trim);
+		const TIndexOffU tidx = off.first;  // text id where anchor mate hit
+		const TIndexOffU toff = off.second; // offset where anchor mate hit
+		TIndexOffU begin, end;
+		if(!mateWindow(minins, maxins, matchRight, tidx, toff, alen, qlen, begin, end)) {
+			return false;
+		}
 		std::vector<Range> ranges;
 		std::vector<TIndexOffU> offs;
-		refAligner_->find(1, tidx, refs_, seq, qual, begin, end, ranges,
-		                  offs, pairFw ? &pairs_fw_ : &pairs_rc_,
-		                  toff, fw);
+		TSetPairs* pairs = pairFw ? &pairs_fw_ : &pairs_rc_;
+		TIndexOffU nbegin, nend;
+		if(narrowWindow(trim, minins, maxins, matchRight, tidx, toff, alen,
+		                qlen, begin, end, nbegin, nend))
+		{
+			int where = refAligner_->findNarrowFirst(1, tidx, refs_, seq, qual,
+			                                         begin, end, nbegin, nend,
+			                                         ranges, offs, pairs, toff, fw);
+			insStats_.narrowed++;
+			if(where == 1) insStats_.narrowHits++;
+			if(where == 2) insStats_.wideHits++;
+		} else {
+			refAligner_->find(1, tidx, refs_, seq, qual, begin, end, ranges,
+			                  offs, pairs, toff, fw);
+			if(!ranges.empty() && range.bot - range.top == 1) {
+				// Anchor is unique; learn from this pair's insert size
+				TIndexOffU ins = matchRight ? (offs[0] + qlen - toff) : (toff + alen - offs[0]);
+				gInsertModel().add((uint32_t)ins + trim);
+			}
+		}
 		assert_eq(ranges.size(), offs.size());
 		for(size_t i = 0; i < ranges.size(); i++) {
 			Range& r = ranges[i];
@@ -2021,6 +2121,9 @@ protected:
 	const uint32_t minInsert_;
 	const uint32_t maxInsert_;
 
+	// Counts of mate searches using the learned insert-size window
+	InsertSearchStats insStats_;
+
 	const uint32_t mixedAttemptLim_;
 	uint32_t mixedAttempts_;
 
@@ -0,0 +1,675 @@
+/*
+ * bgzf.h
+ *
+ * Reading and writing of BGZF, the blocked gzip variant that BAM files
+ * are stored in.  Every BGZF block is an independent gzip member
+ * holding at most 64 KB of data, so a batch of blocks can be inflated
+ * or deflated in parallel.
+ */
+
+#ifndef BGZF_H_
+#define BGZF_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "assert_helpers.h"
+#include "threading.h"
+#include "filebuf.h"
+
+/// Little-endian 16-bit value at p
+static inline uint16_t bgzfLe16(const uint8_t *p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/// Little-endian 32-bit value at p
+static inline uint32_t bgzfLe32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/// Store v at p, little-endian
+static inline void bgzfPut16(uint8_t *p, uint16_t v) {
+	p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8);
+}
+
+/// Store v at p, little-endian
+static inline void bgzfPut32(uint8_t *p, uint32_t v) {
+	p[0] = (uint8_t)v;         p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+/**
+ * One BGZF block: the compressed member as read from or written to the
+ * file and the data it inflates to.
+ */
+struct BGZFBlock {
+	static const size_t MAX_SZ = 65536;
+	/// Most data a written block holds, leaving room for the header,
+	/// trailer and deflate's overhead on incompressible input
+	static const size_t MAX_DATA_SZ = 0xff00;
+	static const size_t HDR_SZ = 18;
+
+	BGZFBlock() : clen(0), coff(0), ulen(0), ok(true) {
+		cdata.resize(MAX_SZ);
+		udata.resize(MAX_SZ);
+	}
+
+	/**
+	 * Inflate cdata into udata and check the CRC and length in the
+	 * gzip trailer; set ok = false on any problem.
+	 */
+	void inflate() {
+		ok = false;
+		if(clen < coff + 8) return;
+		const uint8_t *trailer = &cdata[clen - 8];
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if(inflateInit2(&zs, -15) != Z_OK) return;
+		zs.next_in   = &cdata[coff];
+		zs.avail_in  = (uInt)(clen - coff - 8);
+		zs.next_out  = &udata[0];
+		zs.avail_out = (uInt)MAX_SZ;
+		int ret = ::inflate(&zs, Z_FINISH);
+		ulen = zs.total_out;
+		inflateEnd(&zs);
+		if(ret != Z_STREAM_END) return;
+		if(ulen != bgzfLe32(trailer + 4)) return;
+		if(crc32(crc32(0L, Z_NULL, 0), &udata[0], (uInt)ulen) != bgzfLe32(trailer)) return;
+		ok = true;
+	}
+
+	/**
+	 * Deflate the first ulen bytes of udata into a complete BGZF
+	 * member in cdata at the given compression level.  Data that
+	 * won't shrink to fit is stored uncompressed instead.  Returns
+	 * false if zlib fails; this runs on a deflating thread, so the
+	 * caller passes the failure on rather than throwing.
+	 */
+	bool deflate(int level) {
+		assert_leq(ulen, MAX_DATA_SZ);
+		uint8_t *c = &cdata[0];
+		static const uint8_t hdr[HDR_SZ] = {
+			31, 139, 8, 4,  // gzip magic, deflate, FEXTRA
+			0, 0, 0, 0,     // MTIME
+			0, 255,         // XFL, OS unknown
+			6, 0,           // XLEN
+			'B', 'C', 2, 0, // BC subfield: total block size - 1
+			0, 0
+		};
+		memcpy(c, hdr, HDR_SZ);
+		size_t dlen = 0;
+		while(true) {
+			z_stream zs;
+			memset(&zs, 0, sizeof(zs));
+			if(deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				std::cerr << "Error: could not initialize zlib for BGZF compression" << std::endl;
+				return false;
+			}
+			zs.next_in   = &udata[0];
+			zs.avail_in  = (uInt)ulen;
+			zs.next_out  = c + HDR_SZ;
+			zs.avail_out = (uInt)(MAX_SZ - HDR_SZ - 8);
+			int ret = ::deflate(&zs, Z_FINISH);
+			dlen = zs.total_out;
+			deflateEnd(&zs);
+			if(ret == Z_STREAM_END) break;
+			if(level == 0) {
+				std::cerr << "Error: BGZF block overflowed while compressing" << std::endl;
+				return false;
+			}
+			level = 0;
+		}
+		clen = HDR_SZ + dlen + 8;
+		coff = HDR_SZ;
+		bgzfPut16(c + 16, (uint16_t)(clen - 1));
+		bgzfPut32(c + HDR_SZ + dlen, (uint32_t)crc32(crc32(0L, Z_NULL, 0), &udata[0], (uInt)ulen));
+		bgzfPut32(c + HDR_SZ + dlen + 4, (uint32_t)ulen);
+		return true;
+	}
+
+	std::vector<uint8_t> cdata; /// compressed member, header included
+	size_t clen;                /// # bytes of cdata in use
+	size_t coff;                /// offset of deflate stream in cdata
+	std::vector<uint8_t> udata; /// inflated data
+	size_t ulen;                /// # bytes of udata in use
+	bool ok;                    /// false -> block was corrupt
+};
+
+/**
+ * Sequential reader for a BGZF stream.  nthreads long-lived worker
+ * threads take turns reading the next compressed block into a ring of
+ * 4 x nthreads blocks and inflate it without holding any lock, so
+ * inflation runs ahead of, and in parallel with, the caller; the
+ * caller then consumes the inflated bytes in file order with read().
+ */
+class BGZFReader {
+
+#ifdef WITH_TBB
+	/// Task that runs one worker's loop
+	struct WorkerTask {
+		BGZFReader *r;
+		void operator()() const { r->workerLoop(); }
+	};
+#endif
+
+	/// States of a slot in the ring
+	enum {
+		SLOT_FREE = 0, /// empty, or being consumed
+		SLOT_BUSY,     /// being inflated by a worker
+		SLOT_READY     /// inflated, waiting to be consumed
+	};
+
+public:
+
+	BGZFReader(int nthreads = 1) :
+		in_(NULL),
+		name_(),
+		nthreads_(nthreads > 0 ? nthreads : 1),
+		blocks_(4 * (nthreads > 0 ? nthreads : 1)),
+		state_(blocks_.size(), SLOT_FREE),
+		cur_(NULL),
+		off_(0),
+		nextRead_(0),
+		nextUse_(0),
+		endSeq_(0),
+		done_(true),
+		bad_(false),
+		busy_(0),
+		stop_(false),
+		started_(false)
+	{ }
+
+	~BGZFReader() {
+		close();
+		stopWorkers();
+	}
+
+	/**
+	 * Start reading from 'in'; 'name' is used in error messages.
+	 */
+	void open(FILE *in, const std::string& name) {
+		close();
+		if(!started_) startWorkers();
+		WaitLock::Guard g(wl_);
+		in_ = in;
+		name_ = name;
+		nextRead_ = nextUse_ = endSeq_ = 0;
+		done_ = bad_ = false;
+		wl_.notifyAll();
+	}
+
+	/**
+	 * Stop reading ahead, wait for blocks being inflated, and close
+	 * the input.
+	 */
+	void close() {
+		FILE *in;
+		{
+			WaitLock::Guard g(wl_);
+			done_ = true;
+			while(busy_ > 0) wl_.wait();
+			std::fill(state_.begin(), state_.end(), (int)SLOT_FREE);
+			cur_ = NULL;
+			off_ = 0;
+			in = in_;
+			in_ = NULL;
+		}
+		if(in != NULL && in != stdin) fclose(in);
+	}
+
+	bool isOpen() const { return in_ != NULL; }
+
+	/**
+	 * Copy the next 'len' inflated bytes into 'dst' and return the
+	 * number copied, which is less than 'len' only at end of input.
+	 */
+	size_t read(void *dst, size_t len) {
+		uint8_t *d = (uint8_t*)dst;
+		size_t got = 0;
+		while(got < len) {
+			if((cur_ == NULL || off_ == cur_->ulen) && !next()) break;
+			size_t n = std::min(len - got, cur_->ulen - off_);
+			memcpy(d + got, &cur_->udata[off_], n);
+			got += n;
+			off_ += n;
+		}
+		return got;
+	}
+
+	/**
+	 * Skip over the next 'len' inflated bytes; return false if input
+	 * ended first.
+	 */
+	bool skip(size_t len) {
+		while(len > 0) {
+			if((cur_ == NULL || off_ == cur_->ulen) && !next()) return false;
+			size_t n = std::min(len, cur_->ulen - off_);
+			len -= n;
+			off_ += n;
+		}
+		return true;
+	}
+
+private:
+
+	/**
+	 * Read the next compressed member from in_ into b.  Return 1 if
+	 * one was read, 0 at a clean end of file and -1 if the input is
+	 * corrupt.
+	 */
+	int readBlock(BGZFBlock& b) {
+		uint8_t *c = &b.cdata[0];
+		size_t n = fread(c, 1, 12, in_);
+		if(n == 0) return 0;
+		if(n < 12 || c[0] != 31 || c[1] != 139 || c[2] != 8 || (c[3] & 4) == 0) {
+			return -1;
+		}
+		size_t xlen = bgzfLe16(c + 10);
+		if(12 + xlen > BGZFBlock::MAX_SZ || fread(c + 12, 1, xlen, in_) != xlen) {
+			return -1;
+		}
+		// Find the BC subfield, which holds the total block size - 1
+		size_t bsize = 0;
+		for(size_t i = 12; i + 4 <= 12 + xlen; ) {
+			size_t slen = bgzfLe16(c + i + 2);
+			if(c[i] == 'B' && c[i+1] == 'C' && slen == 2) {
+				bsize = bgzfLe16(c + i + 4) + 1;
+				break;
+			}
+			i += 4 + slen;
+		}
+		if(bsize < 12 + xlen + 8 || bsize > BGZFBlock::MAX_SZ) return -1;
+		size_t rest = bsize - 12 - xlen;
+		if(fread(c + 12 + xlen, 1, rest, in_) != rest) return -1;
+		b.clen = bsize;
+		b.coff = 12 + xlen;
+		return 1;
+	}
+
+	/**
+	 * Give back the block being consumed, if any, and make the next
+	 * non-empty inflated block current, waiting for it if a worker is
+	 * still on it.  Return false if the stream is exhausted.
+	 */
+	bool next() {
+		wl_.lock();
+		if(cur_ != NULL) {
+			cur_ = NULL;
+			nextUse_++;
+			wl_.notifyAll();
+		}
+		while(true) {
+			size_t i = (size_t)(nextUse_ % blocks_.size());
+			while(state_[i] != SLOT_READY && !(done_ && nextUse_ == endSeq_)) {
+				wl_.wait();
+			}
+			if(state_[i] != SLOT_READY) {
+				bool bad = bad_;
+				wl_.unlock();
+				if(bad) corrupt();
+				return false;
+			}
+			state_[i] = SLOT_FREE;
+			if(!blocks_[i].ok) {
+				wl_.unlock();
+				corrupt();
+			}
+			if(blocks_[i].ulen > 0) {
+				cur_ = &blocks_[i];
+				off_ = 0;
+				wl_.unlock();
+				return true;
+			}
+			// Skip empty blocks (e.g. the EOF marker block)
+			nextUse_++;
+			wl_.notifyAll();
+		}
+	}
+
+	/**
+	 * Body of a worker: while there is a free slot, read the next
+	 * block into it and inflate it.  Blocks are read from the file
+	 * under the lock, so they're numbered in file order, but inflated
+	 * outside it.
+	 */
+	void workerLoop() {
+		wl_.lock();
+		while(true) {
+			while(!stop_ && (done_ || nextRead_ - nextUse_ == blocks_.size())) {
+				wl_.wait();
+			}
+			if(stop_) break;
+			uint64_t seq = nextRead_;
+			size_t i = (size_t)(seq % blocks_.size());
+			BGZFBlock& b = blocks_[i];
+			int ret = readBlock(b);
+			if(ret <= 0) {
+				done_ = true;
+				bad_ = (ret < 0);
+				endSeq_ = seq;
+				wl_.notifyAll();
+				continue;
+			}
+			nextRead_++;
+			state_[i] = SLOT_BUSY;
+			busy_++;
+			wl_.unlock();
+			b.inflate();
+			wl_.lock();
+			state_[i] = SLOT_READY;
+			busy_--;
+			wl_.notifyAll();
+		}
+		wl_.unlock();
+	}
+
+	static void workerEntry(void *vp) {
+		gCpuAffinity().pinHelper();
+		((BGZFReader*)vp)->workerLoop();
+	}
+
+	void startWorkers() {
+		started_ = true;
+#ifdef WITH_TBB
+		for(int i = 0; i < nthreads_; i++) {
+			WorkerTask t;
+			t.r = this;
+			grp_.run(t);
+		}
+#else
+		for(int i = 0; i < nthreads_; i++) {
+			threads_.push_back(new tthread::thread(workerEntry, (void*)this));
+		}
+#endif
+	}
+
+	void stopWorkers() {
+		if(!started_) return;
+		{
+			WaitLock::Guard g(wl_);
+			stop_ = true;
+			wl_.notifyAll();
+		}
+#ifdef WITH_TBB
+		grp_.wait();
+#else
+		for(size_t i = 0; i < threads_.size(); i++) {
+			threads_[i]->join();
+			delete threads_[i];
+		}
+		threads_.clear();
+#endif
+		started_ = false;
+	}
+
+	void corrupt() {
+		std::cerr << "Error: \"" << name_ << "\" is not a valid BGZF-compressed (BAM) file, or is truncated" << std::endl;
+		throw 1;
+	}
+
+	FILE *in_;
+	std::string name_;
+	int nthreads_;
+	std::vector<BGZFBlock> blocks_; /// ring of blocks; block #s is in slot s % size
+	std::vector<int> state_;  /// SLOT_* state of each slot
+	const BGZFBlock *cur_;    /// block being consumed, or NULL
+	size_t off_;              /// offset into cur_->udata
+	uint64_t nextRead_;       /// # of the next block to read from in_
+	uint64_t nextUse_;        /// # of the block being or next to be consumed
+	uint64_t endSeq_;         /// if done_, # of blocks in in_ (or read before an error)
+	bool done_;               /// true -> no more blocks to read from in_
+	bool bad_;                /// true -> reading stopped at a corrupt block
+	int busy_;                /// # blocks being inflated
+	bool stop_;               /// true -> workers should exit
+	bool started_;            /// true -> workers are running
+	WaitLock wl_;             /// guards all of the above but cur_/off_
+#ifdef WITH_TBB
+	tbb::task_group grp_;
+#else
+	std::vector<tthread::thread*> threads_;
+#endif
+};
+
+/**
+ * OutFileBuf filter that writes its output as a BGZF stream.  Data
+ * is cut into blocks of MAX_DATA_SZ bytes in a ring of 4 blocks per
+ * thread.  Each full block gets the next sequence number and is queued
+ * for nthreads long-lived deflating threads.  The caller writes
+ * deflated blocks out in sequence order as they finish, and waits only
+ * when every block in the ring is queued or being deflated.  finish()
+ * writes the last, partial block and the empty block that marks the
+ * end of a BGZF file.
+ */
+class BGZFWriter : public OutFileFilter {
+
+#ifdef WITH_TBB
+	/// Task that runs one worker's loop
+	struct WorkerTask {
+		BGZFWriter *w;
+		void operator()() const { w->workerLoop(); }
+	};
+#endif
+
+public:
+
+	BGZFWriter(int nthreads = 1, int level = Z_DEFAULT_COMPRESSION) :
+		nthreads_(nthreads > 0 ? nthreads : 1),
+		level_(level),
+		blocks_(4 * (nthreads > 0 ? nthreads : 1)),
+		done_(blocks_.size(), false),
+		subSeq_(0),
+		defSeq_(0),
+		outSeq_(0),
+		stop_(false),
+		failed_(false),
+		started_(false),
+		bytesIn_(0),
+		bytesOut_(0)
+	{ }
+
+	virtual ~BGZFWriter() { stopWorkers(); }
+
+	/**
+	 * Append 'len' bytes to the stream, queueing each block for
+	 * deflating as it fills.
+	 */
+	virtual void write(FILE *out, const char *s, size_t len) {
+		while(len > 0) {
+			// Only this thread touches the block being filled
+			BGZFBlock& b = blocks_[subSeq_ % blocks_.size()];
+			size_t n = std::min(len, BGZFBlock::MAX_DATA_SZ - b.ulen);
+			memcpy(&b.udata[b.ulen], s, n);
+			b.ulen += n;
+			s += n;
+			len -= n;
+			bytesIn_ += n;
+			if(b.ulen == BGZFBlock::MAX_DATA_SZ) submit(out);
+		}
+	}
+
+	/**
+	 * Write out any buffered data followed by the EOF marker block.
+	 */
+	virtual void finish(FILE *out) {
+		if(blocks_[subSeq_ % blocks_.size()].ulen > 0) submit(out);
+		writeDone(out, true);
+		static const uint8_t eof[28] = {
+			31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+			27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+		};
+		writeOut(out, eof, sizeof(eof));
+	}
+
+	/// # uncompressed bytes written so far
+	uint64_t bytesIn() const { return bytesIn_; }
+
+	/// # compressed bytes written so far
+	uint64_t bytesOut() const { return bytesOut_; }
+
+	/**
+	 * Print the number of bytes taken and written.
+	 */
+	virtual void printStats(std::ostream& os) const {
+		os << "Compressed output:" << std::endl
+		   << "  bytes in: " << bytesIn_ << std::endl
+		   << "  bytes out: " << bytesOut_;
+		if(bytesIn_ > 0) {
+			os << " (" << (100 * bytesOut_ / bytesIn_) << "%)";
+		}
+		os << std::endl
+		   << "  deflating threads: " << nthreads_ << std::endl;
+	}
+
+private:
+
+	/**
+	 * Queue the block being filled for deflating, then write out any
+	 * blocks that are finished, waiting for the oldest one if the ring
+	 * has no free block left to fill.
+	 */
+	void submit(FILE *out) {
+		if(!started_) startWorkers();
+		{
+			WaitLock::Guard g(wl_);
+			// The worker already printed what went wrong
+			if(failed_) throw 1;
+			done_[subSeq_ % blocks_.size()] = false;
+			subSeq_++;
+			wl_.notifyAll();
+		}
+		writeDone(out, false);
+	}
+
+	/**
+	 * Write deflated blocks to 'out' in sequence order, stopping at the
+	 * first one that isn't finished unless that leaves no free block
+	 * to fill or 'all' is set, in which case wait for it.  Throws if
+	 * a deflating thread failed.
+	 */
+	void writeDone(FILE *out, bool all) {
+		wl_.lock();
+		while(outSeq_ < subSeq_) {
+			if(failed_) {
+				wl_.unlock();
+				throw 1;
+			}
+			size_t i = (size_t)(outSeq_ % blocks_.size());
+			if(!done_[i]) {
+				if(!all && subSeq_ - outSeq_ < blocks_.size()) break;
+				wl_.wait();
+				continue;
+			}
+			// Deflated and not yet written; no worker touches it
+			wl_.unlock();
+			writeOut(out, &blocks_[i].cdata[0], blocks_[i].clen);
+			blocks_[i].ulen = 0;
+			wl_.lock();
+			outSeq_++;
+		}
+		wl_.unlock();
+	}
+
+	/**
+	 * Body of a deflating thread: deflate queued blocks, oldest first,
+	 * until told to stop.  An exception thrown here would terminate
+	 * the process, so a failure is recorded in failed_ for the thread
+	 * calling write() or finish() to throw, and every worker stops.
+	 */
+	void workerLoop() {
+		wl_.lock();
+		while(true) {
+			while(!stop_ && !failed_ && defSeq_ == subSeq_) wl_.wait();
+			if(stop_ || failed_) break;
+			size_t i = (size_t)(defSeq_++ % blocks_.size());
+			wl_.unlock();
+			bool ok = blocks_[i].deflate(level_);
+			wl_.lock();
+			if(!ok) failed_ = true;
+			done_[i] = true;
+			wl_.notifyAll();
+		}
+		wl_.unlock();
+	}
+
+	static void workerEntry(void *vp) {
+		gCpuAffinity().pinHelper();
+		((BGZFWriter*)vp)->workerLoop();
+	}
+
+	void startWorkers() {
+		started_ = true;
+#ifdef WITH_TBB
+		for(int i = 0; i < nthreads_; i++) {
+			WorkerTask t;
+			t.w = this;
+			grp_.run(t);
+		}
+#else
+		for(int i = 0; i < nthreads_; i++) {
+			threads_.push_back(new tthread::thread(workerEntry, (void*)this));
+		}
+#endif
+	}
+
+	/**
+	 * Tell the deflating threads to exit and wait for them.  Blocks
+	 * still queued are abandoned; finish() has written them already.
+	 */
+	void stopWorkers() {
+		if(!started_) return;
+		{
+			WaitLock::Guard g(wl_);
+			stop_ = true;
+			wl_.notifyAll();
+		}
+#ifdef WITH_TBB
+		grp_.wait();
+#else
+		for(size_t i = 0; i < threads_.size(); i++) {
+			threads_[i]->join();
+			delete threads_[i];
+		}
+		threads_.clear();
+#endif
+		started_ = false;
+	}
+
+	/**
+	 * Write a deflated block.  This runs on the thread calling write()
+	 * or finish(), never on a worker, so it can throw.
+	 */
+	void writeOut(FILE *out, const uint8_t *p, size_t len) {
+		if(fwrite(p, 1, len, out) != len) {
+			std::cerr << "Error while writing BGZF-compressed output" << std::endl;
+			throw 1;
+		}
+		bytesOut_ += len;
+	}
+
+	int nthreads_;
+	int level_;
+	std::vector<BGZFBlock> blocks_; /// ring of blocks; block #s is in slot s % size
+	std::vector<bool> done_; /// true -> slot's block is deflated
+	uint64_t subSeq_;   /// # blocks queued; also # of the block being filled
+	uint64_t defSeq_;   /// # of the next block for a worker to deflate
+	uint64_t outSeq_;   /// # of the next block to write out
+	bool stop_;         /// true -> workers should exit
+	bool failed_;       /// true -> a worker couldn't deflate a block
+	bool started_;      /// true -> workers are running
+	WaitLock wl_;       /// guards done_, subSeq_, defSeq_, outSeq_, stop_, failed_
+#ifdef WITH_TBB
+	tbb::task_group grp_;
+#else
+	std::vector<tthread::thread*> threads_;
+#endif
+	uint64_t bytesIn_;  /// # uncompressed bytes taken
+	uint64_t bytesOut_; /// # compressed bytes written
+};
+
+#endif /*BGZF_H_*/
@@ -0,0 +1,295 @@
+/*
+ * binhit.cpp
+ *
+ * Writing and reading of the binary alignment format; see binhit.h.
+ */
+
+#include <iostream>
+#include <string.h>
+#include "binhit.h"
+#include "sam.h"
+
+using namespace std;
+using namespace seqan;
+
+/// Append v to o as a little-endian 32-bit value
+static inline void binPut32(StrBuf& o, uint32_t v) {
+	char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+	o.append(b, 4);
+}
+
+/// Append v to o as a little-endian 64-bit value
+static inline void binPut64(StrBuf& o, uint64_t v) {
+	binPut32(o, (uint32_t)v);
+	binPut32(o, (uint32_t)(v >> 32));
+}
+
+static inline uint32_t binGet32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t binGet64(const uint8_t *p) {
+	return (uint64_t)binGet32(p) | ((uint64_t)binGet32(p + 4) << 32);
+}
+
+/// Append v to o as a varint
+static inline void binPutVar(StrBuf& o, uint64_t v) {
+	char b[10];
+	size_t n = 0;
+	while(v >= 0x80) {
+		b[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	b[n++] = (char)v;
+	o.append(b, n);
+}
+
+/**
+ * Append the binary record for h to o.
+ */
+void appendBinHit(StrBuf& o, const Hit& h) {
+	size_t len = length(h.patSeq);
+	size_t nameLen = length(h.patName);
+	bool quals = length(h.quals) == len;
+	bool hasN = false;
+	for(size_t i = 0; i < len; i++) {
+		if((int)h.patSeq[i] > 3) { hasN = true; break; }
+	}
+	bool primer = h.primer != '?' || h.trimc != '?';
+	// The record's length goes first, so build it on the side
+	StrBuf r;
+	r.append((char)((h.fw ? BINHIT_FW : 0) |
+	                (h.mfw ? BINHIT_MATE_FW : 0) |
+	                (h.color ? BINHIT_COLOR : 0) |
+	                (quals ? BINHIT_QUALS : 0) |
+	                (hasN ? BINHIT_SEQ_N : 0) |
+	                (primer ? BINHIT_PRIMER : 0) |
+	                (h.mate << BINHIT_MATE_SHIFT)));
+	binPutVar(r, h.patId);
+	binPutVar(r, h.h.first);
+	binPutVar(r, h.h.second);
+	binPutVar(r, len);
+	binPutVar(r, nameLen);
+	binPutVar(r, h.oms);
+	binPutVar(r, h.cost ^ ((uint32_t)(uint8_t)h.stratum << 14));
+	r.append((char)h.stratum);
+	binPutVar(r, h.mms.count());
+	binPutVar(r, h.cmms.count());
+	if(h.mate != 0) {
+		binPutVar(r, h.mh.first);
+		binPutVar(r, h.mh.second);
+		binPutVar(r, h.mlen);
+	}
+	if(primer) {
+		r.append(h.primer);
+		r.append(h.trimc);
+	}
+	appendStr(r, h.patName);
+	int bits = hasN ? 4 : 2;
+	int per = 8 / bits;
+	for(size_t i = 0; i < len; i += per) {
+		int b = 0;
+		for(int j = 0; j < per && i + j < len; j++) {
+			b |= (int)h.patSeq[i + j] << (j * bits);
+		}
+		r.append((char)b);
+	}
+	if(quals) appendStr(r, h.quals);
+	size_t last = 0;
+	for(size_t i = 0; i < len; i++) {
+		if(h.mms.test((uint32_t)i)) {
+			assert_gt(h.refcs.size(), i);
+			binPutVar(r, i - last);
+			r.append(h.refcs[i]);
+			last = i;
+		}
+	}
+	binPutVar(o, r.length());
+	o.append(r.ptr(), r.length());
+}
+
+/**
+ * Append the file header for an index with the given references.
+ */
+void appendBinHitHeader(StrBuf& o,
+                        size_t numRefs,
+                        const vector<string>& refnames,
+                        ReferenceMap *rmap,
+                        const TIndexOffU* plen,
+                        bool color)
+{
+	o.append(BINHIT_MAGIC, 4);
+	binPut32(o, BINHIT_VERSION);
+	binPut32(o, color ? BINHIT_FILE_COLOR : 0);
+	binPut32(o, (uint32_t)numRefs);
+	StrBuf name;
+	for(size_t i = 0; i < numRefs; i++) {
+		name.clear();
+		SAMHitSink::appendSqName(name, i, refnames, rmap, true);
+		binPut32(o, (uint32_t)name.length());
+		o.append(name.ptr(), name.length());
+		binPut64(o, plen[i]);
+	}
+}
+
+/**
+ * Read exactly 'len' bytes or fail.
+ */
+void BinHitReader::read(void *dst, size_t len) {
+	if(fread(dst, 1, len, in_) != len) corrupt();
+}
+
+void BinHitReader::corrupt() {
+	cerr << "Error: \"" << name_ << "\" is not a valid bowtie binary alignment file, or is truncated" << endl;
+	throw 1;
+}
+
+/**
+ * Start reading from 'in' and read the header.
+ */
+void BinHitReader::open(FILE *in, const string& name) {
+	in_ = in;
+	name_ = name;
+	uint8_t hdr[16];
+	read(hdr, 16);
+	if(memcmp(hdr, BINHIT_MAGIC, 4) != 0) corrupt();
+	uint32_t version = binGet32(hdr + 4);
+	if(version != BINHIT_VERSION) {
+		cerr << "Error: \"" << name_ << "\" uses binary alignment format version "
+		     << version << "; this program reads only version "
+		     << BINHIT_VERSION << endl;
+		throw 1;
+	}
+	color_ = (binGet32(hdr + 8) & BINHIT_FILE_COLOR) != 0;
+	uint32_t nrefs = binGet32(hdr + 12);
+	refnames_.resize(nrefs);
+	reflens_.resize(nrefs);
+	for(uint32_t i = 0; i < nrefs; i++) {
+		uint8_t b[8];
+		read(b, 4);
+		uint32_t nlen = binGet32(b);
+		refnames_[i].resize(nlen);
+		if(nlen > 0) read(&refnames_[i][0], nlen);
+		read(b, 8);
+		reflens_[i] = (TIndexOffU)binGet64(b);
+	}
+}
+
+/**
+ * Read a varint from the file into v; return false if the file ends
+ * before its first byte.
+ */
+bool BinHitReader::readVar(uint64_t& v) {
+	v = 0;
+	for(int shift = 0; shift < 64; shift += 7) {
+		int c = getc(in_);
+		if(c == EOF) {
+			if(shift == 0) return false;
+			corrupt();
+		}
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if((c & 0x80) == 0) return true;
+	}
+	corrupt();
+	return false;
+}
+
+/**
+ * Decode the varint at p, which mustn't run to 'end', and move p past
+ * it.
+ */
+uint64_t BinHitReader::getVar(const uint8_t*& p, const uint8_t *end) {
+	uint64_t v = 0;
+	for(int shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t b = *p++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if((b & 0x80) == 0) return v;
+	}
+	corrupt();
+	return 0;
+}
+
+/**
+ * Read the next record into h; return false at end of file.
+ */
+bool BinHitReader::next(Hit& h) {
+	uint64_t recLen;
+	if(!readVar(recLen)) return false;
+	if(recLen == 0 || recLen > (1 << 24)) corrupt();
+	rec_.resize((size_t)recLen);
+	read(&rec_[0], (size_t)recLen);
+	const uint8_t *p = &rec_[0];
+	const uint8_t *end = p + recLen;
+	uint8_t flags = *p++;
+	h.patId     = (uint32_t)getVar(p, end);
+	h.h.first   = (TIndexOffU)getVar(p, end);
+	h.h.second  = (TIndexOffU)getVar(p, end);
+	size_t len     = (size_t)getVar(p, end);
+	size_t nameLen = (size_t)getVar(p, end);
+	h.oms       = (uint32_t)getVar(p, end);
+	uint32_t cost  = (uint32_t)getVar(p, end);
+	if(p >= end) corrupt();
+	h.stratum   = (int8_t)*p++;
+	h.cost      = cost ^ ((uint32_t)(uint8_t)h.stratum << 14);
+	size_t nmm     = (size_t)getVar(p, end);
+	size_t ncmm    = (size_t)getVar(p, end);
+	if(len > 1024 || nmm > len || ncmm > 1024) corrupt();
+	h.fw        = (flags & BINHIT_FW) != 0;
+	h.mfw       = (flags & BINHIT_MATE_FW) != 0;
+	h.color     = (flags & BINHIT_COLOR) != 0;
+	h.mate      = flags >> BINHIT_MATE_SHIFT;
+	h.mh.first  = h.mh.second = 0;
+	h.mlen      = 0;
+	if(h.mate != 0) {
+		h.mh.first  = (TIndexOffU)getVar(p, end);
+		h.mh.second = (TIndexOffU)getVar(p, end);
+		h.mlen      = (uint16_t)getVar(p, end);
+	}
+	h.primer = h.trimc = '?';
+	if((flags & BINHIT_PRIMER) != 0) {
+		if(end - p < 2) corrupt();
+		h.primer = (char)p[0];
+		h.trimc  = (char)p[1];
+		p += 2;
+	}
+	h.seed      = 0;
+	int bits = (flags & BINHIT_SEQ_N) != 0 ? 4 : 2;
+	int per = 8 / bits;
+	size_t seqBytes = (len + per - 1) / per;
+	size_t qualBytes = (flags & BINHIT_QUALS) != 0 ? len : 0;
+	if((size_t)(end - p) < nameLen + seqBytes + qualBytes) corrupt();
+	resize(h.patName, nameLen);
+	for(size_t i = 0; i < nameLen; i++) h.patName[i] = (char)p[i];
+	p += nameLen;
+	resize(h.patSeq, len);
+	int mask = (1 << bits) - 1;
+	for(size_t i = 0; i < len; i++) {
+		int c = (p[i / per] >> ((i % per) * bits)) & mask;
+		if(c > 4) corrupt();
+		h.patSeq[i] = c;
+	}
+	p += seqBytes;
+	resize(h.quals, len);
+	for(size_t i = 0; i < len; i++) h.quals[i] = qualBytes > 0 ? (char)p[i] : 'I';
+	p += qualBytes;
+	// FixedBitset::clear() leaves the count alone, so start afresh
+	h.mms = FixedBitset<1024>();
+	h.refcs.assign(len, 0);
+	size_t pos = 0;
+	for(size_t i = 0; i < nmm; i++) {
+		uint64_t d = getVar(p, end);
+		if(p >= end) corrupt();
+		pos += (size_t)d;
+		if(pos >= len || (i > 0 && d == 0)) corrupt();
+		h.mms.set((uint32_t)pos);
+		h.refcs[pos] = (char)*p++;
+	}
+	// Only the count of color mismatches is kept (for CM:i)
+	h.cmms = FixedBitset<1024>();
+	for(size_t i = 0; i < ncmm; i++) h.cmms.set((uint32_t)i);
+	clear(h.colSeq);
+	clear(h.colQuals);
+	h.crefcs.clear();
+	return true;
+}
@@ -0,0 +1,160 @@
+/*
+ * binhit.h
+ *
+ * A compact, versioned binary alignment format (see --binout) and a
+ * reader for it, used by bowtie-convert to turn it back into verbose
+ * or SAM output.
+ */
+
+#ifndef BINHIT_H_
+#define BINHIT_H_
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include "hit.h"
+#include "strbuf.h"
+#include "btypes.h"
+
+/**
+ * File layout:
+ *
+ *   Header (integers little-endian)
+ *     char[4]  magic "BTB\1"
+ *     u32      format version (BINHIT_VERSION)
+ *     u32      flags (BINHIT_FILE_COLOR: index is colorspace)
+ *     u32      # references
+ *     per reference: u32 name length, name (full, not truncated at
+ *                    whitespace), u64 reference length
+ *
+ *   Records, one per alignment, until end of file.  Integers are
+ *   unsigned varints (7 bits per byte, least significant first, high
+ *   bit set on all but the last byte), so small values take one byte:
+ *     varint  # bytes in the record after this field
+ *     u8      flags (BINHIT_FW, BINHIT_MATE_FW, BINHIT_COLOR,
+ *             BINHIT_QUALS, BINHIT_SEQ_N, BINHIT_PRIMER), with the
+ *             mate (0: unpaired, 1 or 2) in the top two bits
+ *     varint  read id
+ *     varint  reference index
+ *     varint  0-based offset into reference
+ *     varint  read length
+ *     varint  read name length
+ *     varint  # other alignments (oms)
+ *     varint  cost XOR (stratum << 14), which is small since the
+ *             stratum is the cost's top part
+ *     i8      stratum
+ *     varint  # mismatches
+ *     varint  # color mismatches
+ *     if mate != 0: varint mate's reference index, varint mate's
+ *                   offset, varint mate's length
+ *     if BINHIT_PRIMER: char primer base, char trimmed color
+ *   followed by the read name; the sequence as aligned, 4 bases per
+ *   byte at 2 bits each (A=0, C=1, G=2, T=3), or 2 per byte at 4 bits
+ *   each with N=4 if BINHIT_SEQ_N is set, first base in the low bits;
+ *   the qualities (Phred+33) if BINHIT_QUALS is set, else they're all
+ *   'I'; and for each mismatch, in order, a varint of its read
+ *   position minus the previous mismatch's (or 0), and the reference
+ *   character there.
+ *
+ * A reader should reject versions it doesn't know and skip any bytes
+ * of a record beyond the parts it understands, which later versions
+ * may add.
+ */
+
+static const char     BINHIT_MAGIC[4]    = { 'B', 'T', 'B', 1 };
+static const uint32_t BINHIT_VERSION     = 2;
+static const uint32_t BINHIT_FILE_COLOR  = 1;
+
+enum {
+	BINHIT_FW      = 1,
+	BINHIT_MATE_FW = 2,
+	BINHIT_COLOR   = 4,
+	BINHIT_QUALS   = 8,
+	BINHIT_SEQ_N   = 16,
+	BINHIT_PRIMER  = 32
+};
+
+/// Shift of the mate number in a record's flags
+static const int BINHIT_MATE_SHIFT = 6;
+
+/**
+ * Append the binary record for h to o.
+ */
+extern void appendBinHit(StrBuf& o, const Hit& h);
+
+/**
+ * Append the file header for an index with the given references.
+ */
+extern void appendBinHitHeader(StrBuf& o,
+                               size_t numRefs,
+                               const std::vector<std::string>& refnames,
+                               ReferenceMap *rmap,
+                               const TIndexOffU* plen,
+                               bool color);
+
+/**
+ * Sink that writes alignments in the binary format.  Which alignments
+ * are reported, and how -M sampling sets oms, is as for the default
+ * verbose output.
+ */
+class BinaryHitSink : public VerboseHitSink {
+public:
+	BinaryHitSink(OutFileBuf* out,
+	              DECL_HIT_DUMPS2) :
+	VerboseHitSink(out, 0, false, false, false, Bitset(64), NULL, NULL,
+	               false, PASS_HIT_DUMPS2) { }
+
+	using VerboseHitSink::append;
+
+	/**
+	 * Append a binary alignment record.
+	 */
+	virtual void append(StrBuf& o, const Hit& h) {
+		appendBinHit(o, h);
+	}
+};
+
+/**
+ * Reads a binary alignment file written with --binout.
+ */
+class BinHitReader {
+public:
+
+	BinHitReader() : in_(NULL), color_(false) { }
+
+	~BinHitReader() {
+		if(in_ != NULL && in_ != stdin) fclose(in_);
+	}
+
+	/**
+	 * Start reading from 'in' (named 'name' in error messages) and
+	 * read the header.
+	 */
+	void open(FILE *in, const std::string& name);
+
+	/**
+	 * Read the next record into h; return false at end of file.
+	 */
+	bool next(Hit& h);
+
+	const std::vector<std::string>& refnames() const { return refnames_; }
+	const std::vector<TIndexOffU>& reflens() const { return reflens_; }
+	bool color() const { return color_; }
+
+private:
+
+	void read(void *dst, size_t len);
+	bool readVar(uint64_t& v);
+	uint64_t getVar(const uint8_t*& p, const uint8_t *end);
+	void corrupt();
+
+	FILE *in_;
+	std::string name_;
+	bool color_;                        /// index is colorspace
+	std::vector<std::string> refnames_; /// full reference names
+	std::vector<TIndexOffU> reflens_;   /// reference lengths
+	std::vector<uint8_t> rec_;          /// current record
+};
+
+#endif /* BINHIT_H_ */
@@ -46,116 +46,6 @@ bitsetRealloc(uint32_t& sz, uint32_t* words, const char *errmsg = NULL) {
 	return newwords; // return new array
 }
 
-/**
- * A simple synchronized bitset class.
- */
-class SyncBitset {
-
-public:
-	/**
-	 * Allocate enough words to accommodate 'sz' bits.  Output the given
-	 * error message and quit if allocation fails.
-	 */
-	SyncBitset(uint32_t sz, const char *errmsg = NULL) : _errmsg(errmsg) {
-		uint32_t nwords = (sz >> 5)+1; // divide by 32 and add 1
-		try {
-			_words = new uint32_t[nwords];
-		} catch(std::bad_alloc& ba) {
-			if(_errmsg != NULL) {
-				std::cerr << _errmsg;
-			}
-			throw 1;
-		}
-		assert(_words != NULL);
-		memset(_words, 0, nwords * 4 /* words to bytes */);
-		_sz = nwords << 5 /* words to bits */;
-	}
-
-	/**
-	 * Free memory for words.
-	 */
-	~SyncBitset() {
-		delete[] _words;
-	}
-
-	/**
-	 * Test whether the given bit is set in an unsynchronized manner.
-	 */
-	bool testUnsync(uint32_t i) {
-		if(i < _sz) {
-			return ((_words[i >> 5] >> (i & 0x1f)) & 1) != 0;
-		}
-		return false;
-	}
-
-	/**
-	 * Test whether the given bit is set in a synchronized manner.
-	 */
-	bool test(uint32_t i) {
-		bool ret;
-        GUARD_LOCK(mutex_m);
-		ret = testUnsync(i);
-		return ret;
-	}
-
-	/**
-	 * Set a bit in the vector that hasn't been set before.  Assert if
-	 * it has been set.  Uses synchronization.
-	 */
-	void set(uint32_t i) {
-		GUARD_LOCK(mutex_m);
-		while(i >= _sz) {
-			// Slow path: bitset needs to be expanded before the
-			// specified bit can be set
-			ASSERT_ONLY(uint32_t oldsz = _sz);
-			expand();
-			assert_gt(_sz, oldsz);
-		}
-		// Fast path
-		assert_lt(i, _sz);
-		assert(((_words[i >> 5] >> (i & 0x1f)) & 1) == 0);
-		_words[i >> 5] |= (1 << (i & 0x1f));
-		assert(((_words[i >> 5] >> (i & 0x1f)) & 1) == 1);
-	}
-
-	/**
-	 * Set a bit in the vector that might have already been set.  Uses
-	 * synchronization.
-	 */
-	void setOver(uint32_t i) {
-		GUARD_LOCK(mutex_m);
-		while(i >= _sz) {
-			// Slow path: bitset needs to be expanded before the
-			// specified bit can be set
-			ASSERT_ONLY(uint32_t oldsz = _sz);
-			expand();
-			assert_gt(_sz, oldsz);
-		}
-		// Fast path
-		assert_lt(i, _sz);
-		_words[i >> 5] |= (1 << (i & 0x1f));
-		assert(((_words[i >> 5] >> (i & 0x1f)) & 1) == 1);
-	}
-
-
-private:
-
-	/**
-	 * Expand the size of the _words array by 50% to accommodate more
-	 * bits.
-	 */
-	void expand() {
-		uint32_t *newwords = bitsetRealloc(_sz, _words, _errmsg);
-		delete[] _words;   // delete old array
-		_words = newwords; // install new array
-	}
-
-	const char *_errmsg; // error message if an allocation fails
-	uint32_t _sz;        // size as # of bits
-	MUTEX_T mutex_m;       // mutex
-	uint32_t *_words;    // storage
-};
-
 /**
  * A simple unsynchronized bitset class.
  */
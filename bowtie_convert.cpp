@@ -0,0 +1,147 @@
+/*
+ * bowtie_convert.cpp
+ *
+ * Convert a binary alignment file written with bowtie's --binout
+ * option to bowtie's default (verbose) output or to SAM.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <getopt.h>
+#include "binhit.h"
+#include "sam.h"
+#include "filebuf.h"
+#include "strbuf.h"
+
+using namespace std;
+
+static int offBase;   // add to 0-based reference offsets in verbose output
+static bool samOut;   // write SAM instead of verbose output
+static bool fullRef;  // print full reference names
+static bool samNoHead; // don't print SAM header lines
+static bool samNoSQ;  // don't print @SQ header lines
+
+// Read by the output routines shared with bowtie
+bool showSeed = false;            // seeds aren't kept in binary files
+bool gReportColorPrimer = false;  // print ZP:/Zp: tags for colorspace SAM
+
+enum {
+	ARG_FULLREF = 256,
+	ARG_SAM_NOHEAD,
+	ARG_SAM_NOSQ,
+	ARG_COLOR_PRIMER
+};
+
+static const char *short_options = "SB:h";
+
+static struct option long_options[] = {
+	{(char*)"sam",        no_argument,       0, 'S'},
+	{(char*)"offbase",    required_argument, 0, 'B'},
+	{(char*)"fullref",    no_argument,       0, ARG_FULLREF},
+	{(char*)"sam-nohead", no_argument,       0, ARG_SAM_NOHEAD},
+	{(char*)"sam-nosq",   no_argument,       0, ARG_SAM_NOSQ},
+	{(char*)"col-primer", no_argument,       0, ARG_COLOR_PRIMER},
+	{(char*)"help",       no_argument,       0, 'h'},
+	{(char*)0, 0, 0, 0}
+};
+
+static void printUsage(ostream& out) {
+	out << "Usage: bowtie-convert [options]* <binary_in> [<hit_outfile>]" << endl
+	    << "  <binary_in>        file written by bowtie --binout (\"-\" for stdin)" << endl
+	    << "  <hit_outfile>      file to write alignments to (default: stdout)" << endl
+	    << "Options:" << endl
+	    << "  -S/--sam           write SAM instead of bowtie's default output" << endl
+	    << "  -B/--offbase <int> leftmost ref offset = <int> in default output (default: 0)" << endl
+	    << "  --fullref          write entire ref name (default: only up to 1st space)" << endl
+	    << "  --sam-nohead       suppress header lines (starting with @) for SAM output" << endl
+	    << "  --sam-nosq         suppress @SQ header lines for SAM output" << endl
+	    << "  --col-primer       for colorspace SAM output, keep primer base and 1st color" << endl
+	    << "  -h/--help          print this usage message" << endl;
+}
+
+static int convert(int argc, char **argv) {
+	int next_option;
+	string argstr;
+	for(int i = 0; i < argc; i++) {
+		if(i > 0) argstr += ' ';
+		argstr += argv[i];
+	}
+	do {
+		next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+		switch(next_option) {
+			case 'S': samOut = true; break;
+			case 'B': offBase = atoi(optarg); break;
+			case ARG_FULLREF: fullRef = true; break;
+			case ARG_SAM_NOHEAD: samNoHead = true; break;
+			case ARG_SAM_NOSQ: samNoSQ = true; break;
+			case ARG_COLOR_PRIMER: gReportColorPrimer = true; break;
+			case 'h': printUsage(cout); return 0;
+			case -1: break;
+			default:
+				printUsage(cerr);
+				return 1;
+		}
+	} while(next_option != -1);
+	if(optind >= argc) {
+		cerr << "Error: must specify a binary alignment file" << endl;
+		printUsage(cerr);
+		return 1;
+	}
+	string infile = argv[optind++];
+	FILE *in = (infile == "-") ? stdin : fopen(infile.c_str(), "rb");
+	if(in == NULL) {
+		cerr << "Error: could not open " << infile << endl;
+		return 1;
+	}
+	OutFileBuf *out;
+	if(optind < argc) {
+		out = new OutFileBuf(argv[optind]);
+	} else {
+		out = new OutFileBuf();
+	}
+	BinHitReader rd;
+	rd.open(in, infile);
+	// The file's names are already full; --fullref decides whether
+	// they're cut at the first whitespace
+	vector<string> refnames = rd.refnames();
+	StrBuf o;
+	if(samOut && !samNoHead) {
+		SAMHitSink::appendHeaderText(o, refnames.size(), refnames,
+		                             rd.color(), samNoSQ, NULL,
+		                             rd.reflens().empty() ? NULL : &rd.reflens()[0],
+		                             fullRef, false, argstr.c_str(), NULL);
+	}
+	Bitset suppress(64);
+	Hit h;
+	while(rd.next(h)) {
+		if(samOut) {
+			SAMHitSink::appendAligned(o, h, 255, 0, &refnames, NULL, NULL,
+			                          fullRef, false, 0);
+		} else {
+			VerboseHitSink::append(o, h, &refnames, NULL, NULL, fullRef,
+			                       0, offBase, false, false, false,
+			                       suppress);
+		}
+		if(o.length() >= 64 * 1024) {
+			out->writeChars(o.ptr(), o.length());
+			o.clear();
+		}
+	}
+	out->writeChars(o.ptr(), o.length());
+	out->close();
+	delete out;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	try {
+		return convert(argc, argv);
+	} catch(int e) {
+		return e;
+	} catch(std::exception& e) {
+		cerr << "Error: " << e.what() << endl;
+		return 1;
+	}
+}
@@ -8,6 +8,10 @@
 #include <iostream>
 #include <string>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 #include "alphabet.h"
 #include "color_dec.h"
 #include "color.h"
@@ -55,12 +59,14 @@ static inline bool matches(int i, int j) {
 }
 
 /**
- * Given the dynamic programming table, trace backwards from the last
- * column and populate the 's' and 'cmm' strings accordingly.  Whenever
- * there are multiple equally good ways of backtracking, choose one at
- * random.
+ * Given the backtrack masks for each column of the dynamic programming
+ * table and the scores in its last column, trace backwards from the
+ * last column and populate the 's' and 'cmm' strings accordingly.
+ * Whenever there are multiple equally good ways of backtracking, choose
+ * one at random.
  */
-static void backtrack(int table[4][6][1025], // filled-in table
+static void backtrack(const uint8_t back[][4], // backtrack masks
+                      const int last[4],       // scores in last column
                       const char *read, size_t readi, size_t readf,
                       const char *ref, size_t refi, size_t reff,
                       char *s,    // final nucleotide string
@@ -76,7 +82,7 @@ static void backtrack(int table[4][6][1025], // filled-in table
 	// Determine best base in final column of table
 	for(int i = 0; i < 4; i++) {
 		// Install minimum and backtrack info
-		int m = table[i][4][len-1];
+		int m = last[i];
 		if(m < min) {
 			min = m;
 			bests = (1 << i);
@@ -89,7 +95,7 @@ static void backtrack(int table[4][6][1025], // filled-in table
 	// to <- rightmost nucleotide
 	int to = randFromMask(bests);
 	while(true) {
-		bests = table[to][5][i]; // get next best mask
+		bests = back[i][to]; // get next best mask
 		s[i--] = to; // install best nucleotide
 		if(i < 0) break; // done
 		assert_gt(bests, 0);
@@ -127,6 +133,104 @@ static void backtrack(int table[4][6][1025], // filled-in table
 	// done
 }
 
+#ifdef __SSE2__
+
+/**
+ * Fill in one column of the table, for all four downstream nucleotides
+ * at once (one per 32-bit lane).  'prev' holds the scores in the
+ * previous column and is replaced with the scores in this one;
+ * 'back' gets this column's backtrack masks.
+ */
+static inline void decodeColumn(__m128i& prev,
+                                uint8_t *back,
+                                int readc,
+                                int q,
+                                int refc,
+                                int snpPhred)
+{
+	const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+	// Upstream nucleotide 'from' is rewarded in the lane for 'to' if
+	// the read's color takes 'from' to 'to', i.e. from == to ^ readc
+	const __m128i rw = _mm_set1_epi32(readc < 4 ? q : 0);
+	const __m128i c  = _mm_set1_epi32(readc & 3);
+	__m128i v[4];
+	v[0] = _mm_shuffle_epi32(prev, _MM_SHUFFLE(0, 0, 0, 0));
+	v[1] = _mm_shuffle_epi32(prev, _MM_SHUFFLE(1, 1, 1, 1));
+	v[2] = _mm_shuffle_epi32(prev, _MM_SHUFFLE(2, 2, 2, 2));
+	v[3] = _mm_shuffle_epi32(prev, _MM_SHUFFLE(3, 3, 3, 3));
+	for(int f = 0; f < 4; f++) {
+		__m128i good = _mm_cmpeq_epi32(_mm_xor_si128(lanes, c), _mm_set1_epi32(f));
+		v[f] = _mm_sub_epi32(v[f], _mm_and_si128(good, rw));
+	}
+	// Minimum over upstream nucleotides, and the mask of those that
+	// achieve it; ties are broken exactly as in the scalar loop
+	__m128i min  = v[0];
+	__m128i mask = _mm_set1_epi32(1);
+	for(int f = 1; f < 4; f++) {
+		__m128i lt  = _mm_cmpgt_epi32(min, v[f]);
+		__m128i eq  = _mm_cmpeq_epi32(min, v[f]);
+		__m128i bit = _mm_set1_epi32(1 << f);
+		mask = _mm_or_si128(_mm_and_si128(lt, bit),
+		                    _mm_andnot_si128(lt, _mm_or_si128(mask, _mm_and_si128(eq, bit))));
+		min  = _mm_or_si128(_mm_and_si128(lt, v[f]), _mm_andnot_si128(lt, min));
+	}
+	// Add back the reward, plus a SNP penalty where 'to' doesn't
+	// match the reference
+	const __m128i bits = _mm_set_epi32(8, 4, 2, 1);
+	__m128i snp = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(refc), bits),
+	                              _mm_setzero_si128());
+	min = _mm_add_epi32(min, _mm_set1_epi32(q));
+	prev = _mm_add_epi32(min, _mm_and_si128(snp, _mm_set1_epi32(snpPhred)));
+	// Masks are 1-15, so they survive narrowing to bytes
+	mask = _mm_packs_epi32(mask, mask);
+	mask = _mm_packus_epi16(mask, mask);
+	int m4 = _mm_cvtsi128_si32(mask);
+	memcpy(back, &m4, 4);
+}
+
+#else
+
+/**
+ * Fill in one column of the table.  'prev' holds the scores in the
+ * previous column and is replaced with the scores in this one;
+ * 'back' gets this column's backtrack masks.
+ */
+static inline void decodeColumn(int prev[4],
+                                uint8_t *back,
+                                int readc,
+                                int q,
+                                int refc,
+                                int snpPhred)
+{
+	int cur[4];
+	// For each downstream nucleotide
+	for(int to = 0; to < 4; to++) {
+		int from[] = { prev[0], prev[1], prev[2], prev[3] };
+		const int goodfrom = nuccol2nuc[to][readc];
+		// Reward the preceding position
+		if(goodfrom < 4) from[goodfrom] -= q;
+		int min = from[0];
+		int mask = 1;
+		for(int f = 1; f < 4; f++) {
+			if(from[f] < min) {
+				min = from[f];
+				mask = (1 << f);
+			} else if(from[f] == min) {
+				mask |= (1 << f);
+			}
+		}
+		min += q;
+		if(!matches(to, refc)) {
+			min += snpPhred;
+		}
+		cur[to] = min;
+		back[to] = (uint8_t)mask;
+	}
+	for(int to = 0; to < 4; to++) prev[to] = cur[to];
+}
+
+#endif
+
 /**
  * Decode the colorspace read 'read' as aligned against the reference
  * string 'ref', assuming that it's a hit.
@@ -152,90 +256,46 @@ void decodeHit(
 
 	//
 	// Dynamic programming table; good for colorspace reads up to 1024
-	// colors in length.
+	// colors in length.  Only the previous column's scores are needed
+	// to fill in the next, so just those are kept, along with every
+	// column's backtrack masks: for each nucleotide, the upstream
+	// nucleotides that lead to it with the least penalty.
 	//
-	int table[4][6][1025];
-	// 0 -> A, 1 -> C, 2 -> G, 3 -> T, 4 -> min(A, C, G, T),
-	// 5 -> backtrack mask, 6 -> min mismatches
+	uint8_t back[1025][4];
+	int last[4];
 
 	// The first column of the table just considers the first
 	// nucleotide and whether it matches the ref nucleotide.
 	for(int to = 0; to < 4; to++) {
-		if(matches(to, ref[refi])) {
-			// The assigned subject nucleotide matches the reference;
-			// no penalty
-			table[to][0][0] = 0;
-			table[to][1][0] = 0;
-			table[to][2][0] = 0;
-			table[to][3][0] = 0;
-			table[to][4][0] = 0;
-			table[to][5][0] = 15;
-		} else {
-			// The assigned subject nucleotide does not match the
-			// reference nucleotide, so we add a SNP penalty
-			table[to][0][0] = snpPhred;
-			table[to][1][0] = snpPhred;
-			table[to][2][0] = snpPhred;
-			table[to][3][0] = snpPhred;
-			table[to][4][0] = snpPhred;
-			table[to][5][0] = 15;
-		}
+		// If the assigned subject nucleotide does not match the
+		// reference nucleotide, we add a SNP penalty
+		last[to] = matches(to, ref[refi]) ? 0 : snpPhred;
+		back[0][to] = 15;
 	}
 
 	// Successive columns examine successive alignment positions
-	int omin = INT_MAX, t = 0;
+#ifdef __SSE2__
+	__m128i prev = _mm_set_epi32(last[3], last[2], last[1], last[0]);
+#else
+	int *prev = last;
+#endif
+	int t = 0;
 	for(size_t c = readi; c < readf; c++) {
 		const int readc = (int)read[c];
 		assert_leq(readc, 4);
 		assert_geq(readc, 0);
-		omin = INT_MAX;
 		// t <- index of column in dynamic programming table
 		t = (int)(c - readi + 1);
-		const int refc = ref[refi + t];
-		int from[] = { table[0][4][t-1], table[1][4][t-1],
-		               table[2][4][t-1], table[3][4][t-1] };
-		// For each downstream nucleotide
-		for(int to = 0; to < 4; to++) {
-			// For each upstream nucleotide
-			int min = INT_MAX;
-			const int goodfrom = nuccol2nuc[to][readc];
-			int q = qual[c];
-			// Reward the preceding position
-			if(goodfrom < 4) from[goodfrom] -= q;
-			min = from[0];
-			table[to][5][t] = 1;
-			if(from[1] < min) {
-				min = from[1];
-				table[to][5][t] = 2;
-			} else if(from[1] == min) {
-				table[to][5][t] |= 2;
-			}
-			if(from[2] < min) {
-				min = from[2];
-				table[to][5][t] = 4;
-			} else if(from[2] == min) {
-				table[to][5][t] |= 4;
-			}
-			if(from[3] < min) {
-				min = from[3];
-				table[to][5][t] = 8;
-			} else if(from[3] == min) {
-				table[to][5][t] |= 8;
-			}
-			min += q;
-			if(!matches(to, refc)) {
-				min += snpPhred;
-			}
-			table[to][4][t] = min;
-			if(min < omin) omin = min;
-			if(goodfrom < 4) from[goodfrom] += q;
-		}
+		decodeColumn(prev, back[t], readc, qual[c], ref[refi + t], snpPhred);
 	}
+#ifdef __SSE2__
+	_mm_storeu_si128((__m128i*)last, prev);
+#endif
 
 	t++;
 	assert_eq(t, (int)(reff - refi));
 	// Install the best backward path into ns, cmm, nmm
-	backtrack(table,
+	backtrack(back, last,
 	          read, readi, readi + t - 1,
 	          ref, refi, refi + t,
 	          ns, cmm, nmm, cmms, nmms);
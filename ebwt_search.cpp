@@ -28,7 +28,13 @@
 #include "aligner_23mm.h"
 #include "aligner_seed_mm.h"
 #include "aligner_metrics.h"
+#include "read_cache.h"
+#include "read_sched.h"
+#include "affinity.h"
+#include "insert_size.h"
 #include "sam.h"
+#include "bgzf.h"
+#include "binhit.h"
 #include "ebwt_search.h"
 #ifdef CHUD_PROFILING
 #include <CHUD/CHUD.h>
@@ -46,6 +52,7 @@ static bool startVerbose; // be talkative at startup
 bool quiet;        // print nothing but the alignments
 static int sanityCheck;   // enable expensive sanity checks
 static int format;        // default read format is FASTQ
+static bool bamInput;     // reads are unaligned BAM
 static string origString; // reference text, or filename(s)
 static int seed;          // srandom() seed
 static int timing;        // whether to report basic timing data
@@ -79,6 +86,7 @@ static bool noRefNames;       // true -> print reference indexes; not names
 static string dumpAlBase;     // basename of same-format files to dump aligned reads to
 static string dumpUnalBase;   // basename of same-format files to dump unaligned reads to
 static string dumpMaxBase;    // basename of same-format files to dump reads with more than -m valid alignments to
+static int dumpGz;            // bit (1 << DUMP_*) set -> gzip-compress that kind of dumped reads
 static uint32_t khits;  // number of hits per read; >1 is much slower
 static uint32_t mhits;  // don't report any hits if there are > mhits
 static bool better;     // true -> guarantee alignments from best possible stratum
@@ -100,6 +108,7 @@ static bool mateFwSet;         // true -> user set --ff/--fr/--rf
 static uint32_t mixedThresh;   // threshold for when to switch to paired-end mixed mode (see aligner.h)
 static uint32_t mixedAttemptLim; // number of attempts to make in "mixed mode" before giving up on orientation
 static bool dontReconcileMates;  // suppress pairwise all-versus-all way of resolving mates
+static bool learnInserts;        // learn insert sizes and search the likely window for mates first
 static uint32_t cacheLimit;      // ranges w/ size > limit will be cached
 static uint32_t cacheSize;       // # words per range cache
 static int offBase;              // offsets are 0-based by default, but configurable
@@ -110,7 +119,14 @@ static bool norc; // don't align rc orientation of read
 static bool strandFix;  // attempt to fix strand bias
 static bool randomizeQuals; // randomize quality values
 static bool stats; // print performance stats
-static int chunkPoolMegabytes;    // max MB to dedicate to best-first search frames per thread
+static bool dedup; // align each distinct read sequence only once
+static int dedupMegabytes; // max MB to dedicate to the duplicate-read cache
+static bool reorder; // with -p > 1, write output in input order
+static string cpuAffinity; // "" or --cpu-affinity plan for pinning threads
+static bool sortedOut; // write SAM/BAM sorted by reference position
+static int sortMegabytes; // max MB of records to buffer for --sorted
+static bool gzOut; // gzip-compress the alignment output
+static int chunkPoolMegabytes;    // MB of best-first search frames to keep between reads per thread
 static int chunkSz;    // size of single chunk disbursed by ChunkPool
 static bool chunkVerbose; // have chunk allocator output status messages?
 static bool recal;
@@ -146,6 +162,8 @@ static vector<string> qualities2;
 static string wrapper; // Type of wrapper script
 bool gAllowMateContainment;
 bool gReportColorPrimer;
+bool gReadahead;   // read next chunk of read input on a helper thread
+size_t gReadBufSz; // size of read-input buffers, in bytes
 MUTEX_T gLock;
 
 static void resetOptions() {
@@ -158,6 +176,7 @@ static void resetOptions() {
 	quiet					= false;
 	sanityCheck				= 0;  // enable expensive sanity checks
 	format					= FASTQ; // default read format is FASTQ
+	bamInput				= false; // reads are unaligned BAM
 	origString				= ""; // reference text, or filename(s)
 	seed					= 0; // srandom() seed
 	timing					= 0; // whether to report basic timing data
@@ -191,6 +210,7 @@ static void resetOptions() {
 	dumpAlBase				= "";    // basename of same-format files to dump aligned reads to
 	dumpUnalBase			= "";    // basename of same-format files to dump unaligned reads to
 	dumpMaxBase				= "";    // basename of same-format files to dump reads with more than -m valid alignments to
+	dumpGz					= 0;     // bit (1 << DUMP_*) set -> gzip-compress that kind of dumped reads
 	khits					= 1;     // number of hits per read; >1 is much slower
 	mhits					= 0xffffffff; // don't report any hits if there are > mhits
 	better					= false; // true -> guarantee alignments from best possible stratum
@@ -212,6 +232,7 @@ static void resetOptions() {
 	mixedThresh				= 4;     // threshold for when to switch to paired-end mixed mode (see aligner.h)
 	mixedAttemptLim			= 100;   // number of attempts to make in "mixed mode" before giving up on orientation
 	dontReconcileMates		= true;  // suppress pairwise all-versus-all way of resolving mates
+	learnInserts			= false; // learn insert sizes and search the likely window for mates first
 	cacheLimit				= 5;     // ranges w/ size > limit will be cached
 	cacheSize				= 0;     // # words per range cache
 	offBase					= 0;     // offsets are 0-based by default, but configurable
@@ -222,7 +243,14 @@ static void resetOptions() {
 	strandFix				= true;  // attempt to fix strand bias
 	randomizeQuals			= false; // randomize quality values
 	stats					= false; // print performance stats
-	chunkPoolMegabytes		= 64;    // max MB to dedicate to best-first search frames per thread
+	dedup					= false; // align each distinct read sequence only once
+	dedupMegabytes			= 64;    // max MB to dedicate to the duplicate-read cache
+	reorder					= false; // with -p > 1, write output in input order
+	cpuAffinity				= "";    // "" or --cpu-affinity plan for pinning threads
+	sortedOut				= false; // write SAM/BAM sorted by reference position
+	sortMegabytes			= 768;   // max MB of records to buffer for --sorted
+	gzOut					= false; // gzip-compress the alignment output
+	chunkPoolMegabytes		= 64;    // MB of best-first search frames to keep between reads per thread
 	chunkSz					= 256;   // size of single chunk disbursed by ChunkPool (in KB)
 	chunkVerbose			= false; // have chunk allocator output status messages?
 	recal					= false;
@@ -258,6 +286,8 @@ static void resetOptions() {
 	wrapper.clear();
 	gAllowMateContainment	= false; // true -> alignments where one mate lies inside the other are valid
 	gReportColorPrimer		= false; // true -> print flag with trimmed color primer and downstream color
+	gReadahead				= true;  // read next chunk of read input on a helper thread
+	gReadBufSz				= FileBuf::BUF_SZ; // size of read-input buffers
 }
 
 // mating constraints
@@ -344,7 +374,22 @@ enum {
 	ARG_QUALS2,
 	ARG_ALLOW_CONTAIN,
 	ARG_COLOR_PRIMER,
-	ARG_WRAPPER
+	ARG_WRAPPER,
+	ARG_DEDUP,
+	ARG_DEDUPMBS,
+	ARG_NO_READAHEAD,
+	ARG_READBUFKB,
+	ARG_REORDER,
+	ARG_CPU_AFFINITY,
+	ARG_LEARN_INS,
+	ARG_BAM,
+	ARG_SORTED,
+	ARG_SORTMBS,
+	ARG_BINOUT,
+	ARG_GZOUT,
+	ARG_AL_GZ,
+	ARG_UN_GZ,
+	ARG_MAXDUMP_GZ
 };
 
 static struct option long_options[] = {
@@ -454,6 +499,21 @@ static struct option long_options[] = {
 	{(char*)"allow-contain",no_argument,       0,            ARG_ALLOW_CONTAIN},
 	{(char*)"col-primer",   no_argument,       0,            ARG_COLOR_PRIMER},
 	{(char*)"wrapper",      required_argument, 0,            ARG_WRAPPER},
+	{(char*)"dedup",        no_argument,       0,            ARG_DEDUP},
+	{(char*)"dedupmbs",     required_argument, 0,            ARG_DEDUPMBS},
+	{(char*)"noreadahead",  no_argument,       0,            ARG_NO_READAHEAD},
+	{(char*)"readbufkb",    required_argument, 0,            ARG_READBUFKB},
+	{(char*)"reorder",      no_argument,       0,            ARG_REORDER},
+	{(char*)"cpu-affinity", required_argument, 0,            ARG_CPU_AFFINITY},
+	{(char*)"learn-ins",    no_argument,       0,            ARG_LEARN_INS},
+	{(char*)"bam",          no_argument,       0,            ARG_BAM},
+	{(char*)"sorted",       no_argument,       0,            ARG_SORTED},
+	{(char*)"sortmbs",      required_argument, 0,            ARG_SORTMBS},
+	{(char*)"binout",       no_argument,       0,            ARG_BINOUT},
+	{(char*)"gzout",        no_argument,       0,            ARG_GZOUT},
+	{(char*)"al-gz",        required_argument, 0,            ARG_AL_GZ},
+	{(char*)"un-gz",        required_argument, 0,            ARG_UN_GZ},
+	{(char*)"max-gz",       required_argument, 0,            ARG_MAXDUMP_GZ},
 	{(char*)0, 0, 0, 0} // terminator
 };
 
@@ -486,6 +546,7 @@ static void printUsage(ostream& out) {
 	    << "  -q                 query input files are FASTQ .fq/.fastq (default)" << endl
 	    << "  -f                 query input files are (multi-)FASTA .fa/.mfa" << endl
 	    << "  -r                 query input files are raw one-sequence-per-line" << endl
+	    << "  -b                 query input files are unaligned BAM (use --12 for pairs)" << endl
 	    << "  -c                 query sequences given on cmd line (as <mates>, <singles>)" << endl
 	    << "  -C                 reads and index are in colorspace" << endl
 	    << "  -Q/--quals <file>  QV file(s) corresponding to CSFASTA inputs; use with -f -C" << endl
@@ -515,8 +576,9 @@ static void printUsage(ostream& out) {
 	    << "  --nofw/--norc      do not align to forward/reverse-complement reference strand" << endl
 	    << "  --maxbts <int>     max # backtracks for -n 2/3 (default: 125, 800 for --best)" << endl
 	    << "  --pairtries <int>  max # attempts to find mate for anchor hit (default: 100)" << endl
+	    << "  --learn-ins        learn insert sizes; look for mates in the likely range first" << endl
 	    << "  -y/--tryhard       try hard to find valid alignments, at the expense of speed" << endl
-	    << "  --chunkmbs <int>   max megabytes of RAM for best-first search frames (def: 64)" << endl
+	    << "  --chunkmbs <int>   MB of RAM kept for best-first search frames (def: 64)" << endl
 	    << "Reporting:" << endl
 	    << "  -k <int>           report up to <int> good alignments per read (default: 1)" << endl
 	    << "  -a/--all           report all alignments per read (much slower than low -k)" << endl
@@ -533,8 +595,12 @@ static void printUsage(ostream& out) {
 	    << "  --al <fname>       write aligned reads/pairs to file(s) <fname>" << endl
 	    << "  --un <fname>       write unaligned reads/pairs to file(s) <fname>" << endl
 	    << "  --max <fname>      write reads/pairs over -m limit to file(s) <fname>" << endl
+	    << "  --al-gz <fname>    like --al, but gzip-compressed" << endl
+	    << "  --un-gz <fname>    like --un, but gzip-compressed" << endl
+	    << "  --max-gz <fname>   like --max, but gzip-compressed" << endl
 	    << "  --suppress <cols>  suppresses given columns (comma-delim'ed) in default output" << endl
 	    << "  --fullref          write entire ref name (default: only up to 1st space)" << endl
+	    << "  --reorder          with -p > 1, write output in the same order as input reads" << endl
 	    << "Colorspace:" << endl
 	    << "  --snpphred <int>   Phred penalty for SNP when decoding colorspace (def: 30)" << endl
 	    << "     or" << endl
@@ -544,6 +610,11 @@ static void printUsage(ostream& out) {
 	    << "  --col-keepends     keep nucleotides at extreme ends of decoded alignment" << endl
 	    << "SAM:" << endl
 	    << "  -S/--sam           write hits in SAM format" << endl
+	    << "  --bam              write hits in BGZF-compressed BAM format; implies -S" << endl
+	    << "  --sorted           sort SAM/BAM output by reference position" << endl
+	    << "  --sortmbs <int>    max megabytes of RAM for --sorted buffers (default: 768)" << endl
+	    << "  --binout           write hits in binary format (see bowtie-convert)" << endl
+	    << "  --gzout            gzip-compress hit output, with -p threads compressing" << endl
 	    << "  --mapq <int>       default mapping quality (MAPQ) to print for SAM alignments" << endl
 	    << "  --sam-nohead       supppress header lines (starting with @) for SAM output" << endl
 	    << "  --sam-nosq         supppress @SQ header lines for SAM output" << endl
@@ -551,6 +622,11 @@ static void printUsage(ostream& out) {
 	    << "Performance:" << endl
 	    << "  -o/--offrate <int> override offrate of index; must be >= index's offrate" << endl
 	    << "  -p/--threads <int> number of alignment threads to launch (default: 1)" << endl
+	    << "  --dedup            align each distinct read once; reuse hits for duplicates" << endl
+	    << "  --dedupmbs <int>   max megabytes of RAM for --dedup cache (default: 64)" << endl
+	    << "  --readbufkb <int>  size of read-input buffers in KB (default: 256)" << endl
+	    << "  --noreadahead      don't read input ahead on a helper thread" << endl
+	    << "  --cpu-affinity <s> pin threads to CPUs: compact, scatter or a list (e.g. 0-3)" << endl
 #ifdef BOWTIE_MM
 	    << "  --mm               use memory-mapped I/O for index; many 'bowtie's can share" << endl
 #endif
@@ -665,6 +741,7 @@ static void parseOptions(int argc, const char **argv) {
 				break;
 			}
 			case 'q': format = FASTQ; break;
+			case 'b': bamInput = true; break;
 			case 'r': format = RAW; break;
 			case 'c': format = CMDLINE; break;
 			case 'C': color = true; break;
@@ -688,6 +765,9 @@ static void parseOptions(int argc, const char **argv) {
 			case ARG_RANGE: rangeMode = true; break;
 			case ARG_CONCISE: outType = OUTPUT_CONCISE; break;
 			case 'S': outType = OUTPUT_SAM; break;
+			case ARG_BAM: outType = OUTPUT_BAM; break;
+			case ARG_BINOUT: outType = OUTPUT_BINARY; break;
+			case ARG_GZOUT: gzOut = true; break;
 			case ARG_REFOUT: refOut = true; break;
 			case ARG_NOOUT: outType = OUTPUT_NONE; break;
 			case ARG_REFMAP: refMapFile = optarg; break;
@@ -721,9 +801,12 @@ static void parseOptions(int argc, const char **argv) {
 			}
 			case ARG_MMSWEEP: mmSweep = true; break;
 			case ARG_HADOOPOUT: hadoopOut = true; break;
-			case ARG_AL: dumpAlBase = optarg; break;
-			case ARG_UN: dumpUnalBase = optarg; break;
-			case ARG_MAXDUMP: dumpMaxBase = optarg; break;
+			case ARG_AL: dumpAlBase = optarg; dumpGz &= ~(1 << DUMP_AL); break;
+			case ARG_UN: dumpUnalBase = optarg; dumpGz &= ~(1 << DUMP_UNAL); break;
+			case ARG_MAXDUMP: dumpMaxBase = optarg; dumpGz &= ~(1 << DUMP_MAX); break;
+			case ARG_AL_GZ: dumpAlBase = optarg; dumpGz |= (1 << DUMP_AL); break;
+			case ARG_UN_GZ: dumpUnalBase = optarg; dumpGz |= (1 << DUMP_UNAL); break;
+			case ARG_MAXDUMP_GZ: dumpMaxBase = optarg; dumpGz |= (1 << DUMP_MAX); break;
 			case ARG_SOLEXA_QUALS: solexaQuals = true; break;
 			case ARG_integerQuals: integerQuals = true; break;
 			case ARG_PHRED64: phred64Quals = true; break;
@@ -836,6 +919,15 @@ static void parseOptions(int argc, const char **argv) {
 			case ARG_NO_FW: nofw = true; break;
 			case ARG_NO_RC: norc = true; break;
 			case ARG_STATS: stats = true; break;
+			case ARG_DEDUP: dedup = true; break;
+			case ARG_DEDUPMBS: dedupMegabytes = parseInt(1, "--dedupmbs arg must be at least 1"); break;
+			case ARG_NO_READAHEAD: gReadahead = false; break;
+			case ARG_READBUFKB: gReadBufSz = (size_t)parseInt(1, "--readbufkb arg must be at least 1") * 1024; break;
+			case ARG_REORDER: reorder = true; break;
+			case ARG_CPU_AFFINITY: cpuAffinity = optarg; break;
+			case ARG_LEARN_INS: learnInserts = true; break;
+			case ARG_SORTED: sortedOut = true; break;
+			case ARG_SORTMBS: sortMegabytes = parseInt(1, "--sortmbs arg must be at least 1"); break;
 			case ARG_PEV2: useV1 = false; break;
 			case ARG_SAM_NO_QNAME_TRUNC: samNoQnameTrunc = true; break;
 			case ARG_SAM_NOHEAD: samNoHead = true; break;
@@ -876,6 +968,18 @@ static void parseOptions(int argc, const char **argv) {
 		}
 	} while(next_option != -1);
 	bool paired = mates1.size() > 0 || mates2.size() > 0 || mates12.size() > 0;
+	if(bamInput) {
+		if(color) {
+			cerr << "Error: -b cannot be combined with -C; BAM input must be in nucleotide space" << endl;
+			throw 1;
+		}
+		if(mates1.size() > 0) {
+			cerr << "Error: -b cannot be combined with -1/-2; BAM files holding paired records" << endl
+			     << "should be specified with --12" << endl;
+			throw 1;
+		}
+		format = BAM;
+	}
 	if(rangeMode) {
 		// Tell the Ebwt loader to ignore the suffix-array portion of
 		// the index.  We don't need it because the user isn't asking
@@ -986,6 +1090,49 @@ static void parseOptions(int argc, const char **argv) {
 		cerr << "Error: --refout cannot be combined with -S/--sam" << endl;
 		throw 1;
 	}
+	if(outType == OUTPUT_BAM && refOut) {
+		cerr << "Error: --refout cannot be combined with --bam" << endl;
+		throw 1;
+	}
+	if(outType == OUTPUT_BINARY && refOut) {
+		cerr << "Error: --refout cannot be combined with --binout" << endl;
+		throw 1;
+	}
+	if(gzOut && outType == OUTPUT_BAM) {
+		cerr << "Error: --gzout cannot be combined with --bam, which is already compressed" << endl;
+		throw 1;
+	}
+	if(gzOut && refOut) {
+		cerr << "Error: --gzout cannot be combined with --refout" << endl;
+		throw 1;
+	}
+	if(sortedOut && outType != OUTPUT_SAM && outType != OUTPUT_BAM) {
+		cerr << "Error: --sorted requires -S/--sam or --bam" << endl;
+		throw 1;
+	}
+	if(sortedOut && reorder) {
+		cerr << "Error: --sorted cannot be combined with --reorder" << endl;
+		throw 1;
+	}
+	if(reorder && refOut) {
+		cerr << "Error: --reorder cannot be combined with --refout" << endl;
+		throw 1;
+	}
+	if(reorder && randReadsNoSync) {
+		cerr << "Error: --reorder cannot be combined with --randreadnosync" << endl;
+		throw 1;
+	}
+	if(reorder && prefetchWidth > 1) {
+		cerr << "Error: --reorder cannot be combined with --prewidth > 1" << endl;
+		throw 1;
+	}
+	if(!cpuAffinity.empty()) {
+		gCpuAffinity().plan(cpuAffinity, nthreads);
+		if(verbose || stats) gCpuAffinity().printPlan(cerr);
+	} else {
+		gCpuAffinity() = CpuAffinity();
+	}
+	gInsertModel().reset(learnInserts);
 	if(!mateFwSet) {
 		if(color) {
 			// Set colorspace default (--ff)
@@ -1007,7 +1154,7 @@ static void parseOptions(int argc, const char **argv) {
 static const char *argv0 = NULL;
 
 #define FINISH_READ(p) \
-	/* Don't do finishRead if the read isn't legit or if the read was skipped by the doneMask */ \
+	/* Don't do finishRead if the read isn't legit */ \
 	if(!p->empty()) { \
 		sink->finishRead(*p, true, !skipped); \
 	} \
@@ -1015,7 +1162,10 @@ static const char *argv0 = NULL;
 
 /// Macro for getting the next read, possibly aborting depending on
 /// whether the result is empty or the patid exceeds the limit, and
-/// marshaling the read into convenient variables.
+/// marshaling the read into convenient variables.  Reversed and
+/// reverse-complemented views are built lazily; obtain them through
+/// the ReadBuf get*() accessors.  Reads already in the --dedup cache
+/// skip straight to FINISH_READ with the cached hits.
 #define GET_READ(p) \
 	p->nextReadPair(); \
 	if(p->empty() || p->patid() >= qUpto) { \
@@ -1025,20 +1175,13 @@ static const char *argv0 = NULL;
 	assert(!empty(p->bufa().patFw)); \
 	String<Dna5>& patFw  = p->bufa().patFw;  \
 	patFw.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<Dna5>& patRc  = p->bufa().patRc;  \
-	patRc.data_begin += 0; /* suppress "unused" compiler warning */ \
 	String<char>& qual = p->bufa().qual; \
 	qual.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<char>& qualRev = p->bufa().qualRev; \
-	qualRev.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<Dna5>& patFwRev  = p->bufa().patFwRev;  \
-	patFwRev.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<Dna5>& patRcRev  = p->bufa().patRcRev;  \
-	patRcRev.data_begin += 0; /* suppress "unused" compiler warning */ \
 	String<char>& name   = p->bufa().name;   \
 	name.data_begin += 0; /* suppress "unused" compiler warning */ \
 	uint32_t      patid  = p->patid();       \
-	params.setPatId(patid);
+	params.setPatId(patid); \
+	if(sink->checkCache(*p)) continue;
 
 /// Macro for getting the forward oriented version of next read,
 /// possibly aborting depending on whether the result is empty or the
@@ -1056,13 +1199,10 @@ static const char *argv0 = NULL;
 	patFw.data_begin += 0; /* suppress "unused" compiler warning */ \
 	String<char>& qual = p->bufa().qual; \
 	qual.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<Dna5>& patFwRev  = p->bufa().patFwRev;  \
-	patFwRev.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<char>& qualRev = p->bufa().qualRev; \
-	qualRev.data_begin += 0; /* suppress "unused" compiler warning */ \
 	String<char>& name   = p->bufa().name;   \
 	name.data_begin += 0; /* suppress "unused" compiler warning */ \
-	uint32_t      patid  = p->patid();
+	uint32_t      patid  = p->patid(); \
+	if(sink->checkCache(*p)) continue;
 
 #define WORKER_EXIT() \
 	patsrcFact->destroy(patsrc); \
@@ -1079,6 +1219,8 @@ static const char *argv0 = NULL;
 #define CHUD_STOP()
 #endif
 
+static ReadScheduler* readSched; // hands out reads when -p > 1
+
 /// Create a PatternSourcePerThread for the current thread according
 /// to the global params and return a pointer to it
 static PatternSourcePerThreadFactory*
@@ -1086,6 +1228,8 @@ createPatsrcFactory(PairedPatternSource& _patsrc, int tid) {
 	PatternSourcePerThreadFactory *patsrcFact;
 	if(randReadsNoSync) {
 		patsrcFact = new RandomPatternSourcePerThreadFactory(numRandomReads, lenRandomReads, nthreads, tid);
+	} else if(readSched != NULL) {
+		patsrcFact = new ScheduledPatternSourcePerThreadFactory(*readSched, tid);
 	} else {
 		patsrcFact = new WrappedPatternSourcePerThreadFactory(_patsrc);
 	}
@@ -1150,6 +1294,7 @@ static void exactSearchWorker(void *vp) {
 	const BitPairReference* refs =  exactSearch_refs;
 
 	// Per-thread initialization
+	gCpuAffinity().pinWorker(tid);
 	PatternSourcePerThreadFactory *patsrcFact = createPatsrcFactory(_patsrc, tid);
 	PatternSourcePerThread *patsrc = patsrcFact->create();
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
@@ -1198,6 +1343,7 @@ static void exactSearchWorkerStateful(void *vp) {
 	BitPairReference* refs       =  exactSearch_refs;
 
 	// Global initialization
+	gCpuAffinity().pinWorker(tid);
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
 
@@ -1266,6 +1412,10 @@ static void exactSearchWorkerStateful(void *vp) {
 
 	delete patsrcFact;
 	delete sinkFact;
+	if(stats) {
+		ThreadSafe _ts(&gLock);
+		pool->printStats(cerr, tid);
+	}
 	delete pool;
 	return;
 }
@@ -1274,13 +1424,13 @@ static void exactSearchWorkerStateful(void *vp) {
 	bt.setQuery(&p->bufa().patFw, &p->bufa().qual, &p->bufa().name); \
 	params.setFw(true);
 #define SET_A_RC(bt, p, params) \
-	bt.setQuery(&p->bufa().patRc, &p->bufa().qualRev, &p->bufa().name); \
+	bt.setQuery(&p->bufa().getPatRc(), &p->bufa().getQualRev(), &p->bufa().name); \
 	params.setFw(false);
 #define SET_B_FW(bt, p, params) \
 	bt.setQuery(&p->bufb().patFw, &p->bufb().qual, &p->bufb().name); \
 	params.setFw(true);
 #define SET_B_RC(bt, p, params) \
-	bt.setQuery(&p->bufb().patRc, &p->bufb().qualRev, &p->bufb().name); \
+	bt.setQuery(&p->bufb().getPatRc(), &p->bufb().getQualRev(), &p->bufb().name); \
 	params.setFw(false);
 
 /**
@@ -1362,8 +1512,6 @@ static HitSink*                       mismatchSearch_sink;
 static Ebwt<String<Dna> >*            mismatchSearch_ebwtFw;
 static Ebwt<String<Dna> >*            mismatchSearch_ebwtBw;
 static vector<String<Dna5> >*         mismatchSearch_os;
-static SyncBitset*                    mismatchSearch_doneMask;
-static SyncBitset*                    mismatchSearch_hitMask;
 static BitPairReference*              mismatchSearch_refs;
 
 /**
@@ -1383,6 +1531,7 @@ static void mismatchSearchWorkerFullStateful(void *vp) {
 	BitPairReference*      refs    =  mismatchSearch_refs;
 
 	// Global initialization
+	gCpuAffinity().pinWorker(tid);
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
 	ChunkPool *pool = new ChunkPool(chunkSz * 1024, chunkPoolMegabytes * 1024 * 1024, chunkVerbose);
@@ -1451,6 +1600,10 @@ static void mismatchSearchWorkerFullStateful(void *vp) {
 
 	delete patsrcFact;
 	delete sinkFact;
+	if(stats) {
+		ThreadSafe _ts(&gLock);
+		pool->printStats(cerr, tid);
+	}
 	delete pool;
 	return;
 }
@@ -1468,6 +1621,7 @@ static void mismatchSearchWorkerFull(void *vp){
 	const BitPairReference* refs     =  mismatchSearch_refs;
 
 	// Per-thread initialization
+	gCpuAffinity().pinWorker(tid);
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	PatternSourcePerThread* patsrc = patsrcFact->create();
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
@@ -1498,10 +1652,8 @@ static void mismatchSearchWorkerFull(void *vp){
 		uint32_t s = plen;
 		uint32_t s3 = s >> 1; // length of 3' half of seed
 		uint32_t s5 = (s >> 1) + (s & 1); // length of 5' half of seed
-		#define DONEMASK_SET(p)
 		#include "search_1mm_phase1.c"
 		#include "search_1mm_phase2.c"
-		#undef DONEMASK_SET
 	} // End read loop
 	FINISH_READ(patsrc);
     WORKER_EXIT();
@@ -1521,8 +1673,6 @@ static void mismatchSearchFull(PairedPatternSource& _patsrc,
 	mismatchSearch_sink         = &_sink;
 	mismatchSearch_ebwtFw       = &ebwtFw;
 	mismatchSearch_ebwtBw       = &ebwtBw;
-	mismatchSearch_doneMask     = NULL;
-	mismatchSearch_hitMask      = NULL;
 	mismatchSearch_os           = &os;
 
 	assert(!ebwtFw.isInMemory());
@@ -1644,7 +1794,7 @@ static void mismatchSearchFull(PairedPatternSource& _patsrc,
 			::printHit( \
 				os, \
 				hits[0], \
-				patRc, \
+				patsrc->bufa().getPatRc(), \
 				plen, \
 				unrevOff, \
 				oneRevOff, \
@@ -1660,8 +1810,6 @@ static HitSink*                       twoOrThreeMismatchSearch_sink;
 static Ebwt<String<Dna> >*            twoOrThreeMismatchSearch_ebwtFw;
 static Ebwt<String<Dna> >*            twoOrThreeMismatchSearch_ebwtBw;
 static vector<String<Dna5> >*         twoOrThreeMismatchSearch_os;
-static SyncBitset*                    twoOrThreeMismatchSearch_doneMask;
-static SyncBitset*                    twoOrThreeMismatchSearch_hitMask;
 static bool                           twoOrThreeMismatchSearch_two;
 static BitPairReference*              twoOrThreeMismatchSearch_refs;
 
@@ -1684,6 +1832,7 @@ static void twoOrThreeMismatchSearchWorkerStateful(void *vp) {
 	static bool            two     =  twoOrThreeMismatchSearch_two;
 
 	// Global initialization
+	gCpuAffinity().pinWorker(tid);
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
 
@@ -1754,6 +1903,10 @@ static void twoOrThreeMismatchSearchWorkerStateful(void *vp) {
 
 	delete patsrcFact;
 	delete sinkFact;
+	if(stats) {
+		ThreadSafe _ts(&gLock);
+		pool->printStats(cerr, tid);
+	}
 	delete pool;
 	return;
 }
@@ -1767,6 +1920,7 @@ static void twoOrThreeMismatchSearchWorkerFull(void *vp) {
 	HitSink&                       _sink    = *twoOrThreeMismatchSearch_sink;
 	vector<String<Dna5> >&         os       = *twoOrThreeMismatchSearch_os;
 	bool                           two      = twoOrThreeMismatchSearch_two;
+    gCpuAffinity().pinWorker(tid);
     PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	PatternSourcePerThread* patsrc = patsrcFact->create();
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
@@ -1846,11 +2000,9 @@ static void twoOrThreeMismatchSearchWorkerFull(void *vp) {
 		uint32_t s = plen;
 		uint32_t s3 = s >> 1; // length of 3' half of seed
 		uint32_t s5 = (s >> 1) + (s & 1); // length of 5' half of seed
-		#define DONEMASK_SET(p)
 		#include "search_23mm_phase1.c"
 		#include "search_23mm_phase2.c"
 		#include "search_23mm_phase3.c"
-		#undef DONEMASK_SET
 	}
 	FINISH_READ(patsrc);
 	// Threads join at end of Phase 1
@@ -1893,8 +2045,6 @@ static void twoOrThreeMismatchSearchFull(
 	twoOrThreeMismatchSearch_ebwtFw   = &ebwtFw;
 	twoOrThreeMismatchSearch_ebwtBw   = &ebwtBw;
 	twoOrThreeMismatchSearch_os       = &os;
-	twoOrThreeMismatchSearch_doneMask = NULL;
-	twoOrThreeMismatchSearch_hitMask  = NULL;
 	twoOrThreeMismatchSearch_two      = two;
 
 #ifdef WITH_TBB
@@ -1938,8 +2088,6 @@ static HitSink*                 seededQualSearch_sink;
 static Ebwt<String<Dna> >*      seededQualSearch_ebwtFw;
 static Ebwt<String<Dna> >*      seededQualSearch_ebwtBw;
 static vector<String<Dna5> >*   seededQualSearch_os;
-static SyncBitset*              seededQualSearch_doneMask;
-static SyncBitset*              seededQualSearch_hitMask;
 static PartialAlignmentManager* seededQualSearch_pamFw;
 static PartialAlignmentManager* seededQualSearch_pamRc;
 static int                      seededQualSearch_qualCutoff;
@@ -1955,6 +2103,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	HitSink&                 _sink      = *seededQualSearch_sink;
 	vector<String<Dna5> >&   os         = *seededQualSearch_os;
 	int                      qualCutoff = seededQualSearch_qualCutoff;
+	gCpuAffinity().pinWorker(tid);
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	PatternSourcePerThread* patsrc = patsrcFact->create();
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
@@ -2125,12 +2274,10 @@ static void seededQualSearchWorkerFull(void *vp) {
 		uint32_t qs = min<uint32_t>(plen, s);
 		uint32_t qs3 = qs >> 1;
 		uint32_t qs5 = (qs >> 1) + (qs & 1);
-		#define DONEMASK_SET(p)
 		#include "search_seeded_phase1.c"
 		#include "search_seeded_phase2.c"
 		#include "search_seeded_phase3.c"
 		#include "search_seeded_phase4.c"
-		#undef DONEMASK_SET
 	}
 	FINISH_READ(patsrc);
 	if(seedMms > 0) {
@@ -2154,6 +2301,7 @@ static void seededQualSearchWorkerFullStateful(void *vp) {
 	BitPairReference*        refs       = seededQualSearch_refs;
 
 	// Global initialization
+	gCpuAffinity().pinWorker(tid);
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
 	ChunkPool *pool = new ChunkPool(chunkSz * 1024, chunkPoolMegabytes * 1024 * 1024, chunkVerbose);
@@ -2240,6 +2388,10 @@ static void seededQualSearchWorkerFullStateful(void *vp) {
 
 	delete patsrcFact;
 	delete sinkFact;
+	if(stats) {
+		ThreadSafe _ts(&gLock);
+		pool->printStats(cerr, tid);
+	}
 	delete pool;
 	return;
 }
@@ -2278,8 +2430,6 @@ static void seededQualCutoffSearchFull(
 	seededQualSearch_ebwtFw   = &ebwtFw;
 	seededQualSearch_ebwtBw   = &ebwtBw;
 	seededQualSearch_os       = &os;
-	seededQualSearch_doneMask = NULL;
-	seededQualSearch_hitMask  = NULL;
 	seededQualSearch_pamFw    = NULL;
 	seededQualSearch_pamRc    = NULL;
 	seededQualSearch_qualCutoff = qualCutoff;
@@ -2392,6 +2542,12 @@ patsrcFromStrings(int format,
 			                               patDumpfile, verbose,
 			                               trim3, trim5,
 			                               skipReads);
+		case BAM:
+			return new BAMPatternSource   (seed, reads,
+			                               randomizeQuals,
+			                               patDumpfile, verbose,
+			                               trim3, trim5,
+			                               skipReads, nthreads);
 		case RANDOM:
 			return new RandomPatternSource(seed, 2000000, lenRandomReads,
 			                               patDumpfile,
@@ -2403,7 +2559,30 @@ patsrcFromStrings(int format,
 	}
 }
 
-#define PASS_DUMP_FILES dumpAlBase, dumpUnalBase, dumpMaxBase
+/**
+ * Print how much input was read and how long the search threads spent
+ * waiting for it, summed over all of the read files.
+ */
+static void printInputStats(ostream& out,
+                            const vector<PatternSource*>& a,
+                            const vector<PatternSource*>& b,
+                            const vector<PatternSource*>& ab)
+{
+	FileBufStats st;
+	const vector<PatternSource*>* srcs[] = { &a, &b, &ab };
+	for(size_t i = 0; i < 3; i++) {
+		for(size_t j = 0; j < srcs[i]->size(); j++) {
+			if((*srcs[i])[j] != NULL) (*srcs[i])[j]->addInputStats(st);
+		}
+	}
+	out << "Read input:" << endl
+	    << "  buffers: " << st.refills << " (" << (gReadBufSz >> 10) << " KB"
+	    << (gReadahead ? ", readahead" : "") << ")" << endl
+	    << "  bytes: " << st.bytes << endl
+	    << "  stall: " << (st.stallUs / 1000) << " ms" << endl;
+}
+
+#define PASS_DUMP_FILES dumpAlBase, dumpUnalBase, dumpMaxBase, dumpGz
 
 static string argstr;
 
@@ -2566,11 +2745,22 @@ static void driver(const char * type,
 				cerr << "Warning: ignoring alignment output file " << outfile << " because --refout was specified" << endl;
 			}
 		} else {
-			fout = new OutFileBuf(outfile.c_str(), false);
+			fout = new OutFileBuf(outfile.c_str(), outType == OUTPUT_BAM || outType == OUTPUT_BINARY || gzOut);
 		}
 	} else {
 		fout = new OutFileBuf();
 	}
+	if(fout != NULL && (outType == OUTPUT_BAM || gzOut)) {
+		// Compress with one deflating thread per search thread.  BGZF
+		// is a series of ordinary gzip members, so --gzout output can
+		// be read by gzip and zcat as well as by bgzip and tabix.
+		fout->setFilter(new BGZFWriter(nthreads));
+	}
+	if(fout != NULL) {
+		// Write (and compress) on a separate thread so that search
+		// threads reporting alignments don't wait on the disk
+		fout->setAsync(OutFileBuf::ASYNC_DEPTH);
+	}
 	ReferenceMap* rmap = NULL;
 	if(refMapFile != NULL) {
 		if(verbose || startVerbose) {
@@ -2674,6 +2864,14 @@ static void driver(const char * type,
 		}
 		vector<string>* refnames = &ebwt.refnames();
 		if(noRefNames) refnames = NULL;
+		HitSorter *sorter = NULL;
+		if(sortedOut) {
+			const char *tmpDir = getenv("TMPDIR");
+			sorter = new HitSorter(
+				(size_t)sortMegabytes * 1024 * 1024,
+				nthreads,
+				(tmpDir != NULL && tmpDir[0] != '\0') ? tmpDir : "/tmp");
+		}
 		switch(outType) {
 			case OUTPUT_FULL:
 				if(refOut) {
@@ -2695,23 +2893,37 @@ static void driver(const char * type,
 				}
 				break;
 			case OUTPUT_SAM:
+			case OUTPUT_BAM:
 				if(refOut) {
 					throw 1;
 				} else {
-					SAMHitSink *sam = new SAMHitSink(
+					SAMHitSink *sam;
+					if(outType == OUTPUT_BAM) {
+						sam = new BAMHitSink(
+							fout, 1, rmap, amap,
+							fullRef, samNoQnameTrunc, defaultMapq,
+							PASS_DUMP_FILES,
+							format == TAB_MATE, sampleMax,
+							table, refnames);
+					} else {
+						sam = new SAMHitSink(
 							fout, 1, rmap, amap,
 							fullRef, samNoQnameTrunc, defaultMapq,
 							PASS_DUMP_FILES,
 							format == TAB_MATE, sampleMax,
 							table, refnames);
-					if(!samNoHead) {
+					}
+					sam->setSorter(sorter);
+					// A BAM file always has a header, if only to list the
+					// references that records point to
+					if(!samNoHead || outType == OUTPUT_BAM) {
 						vector<string> refnames;
-						if(!samNoSQ) {
+						if(!samNoSQ || outType == OUTPUT_BAM) {
 							readEbwtRefnames(adjustedEbwtFileBase, refnames);
 						}
 						sam->appendHeaders(
 								sam->out(0), ebwt.nPat(),
-								refnames, color, samNoSQ, rmap,
+								refnames, color, samNoHead, samNoSQ, rmap,
 								ebwt.plen(), fullRef,
 								samNoQnameTrunc,
 								argstr.c_str(),
@@ -2720,6 +2932,20 @@ static void driver(const char * type,
 					sink = sam;
 				}
 				break;
+			case OUTPUT_BINARY: {
+				BinaryHitSink *bin = new BinaryHitSink(
+					fout, PASS_DUMP_FILES,
+					format == TAB_MATE, sampleMax,
+					table, refnames);
+				vector<string> refnames;
+				readEbwtRefnames(adjustedEbwtFileBase, refnames);
+				StrBuf hdr;
+				appendBinHitHeader(hdr, ebwt.nPat(), refnames, rmap,
+				                   ebwt.plen(), color);
+				bin->out(0).writeChars(hdr.ptr(), hdr.length());
+				sink = bin;
+				break;
+			}
 			case OUTPUT_CONCISE:
 				if(refOut) {
 					sink = new ConciseHitSink(
@@ -2742,6 +2968,31 @@ static void driver(const char * type,
 				cerr << "Invalid output type: " << outType << endl;
 				throw 1;
 		}
+		sink->openDumps(
+			queries.size() > 0,
+			mates1.size() > 0 || mates12.size() > 0,
+			qualities.size() > 0 || qualities1.size() > 0);
+		ReadCache *readCache = NULL;
+		if(dedup) {
+			// Qualities shape the search whenever it's quality-aware
+			readCache = new ReadCache(
+				(size_t)dedupMegabytes * 1024 * 1024,
+				maqLike || stateful, // key on quality class
+				!noMaqRound,
+				color);
+			sink->setReadCache(readCache);
+		}
+		ReorderBuffer *reorderBuf = NULL;
+		if(reorder && nthreads > 1) {
+			// A single thread already writes output in input order
+			reorderBuf = new ReorderBuffer(sink->out(0), ReorderBuffer::WIN_PER_THREAD * nthreads);
+			sink->setReorder(reorderBuf);
+			patsrc->setReorder(reorderBuf);
+		}
+		readSched = NULL;
+		if(nthreads > 1 && !randReadsNoSync) {
+			readSched = new ReadScheduler(*patsrc, nthreads);
+		}
 		if(verbose || startVerbose) {
 			cerr << "Dispatching to search driver: "; logTime(cerr, true);
 		}
@@ -2781,6 +3032,22 @@ static void driver(const char * type,
 		if(!quiet) {
 			sink->finish(hadoopOut); // end the hits section of the hit file
 		}
+		if(stats) {
+			printInputStats(cerr, patsrcs_a, patsrcs_b, patsrcs_ab);
+		}
+		if(readSched != NULL) {
+			if(stats) readSched->printStats(cerr);
+			delete readSched;
+			readSched = NULL;
+		}
+		if(reorderBuf != NULL) {
+			if(stats) reorderBuf->printStats(cerr);
+			delete reorderBuf;
+		}
+		if(readCache != NULL) {
+			if(stats) readCache->printStats(cerr);
+			delete readCache;
+		}
 		for(size_t i = 0; i < patsrcs_a.size(); i++) {
 			assert(patsrcs_a[i] != NULL);
 			delete patsrcs_a[i];
@@ -2796,10 +3063,20 @@ static void driver(const char * type,
 			}
 		}
 		delete patsrc;
+		if(stats) sink->printRefOutStats(cerr);
+		if(!quiet) gInsertModel().printStats(cerr);
 		delete sink;
 		delete amap;
 		delete rmap;
-		if(fout != NULL) delete fout;
+		if(sorter != NULL) {
+			// Runs are merged when the sink closes its output
+			if(stats) sorter->printStats(cerr);
+			delete sorter;
+		}
+		if(fout != NULL) {
+			if(stats) fout->printStats(cerr);
+			delete fout;
+		}
 	}
 }
 
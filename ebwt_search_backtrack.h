@@ -92,11 +92,11 @@ public:
 		const bool fw = _params.fw();
 		const bool ebwtFw = _ebwt->fw();
 		if(ebwtFw) {
-			_qry  = fw ? &r.patFw : &r.patRc;
-			_qual = fw ? &r.qual  : &r.qualRev;
+			_qry  = fw ? &r.patFw : &r.getPatRc();
+			_qual = fw ? &r.qual  : &r.getQualRev();
 		} else {
-			_qry  = fw ? &r.patFwRev : &r.patRcRev;
-			_qual = fw ? &r.qualRev  : &r.qual;
+			_qry  = fw ? &r.getPatFwRev() : &r.getPatRcRev();
+			_qual = fw ? &r.getQualRev() : &r.qual;
 		}
 		_name = &r.name;
 		// Reset _qlen
@@ -1845,15 +1845,15 @@ public:
 	virtual void setQuery(ReadBuf& r, Range *seedRange) {
 		const bool ebwtFw = ebwt_->fw();
 		if(ebwtFw) {
-			qry_  = fw_ ? &r.patFw : &r.patRc;
-			qual_ = fw_ ? &r.qual  : &r.qualRev;
-			altQry_  = (String<Dna5>*)(fw_ ? r.altPatFw : r.altPatRc);
-			altQual_ = (String<char>*)(fw_ ? r.altQual  : r.altQualRev);
+			qry_  = fw_ ? &r.patFw : &r.getPatRc();
+			qual_ = fw_ ? &r.qual  : &r.getQualRev();
+			altQry_  = (String<Dna5>*)(fw_ ? r.altPatFw : r.getAltPatRc());
+			altQual_ = (String<char>*)(fw_ ? r.altQual  : r.getAltQualRev());
 		} else {
-			qry_  = fw_ ? &r.patFwRev : &r.patRcRev;
-			qual_ = fw_ ? &r.qualRev  : &r.qual;
-			altQry_  = (String<Dna5>*)(fw_ ? r.altPatFwRev : r.altPatRcRev);
-			altQual_ = (String<char>*)(fw_ ? r.altQualRev  : r.altQual);
+			qry_  = fw_ ? &r.getPatFwRev() : &r.getPatRcRev();
+			qual_ = fw_ ? &r.getQualRev() : &r.qual;
+			altQry_  = (String<Dna5>*)(fw_ ? r.getAltPatFwRev() : r.getAltPatRcRev());
+			altQual_ = (String<char>*)(fw_ ? r.getAltQualRev() : r.altQual);
 		}
 		alts_ = r.alts;
 		name_ = &r.name;
@@ -161,146 +161,95 @@ void printHit(const vector<String<Dna5> >& os,
 			  bool ebwtFw);
 
 /**
- * A synchronized data structure for storing partial alignments
- * associated with patids, with particular attention to compactness.
+ * Holds the partial alignments found for a read in one phase of the
+ * seeded search until a later phase extends them.  Each search thread
+ * has its own managers and works on one read at a time, so a manager
+ * only ever holds the partial alignments of the read its thread is
+ * working on: no locking is needed, and memory is bounded by the most
+ * partial alignments found for any one read rather than growing with
+ * the number of reads.  Adding partial alignments for a new read
+ * discards any left over from the previous one.
  */
 class PartialAlignmentManager {
 public:
-	PartialAlignmentManager(size_t listSz = 10 * 1024 * 1024) {
-		// Reserve space for 10M partialsList entries = 40 MB
+
+	/// Keep at most this many entries' worth of memory between reads
+	static const size_t MAX_KEEP = 64 * 1024;
+
+	PartialAlignmentManager(size_t listSz = 64) :
+		_patid(0xffffffff),
+		_listSz(listSz)
+	{
 		_partialsList.reserve(listSz);
 	}
 
 	~PartialAlignmentManager() { }
 
 	/**
-	 * Add a set of partial alignments for a particular patid into the
-	 * partial-alignment database.  This version locks the database,
-	 * and so is safe to call if there are potential readers or
-	 * writers currently running.
+	 * Add a set of partial alignments for a particular patid.
 	 */
 	void addPartials(uint32_t patid, const vector<PartialAlignment>& ps) {
 		if(ps.size() == 0) return;
-		GUARD_LOCK(mutex_m);
-		size_t origPlSz = _partialsList.size();
+		if(patid != _patid) {
+			// Anything still here belongs to a read that's finished
+			reset();
+			_patid = patid;
+		}
 		// Assert that the entry doesn't exist yet
-		assert(_partialsMap.find(patid) == _partialsMap.end());
-		if(ps.size() == 1) {
-			_partialsMap[patid] = ps[0];
-			_partialsMap[patid].entry.type = 0; // singleton
-		} else {
-#ifndef NDEBUG
-			// Make sure there are not duplicate entries
-			for(size_t i = 0; i < ps.size()-1; i++)
-				for(size_t j = i+1; j < ps.size(); j++)
-					assert(!samePartialAlignment(ps[i], ps[j]));
-#endif
-			// Insert a "pointer" record into the map that refers to
-			// the stretch of the _partialsList vector that contains
-			// the partial alignments.
-			PartialAlignment al;
-			al.u64.u64 = 0xffffffffffffffffllu;
-			al.off.off = origPlSz;
-			al.off.type = 1; // list offset
-			_partialsMap[patid] = al; // install pointer
-			assert_gt(ps.size(), 1);
-			// Now add all the non-tail partial alignments (all but the
-			// last) to the _partialsList
-			for(size_t i = 0; i < ps.size()-1; i++) {
-				assert(validPartialAlignment(ps[i]));
-				_partialsList.push_back(ps[i]);
-				// list entry (non-tail)
-				_partialsList.back().entry.type = 2;
-			}
-			// Now add the tail (last) partial alignment and mark it as
-			// such
-			assert(validPartialAlignment(ps.back()));
-			_partialsList.push_back(ps.back());
-			// list tail
-			_partialsList.back().entry.type = 3;
+		assert_eq(0, _partialsList.size());
 #ifndef NDEBUG
-			// Make sure there are not duplicate entries
-			assert_eq(_partialsList.size(), origPlSz + ps.size());
-			for(size_t i = origPlSz; i < _partialsList.size()-1; i++) {
-				for(size_t j = i+1; j < _partialsList.size(); j++) {
-					assert(!samePartialAlignment(_partialsList[i], _partialsList[j]));
-				}
-			}
+		// Make sure there are not duplicate entries
+		for(size_t i = 0; i + 1 < ps.size(); i++)
+			for(size_t j = i+1; j < ps.size(); j++)
+				assert(!samePartialAlignment(ps[i], ps[j]));
 #endif
+		for(size_t i = 0; i < ps.size(); i++) {
+			assert(validPartialAlignment(ps[i]));
+			_partialsList.push_back(ps[i]);
+			// singleton, list entry (non-tail) or list tail
+			_partialsList.back().entry.type =
+				(ps.size() == 1) ? 0 : ((i < ps.size()-1) ? 2 : 3);
 		}
-		// Assert that we added an entry
-		assert(_partialsMap.find(patid) != _partialsMap.end());
 	}
 
 	/**
-	 * Get a set of partial alignments for a particular patid out of
-	 * the partial-alignment database.
+	 * Get the set of partial alignments for a particular patid.
 	 */
 	void getPartials(uint32_t patid, vector<PartialAlignment>& ps) {
-		assert_eq(0, ps.size());
-		GUARD_LOCK(mutex_m);
 		getPartialsUnsync(patid, ps);
 	}
 
 	/**
-	 * Get a set of partial alignments for a particular patid out of
-	 * the partial-alignment database.  This version does not attempt to
-	 * lock the database.  This is more efficient than the synchronized
-	 * version, but is unsafe if there are other threads that may be
-	 * writing to the database.
+	 * Get the set of partial alignments for a particular patid.  Kept
+	 * alongside getPartials() for callers that used to need to avoid
+	 * locking; a manager is never shared between threads.
 	 */
 	void getPartialsUnsync(uint32_t patid, vector<PartialAlignment>& ps) {
 		assert_eq(0, ps.size());
-		if(_partialsMap.find(patid) == _partialsMap.end()) {
-			return;
-		}
-		PartialAlignment al;
-		al.u64.u64 = _partialsMap[patid].u64.u64;
-		uint32_t type = al.unk.type;
-		if(type == 0) {
-			// singleton
-			ps.push_back(al);
-		} else {
-			// list
-			assert_eq(1, type);
-			uint32_t off = (uint32_t)al.off.off;
-			do {
-				assert_lt(off, _partialsList.size());
-				ASSERT_ONLY(type = _partialsList[off].entry.type);
-				assert(type == 2 || type == 3);
+		if(patid != _patid) return;
+		for(size_t i = 0; i < _partialsList.size(); i++) {
 #ifndef NDEBUG
-				// Make sure this entry isn't equal to any other entry
-				for(size_t i = 0; i < ps.size(); i++) {
-					assert(validPartialAlignment(ps[i]));
-					assert(!samePartialAlignment(ps[i], _partialsList[off]));
-				}
+			// Make sure this entry isn't equal to any other entry
+			for(size_t j = 0; j < ps.size(); j++) {
+				assert(!samePartialAlignment(ps[j], _partialsList[i]));
+			}
 #endif
-				assert(validPartialAlignment(_partialsList[off]));
-				ps.push_back(_partialsList[off]);
-				ASSERT_ONLY(uint32_t pos0 = ps.back().entry.pos0);
-				ASSERT_ONLY(uint32_t pos1 = ps.back().entry.pos1);
-				ASSERT_ONLY(uint32_t pos2 = ps.back().entry.pos2);
-				assert(pos1 == 0xffff || pos0 != pos1);
-				assert(pos2 == 0xffff || pos0 != pos2);
-				assert(pos2 == 0xffff || pos1 != pos2);
-			} while(_partialsList[off++].entry.type == 2);
-			assert_eq(3, _partialsList[off-1].entry.type);
+			assert(validPartialAlignment(_partialsList[i]));
+			ps.push_back(_partialsList[i]);
 		}
-		assert_gt(ps.size(), 0);
 	}
 
-	/// Call to clear the database when there is only one element in it
+	/// Call to clear the database once the read's partial alignments
+	/// have been retrieved
 	void clear(uint32_t patid) {
-		assert_eq(1, _partialsMap.count(patid));
-		assert_eq(1, _partialsMap.size());
-		_partialsMap.erase(patid);
-		assert_eq(0, _partialsMap.size());
-		_partialsList.clear();
-		assert_eq(0, _partialsList.size());
+		assert_eq(_patid, patid);
+		assert_eq(1, size());
+		reset();
 	}
 
+	/// Return the number of reads with partial alignments (0 or 1)
 	size_t size() {
-		return _partialsMap.size();
+		return _partialsList.empty() ? 0 : 1;
 	}
 
 	/**
@@ -360,13 +309,27 @@ public:
 		return oldQuals;
 	}
 private:
-	/// Maps patids to partial alignments for that patid
-	map<uint32_t, PartialAlignment> _partialsMap;
-	/// Overflow for when a patid has more than 1 partial alignment
+
+	/**
+	 * Drop all partial alignments, giving back memory if an unusually
+	 * prolific read made the list large.
+	 */
+	void reset() {
+		if(_partialsList.capacity() > MAX_KEEP) {
+			vector<PartialAlignment>().swap(_partialsList);
+			_partialsList.reserve(_listSz);
+		} else {
+			_partialsList.clear();
+		}
+		_patid = 0xffffffff;
+	}
+
+	/// Read whose partial alignments are held
+	uint32_t _patid;
+	/// Its partial alignments
 	vector<PartialAlignment> _partialsList;
-	/// Lock for 'partialsMap' and 'partialsList'; necessary because
-	/// search threads will be reading and writing them
-	MUTEX_T mutex_m;
+	/// Initial capacity of _partialsList
+	size_t _listSz;
 };
 
 #endif /* EBWT_SEARCH_UTIL_H_ */
@@ -13,15 +13,54 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <sys/time.h>
 #include "assert_helpers.h"
+#include "threading.h"
+#include "affinity.h"
+
+/**
+ * Counters describing how a FileBuf's input was consumed.  'stallUs'
+ * is the time the reader spent waiting for input, whether that was a
+ * synchronous fread() or waiting on a readahead that hadn't finished.
+ */
+struct FileBufStats {
+	FileBufStats() : refills(0), bytes(0), stallUs(0) { }
+
+	void add(const FileBufStats& o) {
+		refills += o.refills;
+		bytes   += o.bytes;
+		stallUs += o.stallUs;
+	}
+
+	uint64_t refills; /// # buffers handed to the reader
+	uint64_t bytes;   /// # bytes handed to the reader
+	uint64_t stallUs; /// microseconds the reader waited for input
+};
 
 /**
  * Simple wrapper for a FILE*, istream or ifstream that reads it in
  * chunks (with fread) and keeps those chunks in a buffer.  It also
  * services calls to get(), peek() and gets() from the buffer, reading
  * in additional chunks when necessary.
+ *
+ * If readahead is enabled with setReadahead(), the next chunk is read
+ * into a second buffer by a helper thread while the caller consumes
+ * the current one, so that slow (e.g. networked) storage doesn't stall
+ * the parser on every chunk.  The helper is started on the first
+ * refill and sleeps on a condition variable between chunks.
  */
 class FileBuf {
+
+#ifdef WITH_TBB
+	/// Task that runs the readahead loop
+	struct AheadTask {
+		FileBuf *fb;
+		void operator()() const { fb->aheadLoop(); }
+	};
+#endif
+
 public:
 	FileBuf() {
 		init();
@@ -45,6 +84,35 @@ public:
 		assert(_ins != NULL);
 	}
 
+	~FileBuf() {
+		waitAhead();
+		stopAhead();
+		delete[] _buf;
+		delete[] _ahead;
+		delete[] _lastn_buf;
+	}
+
+	/**
+	 * Set the size of the input buffer(s).  Must be called before any
+	 * input is read.
+	 */
+	void setBufSize(size_t sz) {
+		assert(_buf == NULL);
+		assert_gt(sz, 0);
+		_buf_cap = sz;
+	}
+
+	/**
+	 * Enable or disable reading the next chunk ahead on a helper
+	 * thread.
+	 */
+	void setReadahead(bool readahead) {
+		_readahead = readahead;
+	}
+
+	/// Return input counters accumulated over all files read so far
+	const FileBufStats& stats() const { return _stats; }
+
 	bool isOpen() {
 		return _in != NULL || _inf != NULL || _ins != NULL;
 	}
@@ -53,6 +121,7 @@ public:
 	 * Close the input stream (if that's possible)
 	 */
 	void close() {
+		waitAhead();
 		if(_in != NULL && _in != stdin) {
 			fclose(_in);
 		} else if(_inf != NULL) {
@@ -70,7 +139,8 @@ public:
 		int c = peek();
 		if(c != -1) {
 			_cur++;
-			if(_lastn_cur < LASTN_BUF_SZ) _lastn_buf[_lastn_cur++] = c;
+			if(_lastn_cur == _lastn_cap) growLastN();
+			_lastn_buf[_lastn_cur++] = c;
 		}
 		return c;
 	}
@@ -86,11 +156,11 @@ public:
 	 * Initialize the buffer with a new C-style file.
 	 */
 	void newFile(FILE *in) {
+		waitAhead();
 		_in = in;
 		_inf = NULL;
 		_ins = NULL;
-		_cur = BUF_SZ;
-		_buf_sz = BUF_SZ;
+		_cur = _buf_sz = 0;
 		_done = false;
 	}
 
@@ -98,11 +168,11 @@ public:
 	 * Initialize the buffer with a new ifstream.
 	 */
 	void newFile(std::ifstream *__inf) {
+		waitAhead();
 		_in = NULL;
 		_inf = __inf;
 		_ins = NULL;
-		_cur = BUF_SZ;
-		_buf_sz = BUF_SZ;
+		_cur = _buf_sz = 0;
 		_done = false;
 	}
 
@@ -110,11 +180,11 @@ public:
 	 * Initialize the buffer with a new istream.
 	 */
 	void newFile(std::istream *__ins) {
+		waitAhead();
 		_in = NULL;
 		_inf = NULL;
 		_ins = __ins;
-		_cur = BUF_SZ;
-		_buf_sz = BUF_SZ;
+		_cur = _buf_sz = 0;
 		_done = false;
 	}
 
@@ -123,6 +193,7 @@ public:
 	 * stream.
 	 */
 	void reset() {
+		waitAhead();
 		if(_inf != NULL) {
 			_inf->clear();
 			_inf->seekg(0, std::ios::beg);
@@ -132,8 +203,7 @@ public:
 		} else {
 			rewind(_in);
 		}
-		_cur = BUF_SZ;
-		_buf_sz = BUF_SZ;
+		_cur = _buf_sz = 0;
 		_done = false;
 	}
 
@@ -152,26 +222,11 @@ public:
 			}
 			// Read a new buffer's worth of data
 			else {
-				// Get the next chunk
-				if(_inf != NULL) {
-					_inf->read((char*)_buf, BUF_SZ);
-					_buf_sz = _inf->gcount();
-				} else if(_ins != NULL) {
-					_ins->read((char*)_buf, BUF_SZ);
-					_buf_sz = _ins->gcount();
-				} else {
-					assert(_in != NULL);
-					_buf_sz = fread(_buf, 1, BUF_SZ, _in);
-				}
-				_cur = 0;
+				refill();
 				if(_buf_sz == 0) {
 					// Exhausted, and we have nothing to return to the
 					// caller
-					_done = true;
 					return -1;
-				} else if(_buf_sz < BUF_SZ) {
-					// Exhausted
-					_done = true;
 				}
 			}
 		}
@@ -223,6 +278,8 @@ public:
 		return len;
 	}
 
+	/// Initial size of the last-N-chars buffer; it grows to fit the
+	/// longest record
 	static const size_t LASTN_BUF_SZ = 8 * 1024;
 
 	/**
@@ -313,28 +370,203 @@ public:
 		return _lastn_cur;
 	}
 
+	static const size_t BUF_SZ = 256 * 1024;
+
 private:
 
+	// Not copyable; owns its buffers and possibly a helper thread
+	FileBuf(const FileBuf&);
+	FileBuf& operator=(const FileBuf&);
+
 	void init() {
 		_in = NULL;
 		_inf = NULL;
 		_ins = NULL;
-		_cur = _buf_sz = BUF_SZ;
+		_cur = _buf_sz = 0;
 		_done = false;
+		_buf = NULL;
+		_buf_cap = BUF_SZ;
+		_ahead = NULL;
+		_ahead_sz = 0;
+		_ahead_pending = false;
+		_ahead_req = false;
+		_ahead_stop = false;
+		_ahead_started = false;
+		_readahead = false;
+#ifndef WITH_TBB
+		_ahead_thread = NULL;
+#endif
 		_lastn_cur = 0;
-		// no need to clear _buf[]
+		_lastn_cap = LASTN_BUF_SZ;
+		_lastn_buf = new char[_lastn_cap];
+	}
+
+	/**
+	 * Double the size of the last-N-chars buffer, keeping its contents.
+	 */
+	void growLastN() {
+		char *nbuf = new char[_lastn_cap * 2];
+		memcpy(nbuf, _lastn_buf, _lastn_cur);
+		delete[] _lastn_buf;
+		_lastn_buf = nbuf;
+		_lastn_cap *= 2;
+	}
+
+	static uint64_t nowUs() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+
+	/**
+	 * Read up to _buf_cap bytes from the input stream into buf and
+	 * return the number read.
+	 */
+	size_t readChunk(uint8_t *buf) {
+		if(_inf != NULL) {
+			_inf->read((char*)buf, _buf_cap);
+			return _inf->gcount();
+		} else if(_ins != NULL) {
+			_ins->read((char*)buf, _buf_cap);
+			return _ins->gcount();
+		}
+		assert(_in != NULL);
+		return fread(buf, 1, _buf_cap, _in);
+	}
+
+	/**
+	 * Make the next chunk current: take the readahead buffer if one is
+	 * in flight, otherwise read synchronously.  Then, if there may be
+	 * more input, start reading the chunk after it.
+	 */
+	void refill() {
+		uint64_t start = nowUs();
+		if(_buf == NULL) _buf = new uint8_t[_buf_cap];
+		if(_ahead_pending) {
+			waitAhead();
+			std::swap(_buf, _ahead);
+			_buf_sz = _ahead_sz;
+		} else {
+			_buf_sz = readChunk(_buf);
+		}
+		_stats.stallUs += nowUs() - start;
+		_stats.refills++;
+		_stats.bytes += _buf_sz;
+		_cur = 0;
+		if(_buf_sz < _buf_cap) {
+			// Exhausted
+			_done = true;
+		} else if(_readahead) {
+			startAhead();
+		}
+	}
+
+	/**
+	 * Body of the readahead helper: sleep until asked for a chunk,
+	 * read it into _ahead, and report back, until told to stop.
+	 */
+	void aheadLoop() {
+		_ahead_lock.lock();
+		while(true) {
+			while(!_ahead_req && !_ahead_stop) _ahead_lock.wait();
+			if(_ahead_stop) break;
+			_ahead_lock.unlock();
+			_ahead_sz = readChunk(_ahead);
+			_ahead_lock.lock();
+			_ahead_req = false;
+			_ahead_lock.notifyAll();
+		}
+		_ahead_lock.unlock();
+	}
+
+	static void aheadWorker(void *vp) {
+		gCpuAffinity().pinHelper();
+		((FileBuf*)vp)->aheadLoop();
+	}
+
+	/**
+	 * Ask the helper thread, starting it if need be, to read the next
+	 * chunk into _ahead.
+	 */
+	void startAhead() {
+		assert(!_ahead_pending);
+		if(_ahead == NULL) _ahead = new uint8_t[_buf_cap];
+		if(!_ahead_started) {
+			_ahead_started = true;
+#ifdef WITH_TBB
+			AheadTask t;
+			t.fb = this;
+			_ahead_grp.run(t);
+#else
+			_ahead_thread = new tthread::thread(aheadWorker, (void*)this);
+#endif
+		}
+		_ahead_pending = true;
+		WaitLock::Guard g(_ahead_lock);
+		_ahead_req = true;
+		_ahead_lock.notifyAll();
+	}
+
+	/**
+	 * Wait for any readahead in flight to finish.  Its data stays in
+	 * _ahead; callers that are abandoning the stream just ignore it.
+	 */
+	void waitAhead() {
+		if(!_ahead_pending) return;
+		{
+			WaitLock::Guard g(_ahead_lock);
+			while(_ahead_req) _ahead_lock.wait();
+		}
+		_ahead_pending = false;
+	}
+
+	/**
+	 * Tell the helper thread, if there is one, to exit, and wait for
+	 * it.  No readahead may be in flight.
+	 */
+	void stopAhead() {
+		assert(!_ahead_pending);
+		if(!_ahead_started) return;
+		{
+			WaitLock::Guard g(_ahead_lock);
+			_ahead_stop = true;
+			_ahead_lock.notifyAll();
+		}
+#ifdef WITH_TBB
+		_ahead_grp.wait();
+#else
+		_ahead_thread->join();
+		delete _ahead_thread;
+		_ahead_thread = NULL;
+#endif
+		_ahead_started = false;
 	}
 
-	static const size_t BUF_SZ = 256 * 1024;
 	FILE     *_in;
 	std::ifstream *_inf;
 	std::istream  *_ins;
 	size_t    _cur;
 	size_t    _buf_sz;
 	bool      _done;
-	uint8_t   _buf[BUF_SZ]; // (large) input buffer
+	uint8_t  *_buf;      // (large) input buffer, allocated on first read
+	size_t    _buf_cap;  // capacity of _buf and _ahead
+	uint8_t  *_ahead;    // buffer being filled by readahead
+	size_t    _ahead_sz; // # bytes read into _ahead
+	bool      _ahead_pending; // true -> readahead in flight
+	bool      _ahead_req;     // true -> helper has a chunk to read
+	bool      _ahead_stop;    // true -> helper should exit
+	bool      _ahead_started; // true -> helper is running
+	bool      _readahead;     // true -> read next chunk ahead
+	WaitLock  _ahead_lock;    // guards _ahead_req and _ahead_stop
+#ifdef WITH_TBB
+	tbb::task_group _ahead_grp;
+#else
+	tthread::thread *_ahead_thread;
+#endif
+	FileBufStats _stats;
 	size_t    _lastn_cur;
-	char      _lastn_buf[LASTN_BUF_SZ]; // buffer of the last N chars dispensed
+	size_t    _lastn_cap;
+	char     *_lastn_buf; // buffer of the last N chars dispensed
 };
 
 /**
@@ -403,21 +635,62 @@ private:
 	char     buf_[BUF_SZ]; // (large) input buffer
 };
 
+/**
+ * Filter that an OutFileBuf passes its bytes through on their way to
+ * the file, e.g. to compress them (see BGZFWriter in bgzf.h).  write()
+ * and finish() report errors by throwing on the calling thread, which
+ * is the OutFileBuf's writer thread when it is asynchronous; threads
+ * of the filter's own must not throw.
+ */
+class OutFileFilter {
+public:
+	virtual ~OutFileFilter() { }
+
+	/// Take 'len' more bytes of output destined for 'out'
+	virtual void write(FILE *out, const char *s, size_t len) = 0;
+
+	/// Write anything still held to 'out'; called once, before closing
+	virtual void finish(FILE *out) = 0;
+
+	/// Print statistics about the filtered output
+	virtual void printStats(std::ostream& os) const { }
+};
+
 /**
  * Wrapper for a buffered output stream that writes characters and
  * other data types.  This class is *not* synchronized; the caller is
  * responsible for synchronization.
+ *
+ * If setAsync() is called, full buffers are copied into a bounded
+ * queue and written (and passed through the filter, if any) by a
+ * writer thread, so a caller holding a lock around its writes only
+ * waits on the disk when the queue is full.  The writer sleeps on the
+ * queue's condition variable while the queue is empty, and a caller
+ * that finds it full sleeps there until the writer frees a slot.  If
+ * a write fails, the writer prints the error and stops; later buffers
+ * are dropped, and close() throws.  Buffers are usually handed over
+ * by search threads, where a throw would terminate the process, so
+ * the error surfaces on the thread that closes the stream.
  */
 class OutFileBuf {
 
+#ifdef WITH_TBB
+	/// Task that runs the writer loop
+	struct WriterTask {
+		OutFileBuf *ofb;
+		void operator()() const { ofb->writerLoop(); }
+	};
+#endif
+
 public:
 
 	/**
 	 * Open a new output stream to a file with given name.
 	 */
 	OutFileBuf(const char *out, bool binary = false) :
-		name_(out), cur_(0), closed_(false)
+		name_(out), cur_(0), closed_(false), filter_(NULL)
 	{
+		initAsync();
 		assert(out != NULL);
 		out_ = fopen(out, binary ? "wb" : "w");
 		if(out_ == NULL) {
@@ -428,13 +701,79 @@ public:
 			std::cerr << "Warning: Could not allocate the proper buffer size for output file stream. " << std::endl;
 	}
 
+	/**
+	 * Write to 'out', a stream the caller has already opened, named
+	 * 'name'.  The stream is closed by close().
+	 */
+	OutFileBuf(FILE *out, const char *name) :
+		name_(name), cur_(0), closed_(false), filter_(NULL)
+	{
+		initAsync();
+		assert(out != NULL);
+		out_ = out;
+		if(setvbuf(out_, NULL, _IOFBF, 10* 1024* 1024)) 
+			std::cerr << "Warning: Could not allocate the proper buffer size for output file stream. " << std::endl;
+	}
+
 	/**
 	 * Open a new output stream to standard out.
 	 */
-	OutFileBuf() : name_("cout"), cur_(0), closed_(false) {
+	OutFileBuf() : name_("cout"), cur_(0), closed_(false), filter_(NULL) {
+		initAsync();
 		out_ = stdout;
 	}
 
+	~OutFileBuf() {
+		stopWriter();
+		delete filter_;
+	}
+
+	/// Default # buffers a writer thread's queue holds
+	static const size_t ASYNC_DEPTH = 32;
+
+	/**
+	 * Hand full buffers to a writer thread through a queue of 'depth'
+	 * buffers.  Call before anything is written.
+	 */
+	void setAsync(size_t depth) {
+		assert(!async_);
+		assert_eq(0, cur_);
+		async_ = true;
+		queue_.resize(depth > 0 ? depth : 1);
+		stop_ = false;
+#ifdef WITH_TBB
+		WriterTask t;
+		t.ofb = this;
+		writerGrp_.run(t);
+#else
+		writer_ = new tthread::thread(writerWorker, (void*)this);
+#endif
+	}
+
+	/**
+	 * Pass all further output through filter 'f', which this object
+	 * takes ownership of.
+	 */
+	void setFilter(OutFileFilter *f) {
+		assert(filter_ == NULL);
+		assert_eq(0, cur_);
+		filter_ = f;
+	}
+
+	/**
+	 * Print statistics from the output filter, if any.
+	 */
+	void printStats(std::ostream& os) const {
+		if(async_) {
+			os << "Output writer (" << name_ << "):" << std::endl
+			   << "  buffers queued: " << queued_ << std::endl
+			   << "  max queue depth: " << maxDepth_ << " of " << queue_.size() << std::endl
+			   << "  stalls: " << stalls_ << std::endl
+			   << "  stall time: " << (stallUs_ / 1000) << " ms" << std::endl;
+		}
+		if(filter_ != NULL) filter_->printStats(os);
+	}
+
 	/**
 	 * Open a new output stream to a file with given name.
 	 */
@@ -467,13 +806,7 @@ public:
 		if(cur_ + slen > BUF_SZ) {
 			if(cur_ > 0) flush();
 			if(slen >= BUF_SZ) {
-				size_t wlen = fwrite(s.c_str(), 1, slen, out_);
-				if(wlen != slen) {
-					std::cerr << "Error while writing string output; " << slen
-							  << " characters in string, " << wlen
-							  << " written" << std::endl;
-					throw 1;
-				}
+				writeThrough(s.c_str(), slen);
 			} else {
 				memcpy(&buf_[cur_], s.data(), slen);
 				assert_eq(0, cur_);
@@ -494,13 +827,7 @@ public:
 		if(cur_ + len > BUF_SZ) {
 			if(cur_ > 0) flush();
 			if(len >= BUF_SZ) {
-				size_t wlen = fwrite(s, 1, len, out_);
-				if(wlen != len) {
-					std::cerr << "Error while writing string output; " << len
-							  << " characters in string, " << wlen
-							  << " written" << std::endl;
-					throw 1;
-				}
+				writeThrough(s, len);
 			} else {
 				memcpy(&buf_[cur_], s, len);
 				assert_eq(0, cur_);
@@ -519,6 +846,14 @@ public:
 	void close() {
 		if(closed_) return;
 		if(cur_ > 0) flush();
+		stopWriter();
+		if(failed_) {
+			// The writer already printed what went wrong
+			closed_ = true;
+			if(out_ != stdout) fclose(out_);
+			throw 1;
+		}
+		if(filter_ != NULL) filter_->finish(out_);
 		closed_ = true;
 		if(out_ != stdout) {
 			fclose(out_);
@@ -534,7 +869,14 @@ public:
 	}
 
 	void flush() {
-		if(!fwrite((const void *)buf_, cur_, 1, out_)) {
+		if(async_) {
+			enqueue(buf_, cur_);
+			cur_ = 0;
+			return;
+		}
+		if(filter_ != NULL) {
+			filter_->write(out_, buf_, cur_);
+		} else if(!fwrite((const void *)buf_, cur_, 1, out_)) {
 			std::cerr << "Error while flushing and closing output" << std::endl;
 			throw 1;
 		}
@@ -557,6 +899,143 @@ public:
 
 private:
 
+	/**
+	 * Write a string too large for the buffer straight to the file
+	 * (or filter).
+	 */
+	void writeThrough(const char *s, size_t len) {
+		if(async_) {
+			enqueue(s, len);
+			return;
+		}
+		if(filter_ != NULL) {
+			filter_->write(out_, s, len);
+			return;
+		}
+		size_t wlen = fwrite(s, 1, len, out_);
+		if(wlen != len) {
+			std::cerr << "Error while writing string output; " << len
+					  << " characters in string, " << wlen
+					  << " written" << std::endl;
+			throw 1;
+		}
+	}
+
+	void initAsync() {
+		async_ = false;
+		stop_ = false;
+		failed_ = false;
+		head_ = tail_ = 0;
+#ifndef WITH_TBB
+		writer_ = NULL;
+#endif
+		queued_ = maxDepth_ = stalls_ = stallUs_ = 0;
+	}
+
+	/**
+	 * Copy 'len' bytes into the next free queue slot, first waiting
+	 * for the writer to free one if the queue is full.
+	 */
+	void enqueue(const char *s, size_t len) {
+		if(len == 0) return;
+		{
+			WaitLock::Guard g(qlock_);
+			if((size_t)(tail_ - head_) == queue_.size() && !failed_) {
+				uint64_t start = nowUs();
+				while((size_t)(tail_ - head_) == queue_.size() && !failed_) {
+					qlock_.wait();
+				}
+				stalls_++;
+				stallUs_ += nowUs() - start;
+			}
+			// The writer already printed what went wrong; close()
+			// throws
+			if(failed_) return;
+		}
+		// Only this (the producing) thread touches the tail slot, and
+		// the writer doesn't look at it until tail_ moves past it
+		queue_[tail_ % queue_.size()].assign(s, len);
+		WaitLock::Guard g(qlock_);
+		tail_++;
+		queued_++;
+		size_t depth = (size_t)(tail_ - head_);
+		if(depth > maxDepth_) maxDepth_ = depth;
+		qlock_.notifyAll();
+	}
+
+	/// Write a dequeued buffer to the file (or filter)
+	void writeOut(const char *s, size_t len) {
+		if(filter_ != NULL) {
+			filter_->write(out_, s, len);
+		} else if(fwrite(s, 1, len, out_) != len) {
+			std::cerr << "Error while writing output" << std::endl;
+			throw 1;
+		}
+	}
+
+	/**
+	 * Body of the writer thread: write queued buffers in order,
+	 * sleeping while the queue is empty, until told to stop and the
+	 * queue is empty.  An exception here would terminate the process,
+	 * so a failed write is recorded in failed_ for the producing
+	 * thread to throw, and the writer stops.
+	 */
+	void writerLoop() {
+		while(true) {
+			std::string *b;
+			{
+				WaitLock::Guard g(qlock_);
+				while(head_ == tail_ && !stop_) qlock_.wait();
+				if(head_ == tail_) break;
+				b = &queue_[head_ % queue_.size()];
+			}
+			try {
+				writeOut(b->data(), b->length());
+			} catch(int) {
+				WaitLock::Guard g(qlock_);
+				failed_ = true;
+				qlock_.notifyAll();
+				return;
+			}
+			b->clear();
+			WaitLock::Guard g(qlock_);
+			head_++;
+			qlock_.notifyAll();
+		}
+	}
+
+	static void writerWorker(void *vp) {
+		gCpuAffinity().pinHelper();
+		((OutFileBuf*)vp)->writerLoop();
+	}
+
+	/**
+	 * Tell the writer thread to finish what's queued and wait for it.
+	 */
+	void stopWriter() {
+		if(!async_) return;
+		{
+			WaitLock::Guard g(qlock_);
+			if(stop_) return;
+			stop_ = true;
+			qlock_.notifyAll();
+		}
+#ifdef WITH_TBB
+		writerGrp_.wait();
+#else
+		writer_->join();
+		delete writer_;
+		writer_ = NULL;
+#endif
+		assert(failed_ || head_ == tail_);
+	}
+
+	static uint64_t nowUs() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+
 	static const size_t BUF_SZ = 16 * 1024;
 
 	const char *name_;
@@ -564,6 +1043,25 @@ private:
 	size_t    cur_;
 	char        buf_[BUF_SZ]; // (large) input buffer
 	bool        closed_;
+	OutFileFilter *filter_; /// if non-NULL, output goes through here
+
+	bool     async_;   /// true -> a writer thread does the writing
+	bool     stop_;    /// true -> writer should exit once queue is empty
+	bool     failed_;  /// true -> a write failed and the writer stopped
+	std::vector<std::string> queue_; /// ring of buffers waiting to be written
+	uint64_t head_;    /// # buffers written
+	uint64_t tail_;    /// # buffers queued
+	WaitLock qlock_;   /// guards head_, tail_, stop_, failed_; signalled when they change
+#ifdef WITH_TBB
+	tbb::task_group writerGrp_;
+#else
+	tthread::thread *writer_;
+#endif
+
+	uint64_t queued_;   /// # buffers queued
+	uint64_t maxDepth_; /// most buffers ever waiting
+	uint64_t stalls_;   /// # times a producer found the queue full
+	uint64_t stallUs_;  /// microseconds producers spent waiting
 };
 
 #endif /*ndef FILEBUF_H_*/
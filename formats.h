@@ -16,7 +16,8 @@ enum file_format {
 	RAW,
 	CMDLINE,
 	INPUT_CHAIN,
-	RANDOM
+	RANDOM,
+	BAM
 };
 
 static const std::string file_format_names[] = {
@@ -28,7 +29,8 @@ static const std::string file_format_names[] = {
 	"Raw",
 	"Command line",
 	"Chained",
-	"Random"
+	"Random",
+	"BAM"
 };
 
 /**
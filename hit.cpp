@@ -1,6 +1,7 @@
 #include "hit.h"
 #include "hit_set.h"
 #include "search_globals.h"
+#include "read_cache.h"
 
 using namespace std;
 using namespace seqan;
@@ -10,11 +11,48 @@ bool operator< (const Hit& a, const Hit& b) {
     return a.h < b.h;
 }
 
+/**
+ * Look the current read up in the duplicate-read cache.  On a hit,
+ * the cached alignments are loaded into the buffer as though the
+ * search had just reported them.
+ */
+bool HitSinkPerThread::checkCache(PatternSourcePerThread& p) {
+	cacheMiss_ = false;
+	if(cache_ == NULL || p.paired()) return false;
+	ReadBuf& r = p.bufa();
+	cache_->makeKey(r, cacheKey_);
+	uint32_t nhits = 0;
+	assert(_bufferedHits.empty());
+	if(!cache_->lookup(cacheKey_, nhits, _bufferedHits)) {
+		cacheMiss_ = true;
+		return false;
+	}
+	for(size_t i = 0; i < _bufferedHits.size(); i++) {
+		Hit& h = _bufferedHits[i];
+		h.patId   = p.patid();
+		h.patName = r.name;
+		if(!cache_->keepsQuals()) {
+			h.quals = h.fw ? r.qual : r.getQualRev();
+		}
+		h.primer  = r.primer;
+		h.trimc   = r.trimc;
+		h.seed    = r.seed;
+	}
+	_numValidHits += nhits;
+	hitsForThisRead_ = nhits;
+	return true;
+}
+
+void HitSinkPerThread::cacheInsert(uint32_t nhits) {
+	assert(cache_ != NULL);
+	cache_->insert(cacheKey_, nhits, _bufferedHits);
+}
+
 /**
  * Report a maxed-out read.
  */
-void VerboseHitSink::reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p) {
-	HitSink::reportMaxed(hs, p);
+void VerboseHitSink::reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p, HitSinkLocal& l) {
+	HitSink::reportMaxed(hs, p, l);
 	if(sampleMax_) {
 		RandomSource rand;
 		rand.init(p.bufa().seed);
@@ -41,7 +79,7 @@ void VerboseHitSink::reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p) {
 				if(strat == bestStratum) {
 					if(num == r) {
 						hs[i].oms = hs[i+1].oms = (uint32_t)(hs.size()/2);
-						reportHits(hs, i, i+2);
+						reportHits(hs, i, i+2, l);
 						break;
 					}
 					num++;
@@ -58,15 +96,15 @@ void VerboseHitSink::reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p) {
 			uint32_t r = rand.nextU32() % num;
 			Hit& h = hs[r];
 			h.oms = (uint32_t)hs.size();
-			reportHit(h, false);
+			reportHit(h, false, l);
 		}
 	}
 }
 
 /**
- * Append a verbose, readable hit to the given output stream.
+ * Append a verbose, readable hit to the given buffer.
  */
-void VerboseHitSink::append(ostream& ss,
+void VerboseHitSink::append(StrBuf& o,
                    const Hit& h,
                    const vector<string>* refnames,
                    ReferenceMap *rmap,
@@ -99,18 +137,11 @@ void VerboseHitSink::append(ostream& ss,
 			int pospart = abs(partition);
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
+				else o.append('\t');
 				// Output a partitioning key
 				// First component of the key is the reference index
-				if(refnames != NULL && rmap != NULL) {
-					printUptoWs(ss, rmap->getName(h.h.first), !fullRef);
-				} else if(refnames != NULL && h.h.first < refnames->size()) {
-					printUptoWs(ss, (*refnames)[h.h.first], !fullRef);
-				} else {
-					ss << h.h.first;
-				}
+				appendRefName(o, h.h.first, refnames, rmap, fullRef);
 			}
-			ostringstream ss2, ss3;
 			// Next component of the key is the partition id
 			if(!dospill) {
 				pdiv = (h.h.second + offBase) / pospart;
@@ -119,7 +150,6 @@ void VerboseHitSink::append(ostream& ss,
 			assert_neq(0xffffffff, pdiv);
 			assert_neq(0xffffffff, pmod);
 			if(dospill) assert_gt(spillAmt, 0);
-			ss2 << (pdiv + (dospill ? spillAmt : 0));
 			if(partition > 0 &&
 			   (pmod + h.length()) >= ((uint32_t)pospart * (spillAmt + 1))) {
 				// Spills into the next partition so we need to
@@ -128,92 +158,77 @@ void VerboseHitSink::append(ostream& ss,
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
+				else o.append('\t');
 				// Print partition id with leading 0s so that Hadoop
 				// can do lexicographical sort (modern Hadoop versions
 				// seen to support numeric)
-				string s2 = ss2.str();
 				size_t partDigits = 1;
 				if(pospart >= 10) partDigits++;
 				if(pospart >= 100) partDigits++;
 				if(pospart >= 1000) partDigits++;
 				if(pospart >= 10000) partDigits++;
 				if(pospart >= 100000) partDigits++;
-				for(size_t i = s2.length(); i < (10-partDigits); i++) {
-					ss << "0";
-				}
-				ss << s2.c_str();
+				o.appendNumPadded(pdiv + (dospill ? spillAmt : 0), 10-partDigits);
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
+				else o.append('\t');
 				// Print offset with leading 0s
-				ss3 << (h.h.second + offBase);
-				string s3 = ss3.str();
-				for(size_t i = s3.length(); i < 9; i++) {
-					ss << "0";
-				}
-				ss << s3;
+				o.appendNumPadded(h.h.second + offBase, 9);
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
-				ss << (h.fw? "+":"-");
+				else o.append('\t');
+				o.append(h.fw? '+' : '-');
 			}
 			// end if(partition != 0)
 		} else {
 			assert(!dospill);
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
-				ss << h.patName;
+				else o.append('\t');
+				appendStr(o, h.patName);
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
-				ss << (h.fw? '+' : '-');
+				else o.append('\t');
+				o.append(h.fw? '+' : '-');
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
+				else o.append('\t');
 				// .first is text id, .second is offset
-				if(refnames != NULL && rmap != NULL) {
-					printUptoWs(ss, rmap->getName(h.h.first), !fullRef);
-				} else if(refnames != NULL && h.h.first < refnames->size()) {
-					printUptoWs(ss, (*refnames)[h.h.first], !fullRef);
-				} else {
-					ss << h.h.first;
-				}
+				appendRefName(o, h.h.first, refnames, rmap, fullRef);
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
-				ss << (h.h.second + offBase);
+				else o.append('\t');
+				o.appendNum(h.h.second + offBase);
 			}
 			// end else clause of if(partition != 0)
 		}
 		if(!suppress.test((uint32_t)field++)) {
 			if(firstfield) firstfield = false;
-			else ss << '\t';
+			else o.append('\t');
 			const String<Dna5>* pat = &h.patSeq;
 			if(h.color && colorSeq) pat = &h.colSeq;
-			ss << *pat;
+			appendSeq(o, *pat);
 		}
 		if(!suppress.test((uint32_t)field++)) {
 			if(firstfield) firstfield = false;
-			else ss << '\t';
+			else o.append('\t');
 			const String<char>* qual = &h.quals;
 			if(h.color && colorQual) qual = &h.colQuals;
-			ss << *qual;
+			appendStr(o, *qual);
 		}
 		if(!suppress.test((uint32_t)field++)) {
 			if(firstfield) firstfield = false;
-			else ss << '\t';
-			ss << h.oms;
+			else o.append('\t');
+			o.appendNum(h.oms);
 		}
 		if(!suppress.test((uint32_t)field++)) {
 			if(firstfield) firstfield = false;
-			else ss << '\t';
+			else o.append('\t');
 			// Look for SNP annotations falling within the alignment
 			map<int, char> snpAnnots;
 			const size_t len = length(h.patSeq);
@@ -243,35 +258,35 @@ void VerboseHitSink::append(ostream& ss,
 			for (unsigned int i = 0; i < len; ++ i) {
 				if(h.mms.test(i)) {
 					// There's a mismatch at this position
-					if (!firstmm) ss << ",";
-					ss << i; // position
+					if (!firstmm) o.append(',');
+					o.appendNum(i); // position
 					assert_gt(h.refcs.size(), i);
 					char refChar = toupper(h.refcs[i]);
 					char qryChar = (h.fw ? h.patSeq[i] : h.patSeq[length(h.patSeq)-i-1]);
 					assert_neq(refChar, qryChar);
-					ss << ":" << refChar << ">" << qryChar;
+					o.append(':'); o.append(refChar); o.append('>'); o.append(qryChar);
 					firstmm = false;
 				} else if(snpAnnots.find(i) != snpAnnots.end()) {
-					if (!firstmm) ss << ",";
-					ss << i; // position
+					if (!firstmm) o.append(',');
+					o.appendNum(i); // position
 					char qryChar = (h.fw ? h.patSeq[i] : h.patSeq[length(h.patSeq)-i-1]);
-					ss << "S:" << snpAnnots[i] << ">" << qryChar;
+					o.append("S:", 2); o.append(snpAnnots[i]); o.append('>'); o.append(qryChar);
 					firstmm = false;
 				}
 			}
-			if(partition != 0 && firstmm) ss << '-';
+			if(partition != 0 && firstmm) o.append('-');
 		}
 		if(partition != 0) {
 			// Fields addded as of Crossbow 0.1.4
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
-				ss << (int)h.mate;
+				else o.append('\t');
+				o.appendNum((int)h.mate);
 			}
 			// Print label, or whole read name if label isn't found
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
+				else o.append('\t');
 				int labelOff = -1;
 				// If LB: field is present, print its value
 				for(int i = 0; i < (int)seqan::length(h.patName)-3; i++) {
@@ -283,7 +298,7 @@ void VerboseHitSink::append(ostream& ss,
 						labelOff = i+3;
 						for(int j = labelOff; j < (int)seqan::length(h.patName); j++) {
 							if(h.patName[j] != ';') {
-								ss << h.patName[j];
+								o.append(h.patName[j]);
 							} else {
 								break;
 							}
@@ -291,31 +306,31 @@ void VerboseHitSink::append(ostream& ss,
 					}
 				}
 				// Otherwise, print the whole read name
-				if(labelOff == -1) ss << h.patName;
+				if(labelOff == -1) appendStr(o, h.patName);
 			}
 		}
 		if(cost) {
 			// Stratum
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
-				ss << (int)h.stratum;
+				else o.append('\t');
+				o.appendNum((int)h.stratum);
 			}
 			// Cost
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
-				ss << (int)h.cost;
+				else o.append('\t');
+				o.appendNum((int)h.cost);
 			}
 		}
 		if(showSeed) {
 			// Seed
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else ss << '\t';
-				ss << h.seed;
+				else o.append('\t');
+				o.appendNum(h.seed);
 			}
 		}
-		ss << endl;
+		o.append('\n');
 	} while(spill);
 }
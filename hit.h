@@ -2,6 +2,7 @@
 #define HIT_H_
 
 #include <vector>
+#include <list>
 #include <stdint.h>
 #include <iostream>
 #include <sstream>
@@ -17,10 +18,16 @@
 #include "pat.h"
 #include "formats.h"
 #include "filebuf.h"
+#include "bgzf.h"
+#include "strbuf.h"
+#include "hit_sorter.h"
+#include "refout.h"
 #include "edit.h"
 #include "refmap.h"
 #include "annot.h"
 
+class ReadCache;
+
 /**
  * Classes for dealing with reporting alignments.
  */
@@ -35,6 +42,7 @@ enum output_types {
 	OUTPUT_BINARY,
 	OUTPUT_CHAIN,
 	OUTPUT_SAM,
+	OUTPUT_BAM,
 	OUTPUT_NONE
 };
 
@@ -263,12 +271,14 @@ protected:
 #define DECL_HIT_DUMPS \
 	const std::string& dumpAl, \
 	const std::string& dumpUnal, \
-	const std::string& dumpMax
+	const std::string& dumpMax, \
+	int dumpGz
 
 #define INIT_HIT_DUMPS \
 	dumpAlBase_(dumpAl), \
 	dumpUnalBase_(dumpUnal), \
-	dumpMaxBase_(dumpMax)
+	dumpMaxBase_(dumpMax), \
+	dumpGz_(dumpGz)
 
 #define DECL_HIT_DUMPS2 \
 	DECL_HIT_DUMPS, \
@@ -280,7 +290,8 @@ protected:
 #define PASS_HIT_DUMPS \
 	dumpAl, \
 	dumpUnal, \
-	dumpMax
+	dumpMax, \
+	dumpGz
 
 #define PASS_HIT_DUMPS2 \
 	PASS_HIT_DUMPS, \
@@ -289,6 +300,60 @@ protected:
 	recalTable, \
 	refnames
 
+/// Kinds of reads dumped to files: --al, --un and --max
+enum {
+	DUMP_AL = 0,
+	DUMP_UNAL,
+	DUMP_MAX,
+	DUMP_KINDS
+};
+
+/// # dump streams per kind: unpaired, mate 1 and mate 2, each with a
+/// reads file and a qualities file
+static const size_t DUMP_PER_KIND = 6;
+
+/**
+ * Output state private to one search thread: formatted records not yet
+ * handed to an output stream, and alignment tallies that are folded
+ * into the HitSink's totals once the thread is done.  Reporting a read
+ * through a HitSinkLocal takes no shared lock until the buffer fills.
+ */
+struct HitSinkLocal {
+
+	/// Hand buffered records to the output stream once this many bytes
+	/// have accumulated
+	static const size_t FLUSH_SZ = 64 * 1024;
+
+	/// Index into 'dumps' of the buffer for dumped reads of 'kind'
+	/// (DUMP_AL, DUMP_UNAL or DUMP_MAX) for mate 0 (unpaired), 1 or 2,
+	/// reads or qualities
+	static size_t dumpIdx(int kind, int mate, bool qual) {
+		return kind * DUMP_PER_KIND + mate * 2 + (qual ? 1 : 0);
+	}
+
+	HitSinkLocal() :
+		buf(),
+		strIdx(0),
+		first(true),
+		numAligned(0llu),
+		numUnaligned(0llu),
+		numMaxed(0llu),
+		numReported(0llu),
+		numReportedPaired(0llu)
+	{ }
+
+	StrBuf   buf;               /// records bound for output stream strIdx
+	StrBuf   dumps[DUMP_KINDS * DUMP_PER_KIND]; /// reads bound for --al/--un/--max files
+	std::vector<SortRec> recs;  /// with --sorted, keys of records in buf
+	size_t   strIdx;            /// output stream that buf belongs to
+	bool     first;             /// true -> no hit reported by this thread yet
+	uint64_t numAligned;        /// # reads with >= 1 alignment
+	uint64_t numUnaligned;      /// # reads with no alignments
+	uint64_t numMaxed;          /// # reads with # alignments exceeding -m ceiling
+	uint64_t numReported;       /// # single-ended alignments reported
+	uint64_t numReportedPaired; /// # paired-end alignments reported
+};
+
 /**
  * Encapsulates an object that accepts hits, optionally retains them in
  * a vector, and does something else with them according to
@@ -318,7 +383,11 @@ public:
 		numReported_(0llu),
 		numReportedPaired_(0llu),
 		quiet_(false),
-		ssmode_(ios_base::out)
+		ssmode_(ios_base::out),
+		readCache_(NULL),
+		reorder_(NULL),
+		sorter_(NULL),
+		refPool_(NULL)
 	{
 		_outs.push_back(out);
                 vector<MUTEX_T*>::iterator it;
@@ -328,10 +397,10 @@ public:
 	}
 
 	/**
-	 * Open a number of output streams; usually one per reference
-	 * sequence.  For now, we give then names refXXXXX.map where XXXXX
-	 * is the 0-padded reference index.  Someday we may want to include
-	 * the name of the reference sequence in the filename somehow.
+	 * Write output to one file per reference sequence, named
+	 * refXXXXX.map where XXXXX is the 0-padded reference index (see
+	 * --refout).  Output is pooled by a RefOutPool, so memory and open
+	 * files stay bounded however many references there are.
 	 */
 	explicit HitSink(size_t numOuts,
 			DECL_HIT_DUMPS,
@@ -347,14 +416,20 @@ public:
 		INIT_HIT_DUMPS,
 		onePairFile_(onePairFile),
 		sampleMax_(sampleMax),
+		first_(true),
+		numAligned_(0llu),
+		numUnaligned_(0llu),
+		numMaxed_(0llu),
+		numReported_(0llu),
+		numReportedPaired_(0llu),
 		quiet_(false),
-		ssmode_(ios_base::out)
+		ssmode_(ios_base::out),
+		readCache_(NULL),
+		reorder_(NULL),
+		sorter_(NULL),
+		refPool_(NULL)
 	{
-		// Open all files for writing and initialize all locks
-		for(size_t i = 0; i < numOuts; i++) {
-			_outs.push_back(NULL); // we open output streams lazily
-			_locks.push_back(new MUTEX_T);
-		}
+		refPool_ = new RefOutPool(numOuts, ssmode_ == ios_base::binary);
 		initDumps();
 	}
 
@@ -363,6 +438,7 @@ public:
 	 */
 	virtual ~HitSink() {
 		closeOuts();
+		delete refPool_;
 		if(_deleteOuts) {
 			// Delete all non-NULL output streams
 			for(size_t i = 0; i < _outs.size(); i++) {
@@ -386,63 +462,204 @@ public:
             numWrapper_mutex_m.unlock();
 	}
 
+	/**
+	 * Set the duplicate-read cache consulted by this sink's per-thread
+	 * wrappers; NULL (the default) disables caching.
+	 */
+	void setReadCache(ReadCache* cache) { readCache_ = cache; }
+
+	/// Return the duplicate-read cache, or NULL if there is none
+	ReadCache* readCache() const { return readCache_; }
+
 	/**
 	 * Called by concrete subclasses to figure out which elements of
 	 * the _outs/_locks array to use when outputting the alignment.
 	 */
 	size_t refIdxToStreamIdx(size_t refIdx) {
-		if(refIdx >= _outs.size()) return 0;
+		if(refIdx >= numStreams()) return 0;
 		return refIdx;
 	}
 
+	/// Return the number of output streams: 1, or 1 per reference
+	size_t numStreams() const {
+		return refPool_ != NULL ? refPool_->size() : _outs.size();
+	}
+
 	/**
 	 * Append a single hit to the given output stream.
 	 */
 	virtual void append(ostream& o, const Hit& h) = 0;
 
+	/**
+	 * Append a single hit to the given buffer.  Sinks with a
+	 * hand-rolled formatter override this; others go through their
+	 * ostream formatter.
+	 */
+	virtual void append(StrBuf& o, const Hit& h) {
+		ostringstream ss(ssmode_);
+		append(ss, h);
+		o.append(ss.str());
+	}
+
 	/**
 	 * Report a batch of hits; all in the given vector.
 	 */
-	virtual void reportHits(vector<Hit>& hs) {
-		reportHits(hs, 0, hs.size());
+	virtual void reportHits(vector<Hit>& hs, HitSinkLocal& l) {
+		reportHits(hs, 0, hs.size(), l);
 	}
 
 	/**
 	 * Report a batch of hits from a vector, perhaps subsetting it.
+	 * Records are appended to the calling thread's buffer.
 	 */
-	virtual void reportHits(vector<Hit>& hs, size_t start, size_t end) {
+	virtual void reportHits(vector<Hit>& hs, size_t start, size_t end, HitSinkLocal& l) {
 		assert_geq(end, start);
 		if(end-start == 0) return;
 		bool paired = hs[start].mate > 0;
 		// Sort reads so that those against the same reference sequence
 		// are consecutive.
-		if(_outs.size() > 1 && end-start > 2) {
+		if(numStreams() > 1 && end-start > 2) {
 			sort(hs.begin() + start, hs.begin() + end);
 		}
-		char buf[4096];
 		for(size_t i = start; i < end; i++) {
 			const Hit& h = hs[i];
 			assert(h.repOk());
-			bool diff = false;
-			if(i > start) {
-				diff = (refIdxToStreamIdx(h.h.first) != refIdxToStreamIdx(hs[i-1].h.first));
-				if(diff) unlock(hs[i-1].h.first);
-			}
-			ostringstream ss(ssmode_);
-			ss.rdbuf()->pubsetbuf(buf, 4096);
-			append(ss, h);
-			if(i == start || diff) {
-				lock(h.h.first);
-			}
-			out(h.h.first).writeChars(buf, ss.tellp());
+			size_t mark = l.buf.length();
+			append(localBuf(l, h.h.first), h);
+			keyRecord(l, mark, h);
 		}
-		unlock(hs[end-1].h.first);
-		GUARD_LOCK(main_mutex_m);
 		commitHits(hs);
-		first_ = false;
-		numAligned_++;
-		if(paired) numReportedPaired_ += (end-start);
-		else       numReported_ += (end-start);
+		l.first = false;
+		l.numAligned++;
+		if(paired) l.numReportedPaired += (end-start);
+		else       l.numReported += (end-start);
+		maybeFlush(l);
+	}
+
+	/**
+	 * Return the buffer that records for reference 'refIdx' should be
+	 * appended to, first handing off anything buffered for a different
+	 * output stream (see --refout).
+	 */
+	StrBuf& localBuf(HitSinkLocal& l, size_t refIdx) {
+		size_t strIdx = refIdxToStreamIdx(refIdx);
+		if(strIdx != l.strIdx) {
+			flush(l);
+			l.strIdx = strIdx;
+		}
+		return l.buf;
+	}
+
+	/**
+	 * Hand off the thread's buffered records if enough have
+	 * accumulated.  With --reorder, records are held until the read is
+	 * finished; see finishReadOutput().
+	 */
+	void maybeFlush(HitSinkLocal& l) {
+		if(sorter_ != NULL) {
+			if(sorter_->full(l.buf, l.recs)) flush(l);
+		} else if(reorder_ == NULL && l.buf.length() >= HitSinkLocal::FLUSH_SZ) {
+			flush(l);
+		}
+	}
+
+	/**
+	 * With --sorted, note the sort key of the record that was appended
+	 * to l.buf starting at offset 'mark'.  An unaligned read is keyed
+	 * by its read id only (ref = 0xffffffff) so that it sorts last.
+	 */
+	void keyRecord(HitSinkLocal& l, size_t mark, uint32_t ref, uint32_t off, uint64_t patid) {
+		if(sorter_ == NULL) return;
+		SortRec r;
+		r.ref   = ref;
+		r.off   = off;
+		r.patid = patid;
+		r.start = (uint32_t)mark;
+		r.len   = (uint32_t)(l.buf.length() - mark);
+		l.recs.push_back(r);
+	}
+
+	void keyRecord(HitSinkLocal& l, size_t mark, const Hit& h) {
+		keyRecord(l, mark, (uint32_t)h.h.first, (uint32_t)h.h.second, (uint64_t)h.patId);
+	}
+
+	/**
+	 * Called once all records for read p have been reported.  With
+	 * --reorder, move them into p's slot in the ReorderBuffer, which
+	 * writes them out after the records for all earlier reads.
+	 */
+	void finishReadOutput(PatternSourcePerThread& p, HitSinkLocal& l) {
+		ReorderBuffer* r = p.reorder();
+		if(r == NULL || l.buf.empty()) return;
+		r->append(p.seq(), l.buf.ptr(), l.buf.length());
+		l.buf.clear();
+	}
+
+	/**
+	 * Send output through the given ReorderBuffer so that it comes out
+	 * in input order (see --reorder).
+	 */
+	void setReorder(ReorderBuffer* reorder) { reorder_ = reorder; }
+
+	/**
+	 * Open the --al, --un and --max files before any search thread
+	 * starts, so that a path that can't be written is reported up
+	 * front.  'unpaired' and 'paired' say which kinds of reads the
+	 * input holds, and 'quals' whether their qualities come from
+	 * separate files.
+	 */
+	void openDumps(bool unpaired, bool paired, bool quals) {
+		for(int kind = 0; kind < DUMP_KINDS; kind++) {
+			openDumps(kind, unpaired, paired, quals);
+		}
+	}
+
+	/**
+	 * Hold all records and write them sorted by reference position
+	 * once the search is done (see --sorted).  Must be set before any
+	 * records are reported.
+	 */
+	void setSorter(HitSorter* sorter) { sorter_ = sorter; }
+
+	/**
+	 * Write all of the thread's buffered records to their output
+	 * stream in one locked operation.
+	 */
+	void flush(HitSinkLocal& l) {
+		if(l.buf.empty()) return;
+		if(sorter_ != NULL) {
+			// Becomes one sorted run; see HitSorter
+			sorter_->spill(l.buf, l.recs);
+			return;
+		}
+		if(refPool_ != NULL) {
+			refPool_->write(l.strIdx, l.buf.ptr(), l.buf.length());
+		} else {
+			lock(l.strIdx);
+			out(l.strIdx).writeChars(l.buf.ptr(), l.buf.length());
+			unlock(l.strIdx);
+		}
+		l.buf.clear();
+	}
+
+	/**
+	 * Called once a thread is done reporting: write out its remaining
+	 * records and fold its tallies into the totals printed by
+	 * finish().
+	 */
+	void finishLocal(HitSinkLocal& l) {
+		flush(l);
+		flushDumps(l);
+		GUARD_LOCK(main_mutex_m);
+		if(!l.first) first_ = false;
+		numAligned_        += l.numAligned;
+		numUnaligned_      += l.numUnaligned;
+		numMaxed_          += l.numMaxed;
+		numReported_       += l.numReported;
+		numReportedPaired_ += l.numReportedPaired;
+		l.first = true;
+		l.numAligned = l.numUnaligned = l.numMaxed = 0llu;
+		l.numReported = l.numReportedPaired = 0llu;
 	}
 
 	void commitHit(const Hit& hit) {
@@ -453,6 +670,7 @@ public:
 
 	void commitHits(const std::vector<Hit>& hits) {
 		if(recalTable_ != NULL) {
+			GUARD_LOCK(main_mutex_m);
 			const size_t sz = hits.size();
 			for(size_t i = 0; i < sz; i++) {
 				commitHit(hits[i]);
@@ -461,12 +679,15 @@ public:
 	}
 
 	/**
-	 * Called when all alignments are complete.  It is assumed that no
-	 * synchronization is necessary.
+	 * Called when all alignments are complete and every thread has
+	 * called finishLocal().  It is assumed that no synchronization is
+	 * necessary.
 	 */
 	void finish(bool hadoopOut) {
-		// Close output streams
+		// Close output streams here rather than in the destructor, so
+		// that a write error can be thrown
 		closeOuts();
+		closeDumps();
 		if(!quiet_) {
 			// Print information about how many unpaired and/or paired
 			// reads were aligned.
@@ -501,12 +722,12 @@ public:
 			}
 			else if(numReportedPaired_ > 0 && numReported_ == 0) {
 				cerr << "Reported " << (numReportedPaired_ >> 1)
-					 << " paired-end alignments to " << _outs.size()
+					 << " paired-end alignments to " << numStreams()
 					 << " output stream(s)" << endl;
 			}
 			else if(numReported_ > 0 && numReportedPaired_ == 0) {
 				cerr << "Reported " << numReported_
-					 << " alignments to " << _outs.size()
+					 << " alignments to " << numStreams()
 					 << " output stream(s)" << endl;
 			}
 			else {
@@ -514,7 +735,7 @@ public:
 				assert_gt(numReportedPaired_, 0);
 				cerr << "Reported " << (numReportedPaired_ >> 1)
 					 << " paired-end alignments and " << numReported_
-					 << " singleton alignments to " << _outs.size()
+					 << " singleton alignments to " << numStreams()
 					 << " output stream(s)" << endl;
 			}
 			if(hadoopOut) {
@@ -531,25 +752,23 @@ public:
 		}
 	}
 
-	/// Returns the alignment output stream; if the stream needs to be
-	/// created, create it
+	/// Returns the alignment output stream.  Not available with
+	/// --refout, where output goes through the RefOutPool.
 	OutFileBuf& out(size_t refIdx) {
+		assert(refPool_ == NULL);
 		size_t strIdx = refIdxToStreamIdx(refIdx);
-		if(_outs[strIdx] == NULL) {
-			assert(_deleteOuts);
-			ostringstream oss;
-			oss << "ref";
-			if     (strIdx < 10)    oss << "0000";
-			else if(strIdx < 100)   oss << "000";
-			else if(strIdx < 1000)  oss << "00";
-			else if(strIdx < 10000) oss << "0";
-			oss << strIdx << ".map";
-			_outs[strIdx] = new OutFileBuf(oss.str().c_str(), ssmode_ == ios_base::binary);
-		}
 		assert(_outs[strIdx] != NULL);
 		return *(_outs[strIdx]);
 	}
 
+	/**
+	 * With --refout, print statistics about the per-reference output
+	 * files; call after finish().
+	 */
+	void printRefOutStats(std::ostream& os) const {
+		if(refPool_ != NULL) refPool_->printStats(os);
+	}
+
 	/**
 	 * Lock the monolithic lock for this HitSink.  This is useful when,
 	 * for example, outputting a read to an unaligned-read file.
@@ -600,161 +819,41 @@ public:
 	}
 
 	/**
-	 * Dump an aligned read to all of the appropriate output streams.
-	 * Be careful to synchronize correctly - there may be multiple
-	 * simultaneous writers.
+	 * Dump an aligned read to the --al file(s).  The read goes into
+	 * the thread's buffer for that file; see dumpRead().
 	 */
-	void dumpAlign(PatternSourcePerThread& p) {
+	void dumpAlign(PatternSourcePerThread& p, HitSinkLocal& l) {
 		if(!dumpAlignFlag_) return;
-		if(!p.paired() || onePairFile_) {
-			// Dump unpaired read to an aligned-read file of the same format
-			if(!dumpAlBase_.empty()) {
-				GUARD_LOCK(dumpAlignLock_);
-				if(dumpAl_ == NULL) {
-					assert(dumpAlQv_ == NULL);
-					dumpAl_ = openOf(dumpAlBase_, 0, "");
-					assert(dumpAl_ != NULL);
-					if(p.bufa().qualOrigBufLen > 0) {
-						dumpAlQv_ = openOf(dumpAlBase_ + ".qual", 0, "");
-						assert(dumpAlQv_ != NULL);
-					}
-				}
-				dumpAl_->write(p.bufa().readOrigBuf, p.bufa().readOrigBufLen);
-				if(dumpAlQv_ != NULL) {
-					dumpAlQv_->write(p.bufa().qualOrigBuf, p.bufa().qualOrigBufLen);
-				}
-			}
-		} else {
-			// Dump paired-end read to an aligned-read file (or pair of
-			// files) of the same format
-			if(!dumpAlBase_.empty()) {
-				GUARD_LOCK(dumpAlignLockPE_);
-				if(dumpAl_1_ == NULL) {
-					assert(dumpAlQv_1_ == NULL);
-					assert(dumpAlQv_2_ == NULL);
-					dumpAl_1_ = openOf(dumpAlBase_, 1, "");
-					dumpAl_2_ = openOf(dumpAlBase_, 2, "");
-					assert(dumpAl_1_ != NULL);
-					assert(dumpAl_2_ != NULL);
-					if(p.bufa().qualOrigBufLen > 0) {
-						dumpAlQv_1_ = openOf(dumpAlBase_ + ".qual", 1, "");
-						dumpAlQv_2_ = openOf(dumpAlBase_ + ".qual", 2, "");
-						assert(dumpAlQv_1_ != NULL);
-						assert(dumpAlQv_2_ != NULL);
-					}
-				}
-				dumpAl_1_->write(p.bufa().readOrigBuf, p.bufa().readOrigBufLen);
-				dumpAl_2_->write(p.bufb().readOrigBuf, p.bufb().readOrigBufLen);
-				if(dumpAlQv_1_ != NULL) {
-					dumpAlQv_1_->write(p.bufa().qualOrigBuf, p.bufa().qualOrigBufLen);
-					dumpAlQv_2_->write(p.bufb().qualOrigBuf, p.bufb().qualOrigBufLen);
-				}
-			}
-		}
+		dumpRead(DUMP_AL, p, l);
 	}
 
 	/**
-	 * Dump an unaligned read to all of the appropriate output streams.
-	 * Be careful to synchronize correctly - there may be multiple
-	 * simultaneous writers.
+	 * Dump an unaligned read to the --un file(s).
 	 */
-	void dumpUnal(PatternSourcePerThread& p) {
+	void dumpUnal(PatternSourcePerThread& p, HitSinkLocal& l) {
 		if(!dumpUnalignFlag_) return;
-		if(!p.paired() || onePairFile_) {
-			// Dump unpaired read to an unaligned-read file of the same format
-			if(!dumpUnalBase_.empty()) {
-				GUARD_LOCK(dumpUnalLock_);
-				if(dumpUnal_ == NULL) {
-					assert(dumpUnalQv_ == NULL);
-					dumpUnal_ = openOf(dumpUnalBase_, 0, "");
-					assert(dumpUnal_ != NULL);
-					if(p.bufa().qualOrigBufLen > 0) {
-						dumpUnalQv_ = openOf(dumpUnalBase_ + ".qual", 0, "");
-						assert(dumpUnalQv_ != NULL);
-					}
-				}
-				dumpUnal_->write(p.bufa().readOrigBuf, p.bufa().readOrigBufLen);
-				if(dumpUnalQv_ != NULL) {
-					dumpUnalQv_->write(p.bufa().qualOrigBuf, p.bufa().qualOrigBufLen);
-				}
-			}
-		} else {
-			// Dump paired-end read to an unaligned-read file (or pair
-			// of files) of the same format
-			if(!dumpUnalBase_.empty()) {
-				GUARD_LOCK(dumpUnalLockPE_);
-				if(dumpUnal_1_ == NULL) {
-					assert(dumpUnal_1_ == NULL);
-					assert(dumpUnal_2_ == NULL);
-					dumpUnal_1_ = openOf(dumpUnalBase_, 1, "");
-					dumpUnal_2_ = openOf(dumpUnalBase_, 2, "");
-					assert(dumpUnal_1_ != NULL);
-					assert(dumpUnal_2_ != NULL);
-					if(p.bufa().qualOrigBufLen > 0) {
-						dumpUnalQv_1_ = openOf(dumpUnalBase_ + ".qual", 1, "");
-						dumpUnalQv_2_ = openOf(dumpUnalBase_ + ".qual", 2, "");
-					}
-				}
-				dumpUnal_1_->write(p.bufa().readOrigBuf, p.bufa().readOrigBufLen);
-				dumpUnal_2_->write(p.bufb().readOrigBuf, p.bufb().readOrigBufLen);
-				if(dumpUnalQv_1_ != NULL) {
-					dumpUnalQv_1_->write(p.bufa().qualOrigBuf, p.bufa().qualOrigBufLen);
-					dumpUnalQv_2_->write(p.bufb().qualOrigBuf, p.bufb().qualOrigBufLen);
-				}
-			}
-		}
+		dumpRead(DUMP_UNAL, p, l);
 	}
 
 	/**
-	 * Dump a maxed-out read to all of the appropriate output streams.
-	 * Be careful to synchronize correctly - there may be multiple
-	 * simultaneous writers.
+	 * Dump a maxed-out read to the --max file(s), or to the --un
+	 * file(s) if there is no --max.
 	 */
-	void dumpMaxed(PatternSourcePerThread& p) {
+	void dumpMaxed(PatternSourcePerThread& p, HitSinkLocal& l) {
 		if(!dumpMaxedFlag_) {
-			if(dumpUnalignFlag_) dumpUnal(p);
+			if(dumpUnalignFlag_) dumpUnal(p, l);
 			return;
 		}
-		if(!p.paired() || onePairFile_) {
-			// Dump unpaired read to an maxed-out-read file of the same format
-			if(!dumpMaxBase_.empty()) {
-				GUARD_LOCK(dumpMaxLock_);
-				if(dumpMax_ == NULL) {
-					dumpMax_ = openOf(dumpMaxBase_, 0, "");
-					assert(dumpMax_ != NULL);
-					if(p.bufa().qualOrigBufLen > 0) {
-						dumpMaxQv_ = openOf(dumpMaxBase_ + ".qual", 0, "");
-					}
-				}
-				dumpMax_->write(p.bufa().readOrigBuf, p.bufa().readOrigBufLen);
-				if(dumpMaxQv_ != NULL) {
-					dumpMaxQv_->write(p.bufa().qualOrigBuf, p.bufa().qualOrigBufLen);
-				}
-			}
-		} else {
-			// Dump paired-end read to a maxed-out-read file (or pair
-			// of files) of the same format
-			if(!dumpMaxBase_.empty()) {
-				GUARD_LOCK(dumpMaxLockPE_);
-				if(dumpMax_1_ == NULL) {
-					assert(dumpMaxQv_1_ == NULL);
-					assert(dumpMaxQv_2_ == NULL);
-					dumpMax_1_ = openOf(dumpMaxBase_, 1, "");
-					dumpMax_2_ = openOf(dumpMaxBase_, 2, "");
-					assert(dumpMax_1_ != NULL);
-					assert(dumpMax_2_ != NULL);
-					if(p.bufa().qualOrigBufLen > 0) {
-						dumpMaxQv_1_ = openOf(dumpMaxBase_ + ".qual", 1, "");
-						dumpMaxQv_2_ = openOf(dumpMaxBase_ + ".qual", 2, "");
-					}
-				}
-				dumpMax_1_->write(p.bufa().readOrigBuf, p.bufa().readOrigBufLen);
-				dumpMax_2_->write(p.bufb().readOrigBuf, p.bufb().readOrigBufLen);
-				if(dumpMaxQv_1_ != NULL) {
-					dumpMaxQv_1_->write(p.bufa().qualOrigBuf, p.bufa().qualOrigBufLen);
-					dumpMaxQv_2_->write(p.bufb().qualOrigBuf, p.bufb().qualOrigBufLen);
-				}
-			}
+		dumpRead(DUMP_MAX, p, l);
+	}
+
+	/**
+	 * Write out all of a thread's buffered dumped reads.
+	 */
+	void flushDumps(HitSinkLocal& l) {
+		for(int kind = 0; kind < DUMP_KINDS; kind++) {
+			flushDump(kind, false, l);
+			flushDump(kind, true, l);
 		}
 	}
 
@@ -762,37 +861,42 @@ public:
 	 * Report a maxed-out read.  Typically we do nothing, but we might
 	 * want to print a placeholder when output is chained.
 	 */
-	virtual void reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p) {
-		GUARD_LOCK(main_mutex_m);
-		numMaxed_++;
+	virtual void reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p, HitSinkLocal& l) {
+		l.numMaxed++;
 	}
 
 	/**
 	 * Report an unaligned read.  Typically we do nothing, but we might
 	 * want to print a placeholder when output is chained.
 	 */
-	virtual void reportUnaligned(PatternSourcePerThread& p) {
-		GUARD_LOCK(main_mutex_m);
-		numUnaligned_++;
+	virtual void reportUnaligned(PatternSourcePerThread& p, HitSinkLocal& l) {
+		l.numUnaligned++;
 	}
 
 protected:
 
 	/// Implementation of hit-report
-	virtual void reportHit(const Hit& h) {
+	virtual void reportHit(const Hit& h, HitSinkLocal& l) {
 		assert(h.repOk());
-		GUARD_LOCK(main_mutex_m);
-		commitHit(h);
-		first_ = false;
-		if(h.mate > 0) numReportedPaired_++;
-		else           numReported_++;
-		numAligned_++;
+		if(recalTable_ != NULL) {
+			GUARD_LOCK(main_mutex_m);
+			commitHit(h);
+		}
+		l.first = false;
+		if(h.mate > 0) l.numReportedPaired++;
+		else           l.numReported++;
+		l.numAligned++;
 	}
 
 	/**
 	 * Close (and flush) all OutFileBufs.
 	 */
 	void closeOuts() {
+		// Write the sorted records, which every thread has spilled by now
+		if(sorter_ != NULL && !_outs.empty() && _outs[0] != NULL && !_outs[0]->closed()) {
+			sorter_->merge(*_outs[0]);
+		}
+		if(refPool_ != NULL) refPool_->close();
 		// Flush and close all non-NULL output streams
 		for(size_t i = 0; i < _outs.size(); i++) {
 			if(_outs[i] != NULL && !_outs[i]->closed()) {
@@ -836,59 +940,104 @@ protected:
 	std::string dumpAlBase_;
 	std::string dumpUnalBase_;
 	std::string dumpMaxBase_;
+	int dumpGz_; // bit (1 << kind) set -> gzip-compress dumped reads of kind
 
 	bool onePairFile_;
 	bool sampleMax_;
 
-	// Output streams for dumping sequences
-	std::ofstream *dumpAl_;       // for single-ended reads
-	std::ofstream *dumpAl_1_;     // for first mates
-	std::ofstream *dumpAl_2_;     // for second mates
-	std::ofstream *dumpUnal_;     // for single-ended reads
-	std::ofstream *dumpUnal_1_;   // for first mates
-	std::ofstream *dumpUnal_2_;   // for second mates
-	std::ofstream *dumpMax_;      // for single-ended reads
-	std::ofstream *dumpMax_1_;    // for first mates
-	std::ofstream *dumpMax_2_;    // for second mates
-
-	// Output streams for dumping qualities
-	std::ofstream *dumpAlQv_;     // for single-ended reads
-	std::ofstream *dumpAlQv_1_;   // for first mates
-	std::ofstream *dumpAlQv_2_;   // for second mates
-	std::ofstream *dumpUnalQv_;   // for single-ended reads
-	std::ofstream *dumpUnalQv_1_; // for first mates
-	std::ofstream *dumpUnalQv_2_; // for second mates
-	std::ofstream *dumpMaxQv_;    // for single-ended reads
-	std::ofstream *dumpMaxQv_1_;  // for first mates
-	std::ofstream *dumpMaxQv_2_;  // for second mates
-
-	/**
-	 * Open an ofstream with given name; output error message and quit
-	 * if it fails.
-	 */
-	std::ofstream* openOf(const std::string& name,
-	                      int mateType,
-	                      const std::string& suffix)
+	/**
+	 * Return the base file name given for dumped reads of 'kind'.
+	 */
+	const std::string& dumpBase(int kind) const {
+		if(kind == DUMP_AL) return dumpAlBase_;
+		if(kind == DUMP_UNAL) return dumpUnalBase_;
+		return dumpMaxBase_;
+	}
+
+	/**
+	 * Append the read (or pair) to the thread's buffers for dumped
+	 * reads of 'kind', and write the buffers out once they're big
+	 * enough.  Unpaired reads (and pairs going to a single file with
+	 * --12) and paired reads are buffered and written separately, and
+	 * the two mates' buffers are always written together, so mate
+	 * files stay in step.
+	 */
+	void dumpRead(int kind, PatternSourcePerThread& p, HitSinkLocal& l) {
+		if(dumpBase(kind).empty()) return;
+		bool pe = p.paired() && !onePairFile_;
+		StrBuf *b = &l.dumps[HitSinkLocal::dumpIdx(kind, pe ? 1 : 0, false)];
+		b->append(p.bufa().readOrigBuf, p.bufa().readOrigBufLen);
+		if(p.bufa().qualOrigBufLen > 0) {
+			l.dumps[HitSinkLocal::dumpIdx(kind, pe ? 1 : 0, true)].append(
+				p.bufa().qualOrigBuf, p.bufa().qualOrigBufLen);
+		}
+		if(pe) {
+			l.dumps[HitSinkLocal::dumpIdx(kind, 2, false)].append(
+				p.bufb().readOrigBuf, p.bufb().readOrigBufLen);
+			if(p.bufb().qualOrigBufLen > 0) {
+				l.dumps[HitSinkLocal::dumpIdx(kind, 2, true)].append(
+					p.bufb().qualOrigBuf, p.bufb().qualOrigBufLen);
+			}
+		}
+		if(b->length() >= HitSinkLocal::FLUSH_SZ) flushDump(kind, pe, l);
+	}
+
+	/**
+	 * Write the thread's buffered unpaired (pe = false) or paired
+	 * (pe = true) reads of 'kind' to their files in one locked
+	 * operation, opening the files if need be.
+	 */
+	void flushDump(int kind, bool pe, HitSinkLocal& l) {
+		int first = pe ? 1 : 0, last = pe ? 2 : 0;
+		if(l.dumps[HitSinkLocal::dumpIdx(kind, first, false)].empty()) return;
+		GUARD_LOCK(dumpLocks_[kind][pe ? 1 : 0]);
+		for(int mate = first; mate <= last; mate++) {
+			for(int qv = 0; qv < 2; qv++) {
+				size_t i = HitSinkLocal::dumpIdx(kind, mate, qv != 0);
+				StrBuf& b = l.dumps[i];
+				if(b.empty()) continue;
+				openDump(kind, mate, qv != 0);
+				dumpOuts_[i]->writeChars(b.ptr(), b.length());
+				b.clear();
+			}
+		}
+	}
+
+	/**
+	 * Open an output stream for dumped reads with given name, with "_1"
+	 * or "_2" inserted before the extension for mates.  If 'gz' is set
+	 * (--al-gz etc.) the stream is gzip-compressed, and for a name
+	 * ending in ".gz" the mate number goes before the extension in
+	 * front of the ".gz".  Each stream is written by its own writer
+	 * thread.
+	 */
+	OutFileBuf* openOf(const std::string& name,
+	                   int mateType,
+	                   const std::string& suffix,
+	                   bool gz)
 	{
-		std::string s = name;
-		size_t dotoff = name.find_last_of(".");
+		bool gzExt = gz && name.length() > 3 && name.compare(name.length() - 3, 3, ".gz") == 0;
+		std::string base = gzExt ? name.substr(0, name.length() - 3) : name;
+		std::string s = base;
+		size_t dotoff = base.find_last_of(".");
 		if(mateType == 1) {
 			if(dotoff == string::npos) {
 				s += "_1"; s += suffix;
 			} else {
-				s = name.substr(0, dotoff) + "_1" + s.substr(dotoff);
+				s = base.substr(0, dotoff) + "_1" + s.substr(dotoff);
 			}
 		} else if(mateType == 2) {
 			if(dotoff == string::npos) {
 				s += "_2"; s += suffix;
 			} else {
-				s = name.substr(0, dotoff) + "_2" + s.substr(dotoff);
+				s = base.substr(0, dotoff) + "_2" + s.substr(dotoff);
 			}
 		} else if(mateType != 0) {
 			cerr << "Bad mate type " << mateType << endl; throw 1;
 		}
-		std::ofstream* tmp = new ofstream(s.c_str(), ios::out);
-		if(tmp->fail()) {
+		if(gzExt) s += ".gz";
+		FILE *f = fopen(s.c_str(), "wb");
+		if(f == NULL) {
 			if(mateType == 0) {
 				cerr << "Could not open single-ended aligned/unaligned-read file for writing: " << name << endl;
 			} else {
@@ -896,66 +1045,101 @@ protected:
 			}
 			throw 1;
 		}
-		return tmp;
+		dumpNames_.push_back(s);
+		OutFileBuf *o = new OutFileBuf(f, dumpNames_.back().c_str());
+		if(gz) o->setFilter(new BGZFWriter());
+		o->setAsync(OutFileBuf::ASYNC_DEPTH);
+		return o;
+	}
+
+	/**
+	 * Open the files for dumped reads of 'kind' that an input holding
+	 * unpaired and/or paired reads, with qualities in separate files
+	 * iff 'quals', can write to.
+	 */
+	void openDumps(int kind, bool unpaired, bool paired, bool quals) {
+		if(dumpBase(kind).empty()) return;
+		if(unpaired || (paired && onePairFile_)) {
+			openDump(kind, 0, false);
+			if(quals) openDump(kind, 0, true);
+		}
+		if(paired && !onePairFile_) {
+			for(int mate = 1; mate <= 2; mate++) {
+				openDump(kind, mate, false);
+				if(quals) openDump(kind, mate, true);
+			}
+		}
 	}
 
 	/**
-	 * Initialize all the locks for dumping.
+	 * Open the file for dumped reads of 'kind' for the given mate (0
+	 * for unpaired) if it isn't open already.
+	 */
+	void openDump(int kind, int mate, bool qv) {
+		size_t i = HitSinkLocal::dumpIdx(kind, mate, qv);
+		if(dumpOuts_[i] == NULL) {
+			dumpOuts_[i] = openOf(qv ? dumpBase(kind) + ".qual" : dumpBase(kind), mate, "",
+			                      (dumpGz_ & (1 << kind)) != 0);
+		}
+	}
+
+	/**
+	 * Initialize the dump streams and flags.
 	 */
 	void initDumps() {
-		dumpAl_       = dumpAl_1_     = dumpAl_2_     = NULL;
-		dumpUnal_     = dumpUnal_1_   = dumpUnal_2_   = NULL;
-		dumpMax_      = dumpMax_1_    = dumpMax_2_    = NULL;
-		dumpAlQv_     = dumpAlQv_1_   = dumpAlQv_2_   = NULL;
-		dumpUnalQv_   = dumpUnalQv_1_ = dumpUnalQv_2_ = NULL;
-		dumpMaxQv_    = dumpMaxQv_1_  = dumpMaxQv_2_  = NULL;
+		for(size_t i = 0; i < DUMP_KINDS * DUMP_PER_KIND; i++) {
+			dumpOuts_[i] = NULL;
+		}
 		dumpAlignFlag_   = !dumpAlBase_.empty();
 		dumpUnalignFlag_ = !dumpUnalBase_.empty();
 		dumpMaxedFlag_   = !dumpMaxBase_.empty();
 	}
 
+	/**
+	 * Flush and close the streams for dumped reads.
+	 */
+	void closeDumps() {
+		for(size_t i = 0; i < DUMP_KINDS * DUMP_PER_KIND; i++) {
+			if(dumpOuts_[i] != NULL) dumpOuts_[i]->close();
+		}
+	}
+
 	void destroyDumps() {
-		if(dumpAl_       != NULL) { dumpAl_->close();       delete dumpAl_; }
-		if(dumpAl_1_     != NULL) { dumpAl_1_->close();     delete dumpAl_1_; }
-		if(dumpAl_2_     != NULL) { dumpAl_2_->close();     delete dumpAl_2_; }
-		if(dumpUnal_     != NULL) { dumpUnal_->close();     delete dumpUnal_; }
-		if(dumpUnal_1_   != NULL) { dumpUnal_1_->close();   delete dumpUnal_1_; }
-		if(dumpUnal_2_   != NULL) { dumpUnal_2_->close();   delete dumpUnal_2_; }
-		if(dumpMax_      != NULL) { dumpMax_->close();      delete dumpMax_; }
-		if(dumpMax_1_    != NULL) { dumpMax_1_->close();    delete dumpMax_1_; }
-		if(dumpMax_2_    != NULL) { dumpMax_2_->close();    delete dumpMax_2_; }
-		if(dumpAlQv_     != NULL) { dumpAlQv_->close();     delete dumpAlQv_; }
-		if(dumpAlQv_1_   != NULL) { dumpAlQv_1_->close();   delete dumpAlQv_1_; }
-		if(dumpAlQv_2_   != NULL) { dumpAlQv_2_->close();   delete dumpAlQv_2_; }
-		if(dumpUnalQv_   != NULL) { dumpUnalQv_->close();   delete dumpUnalQv_; }
-		if(dumpUnalQv_1_ != NULL) { dumpUnalQv_1_->close(); delete dumpUnalQv_1_; }
-		if(dumpUnalQv_2_ != NULL) { dumpUnalQv_2_->close(); delete dumpUnalQv_2_; }
-		if(dumpMaxQv_    != NULL) { dumpMaxQv_->close();    delete dumpMaxQv_; }
-		if(dumpMaxQv_1_  != NULL) { dumpMaxQv_1_->close();  delete dumpMaxQv_1_; }
-		if(dumpMaxQv_2_  != NULL) { dumpMaxQv_2_->close();  delete dumpMaxQv_2_; }
-	}
-
-	// Locks for dumping
-	MUTEX_T dumpAlignLock_;
-	MUTEX_T dumpAlignLockPE_; // _1 and _2
-	MUTEX_T dumpUnalLock_;
-	MUTEX_T dumpUnalLockPE_; // _1 and _2
-	MUTEX_T dumpMaxLock_;
-	MUTEX_T dumpMaxLockPE_;   // _1 and _2
+		for(size_t i = 0; i < DUMP_KINDS * DUMP_PER_KIND; i++) {
+			if(dumpOuts_[i] != NULL) {
+				dumpOuts_[i]->close();
+				delete dumpOuts_[i];
+				dumpOuts_[i] = NULL;
+			}
+		}
+	}
+
+	// Output streams for dumped reads and qualities, indexed by
+	// HitSinkLocal::dumpIdx(); NULL until first written
+	OutFileBuf *dumpOuts_[DUMP_KINDS * DUMP_PER_KIND];
+	std::list<std::string> dumpNames_; // names of dump files (OutFileBuf keeps a pointer)
+
+	// Locks for dumping: [kind][0] for unpaired, [kind][1] for paired
+	MUTEX_T dumpLocks_[DUMP_KINDS][2];
 
 	// false -> no dumping
 	bool dumpAlignFlag_;
 	bool dumpUnalignFlag_;
 	bool dumpMaxedFlag_;
 
-	volatile bool     first_;       /// true -> first hit hasn't yet been reported
-	volatile uint64_t numAligned_;  /// # reads with >= 1 alignment
-	volatile uint64_t numUnaligned_;/// # reads with no alignments
-	volatile uint64_t numMaxed_;    /// # reads with # alignments exceeding -m ceiling
-	volatile uint64_t numReported_; /// # single-ended alignments reported
-	volatile uint64_t numReportedPaired_; /// # paired-end alignments reported
+	// Totals over all threads; see finishLocal()
+	bool     first_;       /// true -> first hit hasn't yet been reported
+	uint64_t numAligned_;  /// # reads with >= 1 alignment
+	uint64_t numUnaligned_;/// # reads with no alignments
+	uint64_t numMaxed_;    /// # reads with # alignments exceeding -m ceiling
+	uint64_t numReported_; /// # single-ended alignments reported
+	uint64_t numReportedPaired_; /// # paired-end alignments reported
 	bool quiet_;  /// true -> don't print alignment stats at the end
 	ios_base::openmode ssmode_;     /// output mode for stringstreams
+	ReadCache* readCache_;          /// duplicate-read cache, or NULL
+	ReorderBuffer* reorder_;        /// --reorder buffer, or NULL
+	HitSorter*     sorter_;         /// --sorted record sorter, or NULL
+	RefOutPool*    refPool_;        /// per-reference output for --refout, or NULL
 };
 
 /**
@@ -964,15 +1148,19 @@ protected:
  */
 class HitSinkPerThread {
 public:
-	HitSinkPerThread(HitSink& sink, uint32_t max, uint32_t n) :
+	HitSinkPerThread(HitSink& sink, HitSinkLocal& local, uint32_t max, uint32_t n) :
 		_sink(sink),
+		_local(local),
 		_bestRemainingStratum(0),
 		_numValidHits(0llu),
 		_hits(),
 		_bufferedHits(),
 		hitsForThisRead_(),
 		_max(max),
-		_n(n)
+		_n(n),
+		cache_(sink.readCache()),
+		cacheMiss_(false),
+		cacheKey_()
 	{
 		_sink.addWrapper();
 		assert_gt(_n, 0);
@@ -987,6 +1175,10 @@ public:
 	virtual uint32_t finishRead(PatternSourcePerThread& p, bool report, bool dump) {
 		uint32_t ret = finishReadImpl();
 		_bestRemainingStratum = 0;
+		if(cacheMiss_) {
+			cacheMiss_ = false;
+			if(report) cacheInsert(ret);
+		}
 		if(!report) {
 			_bufferedHits.clear();
 			return 0;
@@ -998,34 +1190,45 @@ public:
 			// reportable hits exceeded the -m limit specified by the
 			// user
 			assert(ret == 0 || ret > _max);
-			if(maxed) _sink.dumpMaxed(p);
-			else      _sink.dumpUnal(p);
+			if(maxed) _sink.dumpMaxed(p, _local);
+			else      _sink.dumpUnal(p, _local);
 		}
 		ret = 0;
 		if(maxed) {
 			// Report that the read maxed-out; useful for chaining output
-			if(dump) _sink.reportMaxed(_bufferedHits, p);
+			if(dump) _sink.reportMaxed(_bufferedHits, p, _local);
 			_bufferedHits.clear();
 		} else if(unal) {
 			// Report that the read failed to align; useful for chaining output
-			if(dump) _sink.reportUnaligned(p);
+			if(dump) _sink.reportUnaligned(p, _local);
 		} else {
 			// Flush buffered hits
 			assert_gt(_bufferedHits.size(), 0);
 			if(_bufferedHits.size() > _n) {
 				_bufferedHits.resize(_n);
 			}
-			_sink.reportHits(_bufferedHits);
-			_sink.dumpAlign(p);
+			_sink.reportHits(_bufferedHits, _local);
+			_sink.dumpAlign(p, _local);
 			ret = (uint32_t)_bufferedHits.size();
 			_bufferedHits.clear();
 		}
+		_sink.finishReadOutput(p, _local);
 		assert_eq(0, _bufferedHits.size());
 		return ret;
 	}
 
 	virtual uint32_t finishReadImpl() = 0;
 
+	/**
+	 * If a read with the same sequence (and quality class) as the
+	 * current unpaired read has already been aligned, load its
+	 * alignments, re-stamped with this read's name, id and qualities,
+	 * and return true; the caller should skip the search and go
+	 * straight to finishRead().  Otherwise arrange for finishRead() to
+	 * cache this read's outcome and return false.
+	 */
+	bool checkCache(PatternSourcePerThread& p);
+
 	/**
 	 * Implementation for hit reporting; update per-thread _hits and
 	 * _numReportableHits variables and call the master HitSink to do the actual
@@ -1135,6 +1338,7 @@ public:
 
 protected:
 	HitSink&    _sink; /// Ultimate destination of reported hits
+	HitSinkLocal& _local; /// output buffer and tallies for this thread
 	/// Least # mismatches in alignments that will be reported in the
 	/// future.  Updated by the search routine.
 	int         _bestRemainingStratum;
@@ -1150,14 +1354,30 @@ protected:
 	uint32_t hitsForThisRead_; /// # hits for this read so far
 	uint32_t _max; /// don't report any hits if there were > _max
 	uint32_t _n;   /// report at most _n hits
+
+	ReadCache*  cache_;     /// duplicate-read cache, or NULL
+	bool        cacheMiss_; /// current read missed cache; cache outcome
+	std::string cacheKey_;  /// cache key of the current read
+
+	/// Remember the current read's outcome in the duplicate-read cache
+	void cacheInsert(uint32_t nhits);
 };
 
 /**
- * Abstract parent factory for HitSinkPerThreads.
+ * Abstract parent factory for HitSinkPerThreads.  Each search thread
+ * creates its own factory, and all HitSinkPerThreads the factory
+ * creates share one HitSinkLocal, so that a thread's records reach the
+ * output in the order the thread reported them.
  */
 class HitSinkPerThreadFactory {
 public:
-	virtual ~HitSinkPerThreadFactory() { }
+	HitSinkPerThreadFactory(HitSink& sink) : sink_(sink), local_() { }
+
+	/// Hand off the thread's remaining output and tallies
+	virtual ~HitSinkPerThreadFactory() {
+		sink_.finishLocal(local_);
+	}
+
 	virtual HitSinkPerThread* create() const = 0;
 	virtual HitSinkPerThread* createMult(uint32_t m) const = 0;
 
@@ -1167,6 +1387,10 @@ public:
 		// Free the HitSinkPerThread
 		delete sink;
 	}
+
+protected:
+	HitSink& sink_;
+	mutable HitSinkLocal local_; /// shared by all sinks we create
 };
 
 /**
@@ -1179,9 +1403,10 @@ class NGoodHitSinkPerThread : public HitSinkPerThread {
 public:
 	NGoodHitSinkPerThread(
 			HitSink& sink,
+			HitSinkLocal& local,
 			uint32_t n,
 			uint32_t max) :
-				HitSinkPerThread(sink, max, n)
+				HitSinkPerThread(sink, local, max, n)
 	{ }
 
 	virtual bool spanStrata() {
@@ -1238,7 +1463,7 @@ public:
 			HitSink& sink,
 			uint32_t n,
 			uint32_t max) :
-			sink_(sink),
+			HitSinkPerThreadFactory(sink),
 			n_(n),
 			max_(max)
 	{ }
@@ -1248,16 +1473,15 @@ public:
 	 * using the parameters given in the constructor.
 	 */
 	virtual HitSinkPerThread* create() const {
-		return new NGoodHitSinkPerThread(sink_, n_, max_);
+		return new NGoodHitSinkPerThread(sink_, local_, n_, max_);
 	}
 	virtual HitSinkPerThread* createMult(uint32_t m) const {
 		uint32_t max = max_ * (max_ == 0xffffffff ? 1 : m);
 		uint32_t n = n_ * (n_ == 0xffffffff ? 1 : m);
-		return new NGoodHitSinkPerThread(sink_, n, max);
+		return new NGoodHitSinkPerThread(sink_, local_, n, max);
 	}
 
 private:
-	HitSink& sink_;
 	uint32_t n_;
 	uint32_t max_;
 };
@@ -1272,10 +1496,11 @@ class NBestFirstStratHitSinkPerThread : public HitSinkPerThread {
 public:
 	NBestFirstStratHitSinkPerThread(
 			HitSink& sink,
+			HitSinkLocal& local,
 			uint32_t n,
 			uint32_t max,
 			uint32_t mult) :
-				HitSinkPerThread(sink, max, n),
+				HitSinkPerThread(sink, local, max, n),
 				bestStratum_(999), mult_(mult)
 	{ }
 
@@ -1372,7 +1597,7 @@ public:
 			HitSink& sink,
 			uint32_t n,
 			uint32_t max) :
-			sink_(sink),
+			HitSinkPerThreadFactory(sink),
 			n_(n),
 			max_(max)
 	{ }
@@ -1382,16 +1607,15 @@ public:
 	 * using the parameters given in the constructor.
 	 */
 	virtual HitSinkPerThread* create() const {
-		return new NBestFirstStratHitSinkPerThread(sink_, n_, max_, 1);
+		return new NBestFirstStratHitSinkPerThread(sink_, local_, n_, max_, 1);
 	}
 	virtual HitSinkPerThread* createMult(uint32_t m) const {
 		uint32_t max = max_ * (max_ == 0xffffffff ? 1 : m);
 		uint32_t n = n_ * (n_ == 0xffffffff ? 1 : m);
-		return new NBestFirstStratHitSinkPerThread(sink_, n, max, m);
+		return new NBestFirstStratHitSinkPerThread(sink_, local_, n, max, m);
 	}
 
 private:
-	HitSink& sink_;
 	uint32_t n_;
 	uint32_t max_;
 };
@@ -1404,8 +1628,9 @@ class AllHitSinkPerThread : public HitSinkPerThread {
 public:
 	AllHitSinkPerThread(
 			HitSink& sink,
+			HitSinkLocal& local,
 	        uint32_t max) :
-		    HitSinkPerThread(sink, max, 0xffffffff) { }
+		    HitSinkPerThread(sink, local, max, 0xffffffff) { }
 
 	virtual bool spanStrata() {
 		return true; // we span strata
@@ -1452,7 +1677,7 @@ public:
 	AllHitSinkPerThreadFactory(
 			HitSink& sink,
 			uint32_t max) :
-			sink_(sink),
+			HitSinkPerThreadFactory(sink),
 			max_(max)
 	{ }
 
@@ -1461,15 +1686,14 @@ public:
 	 * using the parameters given in the constructor.
 	 */
 	virtual HitSinkPerThread* create() const {
-		return new AllHitSinkPerThread(sink_, max_);
+		return new AllHitSinkPerThread(sink_, local_, max_);
 	}
 	virtual HitSinkPerThread* createMult(uint32_t m) const {
 		uint32_t max = max_ * (max_ == 0xffffffff ? 1 : m);
-		return new AllHitSinkPerThread(sink_, max);
+		return new AllHitSinkPerThread(sink_, local_, max);
 	}
 
 private:
-	HitSink& sink_;
 	uint32_t max_;
 };
 
@@ -1532,13 +1756,10 @@ protected:
 	/**
 	 * Report a concise alignment to the appropriate output stream.
 	 */
-	virtual void reportHit(const Hit& h) {
-		HitSink::reportHit(h);
-		ostringstream ss;
-		append(ss, h);
-		lock(h.h.first);
-		out(h.h.first).writeString(ss.str());
-		unlock(h.h.first);
+	virtual void reportHit(const Hit& h, HitSinkLocal& l) {
+		HitSink::reportHit(h, l);
+		HitSink::append(localBuf(l, h.h.first), h);
+		maybeFlush(l);
 	}
 
 private:
@@ -1566,6 +1787,60 @@ inline void printUptoWs(std::ostream& os, const std::string& str, bool ws) {
 	}
 }
 
+/**
+ * Append the given string to 'o'.  If ws = true, append only up to and
+ * not including the first space or tab.
+ */
+inline void appendUptoWs(StrBuf& o, const std::string& str, bool ws) {
+	size_t len = str.length();
+	if(ws) {
+		const char *p = str.data();
+		for(size_t i = 0; i < len; i++) {
+			if(p[i] == ' ' || p[i] == '\t') {
+				len = i;
+				break;
+			}
+		}
+	}
+	o.append(str.data(), len);
+}
+
+/**
+ * Append the name of reference 'refIdx' to 'o', the same way
+ * VerboseHitSink and SAMHitSink have always printed it.
+ */
+inline void appendRefName(StrBuf& o,
+                          TIndexOffU refIdx,
+                          const vector<string>* refnames,
+                          ReferenceMap *rmap,
+                          bool fullRef)
+{
+	if(refnames != NULL && rmap != NULL) {
+		appendUptoWs(o, rmap->getName(refIdx), !fullRef);
+	} else if(refnames != NULL && refIdx < refnames->size()) {
+		appendUptoWs(o, (*refnames)[refIdx], !fullRef);
+	} else {
+		o.appendNum(refIdx);
+	}
+}
+
+/**
+ * Append a nucleotide sequence to 'o' as letters.
+ */
+inline void appendSeq(StrBuf& o, const String<Dna5>& seq) {
+	size_t len = seqan::length(seq);
+	for(size_t i = 0; i < len; i++) {
+		o.append("ACGTN"[(int)seq[i]]);
+	}
+}
+
+/**
+ * Append a character string to 'o'.
+ */
+inline void appendStr(StrBuf& o, const String<char>& str) {
+	o.append(seqan::begin(str), seqan::length(str));
+}
+
 /**
  * Sink that prints lines like this:
  * pat-name \t [-|+] \t ref-name \t ref-off \t pat \t qual \t #-alt-hits \t mm-list
@@ -1625,7 +1900,7 @@ public:
 	{ }
 
 	// In hit.cpp
-	static void append(ostream& ss,
+	static void append(StrBuf& o,
 	                   const Hit& h,
 	                   const vector<string>* refnames,
 	                   ReferenceMap *rmap,
@@ -1642,17 +1917,26 @@ public:
 	 * Append a verbose, readable hit to the output stream
 	 * corresponding to the hit.
 	 */
-	virtual void append(ostream& ss, const Hit& h) {
-		VerboseHitSink::append(ss, h, _refnames, rmap_, amap_,
+	virtual void append(StrBuf& o, const Hit& h) {
+		VerboseHitSink::append(o, h, _refnames, rmap_, amap_,
 		                       fullRef_, partition_, offBase_,
 		                       colorSeq_, colorQual_, cost_,
 		                       suppress_);
 	}
 
+	/**
+	 * Append a verbose, readable hit to the given output stream.
+	 */
+	virtual void append(ostream& ss, const Hit& h) {
+		StrBuf o;
+		append(o, h);
+		ss.write(o.ptr(), o.length());
+	}
+
 	/**
 	 * See hit.cpp
 	 */
-	virtual void reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p);
+	virtual void reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p, HitSinkLocal& l);
 
 protected:
 
@@ -1660,22 +1944,18 @@ protected:
 	 * Report a verbose, human-readable alignment to the appropriate
 	 * output stream.
 	 */
-	virtual void reportHit(const Hit& h) {
-		reportHit(h, true);
+	virtual void reportHit(const Hit& h, HitSinkLocal& l) {
+		reportHit(h, true, l);
 	}
 
 	/**
 	 * Report a verbose, human-readable alignment to the appropriate
 	 * output stream.
 	 */
-	virtual void reportHit(const Hit& h, bool count) {
-		if(count) HitSink::reportHit(h);
-		ostringstream ss;
-		append(ss, h);
-		// Make sure to grab lock before writing to output stream
-		lock(h.h.first);
-		out(h.h.first).writeString(ss.str());
-		unlock(h.h.first);
+	virtual void reportHit(const Hit& h, bool count, HitSinkLocal& l) {
+		if(count) HitSink::reportHit(h, l);
+		append(localBuf(l, h.h.first), h);
+		maybeFlush(l);
 	}
 
 private:
@@ -1697,7 +1977,7 @@ private:
  */
 class StubHitSink : public HitSink {
 public:
-	StubHitSink() : HitSink(new OutFileBuf(".tmp"), "", "", "", false, false, NULL) { }
+	StubHitSink() : HitSink(new OutFileBuf(".tmp"), "", "", "", 0, false, false, NULL) { }
 	virtual void append(ostream& o, const Hit& h) { }
 };
 
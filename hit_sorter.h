@@ -0,0 +1,374 @@
+/*
+ * hit_sorter.h
+ *
+ * External merge sort of output records by reference position, used
+ * to write coordinate-sorted SAM/BAM (see --sorted).
+ */
+
+#ifndef HIT_SORTER_H_
+#define HIT_SORTER_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+#ifdef _WIN32
+# include <process.h>
+# define getpid _getpid
+#else
+# include <unistd.h>
+#endif
+#include "assert_helpers.h"
+#include "threading.h"
+#include "filebuf.h"
+#include "strbuf.h"
+
+/**
+ * Sort key and location of one formatted record in a thread's output
+ * buffer.  Unaligned reads have ref = 0xffffffff so that they sort
+ * after every alignment, as SAM requires.  Ties are broken by read id
+ * and then by the order the records were made in, so the sorted
+ * output doesn't depend on the number of threads.
+ */
+struct SortRec {
+	uint32_t ref;   /// reference index
+	uint32_t off;   /// 0-based offset into reference
+	uint64_t patid; /// read id
+	uint32_t start; /// offset of record in the buffer
+	uint32_t len;   /// length of record
+
+	bool operator<(const SortRec& o) const {
+		if(ref != o.ref) return ref < o.ref;
+		if(off != o.off) return off < o.off;
+		if(patid != o.patid) return patid < o.patid;
+		return start < o.start;
+	}
+};
+
+/**
+ * Collects output records from the search threads and writes them to
+ * the output stream sorted by reference position.
+ *
+ * Each thread formats records into its own buffer as usual, noting a
+ * SortRec for each.  When a thread's buffer reaches its share of the
+ * memory limit, or the thread finishes, the buffer is sorted and
+ * handed over as a run.  The sorter keeps runs in memory while they
+ * fit in its half of the limit.  A run that doesn't fit is spilled to
+ * a temporary run file, which stores each record as its key (ref, off,
+ * patid), its length and its bytes.  At the end the in-memory runs and
+ * any run files are k-way merged into the output stream; if there are
+ * more run files than can be merged at once, groups of them are first
+ * merged into longer run files.  Output that fits in the limit is
+ * sorted without touching the disk.
+ */
+class HitSorter {
+
+	/// A sorted run held in memory
+	struct MemRun {
+		StrBuf buf;                /// records, in the order formatted
+		std::vector<SortRec> recs; /// their keys, sorted
+		uint64_t seq;              /// order in which the run was made
+	};
+
+	/// A sorted run spilled to a file
+	struct FileRun {
+		std::string name;
+		uint64_t seq; /// order in which the run was made
+	};
+
+	/// Head record of one run during a merge
+	struct RunHead {
+		uint32_t ref;
+		uint32_t off;
+		uint64_t patid;
+		uint64_t seq;      /// order of run, to break ties
+		size_t   run;      /// index of run among those being merged
+		const char *data;  /// record bytes
+		uint32_t len;      /// # record bytes
+		std::string rec;   /// holds the record, for file runs
+	};
+
+	/// Orders a priority_queue of RunHead* smallest-first
+	struct HeadGreater {
+		bool operator()(const RunHead* a, const RunHead* b) const {
+			if(a->ref != b->ref) return a->ref > b->ref;
+			if(a->off != b->off) return a->off > b->off;
+			if(a->patid != b->patid) return a->patid > b->patid;
+			return a->seq > b->seq;
+		}
+	};
+
+public:
+
+	/// Most runs merged at once, to stay clear of open-file limits
+	static const size_t MAX_FANIN = 256;
+
+	/// Most bytes a thread buffers, so that SortRec offsets fit
+	static const size_t MAX_THREAD_MEM = 1u << 31;
+
+	/**
+	 * 'memBytes' is the memory allowed for holding records.  Half of
+	 * it is split evenly among 'nthreads' threads' buffers and the
+	 * other half holds sorted runs; run files are made in 'tmpDir'.
+	 */
+	HitSorter(size_t memBytes, int nthreads, const std::string& tmpDir) :
+		threadMem_(std::min<size_t>(std::max<size_t>(memBytes / 2 / (nthreads > 0 ? nthreads : 1), 64 * 1024), (size_t)MAX_THREAD_MEM)),
+		runMem_(memBytes / 2),
+		memBytes_(memBytes),
+		tmpDir_(tmpDir),
+		nextRun_(0),
+		nextSeq_(0),
+		heldBytes_(0),
+		merged_(false),
+		records_(0),
+		memRuns_(0),
+		spills_(0),
+		bytesSpilled_(0),
+		passes_(0)
+	{ }
+
+	~HitSorter() {
+		for(size_t i = 0; i < runs_.size(); i++) {
+			remove(runs_[i].name.c_str());
+		}
+		for(size_t i = 0; i < mems_.size(); i++) {
+			delete mems_[i];
+		}
+	}
+
+	/**
+	 * Return true iff a thread holding 'buf' and 'recs' should hand
+	 * them over with spill().  StrBuf and vector grow by doubling, so
+	 * the memory they hold is checked against half the thread's share.
+	 */
+	bool full(const StrBuf& buf, const std::vector<SortRec>& recs) const {
+		return buf.capacity() + recs.capacity() * sizeof(SortRec) >= threadMem_ / 2;
+	}
+
+	/**
+	 * Take a thread's buffered records, and the storage holding them,
+	 * as a new sorted run, leaving the thread's buffers empty.  The run
+	 * is kept in memory if it fits in what's left of the runs' half of
+	 * the memory limit, and otherwise written to a run file.  Threads
+	 * sort and write runs concurrently; only the lists of runs are
+	 * locked.
+	 */
+	void spill(StrBuf& buf, std::vector<SortRec>& recs) {
+		if(recs.empty()) {
+			buf.clear();
+			return;
+		}
+		MemRun *m = new MemRun();
+		m->buf.take(buf);
+		m->recs.swap(recs);
+		std::sort(m->recs.begin(), m->recs.end());
+		size_t bytes = m->buf.capacity() + m->recs.capacity() * sizeof(SortRec);
+		{
+			GUARD_LOCK(lock_);
+			m->seq = nextSeq_++;
+			records_ += m->recs.size();
+			if(heldBytes_ + bytes <= runMem_) {
+				heldBytes_ += bytes;
+				mems_.push_back(m);
+				memRuns_++;
+				return;
+			}
+		}
+		FileRun f;
+		f.name = newRunName();
+		f.seq = m->seq;
+		{
+			OutFileBuf run(f.name.c_str(), true);
+			for(size_t i = 0; i < m->recs.size(); i++) {
+				const SortRec& r = m->recs[i];
+				writeKey(run, r.ref, r.off, r.patid, r.len);
+				run.writeChars(m->buf.ptr() + r.start, r.len);
+			}
+			run.close();
+		}
+		GUARD_LOCK(lock_);
+		runs_.push_back(f);
+		spills_++;
+		bytesSpilled_ += m->buf.length();
+		delete m;
+	}
+
+	/**
+	 * Merge all runs into 'out' and delete them.  Called once every
+	 * thread has handed over its last records; later calls do nothing.
+	 */
+	void merge(OutFileBuf& out) {
+		if(merged_) return;
+		merged_ = true;
+		std::vector<MemRun*> noMems;
+		while(runs_.size() > MAX_FANIN) {
+			// Merge the oldest run files into one longer run file,
+			// which takes the place of the oldest in tie-breaking
+			std::vector<FileRun> group(runs_.begin(), runs_.begin() + MAX_FANIN);
+			runs_.erase(runs_.begin(), runs_.begin() + MAX_FANIN);
+			FileRun f;
+			f.name = newRunName();
+			f.seq = group[0].seq;
+			{
+				OutFileBuf run(f.name.c_str(), true);
+				mergeRuns(group, noMems, run, true);
+				run.close();
+			}
+			runs_.push_back(f);
+			passes_++;
+		}
+		mergeRuns(runs_, mems_, out, false);
+		runs_.clear();
+		for(size_t i = 0; i < mems_.size(); i++) {
+			delete mems_[i];
+		}
+		mems_.clear();
+		heldBytes_ = 0;
+	}
+
+	/**
+	 * Print how many records were sorted and how many runs and merge
+	 * passes it took.
+	 */
+	void printStats(std::ostream& os) const {
+		os << "Sorted output:" << std::endl
+		   << "  records: " << records_ << std::endl
+		   << "  runs kept in memory: " << memRuns_ << std::endl
+		   << "  runs spilled to disk: " << spills_ << " (" << (bytesSpilled_ >> 20)
+		   << " MB, " << (threadMem_ >> 20) << " MB per thread)" << std::endl
+		   << "  intermediate merge passes: " << passes_ << std::endl;
+	}
+
+private:
+
+	std::string newRunName() {
+		GUARD_LOCK(lock_);
+		char suffix[64];
+		snprintf(suffix, sizeof(suffix), "/bowtie-sort.%d.%u", (int)getpid(), (unsigned)nextRun_++);
+		return tmpDir_ + suffix;
+	}
+
+	static void writeKey(OutFileBuf& run, uint32_t ref, uint32_t off, uint64_t patid, uint32_t len) {
+		run.writeChars((const char*)&ref, 4);
+		run.writeChars((const char*)&off, 4);
+		run.writeChars((const char*)&patid, 8);
+		run.writeChars((const char*)&len, 4);
+	}
+
+	/**
+	 * Read the next record of a run file into h; return false at the
+	 * end of the run.
+	 */
+	static bool readHead(FileBuf& fb, RunHead& h, const std::string& name) {
+		uint32_t len = 0;
+		if(fb.get((char*)&h.ref, 4) == 0) return false;
+		if(fb.get((char*)&h.off, 4) != 4 ||
+		   fb.get((char*)&h.patid, 8) != 8 ||
+		   fb.get((char*)&len, 4) != 4)
+		{
+			truncated(name);
+		}
+		h.rec.resize(len);
+		if(len > 0 && fb.get(&h.rec[0], len) != len) truncated(name);
+		h.data = h.rec.data();
+		h.len = len;
+		return true;
+	}
+
+	/**
+	 * Point h at record i of an in-memory run; return false if the run
+	 * has no record i.
+	 */
+	static bool memHead(const MemRun& m, size_t i, RunHead& h) {
+		if(i == m.recs.size()) return false;
+		const SortRec& r = m.recs[i];
+		h.ref = r.ref;
+		h.off = r.off;
+		h.patid = r.patid;
+		h.data = m.buf.ptr() + r.start;
+		h.len = r.len;
+		return true;
+	}
+
+	static void truncated(const std::string& name) {
+		std::cerr << "Error: sort run file " << name << " is truncated" << std::endl;
+		throw 1;
+	}
+
+	/**
+	 * Merge the given run files and in-memory runs into 'out', keeping
+	 * the keys if 'keys' is set (i.e. if 'out' is itself a run file),
+	 * then delete the files.
+	 */
+	void mergeRuns(const std::vector<FileRun>& files, const std::vector<MemRun*>& mems,
+	               OutFileBuf& out, bool keys)
+	{
+		size_t nf = files.size();
+		size_t n = nf + mems.size();
+		if(n == 0) return;
+		// Share about a quarter of the memory limit among input buffers
+		size_t bufSz = 16 * 1024;
+		if(nf > 0) {
+			bufSz = std::max<size_t>(std::min<size_t>(memBytes_ / 4 / nf, 1024 * 1024), 16 * 1024);
+		}
+		std::vector<FileBuf*> bufs(nf, NULL);
+		std::vector<size_t> next(n, 0); /// for in-memory runs, index of head record
+		std::vector<RunHead> heads(n);
+		std::priority_queue<RunHead*, std::vector<RunHead*>, HeadGreater> q;
+		for(size_t i = 0; i < nf; i++) {
+			FILE *f = fopen(files[i].name.c_str(), "rb");
+			if(f == NULL) {
+				std::cerr << "Error: could not open sort run file " << files[i].name << std::endl;
+				throw 1;
+			}
+			bufs[i] = new FileBuf(f);
+			bufs[i]->setBufSize(bufSz);
+			heads[i].run = i;
+			heads[i].seq = files[i].seq;
+			if(readHead(*bufs[i], heads[i], files[i].name)) q.push(&heads[i]);
+		}
+		for(size_t i = nf; i < n; i++) {
+			heads[i].run = i;
+			heads[i].seq = mems[i - nf]->seq;
+			if(memHead(*mems[i - nf], 0, heads[i])) q.push(&heads[i]);
+		}
+		while(!q.empty()) {
+			RunHead *h = q.top();
+			q.pop();
+			if(keys) writeKey(out, h->ref, h->off, h->patid, h->len);
+			out.writeChars(h->data, h->len);
+			size_t r = h->run;
+			bool more = (r < nf) ? readHead(*bufs[r], *h, files[r].name)
+			                     : memHead(*mems[r - nf], ++next[r], *h);
+			if(more) q.push(h);
+		}
+		for(size_t i = 0; i < nf; i++) {
+			bufs[i]->close();
+			delete bufs[i];
+			remove(files[i].name.c_str());
+		}
+	}
+
+	size_t threadMem_;      /// memory a thread's buffers may hold
+	size_t runMem_;         /// memory in-memory runs may hold
+	size_t memBytes_;       /// overall memory limit
+	std::string tmpDir_;    /// directory for run files
+	std::vector<FileRun> runs_; /// run files not yet merged
+	std::vector<MemRun*> mems_; /// in-memory runs not yet merged
+	uint32_t nextRun_;      /// # run files named so far
+	uint64_t nextSeq_;      /// # runs made so far
+	size_t heldBytes_;      /// memory held by mems_
+	bool merged_;           /// true -> merge() already ran
+	MUTEX_T lock_;          /// guards runs_, mems_, nextRun_, nextSeq_, heldBytes_ and counters
+
+	uint64_t records_;      /// # records handed over
+	uint64_t memRuns_;      /// # runs kept in memory
+	uint64_t spills_;       /// # runs spilled by threads
+	uint64_t bytesSpilled_; /// # bytes of records spilled
+	uint64_t passes_;       /// # intermediate merges
+};
+
+#endif /* HIT_SORTER_H_ */
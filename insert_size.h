@@ -0,0 +1,163 @@
+/*
+ * insert_size.h
+ *
+ * Learning the insert-size distribution of a paired-end library from
+ * the first confidently paired alignments, so that searches for the
+ * opposite mate can try the likely part of the -I/-X window first (see
+ * --learn-ins).
+ */
+
+#ifndef INSERT_SIZE_H_
+#define INSERT_SIZE_H_
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include "assert_helpers.h"
+#include "threading.h"
+
+/**
+ * Counts kept by each paired aligner and added to the model's totals
+ * when the aligner is destroyed, so searching needn't take a lock.
+ */
+struct InsertSearchStats {
+	InsertSearchStats() : narrowed(0), narrowHits(0), wideHits(0) { }
+	uint64_t narrowed;   /// # mate searches that tried the learned window first
+	uint64_t narrowHits; /// # of those that found the mate in that window
+	uint64_t wideHits;   /// # of those that found it only after widening
+};
+
+/**
+ * Collects the insert sizes of the first SAMPLES confidently paired
+ * alignments (the anchor mate aligned to just one place and the
+ * opposite mate was found near it).  Once it has them, it fixes a
+ * window of likely insert sizes: the interquartile range widened by
+ * 3 IQRs on either side, or by MIN_PAD if that's wider, which for a
+ * roughly normal library keeps every insert within about 4.7 standard
+ * deviations of the mean.
+ *
+ * Mate searches started after that search the part of the -I/-X
+ * window allowed by the learned window first and only search the rest
+ * if the mate isn't there, so pairs are never lost, but the mate
+ * found, when there is more than one candidate, may differ from the
+ * one found without --learn-ins.  With -p, which pairs end up in the
+ * sample depends on thread timing.
+ */
+class InsertSizeModel {
+
+public:
+
+	/// # confident pairs to learn from
+	static const size_t SAMPLES = 1000;
+
+	/// Least padding on either side of the interquartile range
+	static const uint32_t MIN_PAD = 10;
+
+	InsertSizeModel() :
+		enabled_(false), learned_(false), med_(0), lo_(0), hi_(0) { }
+
+	/**
+	 * Forget everything learned and turn learning on or off.
+	 */
+	void reset(bool enable) {
+		GUARD_LOCK(lock_);
+		enabled_ = enable;
+		learned_ = false;
+		samples_.clear();
+		med_ = lo_ = hi_ = 0;
+		tot_ = InsertSearchStats();
+	}
+
+	bool enabled() const { return enabled_; }
+
+	/**
+	 * True once the window has been learned, after which samples are
+	 * no longer wanted.
+	 */
+	bool learned() const { return learned_; }
+
+	/**
+	 * Add the insert size of a confidently paired alignment.
+	 */
+	void add(uint32_t ins) {
+		if(!enabled_ || learned_) return;
+		GUARD_LOCK(lock_);
+		if(learned_) return;
+		samples_.push_back(ins);
+		if(samples_.size() < SAMPLES) return;
+		std::sort(samples_.begin(), samples_.end());
+		size_t n = samples_.size();
+		uint32_t q1 = samples_[n / 4];
+		uint32_t q3 = samples_[(3 * n) / 4];
+		med_ = samples_[n / 2];
+		uint32_t pad = 3 * (q3 - q1);
+		if(pad < MIN_PAD) pad = MIN_PAD;
+		lo_ = (q1 > pad) ? (q1 - pad) : 0;
+		hi_ = q3 + pad;
+		std::vector<uint32_t>().swap(samples_);
+		learned_ = true;
+	}
+
+	/**
+	 * If the window has been learned, set lo and hi to its bounds and
+	 * return true.
+	 */
+	bool window(uint32_t& lo, uint32_t& hi) const {
+		if(!learned_) return false;
+		lo = lo_;
+		hi = hi_;
+		return true;
+	}
+
+	/**
+	 * Add one aligner's counts to the totals.
+	 */
+	void addStats(const InsertSearchStats& s) {
+		if(!enabled_) return;
+		GUARD_LOCK(lock_);
+		tot_.narrowed   += s.narrowed;
+		tot_.narrowHits += s.narrowHits;
+		tot_.wideHits   += s.wideHits;
+	}
+
+	/**
+	 * Print the learned window and how often mates were found in it.
+	 */
+	void printStats(std::ostream& os) const {
+		if(!enabled_) return;
+		if(!learned_) {
+			os << "Insert size: not learned; only " << samples_.size()
+			   << " of " << SAMPLES << " confidently paired alignments found" << std::endl;
+			return;
+		}
+		os << "Insert size: median " << med_ << ", window " << lo_ << "-" << hi_
+		   << " (learned from " << SAMPLES << " pairs)" << std::endl;
+		os << "  mate searches in window first: " << tot_.narrowed << std::endl;
+		if(tot_.narrowed > 0) {
+			os << "  mate found in window: " << tot_.narrowHits << " ("
+			   << (100.0 * tot_.narrowHits / tot_.narrowed) << "%)" << std::endl;
+		}
+		os << "  mate found after widening: " << tot_.wideHits << std::endl;
+	}
+
+private:
+
+	bool enabled_;
+	volatile bool learned_;
+	std::vector<uint32_t> samples_; /// insert sizes collected so far
+	volatile uint32_t med_;         /// median of the samples
+	volatile uint32_t lo_, hi_;     /// learned window
+	InsertSearchStats tot_;         /// counts from all aligners
+	MUTEX_T lock_;                  /// guards samples_ and tot_
+};
+
+/**
+ * The process-wide insert-size model.
+ */
+inline InsertSizeModel& gInsertModel() {
+	static InsertSizeModel m;
+	return m;
+}
+
+#endif /* INSERT_SIZE_H_ */
@@ -42,12 +42,9 @@ int parseQuals(ReadBuf& r,
 					assert_eq(num, 0);
 				} else {
 					if(!isdigit(c)) {
-						char buf[2048];
 						cerr << "Warning: could not parse quality line:" << endl;
 						fb.getPastNewline();
-						cerr << fb.copyLastN(buf);
-						buf[2047] = '\0';
-						cerr << buf;
+						cerr.write(fb.lastN(), fb.lastNLen());
 						throw 1;
 					}
 					assert(isdigit(c));
@@ -59,6 +56,7 @@ int parseQuals(ReadBuf& r,
 			if(neg) num = 0;
 			// Phred-33 ASCII encode it and add it to the back of the
 			// quality string
+			r.ensureCap(qualsRead + 1);
 			r.qualBuf[qualsRead++] = ('!' + num);
 			// Skip over next stretch of whitespace
 			c = fb.peek();
@@ -70,6 +68,7 @@ int parseQuals(ReadBuf& r,
 	} else {
 		while (c != '\r' && c != '\n' && c != -1) {
 			c = fb.get();
+			r.ensureCap(qualsRead + 1);
 			r.qualBuf[qualsRead++] = charToPhred33(c, solexa64, phred64);
 			c = fb.peek();
 			while(c != '\r' && c != '\n' && isspace(c) && !fb.eof()) {
@@ -113,13 +112,13 @@ void tooFewQualities(const String<char>& read_name) {
 }
 
 void tooManyQualities(const String<char>& read_name) {
-	cerr << "Reads file contained a pattern with more than 1024 quality values." << endl
+	cerr << "Reads file contained a pattern with more than " << ReadBuf::MAX_LEN << " quality values." << endl
 		 << "Please truncate reads and quality values and and re-run Bowtie" << endl;
 	throw 1;
 }
 
 void tooManySeqChars(const String<char>& read_name) {
-	cerr << "Reads file contained a pattern with more than 1024 sequence characters." << endl
+	cerr << "Reads file contained a pattern with more than " << ReadBuf::MAX_LEN << " sequence characters." << endl
 		 << "Please truncate reads and quality values and and re-run Bowtie." << endl
 		 << "Offending read: " << read_name << endl;
 	throw 1;
@@ -16,6 +16,8 @@
 #include "random_source.h"
 #include "threading.h"
 #include "filebuf.h"
+#include "bgzf.h"
+#include "reorder.h"
 #include "qual.h"
 #include "hit_set.h"
 #include "search_globals.h"
@@ -77,7 +79,21 @@ static inline uint32_t genRandSeed(const String<Dna5>& qry,
  * Each search thread has one.
  */
 struct ReadBuf {
-	ReadBuf() { reset(); }
+	ReadBuf() :
+		patBufFw(NULL), patBufRc(NULL), qualBuf(NULL),
+		patBufFwRev(NULL), patBufRcRev(NULL), qualBufRev(NULL),
+		arena(NULL), cap(0),
+		readOrigBuf(NULL), readOrigBufCap(0),
+		qualOrigBuf(NULL), qualOrigBufCap(0),
+		nameBuf(NULL), nameCap(0)
+	{
+		for(int j = 0; j < 3; j++) {
+			altPatBufFw[j] = altPatBufRc[j] = NULL;
+			altPatBufFwRev[j] = altPatBufRcRev[j] = NULL;
+			altQualBuf[j] = altQualBufRev[j] = NULL;
+		}
+		reset();
+	}
 
 	~ReadBuf() {
 		clearAll(); reset();
@@ -97,10 +113,14 @@ struct ReadBuf {
 			_setBegin(altQual[j], NULL);
 			_setBegin(altQualRev[j], NULL);
 		}
+		delete[] arena;
+		delete[] nameBuf;
+		delete[] readOrigBuf;
+		delete[] qualOrigBuf;
 	}
 
-#define RESET_BUF(str, buf, typ) _setBegin(str, (typ*)buf); _setLength(str, 0); _setCapacity(str, BUF_SIZE);
-#define RESET_BUF_LEN(str, buf, len, typ) _setBegin(str, (typ*)buf); _setLength(str, len); _setCapacity(str, BUF_SIZE);
+#define RESET_BUF(str, buf, typ) _setBegin(str, (typ*)buf); _setLength(str, 0); _setCapacity(str, cap);
+#define RESET_BUF_LEN(str, buf, len, typ) _setBegin(str, (typ*)buf); _setLength(str, len); _setCapacity(str, cap);
 
 	/// Point all Strings to the beginning of their respective buffers
 	/// and set all lengths to 0
@@ -115,13 +135,14 @@ struct ReadBuf {
 		primer = '?';
 		trimc = '?';
 		seed = 0;
+		clearDerived();
 		RESET_BUF(patFw, patBufFw, Dna5);
 		RESET_BUF(patRc, patBufRc, Dna5);
 		RESET_BUF(qual, qualBuf, char);
 		RESET_BUF(patFwRev, patBufFwRev, Dna5);
 		RESET_BUF(patRcRev, patBufRcRev, Dna5);
 		RESET_BUF(qualRev, qualBufRev, char);
-		RESET_BUF(name, nameBuf, char);
+		_setBegin(name, nameBuf); _setLength(name, 0); _setCapacity(name, nameCap);
 		for(int j = 0; j < 3; j++) {
 			RESET_BUF(altPatFw[j], altPatBufFw[j], Dna5);
 			RESET_BUF(altPatFwRev[j], altPatBufFwRev[j], Dna5);
@@ -155,6 +176,52 @@ struct ReadBuf {
 		primer = '?';
 		trimc = '?';
 		seed = 0;
+		clearDerived();
+	}
+
+	/**
+	 * Make sure every sequence and quality buffer can hold at least
+	 * 'len' characters.  Parsers call this before writing into the
+	 * buffers, so that the arena only ever grows to the length of the
+	 * longest read seen by this ReadBuf.
+	 */
+	void ensureCap(size_t len) {
+		if(len > cap) growArena(len);
+	}
+
+	/**
+	 * Make sure nameBuf can hold at least 'len' characters.
+	 */
+	void ensureNameCap(size_t len) {
+		if(len > nameCap) {
+			size_t namelen = seqan::length(name);
+			growBuf(nameBuf, nameCap, len, nameCap);
+			_setBegin(name, nameBuf);
+			_setLength(name, namelen);
+			_setCapacity(name, nameCap);
+		}
+	}
+
+	/**
+	 * Copy the text of the record most recently dispensed by 'fb'
+	 * into readOrigBuf.
+	 */
+	void copyReadOrig(FileBuf& fb) {
+		if(fb.lastNLen() > readOrigBufCap) {
+			growBuf(readOrigBuf, readOrigBufCap, fb.lastNLen(), 0);
+		}
+		readOrigBufLen = fb.copyLastN(readOrigBuf);
+	}
+
+	/**
+	 * Copy the text of the record most recently dispensed by 'fb'
+	 * into qualOrigBuf.
+	 */
+	void copyQualOrig(FileBuf& fb) {
+		if(fb.lastNLen() > qualOrigBufCap) {
+			growBuf(qualOrigBuf, qualOrigBufCap, fb.lastNLen(), 0);
+		}
+		qualOrigBufLen = fb.copyLastN(qualOrigBuf);
 	}
 
 	/// Return true iff the read (pair) is empty
@@ -198,33 +265,92 @@ struct ReadBuf {
 				}
 			}
 		}
+		builtRc = true;
 	}
 
 	/**
-	 * Given patFw, patRc, and qual, construct the *Rev versions in
-	 * place.  Assumes constructRevComps() was called previously.
+	 * Given patFw, construct patFwRev and the reversed fuzzy
+	 * alternatives in place.
 	 */
-	void constructReverses() {
+	void constructFwReverse() {
 		uint32_t len = length();
 		assert_gt(len, 0);
 		RESET_BUF_LEN(patFwRev, patBufFwRev, len, Dna5);
-		RESET_BUF_LEN(patRcRev, patBufRcRev, len, Dna5);
-		RESET_BUF_LEN(qualRev, qualBufRev, len, char);
 		for(int j = 0; j < alts; j++) {
 			RESET_BUF_LEN(altPatFwRev[j], altPatBufFwRev[j], len, Dna5);
+		}
+		for(uint32_t i = 0; i < len; i++) {
+			patBufFwRev[i] = patBufFw[len-i-1];
+			for(int j = 0; j < alts; j++) {
+				altPatBufFwRev[j][i] = altPatBufFw[j][len-i-1];
+			}
+		}
+		builtFwRev = true;
+	}
+
+	/**
+	 * Given patRc, construct patRcRev and the reversed fuzzy
+	 * alternatives in place.  Constructs patRc first if necessary.
+	 */
+	void constructRcReverse() {
+		if(!builtRc) constructRevComps();
+		uint32_t len = length();
+		assert_gt(len, 0);
+		RESET_BUF_LEN(patRcRev, patBufRcRev, len, Dna5);
+		for(int j = 0; j < alts; j++) {
 			RESET_BUF_LEN(altPatRcRev[j], altPatBufRcRev[j], len, Dna5);
+		}
+		for(uint32_t i = 0; i < len; i++) {
+			patBufRcRev[i] = patBufRc[len-i-1];
+			for(int j = 0; j < alts; j++) {
+				altPatBufRcRev[j][i] = altPatBufRc[j][len-i-1];
+			}
+		}
+		builtRcRev = true;
+	}
+
+	/**
+	 * Given qual, construct qualRev and the reversed fuzzy
+	 * alternative qualities in place.
+	 */
+	void constructQualReverse() {
+		uint32_t len = length();
+		assert_gt(len, 0);
+		RESET_BUF_LEN(qualRev, qualBufRev, len, char);
+		for(int j = 0; j < alts; j++) {
 			RESET_BUF_LEN(altQualRev[j], altQualBufRev[j], len, char);
 		}
 		for(uint32_t i = 0; i < len; i++) {
-			patFwRev[i]  = patFw[len-i-1];
-			patRcRev[i]  = patRc[len-i-1];
-			qualRev[i]   = qual[len-i-1];
+			qualRev[i] = qual[len-i-1];
 			for(int j = 0; j < alts; j++) {
-				altPatFwRev[j][i] = altPatFw[j][len-i-1];
-				altPatRcRev[j][i] = altPatRc[j][len-i-1];
-				altQualRev[j][i]  = altQual[j][len-i-1];
+				altQualRev[j][i] = altQual[j][len-i-1];
 			}
 		}
+		builtQualRev = true;
+	}
+
+	/**
+	 * Accessors for the reversed and reverse-complemented views of
+	 * the read.  Each view is constructed the first time it's asked
+	 * for, so orientations an aligner never visits (e.g. with
+	 * --nofw/--norc, or when the read is resolved in an early phase)
+	 * cost nothing.
+	 */
+	String<Dna5>& getPatRc()          { if(!builtRc)      constructRevComps();    return patRc;       }
+	String<Dna5>& getPatFwRev()       { if(!builtFwRev)   constructFwReverse();   return patFwRev;    }
+	String<Dna5>& getPatRcRev()       { if(!builtRcRev)   constructRcReverse();   return patRcRev;    }
+	String<char>& getQualRev()        { if(!builtQualRev) constructQualReverse(); return qualRev;     }
+	String<Dna5>* getAltPatRc()       { if(!builtRc)      constructRevComps();    return altPatRc;    }
+	String<Dna5>* getAltPatFwRev()    { if(!builtFwRev)   constructFwReverse();   return altPatFwRev; }
+	String<Dna5>* getAltPatRcRev()    { if(!builtRcRev)   constructRcReverse();   return altPatRcRev; }
+	String<char>* getAltQualRev()     { if(!builtQualRev) constructQualReverse(); return altQualRev;  }
+
+	/**
+	 * Forget any reversed or reverse-complemented views built for the
+	 * previous contents of this buffer.
+	 */
+	void clearDerived() {
+		builtRc = builtFwRev = builtRcRev = builtQualRev = false;
 	}
 
 	/**
@@ -252,7 +378,7 @@ struct ReadBuf {
 			}
 		}
 		if(append) {
-			assert_leq(namelen, BUF_SIZE-2);
+			ensureNameCap(namelen + 2);
 			_setLength(name, namelen + 2);
 			nameBuf[namelen] = '/';
 			nameBuf[namelen+1] = "012"[i];
@@ -317,46 +443,111 @@ struct ReadBuf {
 		}
 	}
 
-	static const int BUF_SIZE = 1024;
+	/**
+	 * Grow the arena so that each of its buffers holds at least 'len'
+	 * characters, carrying over the contents of the old buffers and
+	 * re-pointing the Strings at the new ones.
+	 */
+	void growArena(size_t len) {
+		size_t newCap = max<size_t>(len, cap << 1);
+		newCap = (newCap + 63) & ~((size_t)63);
+		char *newArena = new char[newCap * ARENA_BUFS];
+		char *p = newArena;
+#define ARENA_MOVE(str, buf, typ, btyp) { \
+	size_t l = seqan::length(str); \
+	if(cap > 0) memcpy(p, buf, cap); \
+	buf = (btyp*)p; p += newCap; \
+	_setBegin(str, (typ*)buf); _setLength(str, l); _setCapacity(str, newCap); \
+}
+		ARENA_MOVE(patFw, patBufFw, Dna5, uint8_t);
+		ARENA_MOVE(patRc, patBufRc, Dna5, uint8_t);
+		ARENA_MOVE(patFwRev, patBufFwRev, Dna5, uint8_t);
+		ARENA_MOVE(patRcRev, patBufRcRev, Dna5, uint8_t);
+		ARENA_MOVE(qual, qualBuf, char, char);
+		ARENA_MOVE(qualRev, qualBufRev, char, char);
+		for(int j = 0; j < 3; j++) {
+			ARENA_MOVE(altPatFw[j], altPatBufFw[j], Dna5, uint8_t);
+			ARENA_MOVE(altPatRc[j], altPatBufRc[j], Dna5, uint8_t);
+			ARENA_MOVE(altPatFwRev[j], altPatBufFwRev[j], Dna5, uint8_t);
+			ARENA_MOVE(altPatRcRev[j], altPatBufRcRev[j], Dna5, uint8_t);
+			ARENA_MOVE(altQual[j], altQualBuf[j], char, char);
+			ARENA_MOVE(altQualRev[j], altQualBufRev[j], char, char);
+		}
+#undef ARENA_MOVE
+		assert_eq(newArena + newCap * ARENA_BUFS, p);
+		delete[] arena;
+		arena = newArena;
+		cap = newCap;
+	}
+
+	/**
+	 * Grow a standalone character buffer to hold at least 'len'
+	 * characters, preserving the first 'keep' characters.
+	 */
+	static void growBuf(char*& buf, size_t& bufCap, size_t len, size_t keep) {
+		size_t newCap = max<size_t>(len, bufCap << 1);
+		newCap = (newCap + 63) & ~((size_t)63);
+		char *newBuf = new char[newCap];
+		if(keep > 0) memcpy(newBuf, buf, keep);
+		delete[] buf;
+		buf = newBuf;
+		bufCap = newCap;
+	}
+
+	/// Longest read the aligners can handle; Edit and Hit store
+	/// mismatch positions in 10 bits
+	static const size_t MAX_LEN = 1024;
+
+	/// Number of buffers carved out of the arena
+	static const size_t ARENA_BUFS = 24;
 
 	String<Dna5>  patFw;               // forward-strand sequence
-	uint8_t       patBufFw[BUF_SIZE];  // forward-strand sequence buffer
+	uint8_t      *patBufFw;            // forward-strand sequence buffer
 	String<Dna5>  patRc;               // reverse-complement sequence
-	uint8_t       patBufRc[BUF_SIZE];  // reverse-complement sequence buffer
+	uint8_t      *patBufRc;            // reverse-complement sequence buffer
 	String<char>  qual;                // quality values
-	char          qualBuf[BUF_SIZE];   // quality value buffer
-
-	String<Dna5>  altPatFw[3];              // forward-strand sequence
-	uint8_t       altPatBufFw[3][BUF_SIZE]; // forward-strand sequence buffer
-	String<Dna5>  altPatRc[3];              // reverse-complement sequence
-	uint8_t       altPatBufRc[3][BUF_SIZE]; // reverse-complement sequence buffer
-	String<char>  altQual[3];               // quality values for alternate basecalls
-	char          altQualBuf[3][BUF_SIZE];  // quality value buffer for alternate basecalls
-
-	String<Dna5>  patFwRev;               // forward-strand sequence reversed
-	uint8_t       patBufFwRev[BUF_SIZE];  // forward-strand sequence buffer reversed
-	String<Dna5>  patRcRev;               // reverse-complement sequence reversed
-	uint8_t       patBufRcRev[BUF_SIZE];  // reverse-complement sequence buffer reversed
-	String<char>  qualRev;                // quality values reversed
-	char          qualBufRev[BUF_SIZE];   // quality value buffer reversed
-
-	String<Dna5>  altPatFwRev[3];              // forward-strand sequence reversed
-	uint8_t       altPatBufFwRev[3][BUF_SIZE]; // forward-strand sequence buffer reversed
-	String<Dna5>  altPatRcRev[3];              // reverse-complement sequence reversed
-	uint8_t       altPatBufRcRev[3][BUF_SIZE]; // reverse-complement sequence buffer reversed
-	String<char>  altQualRev[3];              // quality values for alternate basecalls reversed
-	char          altQualBufRev[3][BUF_SIZE]; // quality value buffer for alternate basecalls reversed
+	char         *qualBuf;             // quality value buffer
+
+	String<Dna5>  altPatFw[3];         // forward-strand sequence
+	uint8_t      *altPatBufFw[3];      // forward-strand sequence buffer
+	String<Dna5>  altPatRc[3];         // reverse-complement sequence
+	uint8_t      *altPatBufRc[3];      // reverse-complement sequence buffer
+	String<char>  altQual[3];          // quality values for alternate basecalls
+	char         *altQualBuf[3];       // quality value buffer for alternate basecalls
+
+	String<Dna5>  patFwRev;            // forward-strand sequence reversed
+	uint8_t      *patBufFwRev;         // forward-strand sequence buffer reversed
+	String<Dna5>  patRcRev;            // reverse-complement sequence reversed
+	uint8_t      *patBufRcRev;         // reverse-complement sequence buffer reversed
+	String<char>  qualRev;             // quality values reversed
+	char         *qualBufRev;          // quality value buffer reversed
+
+	String<Dna5>  altPatFwRev[3];      // forward-strand sequence reversed
+	uint8_t      *altPatBufFwRev[3];   // forward-strand sequence buffer reversed
+	String<Dna5>  altPatRcRev[3];      // reverse-complement sequence reversed
+	uint8_t      *altPatBufRcRev[3];   // reverse-complement sequence buffer reversed
+	String<char>  altQualRev[3];       // quality values for alternate basecalls reversed
+	char         *altQualBufRev[3];    // quality value buffer for alternate basecalls reversed
+
+	// Backing store for all of the sequence and quality buffers above;
+	// ARENA_BUFS buffers of 'cap' characters each, laid out
+	// back-to-back so that short reads stay dense in cache
+	char         *arena;
+	size_t        cap;
 
 	// For remembering the exact input text used to define a read
-	char          readOrigBuf[FileBuf::LASTN_BUF_SZ];
+	char         *readOrigBuf;
 	size_t        readOrigBufLen;
+	size_t        readOrigBufCap;
 
 	// For when qualities are in a separate file
-	char          qualOrigBuf[FileBuf::LASTN_BUF_SZ];
+	char         *qualOrigBuf;
 	size_t        qualOrigBufLen;
+	size_t        qualOrigBufCap;
 
 	String<char>  name;                // read name
-	char          nameBuf[BUF_SIZE];   // read name buffer
+	char         *nameBuf;             // read name buffer
+	size_t        nameCap;             // capacity of nameBuf
 	uint32_t      patid;               // unique 0-based id based on order in read file(s)
 	int           mate;                // 0 = single-end, 1 = mate1, 2 = mate2
 	uint32_t      seed;                // random seed
@@ -367,7 +558,17 @@ struct ReadBuf {
 	char          trimc;               // trimmed color, for csfasta files
 	int           trimmed5;            // amount actually trimmed off 5' end
 	int           trimmed3;            // amount actually trimmed off 3' end
+	bool          builtRc;             // patRc/altPatRc are up to date
+	bool          builtFwRev;          // patFwRev/altPatFwRev are up to date
+	bool          builtRcRev;          // patRcRev/altPatRcRev are up to date
+	bool          builtQualRev;        // qualRev/altQualRev are up to date
 	HitSet        hitset;              // holds previously-found hits; for chaining
+
+private:
+
+	// Not copyable; owns the arena and the name and original-text buffers
+	ReadBuf(const ReadBuf&);
+	ReadBuf& operator=(const ReadBuf&);
 };
 
 /**
@@ -435,14 +636,10 @@ public:
 			// TODO: Perhaps bundle all of the following up into a
 			// finalize() member in the ReadBuf class?
 
-			// Construct the reversed versions of the fw and rc seqs
-			// and quals
-			ra.constructRevComps();
-			ra.constructReverses();
-			if(!rb.empty()) {
-				rb.constructRevComps();
-				rb.constructReverses();
-			}
+			// The reversed versions of the fw and rc seqs and quals
+			// are constructed lazily, on first access
+			ra.clearDerived();
+			rb.clearDerived();
 			// Fill in the random-seed field using a combination of
 			// information from the user-specified seed and the read
 			// sequence, qualities, and name
@@ -477,10 +674,9 @@ public:
 			if(randomizeQuals_) {
 				randomizeQuals(r);
 			}
-			// Construct the reversed versions of the fw and rc seqs
-			// and quals
-			r.constructRevComps();
-			r.constructReverses();
+			// The reversed versions of the fw and rc seqs and quals
+			// are constructed lazily, on first access
+			r.clearDerived();
 			// Fill in the random-seed field using a combination of
 			// information from the user-specified seed and the read
 			// sequence, qualities, and name
@@ -539,6 +735,11 @@ public:
 	 */
 	uint64_t readCnt() const { return readCnt_ - 1; }
 
+	/**
+	 * Add counters for the input files read so far to 'st'.
+	 */
+	virtual void addInputStats(FileBufStats& st) const { }
+
 protected:
 
 	/**
@@ -569,13 +770,13 @@ protected:
 	/**
 	 * Dump the contents of the ReadBuf to the dump file.
 	 */
-	void dumpBuf(const ReadBuf& r) {
+	void dumpBuf(ReadBuf& r) {
 		assert(dumpfile_ != NULL);
 		dump(out_, r.patFw,
 		     empty(r.qual) ? String<char>("(empty)") : r.qual,
 		     empty(r.name)   ? String<char>("(empty)") : r.name);
-		dump(out_, r.patRc,
-		     empty(r.qualRev) ? String<char>("(empty)") : r.qualRev,
+		dump(out_, r.getPatRc(),
+		     empty(r.qual) ? String<char>("(empty)") : r.getQualRev(),
 		     empty(r.name)   ? String<char>("(empty)") : r.name);
 	}
 
@@ -611,7 +812,7 @@ protected:
  */
 class PairedPatternSource {
 public:
-	PairedPatternSource(uint32_t seed) {
+	PairedPatternSource(uint32_t seed) : reorder_(NULL) {
 		seed_ = seed;
 	}
 	virtual ~PairedPatternSource() { }
@@ -621,6 +822,15 @@ public:
 	virtual bool nextReadPair(ReadBuf& ra, ReadBuf& rb, uint32_t& patid) = 0;
 	virtual pair<uint64_t,uint64_t> readCnt() const = 0;
 
+	/**
+	 * Hand out reads in a way that lets their output be put back into
+	 * input order by the given ReorderBuffer (see --reorder).
+	 */
+	void setReorder(ReorderBuffer* reorder) { reorder_ = reorder; }
+
+	/// Return the ReorderBuffer reads are numbered for, or NULL
+	ReorderBuffer* reorder() const { return reorder_; }
+
 	/**
 	 * Lock this PairedPatternSource, usually because one of its shared
 	 * fields is being updated.
@@ -640,6 +850,7 @@ protected:
 
 	MUTEX_T mutex_m; /// mutex for locking critical regions
 	uint32_t seed_;
+	ReorderBuffer* reorder_; /// non-NULL -> number reads for --reorder
 };
 
 /**
@@ -901,38 +1112,69 @@ protected:
 class PatternSourcePerThread {
 public:
 	PatternSourcePerThread() :
-		buf1_(), buf2_(), patid_(0xffffffff) { }
+		buf1_(), buf2_(), bufa_(&buf1_), bufb_(&buf2_), patid_(0xffffffff),
+		reorder_(NULL), seq_(0), seqHeld_(false) { }
 
-	virtual ~PatternSourcePerThread() { }
+	virtual ~PatternSourcePerThread() {
+		releaseSeq();
+	}
 
 	/**
-	 * Read the next read pair.
+	 * Read the next read pair.  Subclasses call this first; it tells
+	 * the ReorderBuffer (if any) that output for the previous read is
+	 * complete.
 	 */
-	virtual void nextReadPair() { }
+	virtual void nextReadPair() {
+		releaseSeq();
+	}
 
-	ReadBuf& bufa()        { return buf1_;         }
-	ReadBuf& bufb()        { return buf2_;         }
+	ReadBuf& bufa()        { return *bufa_;        }
+	ReadBuf& bufb()        { return *bufb_;        }
 
 	uint32_t      patid() const { return patid_;        }
 	virtual void  reset()       { patid_ = 0xffffffff;  }
-	bool          empty() const { return buf1_.empty(); }
+	bool          empty() const { return bufa_->empty(); }
 	uint32_t length(int mate) const {
-		return (mate == 1)? buf1_.length() : buf2_.length();
+		return (mate == 1)? bufa_->length() : bufb_->length();
 	}
 
 	/**
 	 * Return true iff the buffers jointly contain a paired-end read.
 	 */
 	bool paired() {
-		bool ret = !buf2_.empty();
+		bool ret = !bufb_->empty();
 		assert(!ret || !empty());
 		return ret;
 	}
 
+	/**
+	 * Return the ReorderBuffer that the current read's output should
+	 * go through, or NULL if output isn't being reordered.
+	 */
+	ReorderBuffer* reorder() const { return seqHeld_ ? reorder_ : NULL; }
+
+	/// Sequence number of the current read in the ReorderBuffer
+	uint64_t seq() const { return seq_; }
+
 protected:
+
+	/// Commit the current read's slot in the ReorderBuffer, if any
+	void releaseSeq() {
+		if(seqHeld_) {
+			seqHeld_ = false;
+			reorder_->commit(seq_);
+		}
+	}
+
 	ReadBuf  buf1_;    // read buffer for mate a
 	ReadBuf  buf2_;    // read buffer for mate b
+	ReadBuf* bufa_;    // current read's mate a; &buf1_ unless a subclass
+	                   // keeps reads elsewhere
+	ReadBuf* bufb_;    // current read's mate b
 	uint32_t patid_;   // index of read just read
+	ReorderBuffer* reorder_; // --reorder buffer for the current read
+	uint64_t seq_;     // sequence number of the current read in reorder_
+	bool     seqHeld_; // true -> seq_ taken but not yet committed
 };
 
 /**
@@ -986,7 +1228,19 @@ public:
 		ASSERT_ONLY(uint32_t lastPatid = patid_);
 		buf1_.clearAll();
 		buf2_.clearAll();
-		patsrc_.nextReadPair(buf1_, buf2_, patid_);
+		reorder_ = patsrc_.reorder();
+		if(reorder_ != NULL) {
+			// Number reads in the order they're taken from the input
+			reorder_->beginTake();
+			patsrc_.nextReadPair(buf1_, buf2_, patid_);
+			if(!buf1_.empty()) {
+				seq_ = reorder_->take();
+				seqHeld_ = true;
+			}
+			reorder_->endTake();
+		} else {
+			patsrc_.nextReadPair(buf1_, buf2_, patid_);
+		}
 		assert(buf1_.empty() || patid_ != lastPatid);
 	}
 
@@ -1067,8 +1321,8 @@ public:
 		length_(length),
 		seed_(seed)
 	{
-		if(length_ > 1024) {
-			cerr << "Read length for RandomPatternSource may not exceed 1024; got " << length_ << endl;
+		if((size_t)length_ > ReadBuf::MAX_LEN) {
+			cerr << "Read length for RandomPatternSource may not exceed " << ReadBuf::MAX_LEN << "; got " << length_ << endl;
 			throw 1;
 		}
 		rand_.init(seed_);
@@ -1116,6 +1370,7 @@ public:
 	                           uint32_t patid)
 	{
 		// End critical section
+		r.ensureCap(length);
 		for(int i = 0; i < length; i++) {
 			ra = RandomSource::nextU32(ra) >> 8;
 			r.patBufFw[i]           = (ra & 3);
@@ -1126,6 +1381,7 @@ public:
 		_setLength(r.patFw, length);
 		_setBegin (r.qual, r.qualBuf);
 		_setLength(r.qual, length);
+		r.ensureNameCap(12);
 		itoa10(patid, r.nameBuf);
 		_setBegin(r.name, r.nameBuf);
 		_setLength(r.name, strlen(r.nameBuf));
@@ -1162,8 +1418,8 @@ public:
 		thread_(thread)
 	{
 		patid_ = thread_;
-		if(length_ > 1024) {
-			cerr << "Read length for RandomPatternSourcePerThread may not exceed 1024; got " << length_ << endl;
+		if((size_t)length_ > ReadBuf::MAX_LEN) {
+			cerr << "Read length for RandomPatternSourcePerThread may not exceed " << ReadBuf::MAX_LEN << "; got " << length_ << endl;
 			throw 1;
 		}
 		rand_.init(thread_);
@@ -1413,12 +1669,14 @@ public:
 		}
 		// Copy v_*, quals_* strings into the respective Strings
 		r.color = color_;
+		r.ensureCap(seqan::length(v_[cur_]));
 		r.patFw  = v_[cur_];
 		r.qual = quals_[cur_];
 		r.trimmed3 = trimmed3_[cur_];
 		r.trimmed5 = trimmed5_[cur_];
 		ostringstream os;
 		os << cur_;
+		r.ensureNameCap(os.str().length());
 		r.name = os.str();
 		cur_++;
 		readCnt_++;
@@ -1448,17 +1706,21 @@ public:
 			return;
 		}
 		// Copy v_*, quals_* strings into the respective Strings
+		ra.ensureCap(seqan::length(v_[cur_]));
 		ra.patFw  = v_[cur_];
 		ra.qual = quals_[cur_];
 		ra.trimmed3 = trimmed3_[cur_];
 		ra.trimmed5 = trimmed5_[cur_];
 		cur_++;
+		rb.ensureCap(seqan::length(v_[cur_]));
 		rb.patFw  = v_[cur_];
 		rb.qual = quals_[cur_];
 		rb.trimmed3 = trimmed3_[cur_];
 		rb.trimmed5 = trimmed5_[cur_];
 		ostringstream os;
 		os << readCnt_;
+		ra.ensureNameCap(os.str().length());
+		rb.ensureNameCap(os.str().length());
 		ra.name = os.str();
 		rb.name = os.str();
 		ra.color = rb.color = color_;
@@ -1520,6 +1782,10 @@ public:
 		}
 		assert(!fb_.isOpen());
 		assert(!qfb_.isOpen());
+		fb_.setBufSize(gReadBufSz);
+		fb_.setReadahead(gReadahead);
+		qfb_.setBufSize(gReadBufSz);
+		qfb_.setReadahead(gReadahead);
 		open(); // open first file in the list
 		filecur_++;
 	}
@@ -1625,6 +1891,10 @@ public:
 		// If ra.patFw is empty, then the caller knows that we are
 		// finished with the reads
 	}
+	virtual void addInputStats(FileBufStats& st) const {
+		st.add(fb_.stats());
+		st.add(qfb_.stats());
+	}
 	/**
 	 * Reset state so that we read start reading again from the
 	 * beginning of the first file.  Should only be called by the
@@ -1821,6 +2091,7 @@ protected:
 				cerr << "Warning: one or more mismatched read names between FASTA and quality files" << endl;
 				warning = true;
 			}
+			r.ensureNameCap(nameLen + 1);
 			r.nameBuf[nameLen++] = c;
 			c = fb_.get();
 			if(doquals) qc = qfb_.get();
@@ -1857,7 +2128,8 @@ protected:
 				if(c == '.') c = 'N';
 			}
 			if(asc2dnacat[c] > 0 && begin++ >= mytrim5) {
-				if(dstLen + 1 > 1024) tooManySeqChars(r.name);
+				if((size_t)dstLen + 1 > ReadBuf::MAX_LEN) tooManySeqChars(r.name);
+				r.ensureCap(dstLen + 1);
 				r.patBufFw[dstLen] = charToDna5[c];
 				if(!doquals) r.qualBuf[dstLen]  = 'I';
 				dstLen++;
@@ -1892,6 +2164,7 @@ protected:
 		_setLength(r.qual,  dstLen);
 		// Set up a default name if one hasn't been set
 		if(nameLen == 0) {
+			r.ensureNameCap(12);
 			itoa10((int)readCnt_, r.nameBuf);
 			_setBegin(r.name, r.nameBuf);
 			nameLen = (int)strlen(r.nameBuf);
@@ -1900,10 +2173,10 @@ protected:
 		assert_gt(nameLen, 0);
 		readCnt_++;
 		patid = (uint32_t)(readCnt_-1);
-		r.readOrigBufLen = fb_.copyLastN(r.readOrigBuf);
+		r.copyReadOrig(fb_);
 		fb_.resetLastN();
 		if(doquals) {
-			r.qualOrigBufLen = qfb_.copyLastN(r.qualOrigBuf);
+			r.copyQualOrig(qfb_);
 			qfb_.resetLastN();
 			if(false) {
 				cout << "Name: " << r.name << endl
@@ -2022,7 +2295,7 @@ protected:
 		r.trimmed5 = trim5;
 		assert_eq(ct, '\n');
 		assert_neq('\n', fb_.peek());
-		r.readOrigBufLen = fb_.copyLastN(r.readOrigBuf);
+		r.copyReadOrig(fb_);
 		fb_.resetLastN();
 		// The last character read in parseQuals should have been a
 		// '\n'
@@ -2075,7 +2348,7 @@ protected:
 			// Unpaired record; return.
 			rb.clearAll();
 			peekOverNewline(fb_);
-			ra.readOrigBufLen = fb_.copyLastN(ra.readOrigBuf);
+			ra.copyReadOrig(fb_);
 			fb_.resetLastN();
 			readCnt_++;
 			patid = (uint32_t)(readCnt_-1);
@@ -2111,7 +2384,7 @@ protected:
 			assert(false);
 		}
 		peekOverNewline(fb_);
-		ra.readOrigBufLen = fb_.copyLastN(ra.readOrigBuf);
+		ra.copyReadOrig(fb_);
 		fb_.resetLastN();
 
 		rb.trimmed3 = this->trim3_;
@@ -2158,7 +2431,11 @@ private:
 			if(c == '\n' || c == '\r') {
 				return -1;
 			}
-			if(r2 != NULL) (*r2).nameBuf[nameLen] = c;
+			r.ensureNameCap(nameLen + 1);
+			if(r2 != NULL) {
+				(*r2).ensureNameCap(nameLen + 1);
+				(*r2).nameBuf[nameLen] = c;
+			}
 			r.nameBuf[nameLen++] = c;
 		}
 		_setBegin(r.name, r.nameBuf);
@@ -2169,11 +2446,13 @@ private:
 		}
 		// Set up a default name if one hasn't been set
 		if(nameLen == 0) {
+			r.ensureNameCap(12);
 			itoa10((int)readCnt_, r.nameBuf);
 			_setBegin(r.name, r.nameBuf);
 			nameLen = (int)strlen(r.nameBuf);
 			_setLength(r.name, nameLen);
 			if(r2 != NULL) {
+				(*r2).ensureNameCap(12);
 				itoa10((int)readCnt_, (*r2).nameBuf);
 				_setBegin((*r2).name, (*r2).nameBuf);
 				_setLength((*r2).name, nameLen);
@@ -2221,11 +2500,12 @@ private:
 				assert_in(toupper(c), "ACGTN");
 				if(begin++ >= trim5) {
 					assert_neq(0, dna4Cat[c]);
-					if(dstLen + 1 > 1024) {
-						cerr << "Input file contained a pattern more than 1024 characters long.  Please truncate" << endl
+					if((size_t)dstLen + 1 > ReadBuf::MAX_LEN) {
+						cerr << "Input file contained a pattern more than " << ReadBuf::MAX_LEN << " characters long.  Please truncate" << endl
 							 << "reads and re-run Bowtie" << endl;
 						throw 1;
 					}
+					r.ensureCap(dstLen + 1);
 					r.patBufFw[dstLen] = charToDna5[c];
 					dstLen++;
 				}
@@ -2262,7 +2542,8 @@ private:
 					assert_geq(c, 33);
 					if (qualsRead >= trim5) {
 						size_t off = qualsRead - trim5;
-						if(off >= 1024) tooManyQualities(r.name);
+						if(off >= ReadBuf::MAX_LEN) tooManyQualities(r.name);
+						r.ensureCap(off + 1);
 						r.qualBuf[off] = c;
 					}
 					++qualsRead;
@@ -2282,7 +2563,8 @@ private:
 				if(!isspace(c) && c != upto && (upto2 == -1 || c != upto2)) {
 					if (qualsRead >= trim5) {
 						size_t off = qualsRead - trim5;
-						if(off >= 1024) tooManyQualities(r.name);
+						if(off >= ReadBuf::MAX_LEN) tooManyQualities(r.name);
+						r.ensureCap(off + 1);
 						c = charToPhred33(c, solQuals_, phred64Quals_);
 						assert_geq(c, 33);
 						r.qualBuf[off] = c;
@@ -2332,7 +2614,10 @@ public:
 		nameChars_(0), bufCur_(0), subReadCnt_(0llu)
 	{
 		resetForNextFile();
-		assert_lt(length_, (size_t)ReadBuf::BUF_SIZE);
+		if(length_ >= ReadBuf::MAX_LEN) {
+			cerr << "Read length for FastaContinuousPatternSource must be less than " << ReadBuf::MAX_LEN << "; got " << length_ << endl;
+			throw 1;
+		}
 	}
 
 	virtual void reset() {
@@ -2387,6 +2672,7 @@ protected:
 						if(!beginning_) readCnt_++;
 						continue;
 					}
+					r.ensureCap(length_);
 					for(size_t i = 0; i < length_; i++) {
 						if(length_ - i <= bufCur_) {
 							c = buf_[bufCur_ - (length_ - i)];
@@ -2402,6 +2688,7 @@ protected:
 					_setBegin (r.qual, r.qualBuf);
 					_setLength(r.qual, length_);
 					// Set up a default name if one hasn't been set
+					r.ensureNameCap(nameChars_ + 12);
 					for(size_t i = 0; i < nameChars_; i++) {
 						r.nameBuf[i] = nameBuf_[i];
 					}
@@ -2534,7 +2821,6 @@ protected:
 
 	/// Read another pattern from a FASTQ input file
 	virtual void read(ReadBuf& r, uint32_t& patid) {
-		const int bufSz = ReadBuf::BUF_SIZE;
 		while(true) {
 			int c;
 			int dstLen = 0;
@@ -2571,18 +2857,10 @@ protected:
 					}
 					break;
 				}
+				r.ensureNameCap(nameLen + 1);
 				r.nameBuf[nameLen++] = c;
-				if(nameLen > bufSz-2) {
-					// Too many chars in read name; print friendly error message
-					_setBegin(r.name, r.nameBuf);
-					_setLength(r.name, nameLen);
-					cerr << "FASTQ read name is too long; read names must be " << (bufSz-2) << " characters or fewer." << endl;
-					cerr << "Beginning of bad read name: " << r.name << endl;
-					throw 1;
-				}
 			}
 			_setBegin(r.name, r.nameBuf);
-			assert_leq(nameLen, bufSz-2);
 			_setLength(r.name, nameLen);
 			// c now holds the first character on the line after the
 			// @name line
@@ -2633,7 +2911,12 @@ protected:
 					// If it's past the 5'-end trim point
 					assert_in(toupper(c), "ACGTN");
 					if(charsRead >= trim5) {
-						if((*dstLenCur) >= 1024) tooManySeqChars(r.name);
+						if((size_t)(*dstLenCur) >= ReadBuf::MAX_LEN) tooManySeqChars(r.name);
+						if((size_t)(*dstLenCur) >= r.cap) {
+							// Growing the arena moves every buffer
+							r.ensureCap((*dstLenCur) + 1);
+							sbuf = (altBufIdx == 0) ? r.patBufFw : r.altPatBufFw[altBufIdx-1];
+						}
 						sbuf[(*dstLenCur)++] = charToDna5[c];
 					}
 					charsRead++;
@@ -2681,7 +2964,8 @@ protected:
 						assert_geq(c, 33);
 						if (qualsRead >= mytrim5) {
 							size_t off = qualsRead - mytrim5;
-							if(off >= 1024) tooManyQualities(r.name);
+							if(off >= ReadBuf::MAX_LEN) tooManyQualities(r.name);
+							r.ensureCap(off + 1);
 							r.qualBuf[off] = c;
 						}
 						++qualsRead;
@@ -2729,7 +3013,12 @@ protected:
 					if (c != '\r' && c != '\n') {
 						if (*qualsReadCur >= trim5) {
 							size_t off = (*qualsReadCur) - trim5;
-							if(off >= 1024) tooManyQualities(r.name);
+							if(off >= ReadBuf::MAX_LEN) tooManyQualities(r.name);
+							if(off >= r.cap) {
+								// Growing the arena moves every buffer
+								r.ensureCap(off + 1);
+								qbuf = (altBufIdx == 0) ? r.qualBuf : r.altQualBuf[altBufIdx-1];
+							}
 							c = charToPhred33(c, solQuals_, phred64Quals_);
 							assert_geq(c, 33);
 							qbuf[off] = c;
@@ -2804,7 +3093,7 @@ protected:
 					c = peekToEndOfLine(fb_);
 				}
 			}
-			r.readOrigBufLen = fb_.copyLastN(r.readOrigBuf);
+			r.copyReadOrig(fb_);
 			fb_.resetLastN();
 
 			c = fb_.get();
@@ -2812,6 +3101,7 @@ protected:
 
 			// Set up a default name if one hasn't been set
 			if(nameLen == 0) {
+				r.ensureNameCap(12);
 				itoa10((int)readCnt_, r.nameBuf);
 				_setBegin(r.name, r.nameBuf);
 				nameLen = (int)strlen(r.nameBuf);
@@ -2864,6 +3154,306 @@ private:
 	bool color_;
 };
 
+/**
+ * Synchronized concrete pattern source for a list of unaligned BAM
+ * files.  Records are decoded straight from the inflated BGZF stream:
+ * the 4-bit packed bases go directly into the read's Dna5 buffer and
+ * the raw Phred qualities are offset to Phred+33.  Secondary and
+ * supplementary records are skipped, and records flagged as reverse-
+ * complemented are turned back to their original orientation.  When
+ * reading pairs, a record flagged as mate 1 (0x40) must be followed
+ * by its mate 2 (0x80) record, as it is in name-sorted or
+ * unaligned-as-delivered files; records not flagged as paired (0x1)
+ * are returned as unpaired reads.
+ */
+class BAMPatternSource : public TrimmingPatternSource {
+
+	/// Fields of a BAM record that we care about
+	struct Rec {
+		uint16_t flag;
+		const char *name;  /// NUL-terminated, within buf_
+		size_t nameLen;
+		const uint8_t *seq;  /// 4-bit packed bases, within buf_
+		const uint8_t *qual; /// raw Phred qualities, within buf_
+		size_t len;
+	};
+
+public:
+	BAMPatternSource(uint32_t seed,
+	                 const vector<string>& infiles,
+	                 bool randomizeQuals = false,
+	                 const char *dumpfile = NULL,
+	                 bool verbose = false,
+	                 int trim3 = 0,
+	                 int trim5 = 0,
+	                 uint32_t skip = 0,
+	                 int nthreads = 1) :
+		TrimmingPatternSource(seed, randomizeQuals,
+		                      dumpfile, verbose, trim3, trim5),
+		infiles_(infiles),
+		errs_(infiles.size(), false),
+		filecur_(0),
+		bgzf_(nthreads),
+		skip_(skip)
+	{
+		assert_gt(infiles.size(), 0);
+		open();
+	}
+
+	/**
+	 * Fill r with the next primary record, regardless of whether it
+	 * is paired.
+	 */
+	virtual void nextReadImpl(ReadBuf& r, uint32_t& patid) {
+		lock();
+		Rec rec;
+		while(true) {
+			if(!nextRec(rec, buf_)) {
+				unlock();
+				r.clearAll();
+				return;
+			}
+			if(!parse(rec, r)) continue;
+			readCnt_++;
+			patid = (uint32_t)(readCnt_-1);
+			if(patid >= skip_) break;
+		}
+		unlock();
+	}
+
+	/**
+	 * Fill ra and rb with the next pair of mate records, or fill ra
+	 * with the next unpaired record and leave rb empty.
+	 */
+	virtual void nextReadPairImpl(ReadBuf& ra, ReadBuf& rb, uint32_t& patid) {
+		lock();
+		Rec reca, recb;
+		while(true) {
+			if(!nextRec(reca, buf_)) {
+				unlock();
+				ra.clearAll();
+				rb.clearAll();
+				return;
+			}
+			if((reca.flag & 0x1) == 0) {
+				rb.clearAll();
+				if(!parse(reca, ra)) continue;
+			} else {
+				if(!nextRec(recb, bufb_) ||
+				   (recb.flag & 0x1) == 0 ||
+				   (reca.flag & 0xc0) == (recb.flag & 0xc0) ||
+				   (reca.flag & 0xc0) == 0 || (recb.flag & 0xc0) == 0 ||
+				   strcmp(reca.name, recb.name) != 0)
+				{
+					cerr << "Error: paired record \"" << reca.name << "\" in BAM file \""
+					     << infiles_[filecur_] << "\" is not immediately followed by its mate" << endl;
+					throw 1;
+				}
+				if((reca.flag & 0x80) != 0) std::swap(reca, recb);
+				// Parse both so that an empty mate doesn't leave the
+				// other one's record unconsumed
+				bool oka = parse(reca, ra);
+				bool okb = parse(recb, rb);
+				if(!oka || !okb) continue;
+			}
+			readCnt_++;
+			patid = (uint32_t)(readCnt_-1);
+			if(patid >= skip_) break;
+		}
+		unlock();
+	}
+
+	virtual void reset() {
+		TrimmingPatternSource::reset();
+		filecur_ = 0;
+		open();
+	}
+
+protected:
+
+	virtual void dump(ostream& out,
+	                  const String<Dna5>& seq,
+	                  const String<char>& qual,
+	                  const String<char>& name)
+	{
+		out << "@" << name << endl << seq << endl << "+" << endl << qual << endl;
+	}
+
+private:
+
+	/**
+	 * Open the file at filecur_, or the next one after it that can be
+	 * opened, and consume its header.  Return false if there are no
+	 * more files.
+	 */
+	bool open() {
+		bgzf_.close();
+		while(filecur_ < infiles_.size()) {
+			FILE *in;
+			if(infiles_[filecur_] == "-") {
+				in = stdin;
+			} else if((in = fopen(infiles_[filecur_].c_str(), "rb")) == NULL) {
+				if(!errs_[filecur_]) {
+					cerr << "Warning: Could not open read file \"" << infiles_[filecur_] << "\" for reading; skipping..." << endl;
+					errs_[filecur_] = true;
+				}
+				filecur_++;
+				continue;
+			}
+			bgzf_.open(in, infiles_[filecur_]);
+			readHeader();
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Check the magic number and skip over the header text and the
+	 * reference dictionary, which unaligned BAM files leave empty.
+	 */
+	void readHeader() {
+		uint8_t b[4];
+		if(bgzf_.read(b, 4) != 4 || memcmp(b, "BAM\1", 4) != 0) {
+			cerr << "Error: \"" << infiles_[filecur_] << "\" is not a BAM file" << endl;
+			throw 1;
+		}
+		if(bgzf_.read(b, 4) != 4 || !bgzf_.skip(bgzfLe32(b))) truncated();
+		if(bgzf_.read(b, 4) != 4) truncated();
+		uint32_t nref = bgzfLe32(b);
+		for(uint32_t i = 0; i < nref; i++) {
+			// l_name, name, l_ref
+			if(bgzf_.read(b, 4) != 4 || !bgzf_.skip(bgzfLe32(b) + 4)) truncated();
+		}
+	}
+
+	/**
+	 * Read the next primary record into 'buf' and point the fields of
+	 * 'rec' into it, moving on to the next file at end of input.
+	 * Return false when all files are exhausted.
+	 */
+	bool nextRec(Rec& rec, vector<uint8_t>& buf) {
+		while(true) {
+			uint8_t b[4];
+			size_t n = bgzf_.read(b, 4);
+			if(n == 0) {
+				if(filecur_ < infiles_.size()) filecur_++;
+				if(!open()) return false;
+				continue;
+			}
+			if(n != 4) truncated();
+			uint32_t bsz = bgzfLe32(b);
+			if(bsz < 32) truncated();
+			if(buf.size() < bsz) buf.resize(bsz);
+			if(bgzf_.read(&buf[0], bsz) != bsz) truncated();
+			const uint8_t *p = &buf[0];
+			size_t lname = p[8];
+			size_t ncigar = bgzfLe16(p + 12);
+			rec.flag = bgzfLe16(p + 14);
+			rec.len = bgzfLe32(p + 16);
+			if(32 + lname + ncigar * 4 + (rec.len + 1) / 2 + rec.len > bsz || lname == 0) {
+				truncated();
+			}
+			if((rec.flag & 0x900) != 0) continue; // secondary/supplementary
+			rec.name = (const char*)(p + 32);
+			rec.nameLen = lname - 1;
+			rec.seq = p + 32 + lname + ncigar * 4;
+			rec.qual = rec.seq + (rec.len + 1) / 2;
+			return true;
+		}
+	}
+
+	/**
+	 * Decode record 'rec' into r, applying trimming.  Return false if
+	 * the read is empty after trimming.
+	 */
+	bool parse(const Rec& rec, ReadBuf& r) {
+		// BAM 4-bit base codes "=ACMGRSVTWYHKDBN" to Dna5
+		static const uint8_t nt16ToDna5[] = {
+			4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4
+		};
+		r.reset();
+		r.ensureNameCap(rec.nameLen);
+		memcpy(r.nameBuf, rec.name, rec.nameLen);
+		_setBegin(r.name, r.nameBuf);
+		_setLength(r.name, rec.nameLen);
+		copyReadOrig(rec, r);
+		size_t len = rec.len;
+		if(len <= (size_t)(trim3_ + trim5_)) {
+			if(len == 0 && !quiet) {
+				cerr << "Warning: Skipping read (" << r.name << ") because it had length 0" << endl;
+			}
+			return false;
+		}
+		size_t dstLen = len - trim3_ - trim5_;
+		if(dstLen > ReadBuf::MAX_LEN) tooManySeqChars(r.name);
+		r.ensureCap(dstLen);
+		bool rev = (rec.flag & 0x10) != 0;
+		bool noQuals = rec.qual[0] == 0xff;
+		for(size_t i = 0; i < dstLen; i++) {
+			// Offset of this base in the record, which holds the
+			// reverse complement if 'rev'
+			size_t j = rev ? (len - 1 - trim5_ - i) : (trim5_ + i);
+			int b = nt16ToDna5[(rec.seq[j >> 1] >> ((~j & 1) << 2)) & 15];
+			if(rev && b < 4) b ^= 3;
+			r.patBufFw[i] = b;
+			r.qualBuf[i] = noQuals ? 'I' : (char)(min<int>(rec.qual[j], 93) + 33);
+		}
+		_setBegin(r.patFw, (Dna5*)r.patBufFw);
+		_setLength(r.patFw, dstLen);
+		_setBegin(r.qual, r.qualBuf);
+		_setLength(r.qual, dstLen);
+		r.trimmed3 = trim3_;
+		r.trimmed5 = trim5_;
+		return true;
+	}
+
+	/**
+	 * Render the untrimmed record as FASTQ into r.readOrigBuf, for
+	 * --al/--un/--max.
+	 */
+	void copyReadOrig(const Rec& rec, ReadBuf& r) {
+		static const char nt16[] = "=ACMGRSVTWYHKDBN";
+		static const char cmp16[] = "=TGKCYSBAWRDMHVN";
+		size_t len = rec.len;
+		size_t need = rec.nameLen + 2 * len + 6;
+		if(need > r.readOrigBufCap) {
+			ReadBuf::growBuf(r.readOrigBuf, r.readOrigBufCap, need, 0);
+		}
+		bool rev = (rec.flag & 0x10) != 0;
+		char *o = r.readOrigBuf;
+		*o++ = '@';
+		memcpy(o, rec.name, rec.nameLen);
+		o += rec.nameLen;
+		*o++ = '\n';
+		for(size_t i = 0; i < len; i++) {
+			size_t j = rev ? (len - 1 - i) : i;
+			int c = (rec.seq[j >> 1] >> ((~j & 1) << 2)) & 15;
+			*o++ = rev ? cmp16[c] : nt16[c];
+		}
+		*o++ = '\n'; *o++ = '+'; *o++ = '\n';
+		for(size_t i = 0; i < len; i++) {
+			size_t j = rev ? (len - 1 - i) : i;
+			*o++ = (rec.qual[0] == 0xff) ? 'I' : (char)(min<int>(rec.qual[j], 93) + 33);
+		}
+		*o++ = '\n';
+		r.readOrigBufLen = o - r.readOrigBuf;
+		assert_leq(r.readOrigBufLen, need);
+	}
+
+	void truncated() {
+		cerr << "Error: BAM file \"" << infiles_[filecur_] << "\" is truncated or malformed" << endl;
+		throw 1;
+	}
+
+	vector<string> infiles_; /// filenames for read files
+	vector<bool> errs_;      /// whether we've already printed an error for each file
+	size_t filecur_;         /// index into infiles_ of file being read
+	BGZFReader bgzf_;        /// inflated stream of current file
+	vector<uint8_t> buf_;    /// current record
+	vector<uint8_t> bufb_;   /// current mate 2 record, when reading pairs
+	uint32_t skip_;          /// number of reads to skip
+};
+
 /**
  * Read a Raw-format file (one sequence per line).  No quality strings
  * allowed.  All qualities are assumed to be 'I' (40 on the Phred-33
@@ -2944,7 +3534,8 @@ protected:
 			if(c == '.') c = 'N';
 			if(isalpha(c) && dstLen >= mytrim5) {
 				size_t len = dstLen - mytrim5;
-				if(len >= 1024) tooManyQualities(String<char>("(no name)"));
+				if(len >= ReadBuf::MAX_LEN) tooManyQualities(String<char>("(no name)"));
+				r.ensureCap(len + 1);
 				r.patBufFw [len] = charToDna5[c];
 				r.qualBuf[len] = 'I';
 				dstLen++;
@@ -2965,10 +3556,11 @@ protected:
 		c = peekToEndOfLine(fb_);
 		r.trimmed3 = this->trim3_;
 		r.trimmed5 = mytrim5;
-		r.readOrigBufLen = fb_.copyLastN(r.readOrigBuf);
+		r.copyReadOrig(fb_);
 		fb_.resetLastN();
 
 		// Set up name
+		r.ensureNameCap(12);
 		itoa10((int)readCnt_, r.nameBuf);
 		_setBegin(r.name, r.nameBuf);
 		nameLen = (int)strlen(r.nameBuf);
@@ -3044,20 +3636,22 @@ protected:
 			return;
 		}
 		// Now copy the name/sequence/quals into r.name/r.patFw/r.qualFw
+		r.ensureNameCap(seqan::length(r.hitset.name));
+		r.ensureCap(max(seqan::length(r.hitset.seq), seqan::length(r.hitset.qual)));
 		_setBegin(r.name, (char*)r.nameBuf);
-		_setCapacity(r.name, seqan::length(r.hitset.name));
+		_setCapacity(r.name, r.nameCap);
 		_setLength(r.name, seqan::length(r.hitset.name));
 		memcpy(r.nameBuf, seqan::begin(r.hitset.name), seqan::length(r.hitset.name));
 		_setBegin (r.patFw, (Dna5*)r.patBufFw);
-		_setCapacity(r.patFw, seqan::length(r.hitset.seq));
+		_setCapacity(r.patFw, r.cap);
 		_setLength(r.patFw, seqan::length(r.hitset.seq));
 		memcpy(r.patBufFw, seqan::begin(r.hitset.seq), seqan::length(r.hitset.seq));
 		_setBegin (r.qual, r.qualBuf);
-		_setCapacity(r.qual, seqan::length(r.hitset.qual));
+		_setCapacity(r.qual, r.cap);
 		_setLength(r.qual, seqan::length(r.hitset.qual));
 		memcpy(r.qualBuf, seqan::begin(r.hitset.qual), seqan::length(r.hitset.qual));
 
-		r.readOrigBufLen = fb_.copyLastN(r.readOrigBuf);
+		r.copyReadOrig(fb_);
 		fb_.resetLastN();
 
 		readCnt_++;
@@ -15,112 +15,134 @@
 #include "search_globals.h"
 
 /**
- * Very simple allocator for fixed-size chunks of memory.  Chunk size
- * is set at construction time.  Heap memory is only allocated at
- * construction and deallocated at destruction.
+ * Allocator for fixed-size chunks of memory, one per search thread.
+ * Chunk size is set at construction time.  Chunks are allocated from
+ * the heap only as they're first needed, and chunks given back with
+ * free() or reset() go on a free list and are handed out again for
+ * later reads, so once the pool has grown to the size the reads need,
+ * it doesn't call the system allocator any more.
+ *
+ * 'totSz' is a soft cap: a read that needs more chunks gets them, and
+ * chunks beyond the cap are returned to the system when a read that
+ * stayed under the cap is done, so only runs of hard reads pay for the
+ * extra memory.  A read may not hold more than HARD_MULT times 'totSz',
+ * though, so that one pathological read can't take all of the machine's
+ * memory; past that, or if the system can't supply a chunk, alloc()
+ * returns NULL and the read is skipped (see exhausted()).
  */
 class ChunkPool {
 public:
+
+	/// A read may hold at most this many times the soft cap
+	static const uint32_t HARD_MULT = 8;
+
 	/**
-	 * Initialize a new pool with an initial size of about 'bytes'
-	 * bytes.  Exit with an error message if we can't allocate it.
+	 * Initialize a new, empty pool that hands out chunks of 'chunkSz'
+	 * bytes and keeps up to about 'totSz' bytes between reads.
 	 */
 	ChunkPool(uint32_t chunkSz, uint32_t totSz, bool verbose_) :
-		verbose(verbose_), patid(0), pool_(NULL), cur_(0),
+		verbose(verbose_), patid(0), inUse_(0), peak_(0), readPeak_(0),
 		chunkSz_(chunkSz), totSz_(totSz), lim_(totSz/chunkSz),
-		bits_(lim_), exhaustCrash_(false),
-		lastSkippedRead_(0xffffffff), readName_(NULL)
+		hard_(lim_ * HARD_MULT),
+		exhaustCrash_(false), lastSkippedRead_(0xffffffff),
+		readName_(NULL), hinted_(false), grows_(0), trims_(0)
 	{
 		assert_gt(lim_, 0);
-		try {
-			if((pool_ = new int8_t[totSz_]) == NULL) {
-				throw std::bad_alloc();
-			}
-		} catch(std::bad_alloc& e) {
-			ThreadSafe _ts(&gLock);
-			std::cerr << "Error: Could not allocate ChunkPool of "
-			          << totSz << " bytes" << std::endl;
-			exhausted();
-			throw 1; // Exit if we haven't already
-		}
+		if(hard_ / HARD_MULT != lim_) hard_ = 0xffffffff;
 	}
 
 	/**
-	 * Delete all the pools.
+	 * Delete all the chunks.
 	 */
 	~ChunkPool() {
-		if(pool_ != NULL) delete[] pool_;
+		for(size_t i = 0; i < chunks_.size(); i++) {
+			delete[] chunks_[i];
+		}
 	}
 
 	/**
-	 * Reset the pool, freeing all arrays that had been given out.
+	 * Reset the pool, freeing all arrays that had been given out.  If
+	 * the last read stayed under the soft cap, return any chunks beyond
+	 * it to the system; otherwise keep them, since the next read may
+	 * well be as hard.
 	 */
 	void reset(String<char>* name, uint32_t patid_) {
 		patid = patid_;
 		readName_ = name;
-		cur_ = 0;
-		bits_.clear();
-		assert_eq(0, bits_.test(0));
+		if(chunks_.size() > lim_ && readPeak_ <= lim_) {
+			for(size_t i = lim_; i < chunks_.size(); i++) {
+				delete[] chunks_[i];
+			}
+			chunks_.resize(lim_);
+			trims_++;
+		}
+		free_ = chunks_;
+		inUse_ = 0;
+		readPeak_ = 0;
 	}
 
 	/**
-	 * Return our current position.
+	 * Return the number of chunks currently given out.
 	 */
 	uint32_t pos() {
-		return cur_;
+		return inUse_;
 	}
 
 	/**
-	 * Return our current position.
+	 * Return the number of chunks that can be given out before the
+	 * pool grows past its soft cap.
 	 */
 	uint32_t remaining() {
-		assert_geq(lim_, cur_);
-		return lim_ - cur_;
+		return inUse_ < lim_ ? lim_ - inUse_ : 0;
 	}
 
 	/**
-	 * Allocate a single T from the pool.
+	 * Allocate a chunk from the pool, growing the pool if there are
+	 * no free chunks.  Return NULL if the pool is at its hard cap or
+	 * the system is out of memory.
 	 */
 	void* alloc() {
-		assert_lt(cur_, lim_);
-		uint32_t cur = cur_;
-		while(bits_.test(cur)) {
-			cur++;
-			if(cur >= lim_) {
-				cur = 0;
+		if(free_.empty()) {
+			if(chunks_.size() >= hard_) {
+				return NULL;
 			}
-			if(cur == cur_) {
-				// Wrapped all the way around without finding a free
-				// chunk
+			int8_t *c = NULL;
+			try {
+				c = new int8_t[chunkSz_];
+			} catch(std::bad_alloc& e) {
 				return NULL;
 			}
+			chunks_.push_back(c);
+			free_.push_back(c);
+			grows_++;
+		}
+		void *ptr = (void *)free_.back();
+		free_.pop_back();
+		inUse_++;
+		if(inUse_ > readPeak_) {
+			readPeak_ = inUse_;
+			if(inUse_ > peak_) peak_ = inUse_;
 		}
-		void * ptr = (void *)(&pool_[cur * chunkSz_]);
-		assert(!bits_.test(cur));
-		bits_.set(cur);
-		assert(bits_.test(cur));
 		if(verbose) {
 			stringstream ss;
-			ss << patid << ": Allocating chunk with offset: " << cur;
+			ss << patid << ": Allocating chunk; " << inUse_ << " in use";
 			glog.msg(ss.str());
 		}
-		cur_ = cur;
 		return ptr;
 	}
 
 	/**
-	 *
+	 * Return a chunk to the free list.
 	 */
 	void free(void *ptr) {
-		uint32_t off = (uint32_t)((int8_t*)ptr - pool_);
-		assert_eq(0, off % chunkSz_);
-		off /= chunkSz_;
+		assert_gt(inUse_, 0);
 		if(verbose) {
 			stringstream ss;
-			ss << patid << ": Freeing chunk with offset: " << cur_;
+			ss << patid << ": Freeing chunk; " << (inUse_-1) << " in use";
 			glog.msg(ss.str());
 		}
-		bits_.clear(off);
+		free_.push_back((int8_t*)ptr);
+		inUse_--;
 	}
 
 	/**
@@ -137,6 +159,18 @@ public:
 		return totSz_;
 	}
 
+	/**
+	 * Print the most memory in use at once and how often the pool
+	 * grew and shrank.
+	 */
+	void printStats(std::ostream& os, int tid) const {
+		os << "Best-first chunk memory (thread " << tid << "): peak "
+		   << (((uint64_t)peak_ * chunkSz_) >> 10) << " KB in " << peak_
+		   << " chunks (soft cap " << lim_ << ", hard cap " << hard_
+		   << "), " << grows_
+		   << " chunks allocated, " << trims_ << " trims" << std::endl;
+	}
+
 	/**
 	 * Utility function to call when memory has been exhausted.
 	 * Currently just prints a friendly message and quits.
@@ -148,11 +182,14 @@ public:
 				std::cerr << "Exhausted best-first chunk memory for read "
 				          << (*readName_) << " (patid " << patid
 				          << "); skipping read" << std::endl;
+				// Say how to get past the hard cap once per pool
+				if(!hinted_ || exhaustCrash_) {
+					std::cerr << "Please try specifying a larger --chunkmbs <int> (default is 64); "
+					          << "a read may use up to " << HARD_MULT << " times that much" << std::endl;
+					hinted_ = true;
+				}
 			}
 			if(exhaustCrash_) {
-				if(!quiet) {
-					std::cerr << "Please try specifying a larger --chunkmbs <int> (default is 32)" << std::endl;
-				}
 				throw 1;
 			}
 		}
@@ -164,15 +201,21 @@ public:
 
 protected:
 
-	int8_t*  pool_; /// the memory pools
-	uint32_t cur_;  /// index of next free element of pool_
+	std::vector<int8_t*> chunks_; /// all chunks owned by the pool
+	std::vector<int8_t*> free_;   /// chunks not given out
+	uint32_t inUse_; /// # chunks given out
+	uint32_t peak_;  /// most chunks given out at once
+	uint32_t readPeak_; /// most chunks given out at once since reset()
 	const uint32_t chunkSz_;
 	const uint32_t totSz_;
-	uint32_t lim_;  /// # elements held in pool_
-	FixedBitset2 bits_;
+	uint32_t lim_;   /// soft cap on # chunks kept between reads
+	uint32_t hard_;  /// most chunks one read may hold
 	bool exhaustCrash_; /// abort hard when memory's exhausted?
 	uint32_t lastSkippedRead_;
 	String<char>* readName_;
+	bool hinted_;    /// printed the --chunkmbs hint yet?
+	uint64_t grows_; /// # chunks allocated from the system
+	uint64_t trims_; /// # times chunks beyond the cap were released
 };
 
 /**
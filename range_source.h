@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <vector>
+#include <algorithm>
 #include "seqan/sequence.h"
 #include "ebwt.h"
 #include "range.h"
@@ -1225,23 +1226,44 @@ public:
  * A priority queue for Branch objects; makes it easy to process
  * branches in a best-first manner by prioritizing branches with lower
  * cumulative costs over branches with higher cumulative costs.
+ *
+ * Costs are small: a 2-bit stratum over a quality penalty that rarely
+ * gets past a few hundred.  So rather than one heap over all branches,
+ * branches are kept in buckets by cost, each bucket a small heap
+ * ordered by CostCompare, and the lowest non-empty bucket is tracked
+ * with a cursor.  Buckets hold one cost each, except that penalties
+ * of QUAL_BUCKETS-1 or more share a stratum's last bucket, where the
+ * heap orders them by cost as well.  Since costs in the queue only
+ * grow as the search goes on, the cursor rarely moves back and the
+ * common push and pop touch one short heap.
+ *
+ * As before, the front branch may be extended (and curtailed) in place
+ * and stays at the front until it's popped or a better branch is
+ * pushed; the cursor still points at its bucket then, so pop() takes
+ * it from there even if its cost has changed since.
  */
 class BranchQueue {
 
 	typedef std::pair<int, int> TIntPair;
-	typedef std::priority_queue<Branch*, std::vector<Branch*>, CostCompare> TBranchQueue;
 
 public:
 
+	/// # buckets per stratum
+	static const size_t QUAL_BUCKETS = 256;
+
+	/// # buckets in all
+	static const size_t NUM_BUCKETS = 4 * QUAL_BUCKETS;
+
 	BranchQueue(bool verbose, bool quiet) :
-		sz_(0), branchQ_(), patid_(0), verbose_(verbose), quiet_(quiet)
+		sz_(0), buckets_(NUM_BUCKETS), min_(NUM_BUCKETS), hi_(0),
+		patid_(0), verbose_(verbose), quiet_(quiet)
 	{ }
 
 	/**
 	 * Return the front (highest-priority) element of the queue.
 	 */
 	Branch *front() {
-		Branch *b = branchQ_.top();
+		Branch *b = top();
 		if(verbose_) {
 			stringstream ss;
 			ss << patid_ << ": Fronting " << b->id_ << ", " << b << ", " << b->cost_ << ", " << b->exhausted_ << ", " << b->curtailed_ << ", " << sz_ << "->" << (sz_-1);
@@ -1255,8 +1277,19 @@ public:
 	 * queue.
 	 */
 	Branch *pop() {
-		Branch *b = branchQ_.top(); // get it
-		branchQ_.pop(); // remove it
+		assert_lt(min_, NUM_BUCKETS);
+		std::vector<Branch*>& q = buckets_[min_];
+		Branch *b = q.front(); // get it
+		std::pop_heap(q.begin(), q.end(), CostCompare());
+		q.pop_back(); // remove it
+		if(q.empty()) {
+			// Move the cursor up to the next non-empty bucket
+			while(min_ <= hi_ && buckets_[min_].empty()) min_++;
+			if(min_ > hi_) {
+				min_ = NUM_BUCKETS;
+				hi_ = 0;
+			}
+		}
 		if(verbose_) {
 			stringstream ss;
 			ss << patid_ << ": Popping " << b->id_ << ", " << b << ", " << b->cost_ << ", " << b->exhausted_ << ", " << b->curtailed_ << ", " << sz_ << "->" << (sz_-1);
@@ -1271,27 +1304,37 @@ public:
 	 */
 	void push(Branch *b) {
 #ifndef NDEBUG
-		bool bIsBetter = empty() || !CostCompare()(b, branchQ_.top());
+		bool bIsBetter = empty() || !CostCompare()(b, top());
 #endif
 		if(verbose_) {
 			stringstream ss;
 			ss << patid_ << ": Pushing " << b->id_ << ", " << b << ", " << b->cost_ << ", " << b->exhausted_ << ", " << b->curtailed_ << ", " << sz_ << "->" << (sz_+1);
 			glog.msg(ss.str());
 		}
-		branchQ_.push(b);
+		size_t i = bucket(b->cost_);
+		std::vector<Branch*>& q = buckets_[i];
+		q.push_back(b);
+		std::push_heap(q.begin(), q.end(), CostCompare());
+		if(i < min_) min_ = i;
+		if(i > hi_) hi_ = i;
 #ifndef NDEBUG
-		assert(bIsBetter  || branchQ_.top() != b || CostCompare::equal(branchQ_.top(), b));
-		assert(!bIsBetter || branchQ_.top() == b || CostCompare::equal(branchQ_.top(), b));
+		assert(bIsBetter  || top() != b || CostCompare::equal(top(), b));
+		assert(!bIsBetter || top() == b || CostCompare::equal(top(), b));
 #endif
 		sz_++;
 	}
 
 	/**
-	 * Empty the priority queue and reset the count.
+	 * Empty the priority queue and reset the count.  Buckets keep
+	 * their memory for the next read.
 	 */
 	void reset(uint32_t patid) {
 		patid_ = patid;
-		branchQ_ = TBranchQueue();
+		for(size_t i = min_; i <= hi_ && i < NUM_BUCKETS; i++) {
+			buckets_[i].clear();
+		}
+		min_ = NUM_BUCKETS;
+		hi_ = 0;
 		sz_ = 0;
 	}
 
@@ -1299,7 +1342,7 @@ public:
 	 * Return true iff the priority queue of branches is empty.
 	 */
 	bool empty() const {
-		bool ret = branchQ_.empty();
+		bool ret = (min_ == NUM_BUCKETS);
 		assert(ret || sz_ > 0);
 		assert(!ret || sz_ == 0);
 		return ret;
@@ -1318,7 +1361,7 @@ public:
 	 */
 	bool repOk(std::set<Branch*>& bset) {
 		TIntPair pair = bestStratumAndHam(bset);
-		Branch *b = branchQ_.top();
+		Branch *b = top();
 		assert_eq(pair.first, (b->cost_ >> 14));
 		assert_eq(pair.second, (b->cost_ & ~0xc000));
 		std::set<Branch*>::iterator it;
@@ -1355,8 +1398,28 @@ protected:
 	}
 #endif
 
+	/**
+	 * Return the bucket for branches with cost 'cost'.
+	 */
+	static size_t bucket(uint16_t cost) {
+		size_t stratum = cost >> 14;
+		size_t qual = cost & ~0xc000;
+		return stratum * QUAL_BUCKETS + std::min<size_t>(qual, QUAL_BUCKETS - 1);
+	}
+
+	/**
+	 * Return the front element without logging.
+	 */
+	Branch *top() const {
+		assert_lt(min_, NUM_BUCKETS);
+		assert(!buckets_[min_].empty());
+		return buckets_[min_].front();
+	}
+
 	uint32_t sz_;
-	TBranchQueue branchQ_; // priority queue of branches
+	std::vector<std::vector<Branch*> > buckets_; // heap of branches per cost bucket
+	size_t min_;   // lowest non-empty bucket, or NUM_BUCKETS if empty
+	size_t hi_;    // no bucket above this is non-empty
 	uint32_t patid_;
 	bool verbose_;
 	bool quiet_;
@@ -1429,8 +1492,9 @@ public:
 			assert(b != newtop);
 		}
 #endif
-		// Update this PathManager's cost
-		minCost = branchQ_.front()->cost_;
+		// Update this PathManager's cost; if that was the last branch,
+		// keep its cost
+		minCost = branchQ_.empty() ? b->cost_ : branchQ_.front()->cost_;
 		assert(repOk());
 		return b;
 	}
@@ -1837,9 +1901,9 @@ public:
 		ReadBuf* buf = mate1_ ? &patsrc->bufa() : &patsrc->bufb();
 		len_ = buf->length();
 		rs_->setQuery(*buf, r);
-		initRangeSource((fw_ == ebwtFw_) ? buf->qual : buf->qualRev,
+		initRangeSource((fw_ == ebwtFw_) ? buf->qual : buf->getQualRev(),
 		                buf->fuzzy, buf->alts,
-		                (fw_ == ebwtFw_) ? buf->altQual : buf->altQualRev);
+		                (fw_ == ebwtFw_) ? buf->altQual : buf->getAltQualRev());
 		assert_gt(len_, 0);
 		if(this->done) return;
 		ASSERT_ONLY(allTops_.clear());
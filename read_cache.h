@@ -0,0 +1,219 @@
+/*
+ * read_cache.h
+ *
+ * A bounded, thread-safe cache that maps read sequences to the
+ * alignments found for them, so that duplicate reads (common in
+ * small-RNA, amplicon and CRISPR-screen libraries) are searched only
+ * once.
+ */
+
+#ifndef READ_CACHE_H_
+#define READ_CACHE_H_
+
+#include <iostream>
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "assert_helpers.h"
+#include "threading.h"
+#include "qual.h"
+#include "pat.h"
+#include "hit.h"
+
+/**
+ * Alignment outcome remembered for one distinct read.  'nhits' is the
+ * number of valid alignments the per-thread sink counted for the read
+ * (possibly more than hits.size() if the -m ceiling was exceeded) and
+ * 'hits' holds the alignments that were buffered when the read was
+ * finished, with per-read fields (name, qualities) stripped.
+ */
+struct ReadCacheEnt {
+	uint32_t    nhits;
+	vector<Hit> hits;
+	size_t      bytes; /// approximate footprint, charged against budget
+	bool        ref;   /// CLOCK reference bit; set on every lookup hit
+};
+
+/**
+ * Cache keyed by read sequence (plus per-position quality class when
+ * the alignment policy is quality-aware).  The key space is split into
+ * NSHARDS independently locked shards, each allowed 1/NSHARDS of the
+ * byte budget.  When a shard is over budget it evicts with the CLOCK
+ * (second-chance) policy: entries looked up since they were last
+ * considered get another lap, others are dropped.
+ */
+class ReadCache {
+
+	typedef std::map<std::string, ReadCacheEnt> TMap;
+
+	struct Shard {
+		Shard() : bytes(0), lookups(0), hits(0), inserts(0), evictions(0) { }
+		MUTEX_T  lock;
+		TMap     map;
+		std::deque<TMap::iterator> clock; /// insertion-ordered ring
+		size_t   bytes;
+		uint64_t lookups;
+		uint64_t hits;
+		uint64_t inserts;
+		uint64_t evictions;
+	};
+
+public:
+
+	static const size_t NSHARDS = 64;
+
+	/**
+	 * 'quals' -> include each position's quality class in the key;
+	 * 'maqRound' -> quality class is the Maq-rounded penalty;
+	 * 'color' -> reads are colorspace, so decoding depends on the full
+	 * qualities, primer and trimmed color, which all go in the key.
+	 */
+	ReadCache(size_t bytes, bool quals, bool maqRound, bool color) :
+		shardBytes_(bytes / NSHARDS),
+		quals_(quals),
+		maqRound_(maqRound),
+		color_(color)
+	{ }
+
+	/// Return true iff cached hits keep their qualities; in colorspace
+	/// the decoded qualities are part of the outcome, not the read
+	bool keepsQuals() const { return color_; }
+
+	/**
+	 * Build the cache key for read r into 'key'.
+	 */
+	void makeKey(const ReadBuf& r, std::string& key) const {
+		size_t len = seqan::length(r.patFw);
+		key.clear();
+		key.reserve(len * 2 + 2);
+		for(size_t i = 0; i < len; i++) {
+			key.push_back((char)(int)r.patFw[i]);
+		}
+		if(color_) {
+			key.push_back(r.primer);
+			key.push_back(r.trimc);
+			key.append(seqan::begin(r.qual), len);
+		} else if(quals_) {
+			// Search costs only see the penalty each quality implies,
+			// so reads whose qualities round the same way share a key
+			for(size_t i = 0; i < len; i++) {
+				key.push_back((char)mmPenalty(maqRound_, phredCharToPhredQual(r.qual[i])));
+			}
+		}
+	}
+
+	/**
+	 * Look up 'key'; if present, copy its outcome into 'nhits' and
+	 * 'hits' and return true.
+	 */
+	bool lookup(const std::string& key, uint32_t& nhits, vector<Hit>& hits) {
+		Shard& s = shard(key);
+		ThreadSafe ts(&s.lock);
+		s.lookups++;
+		TMap::iterator it = s.map.find(key);
+		if(it == s.map.end()) return false;
+		s.hits++;
+		it->second.ref = true;
+		nhits = it->second.nhits;
+		hits = it->second.hits;
+		return true;
+	}
+
+	/**
+	 * Remember the outcome for 'key', evicting older entries as
+	 * necessary to stay within the shard's budget.  If another thread
+	 * got there first, keep its copy.
+	 */
+	void insert(const std::string& key, uint32_t nhits, const vector<Hit>& hits) {
+		size_t bytes = key.size() + sizeof(ReadCacheEnt) + 64;
+		for(size_t i = 0; i < hits.size(); i++) {
+			const Hit& h = hits[i];
+			bytes += sizeof(Hit) +
+			         seqan::length(h.patSeq) + seqan::length(h.quals) +
+			         seqan::length(h.colSeq) + seqan::length(h.colQuals) +
+			         h.refcs.size() + h.crefcs.size();
+		}
+		if(bytes > shardBytes_) return; // would never fit
+		Shard& s = shard(key);
+		ThreadSafe ts(&s.lock);
+		std::pair<TMap::iterator, bool> ret =
+			s.map.insert(make_pair(key, ReadCacheEnt()));
+		if(!ret.second) return;
+		ReadCacheEnt& e = ret.first->second;
+		e.nhits = nhits;
+		e.hits = hits;
+		for(size_t i = 0; i < e.hits.size(); i++) {
+			// Re-stamped from the duplicate on replay
+			seqan::clear(e.hits[i].patName);
+			if(!color_) seqan::clear(e.hits[i].quals);
+		}
+		e.bytes = bytes;
+		e.ref = false;
+		s.clock.push_back(ret.first);
+		s.bytes += bytes;
+		s.inserts++;
+		while(s.bytes > shardBytes_) {
+			assert(!s.clock.empty());
+			TMap::iterator vit = s.clock.front();
+			s.clock.pop_front();
+			if(vit->second.ref) {
+				// Second chance
+				vit->second.ref = false;
+				s.clock.push_back(vit);
+				continue;
+			}
+			s.bytes -= vit->second.bytes;
+			s.map.erase(vit);
+			s.evictions++;
+		}
+	}
+
+	/**
+	 * Print lookup, hit-rate and eviction totals.
+	 */
+	void printStats(std::ostream& out) {
+		uint64_t lookups = 0, hits = 0, inserts = 0, evictions = 0;
+		size_t entries = 0, bytes = 0;
+		for(size_t i = 0; i < NSHARDS; i++) {
+			ThreadSafe ts(&shards_[i].lock);
+			lookups   += shards_[i].lookups;
+			hits      += shards_[i].hits;
+			inserts   += shards_[i].inserts;
+			evictions += shards_[i].evictions;
+			entries   += shards_[i].map.size();
+			bytes     += shards_[i].bytes;
+		}
+		out << "Read dedup cache:" << std::endl
+		    << "  lookups: " << lookups << std::endl
+		    << "  hits: " << hits;
+		if(lookups > 0) {
+			out << " (" << (100.0 * hits / lookups) << "%)";
+		}
+		out << std::endl
+		    << "  inserts: " << inserts << std::endl
+		    << "  evictions: " << evictions << std::endl
+		    << "  resident: " << entries << " reads, ~"
+		    << (bytes >> 10) << " KB" << std::endl;
+	}
+
+private:
+
+	/// Pick a shard by hashing the key (FNV-1a)
+	Shard& shard(const std::string& key) {
+		uint32_t h = 2166136261u;
+		for(size_t i = 0; i < key.size(); i++) {
+			h = (h ^ (uint8_t)key[i]) * 16777619u;
+		}
+		return shards_[h % NSHARDS];
+	}
+
+	Shard  shards_[NSHARDS];
+	size_t shardBytes_;
+	bool   quals_;
+	bool   maqRound_;
+	bool   color_;
+};
+
+#endif /*READ_CACHE_H_*/
@@ -0,0 +1,376 @@
+/*
+ * read_sched.h
+ *
+ * Hands reads to the search threads in batches, with idle threads
+ * stealing queued reads from busy ones, so that a thread stuck on a
+ * hard read doesn't hold up reads it has already taken.
+ */
+
+#ifndef READ_SCHED_H_
+#define READ_SCHED_H_
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <stdint.h>
+#include <sys/time.h>
+#include "assert_helpers.h"
+#include "threading.h"
+#include "reorder.h"
+#include "pat.h"
+
+/**
+ * A read (or pair) taken from the input and waiting in, or being
+ * worked on by, a search thread.
+ */
+struct SchedRead {
+	ReadBuf  a;       /// mate a, or the unpaired read
+	ReadBuf  b;       /// mate b
+	uint32_t patid;
+	uint64_t seq;     /// sequence number in the ReorderBuffer, if any
+	bool     seqHeld; /// true -> seq must be committed when done
+};
+
+/**
+ * Each search thread has a queue of reads.  A thread works through its
+ * own queue from the front; when the queue is empty it takes the next
+ * BATCH reads from the input into it, and when it can't do that (the
+ * input is used up, or the --reorder window is full) it steals the
+ * back half of another thread's queue.  So input is read in batches,
+ * reads taken by a thread that then gets stuck on a hard read are
+ * finished by the others, and threads run out of work together.
+ *
+ * Threads never wait for room in the reorder window while any queue
+ * holds reads, so the oldest read in the window is always being worked
+ * on and the ReorderBuffer's deadlock argument still holds.
+ */
+class ReadScheduler {
+
+	/// One thread's queue of reads
+	struct Queue {
+		std::deque<SchedRead*> q;
+		MUTEX_T lock;
+	};
+
+public:
+
+	/// # reads a thread takes from the input at once
+	static const size_t BATCH = 32;
+
+	/**
+	 * Schedule reads from 'src' for threads 1 through 'nthreads'.
+	 */
+	ReadScheduler(PairedPatternSource& src, int nthreads) :
+		src_(src),
+		nthreads_(nthreads),
+		queues_(nthreads + 1),
+		free_(nthreads + 1),
+		inputDone_(false),
+		batches_(0),
+		reads_(0),
+		steals_(0),
+		stolen_(0),
+		waits_(0),
+		waitUs_(0)
+	{
+		for(size_t i = 0; i < queues_.size(); i++) {
+			queues_[i] = new Queue();
+		}
+	}
+
+	~ReadScheduler() {
+		for(size_t i = 0; i < queues_.size(); i++) {
+			assert(queues_[i]->q.empty());
+			delete queues_[i];
+		}
+		for(size_t i = 0; i < all_.size(); i++) {
+			delete all_[i];
+		}
+	}
+
+	/**
+	 * Return the next read for thread 'tid', or NULL if there are no
+	 * more reads for it.  Waits only while other threads' reads hold
+	 * up the reorder window.
+	 */
+	SchedRead *next(int tid) {
+		assert_gt(tid, 0);
+		assert_leq(tid, nthreads_);
+		uint64_t waitStart = 0;
+		SchedRead *r = NULL;
+		while(true) {
+			r = popFront(tid);
+			if(r != NULL) break;
+			// Note how far the window has moved before finding it full,
+			// so a commit in between isn't slept through
+			ReorderBuffer *reorder = src_.reorder();
+			uint64_t emitted = (reorder != NULL) ? reorder->emitted() : 0;
+			if(!inputDone_ && refill(tid)) continue;
+			if(steal(tid)) continue;
+			if(inputDone_) {
+				if(waitStart != 0) addWait(waitStart);
+				return NULL;
+			}
+			// The reorder window is full and no one has queued reads.
+			// Room (and so more input, or the end of it) can only come
+			// from a thread committing a read it's working on.
+			assert(reorder != NULL);
+			if(waitStart == 0) waitStart = nowUs();
+			reorder->waitEmitted(emitted);
+		}
+		if(waitStart != 0) addWait(waitStart);
+		return r;
+	}
+
+	/**
+	 * Give back a read that thread 'tid' is done with, to be reused
+	 * for later reads.
+	 */
+	void release(int tid, SchedRead *r) {
+		free_[tid].push_back(r);
+	}
+
+	/**
+	 * Drop the reads left in thread 'tid''s queue when it stops early
+	 * (see -u), committing their reorder slots so output isn't held
+	 * up behind them.
+	 */
+	void drain(int tid) {
+		Queue& q = *queues_[tid];
+		GUARD_LOCK(q.lock);
+		while(!q.q.empty()) {
+			SchedRead *r = q.q.front();
+			q.q.pop_front();
+			if(r->seqHeld) {
+				r->seqHeld = false;
+				src_.reorder()->commit(r->seq);
+			}
+			release(tid, r);
+		}
+	}
+
+	/// Return the ReorderBuffer reads are numbered for, or NULL
+	ReorderBuffer* reorder() const { return src_.reorder(); }
+
+	/**
+	 * Print how reads were taken from the input and moved between
+	 * threads.
+	 */
+	void printStats(std::ostream& os) const {
+		os << "Read scheduler:" << std::endl
+		   << "  reads: " << reads_ << " in " << batches_ << " batches" << std::endl
+		   << "  steals: " << steals_ << " (" << stolen_ << " reads)" << std::endl
+		   << "  waits: " << waits_ << " (" << (waitUs_ / 1000) << " ms)" << std::endl;
+	}
+
+private:
+
+	/**
+	 * Pop and return the front read of thread 'tid''s queue, or NULL if
+	 * the queue is empty.
+	 */
+	SchedRead *popFront(int tid) {
+		Queue& q = *queues_[tid];
+		GUARD_LOCK(q.lock);
+		if(q.q.empty()) return NULL;
+		SchedRead *r = q.q.front();
+		q.q.pop_front();
+		return r;
+	}
+
+	/**
+	 * Take up to BATCH reads from the input into thread 'tid''s queue.
+	 * Return false if none could be taken.
+	 */
+	bool refill(int tid) {
+		ReorderBuffer *reorder = src_.reorder();
+		if(reorder != NULL) {
+			if(!reorder->tryBeginTake()) return false;
+		} else {
+			fillLock_.lock();
+		}
+		size_t n = 0;
+		while(n < BATCH && !inputDone_) {
+			if(reorder != NULL && n > 0 && !reorder->hasRoom()) break;
+			SchedRead *r = alloc(tid);
+			r->a.clearAll();
+			r->b.clearAll();
+			src_.nextReadPair(r->a, r->b, r->patid);
+			if(r->a.empty()) {
+				inputDone_ = true;
+				release(tid, r);
+				break;
+			}
+			r->seqHeld = (reorder != NULL);
+			r->seq = (reorder != NULL) ? reorder->take() : 0;
+			Queue& q = *queues_[tid];
+			GUARD_LOCK(q.lock);
+			q.q.push_back(r);
+			n++;
+		}
+		if(n > 0) {
+			batches_++;
+			reads_ += n;
+		}
+		if(reorder != NULL) {
+			reorder->endTake();
+		} else {
+			fillLock_.unlock();
+		}
+		return n > 0;
+	}
+
+	/**
+	 * Move the back half of the first non-empty queue after thread
+	 * 'tid''s to the back of 'tid''s queue.  Return false if all other
+	 * queues are empty.
+	 */
+	bool steal(int tid) {
+		for(int i = 1; i < nthreads_; i++) {
+			int victim = (tid - 1 + i) % nthreads_ + 1;
+			Queue& v = *queues_[victim];
+			std::vector<SchedRead*> got;
+			{
+				GUARD_LOCK(v.lock);
+				size_t n = (v.q.size() + 1) / 2;
+				for(size_t j = 0; j < n; j++) {
+					got.push_back(v.q.back());
+					v.q.pop_back();
+				}
+			}
+			if(got.empty()) continue;
+			{
+				// Keep the stolen reads in input order
+				Queue& q = *queues_[tid];
+				GUARD_LOCK(q.lock);
+				for(size_t j = got.size(); j > 0; j--) {
+					q.q.push_back(got[j-1]);
+				}
+			}
+			GUARD_LOCK(statsLock_);
+			steals_++;
+			stolen_ += got.size();
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Return a free SchedRead for thread 'tid', making one if needed.
+	 */
+	SchedRead *alloc(int tid) {
+		std::vector<SchedRead*>& f = free_[tid];
+		if(!f.empty()) {
+			SchedRead *r = f.back();
+			f.pop_back();
+			return r;
+		}
+		SchedRead *r = new SchedRead();
+		GUARD_LOCK(statsLock_);
+		all_.push_back(r);
+		return r;
+	}
+
+	void addWait(uint64_t start) {
+		GUARD_LOCK(statsLock_);
+		waits_++;
+		waitUs_ += nowUs() - start;
+	}
+
+	static uint64_t nowUs() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+
+	PairedPatternSource& src_;
+	int nthreads_;
+	std::vector<Queue*> queues_;                 /// per-thread read queues
+	std::vector<std::vector<SchedRead*> > free_; /// per-thread free SchedReads
+	std::vector<SchedRead*> all_;                /// every SchedRead, for deletion
+	volatile bool inputDone_;                    /// input has run out
+	MUTEX_T fillLock_;  /// serializes refills when not reordering
+	MUTEX_T statsLock_; /// guards all_ and steal/wait counters
+
+	uint64_t batches_; /// # refills that got reads
+	uint64_t reads_;   /// # reads taken from the input
+	uint64_t steals_;  /// # successful steals
+	uint64_t stolen_;  /// # reads stolen
+	uint64_t waits_;   /// # times a thread waited for reorder room
+	uint64_t waitUs_;  /// microseconds spent waiting
+};
+
+/**
+ * A search thread's source of reads from a ReadScheduler.  The current
+ * read lives in a SchedRead rather than in buf1_/buf2_.
+ */
+class ScheduledPatternSourcePerThread : public PatternSourcePerThread {
+public:
+	ScheduledPatternSourcePerThread(ReadScheduler& sched, int tid) :
+		sched_(sched), tid_(tid), cur_(NULL) { }
+
+	virtual ~ScheduledPatternSourcePerThread() {
+		releaseSeq();
+		if(cur_ != NULL) sched_.release(tid_, cur_);
+		sched_.drain(tid_);
+	}
+
+	/**
+	 * Finish with the current read and get the next one, or an empty
+	 * read if there are no more.
+	 */
+	virtual void nextReadPair() {
+		PatternSourcePerThread::nextReadPair();
+		if(cur_ != NULL) {
+			sched_.release(tid_, cur_);
+			cur_ = NULL;
+		}
+		bufa_ = &buf1_;
+		bufb_ = &buf2_;
+		buf1_.clearAll();
+		buf2_.clearAll();
+		SchedRead *r = sched_.next(tid_);
+		if(r == NULL) return;
+		cur_ = r;
+		bufa_ = &r->a;
+		bufb_ = &r->b;
+		patid_ = r->patid;
+		reorder_ = r->seqHeld ? sched_.reorder() : NULL;
+		seq_ = r->seq;
+		seqHeld_ = r->seqHeld;
+	}
+
+private:
+
+	ReadScheduler& sched_;
+	int tid_;
+	SchedRead *cur_; /// read being worked on, or NULL
+};
+
+/**
+ * Factory for a thread's ScheduledPatternSourcePerThreads.
+ */
+class ScheduledPatternSourcePerThreadFactory : public PatternSourcePerThreadFactory {
+public:
+	ScheduledPatternSourcePerThreadFactory(ReadScheduler& sched, int tid) :
+		sched_(sched), tid_(tid) { }
+
+	virtual PatternSourcePerThread* create() const {
+		return new ScheduledPatternSourcePerThread(sched_, tid_);
+	}
+
+	virtual std::vector<PatternSourcePerThread*>* create(uint32_t n) const {
+		std::vector<PatternSourcePerThread*>* v = new std::vector<PatternSourcePerThread*>;
+		for(size_t i = 0; i < n; i++) {
+			v->push_back(new ScheduledPatternSourcePerThread(sched_, tid_));
+			assert(v->back() != NULL);
+		}
+		return v;
+	}
+
+private:
+	ReadScheduler& sched_;
+	int tid_;
+};
+
+#endif /* READ_SCHED_H_ */
@@ -104,6 +104,53 @@ public:
 #endif
 	}
 
+	/**
+	 * Like find(), but look in the sub-range nbegin-nend first and only
+	 * look in the rest of begin-end if nothing was found there.  Return
+	 * 1 if alignments were found in nbegin-nend, 2 if they were found
+	 * only elsewhere in begin-end, 0 if none were found.
+	 */
+	int findNarrowFirst(uint32_t numToFind,
+	                    const size_t tidx,
+	                    const BitPairReference *refs,
+	                    const TDna5Str& qry,
+	                    const TCharStr& quals,
+	                    TIndexOffU begin,
+	                    TIndexOffU end,
+	                    TIndexOffU nbegin,
+	                    TIndexOffU nend,
+	                    TRangeVec& ranges,
+	                    std::vector<TIndexOffU>& results,
+	                    TSetPairs* pairs = NULL,
+	                    TIndexOffU aoff = OFF_MASK,
+	                    bool seedOnLeft = false)
+	{
+		assert_leq(begin, nbegin);
+		assert_leq(nend, end);
+		TIndexOffU qlen = (TIndexOffU)seqan::length(qry);
+		size_t rsz = ranges.size();
+		if(nend - nbegin >= qlen) {
+			find(numToFind, tidx, refs, qry, quals, nbegin, nend,
+			     ranges, results, pairs, aoff, seedOnLeft);
+			if(ranges.size() > rsz) return 1;
+		}
+		// An alignment not entirely within nbegin-nend must start
+		// before nbegin or end after nend
+		TIndexOffU lend = min<TIndexOffU>(end, nbegin + qlen - 1);
+		if(lend - begin >= qlen) {
+			find(numToFind, tidx, refs, qry, quals, begin, lend,
+			     ranges, results, pairs, aoff, seedOnLeft);
+			if(ranges.size() > rsz) return 2;
+		}
+		TIndexOffU rbegin = (nend >= begin + qlen - 1) ? (nend - qlen + 1) : begin;
+		if(end - rbegin >= qlen) {
+			find(numToFind, tidx, refs, qry, quals, rbegin, end,
+			     ranges, results, pairs, aoff, seedOnLeft);
+			if(ranges.size() > rsz) return 2;
+		}
+		return 0;
+	}
+
 	/**
 	 * Find one alignment of qry:quals in the range begin-end in
 	 * reference string ref.  Store the alignment details in range.
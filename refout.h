@@ -0,0 +1,237 @@
+/*
+ * refout.h
+ *
+ * Output for --refout, where alignments to each reference sequence go
+ * to their own file, with memory and open files bounded no matter how
+ * many references there are.
+ */
+
+#ifndef REFOUT_H_
+#define REFOUT_H_
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+#include "assert_helpers.h"
+#include "threading.h"
+
+/**
+ * Collects the output for every reference in a bucket in memory and
+ * writes buckets out to the reference's file (refXXXXX.map) when:
+ *
+ *  - a bucket reaches CHUNK_SZ, in which case it alone is written, or
+ *  - all buckets together reach the memory limit, in which case the
+ *    largest buckets are written until half the limit is free, or
+ *  - the pool is closed.
+ *
+ * At most maxOpen files are open at once; when another is needed, the
+ * least recently written one is closed, and reopened for appending if
+ * more output for it turns up.  A file is only created once its
+ * reference has output, as before.  Records for a reference are
+ * written in the order they were handed to write().
+ */
+class RefOutPool {
+
+public:
+
+	/// Bucket size at which a bucket is written by itself
+	static const size_t CHUNK_SZ = 256 * 1024;
+
+	/// Default limit on bytes held in buckets
+	static const size_t DEFAULT_MEM = 64 * 1024 * 1024;
+
+	/// Default limit on open files
+	static const size_t DEFAULT_MAX_OPEN = 64;
+
+	RefOutPool(size_t numRefs,
+	           bool binary,
+	           size_t memBytes = DEFAULT_MEM,
+	           size_t maxOpen = DEFAULT_MAX_OPEN) :
+		binary_(binary),
+		memBytes_(memBytes),
+		maxOpen_(maxOpen > 0 ? maxOpen : 1),
+		buckets_(numRefs),
+		files_(numRefs, NULL),
+		created_(numRefs, false),
+		lastUse_(numRefs, 0),
+		held_(0),
+		clock_(0),
+		closed_(false),
+		opens_(0),
+		writes_(0)
+	{ }
+
+	~RefOutPool() {
+		close();
+	}
+
+	/// # references (and potential output files)
+	size_t size() const { return buckets_.size(); }
+
+	/**
+	 * Append 'len' bytes of output for reference 'refIdx'.
+	 */
+	void write(size_t refIdx, const char *s, size_t len) {
+		assert_lt(refIdx, buckets_.size());
+		GUARD_LOCK(lock_);
+		assert(!closed_);
+		std::string& b = buckets_[refIdx];
+		if(b.empty()) live_.push_back((uint32_t)refIdx);
+		b.append(s, len);
+		held_ += len;
+		if(b.length() >= CHUNK_SZ) {
+			writeBucket(refIdx);
+		} else if(held_ >= memBytes_) {
+			spill();
+		}
+	}
+
+	/**
+	 * Write out every bucket and close all files.
+	 */
+	void close() {
+		GUARD_LOCK(lock_);
+		if(closed_) return;
+		for(size_t i = 0; i < live_.size(); i++) {
+			writeBucket(live_[i], false);
+		}
+		live_.clear();
+		for(size_t i = 0; i < open_.size(); i++) {
+			fclose(files_[open_[i]]);
+			files_[open_[i]] = NULL;
+		}
+		open_.clear();
+		closed_ = true;
+	}
+
+	/**
+	 * Print how many times files were opened and written.
+	 */
+	void printStats(std::ostream& os) const {
+		os << "Per-reference output:" << std::endl
+		   << "  references: " << buckets_.size() << std::endl
+		   << "  file opens: " << opens_ << " (at most " << maxOpen_ << " open)" << std::endl
+		   << "  writes: " << writes_ << std::endl;
+	}
+
+private:
+
+	/// Orders references by the size of their buckets, largest first
+	struct BiggerBucket {
+		BiggerBucket(const std::vector<std::string>& b) : b_(b) { }
+		bool operator()(uint32_t a, uint32_t b) const {
+			return b_[a].length() > b_[b].length();
+		}
+		const std::vector<std::string>& b_;
+	};
+
+	/**
+	 * Write the largest buckets until at most half the memory limit
+	 * is held.
+	 */
+	void spill() {
+		std::sort(live_.begin(), live_.end(), BiggerBucket(buckets_));
+		size_t i = 0;
+		while(i < live_.size() && held_ > memBytes_ / 2) {
+			writeBucket(live_[i++], false);
+		}
+		live_.erase(live_.begin(), live_.begin() + i);
+	}
+
+	/**
+	 * Write bucket 'refIdx' to its file and empty it.  If 'unlist' is
+	 * set, also take it off the list of non-empty buckets.
+	 */
+	void writeBucket(size_t refIdx, bool unlist = true) {
+		std::string& b = buckets_[refIdx];
+		if(b.empty()) return;
+		FILE *f = file(refIdx);
+		if(fwrite(b.data(), 1, b.length(), f) != b.length()) {
+			std::cerr << "Error while writing output file " << fileName(refIdx) << std::endl;
+			throw 1;
+		}
+		writes_++;
+		held_ -= b.length();
+		// Give the memory back; most buckets stay small
+		std::string().swap(b);
+		if(unlist) {
+			std::vector<uint32_t>::iterator it =
+				std::find(live_.begin(), live_.end(), (uint32_t)refIdx);
+			assert(it != live_.end());
+			*it = live_.back();
+			live_.pop_back();
+		}
+	}
+
+	/**
+	 * Return the open file for 'refIdx', opening it (and closing the
+	 * least recently used file if too many are open) if necessary.
+	 */
+	FILE *file(size_t refIdx) {
+		lastUse_[refIdx] = ++clock_;
+		if(files_[refIdx] != NULL) return files_[refIdx];
+		if(open_.size() >= maxOpen_) {
+			size_t lru = 0;
+			for(size_t i = 1; i < open_.size(); i++) {
+				if(lastUse_[open_[i]] < lastUse_[open_[lru]]) lru = i;
+			}
+			fclose(files_[open_[lru]]);
+			files_[open_[lru]] = NULL;
+			open_[lru] = open_.back();
+			open_.pop_back();
+		}
+		std::string name = fileName(refIdx);
+		// Truncate the first time; append when reopening
+		const char *mode = created_[refIdx] ? (binary_ ? "ab" : "a") : (binary_ ? "wb" : "w");
+		FILE *f = fopen(name.c_str(), mode);
+		if(f == NULL) {
+			std::cerr << "Error: Could not open alignment output file " << name << std::endl;
+			throw 1;
+		}
+		// Buckets are written whole, so stdio's buffer would only cost memory
+		setvbuf(f, NULL, _IONBF, 0);
+		created_[refIdx] = true;
+		files_[refIdx] = f;
+		open_.push_back((uint32_t)refIdx);
+		opens_++;
+		return f;
+	}
+
+	/**
+	 * Return the name of the output file for 'refIdx': refXXXXX.map,
+	 * where XXXXX is the 0-padded reference index.
+	 */
+	static std::string fileName(size_t refIdx) {
+		std::ostringstream oss;
+		oss << "ref";
+		if     (refIdx < 10)    oss << "0000";
+		else if(refIdx < 100)   oss << "000";
+		else if(refIdx < 1000)  oss << "00";
+		else if(refIdx < 10000) oss << "0";
+		oss << refIdx << ".map";
+		return oss.str();
+	}
+
+	bool   binary_;   /// open files in binary mode
+	size_t memBytes_; /// limit on bytes held in buckets
+	size_t maxOpen_;  /// limit on open files
+	std::vector<std::string> buckets_; /// output not yet written, per ref
+	std::vector<FILE*> files_;         /// open file per ref, or NULL
+	std::vector<bool> created_;        /// file has been created
+	std::vector<uint64_t> lastUse_;    /// clock_ at last write, per ref
+	std::vector<uint32_t> live_;       /// refs with non-empty buckets
+	std::vector<uint32_t> open_;       /// refs with open files
+	size_t   held_;   /// bytes held in all buckets
+	uint64_t clock_;  /// # file lookups so far
+	bool     closed_;
+	MUTEX_T  lock_;   /// guards everything
+
+	uint64_t opens_;  /// # fopen calls
+	uint64_t writes_; /// # buckets written
+};
+
+#endif /* REFOUT_H_ */
@@ -0,0 +1,205 @@
+/*
+ * reorder.h
+ *
+ * A bounded reorder buffer that lets several search threads emit their
+ * per-read output in input order (see --reorder).
+ */
+
+#ifndef REORDER_H_
+#define REORDER_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/time.h>
+#include "assert_helpers.h"
+#include "threading.h"
+#include "filebuf.h"
+
+/**
+ * Each read is given a sequence number, in input order, when a thread
+ * takes it from the input.  The output records for read 'seq' are
+ * appended to slot seq % capacity of a ring, and when the thread moves
+ * on to its next read it commits the slot.  Committed slots are
+ * written to the output stream strictly in sequence order.
+ *
+ * A thread may only take a new read if its sequence number is less
+ * than capacity reads ahead of the oldest read not yet written, so a
+ * thread that gets far ahead of a slow read waits instead of letting
+ * the ring grow.  Since a thread commits its previous read before it
+ * takes another, the oldest read always belongs to a thread that isn't
+ * waiting, which rules out deadlock so long as each thread works on
+ * one read at a time.  (The ReadScheduler hands threads batches of
+ * reads, but it never waits for room while another thread holds reads
+ * that haven't been started; see tryBeginTake().)  A waiting thread
+ * sleeps on lock_'s condition variable, which commit() signals when it
+ * writes reads out and so moves the window.
+ */
+class ReorderBuffer {
+
+public:
+
+	/// Default window, in reads, per search thread
+	static const size_t WIN_PER_THREAD = 1024;
+
+	ReorderBuffer(OutFileBuf& out, size_t capacity) :
+		out_(out),
+		cap_(capacity > 0 ? capacity : 1),
+		slots_(cap_),
+		ready_(cap_, false),
+		nextSeq_(0),
+		nextEmit_(0),
+		reads_(0),
+		stalls_(0),
+		stallUs_(0)
+	{ }
+
+	~ReorderBuffer() {
+		assert_eq(nextSeq_, nextEmit_);
+	}
+
+	/**
+	 * Begin taking the next read from the input: lock out other
+	 * takers and wait until the next sequence number fits in the
+	 * window, sleeping until a commit() makes room.  Follow with
+	 * take() if a read was obtained, then endTake().
+	 */
+	void beginTake() {
+		takeLock_.lock();
+		WaitLock::Guard g(lock_);
+		if(fullLocked()) {
+			uint64_t start = nowUs();
+			do { lock_.wait(); } while(fullLocked());
+			stalls_++;
+			stallUs_ += nowUs() - start;
+		}
+	}
+
+	/**
+	 * Like beginTake(), but instead of waiting, return false (without
+	 * holding the lock) if the window is full.
+	 */
+	bool tryBeginTake() {
+		takeLock_.lock();
+		if(full()) {
+			takeLock_.unlock();
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Between beginTake() and endTake(), return true iff another read
+	 * fits in the window.
+	 */
+	bool hasRoom() {
+		return !full();
+	}
+
+	/// Return the sequence number of the read just obtained
+	uint64_t take() {
+		reads_++;
+		return nextSeq_++;
+	}
+
+	/// Let other threads take reads
+	void endTake() {
+		takeLock_.unlock();
+	}
+
+	/// Return the # reads written out so far; see waitEmitted()
+	uint64_t emitted() {
+		WaitLock::Guard g(lock_);
+		return nextEmit_;
+	}
+
+	/**
+	 * Sleep until more than 'n' reads have been written out, i.e.
+	 * until the window has moved since emitted() returned 'n'.
+	 */
+	void waitEmitted(uint64_t n) {
+		WaitLock::Guard g(lock_);
+		while(nextEmit_ == n) lock_.wait();
+	}
+
+	/**
+	 * Append output for read 'seq'.  Only the thread that took 'seq'
+	 * touches its slot until it commits, so no lock is needed.
+	 */
+	void append(uint64_t seq, const char *buf, size_t len) {
+		std::string& s = slots_[seq % cap_];
+		s.append(buf, len);
+	}
+
+	/**
+	 * Mark read 'seq' as complete and write out every complete read
+	 * that is now at the head of the ring.
+	 */
+	void commit(uint64_t seq) {
+		WaitLock::Guard g(lock_);
+		assert_geq(seq, nextEmit_);
+		assert_lt(seq, nextEmit_ + cap_);
+		ready_[seq % cap_] = true;
+		uint64_t before = nextEmit_;
+		size_t i = (size_t)(nextEmit_ % cap_);
+		while(ready_[i]) {
+			std::string& s = slots_[i];
+			if(!s.empty()) {
+				out_.writeChars(s.data(), s.length());
+				s.clear();
+			}
+			ready_[i] = false;
+			nextEmit_++;
+			if(++i == cap_) i = 0;
+		}
+		// Wake takers waiting for room
+		if(nextEmit_ != before) lock_.notifyAll();
+	}
+
+	/**
+	 * Print the number of reads passed through the buffer and how
+	 * often and for how long threads waited for room.
+	 */
+	void printStats(std::ostream& out) const {
+		out << "Reorder buffer:" << std::endl
+		    << "  reads: " << reads_ << " (window " << cap_ << ")" << std::endl
+		    << "  stalls: " << stalls_ << std::endl
+		    << "  stall time: " << (stallUs_ / 1000) << " ms" << std::endl;
+	}
+
+private:
+
+	/// True iff taking another read would overrun the ring
+	bool full() {
+		WaitLock::Guard g(lock_);
+		return fullLocked();
+	}
+
+	/// Like full(), with lock_ held
+	bool fullLocked() const {
+		return nextSeq_ >= nextEmit_ + cap_;
+	}
+
+	static uint64_t nowUs() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+
+	OutFileBuf& out_;
+	size_t cap_;                      /// # reads the ring can hold
+	std::vector<std::string> slots_;  /// output for reads in flight
+	std::vector<bool> ready_;         /// slot committed, not yet written
+	uint64_t nextSeq_;                /// sequence number of next read taken
+	uint64_t nextEmit_;               /// sequence number of next read to write
+	WaitLock lock_;                   /// guards ready_, nextEmit_, out_;
+	                                  /// notified as nextEmit_ moves
+	MUTEX_T takeLock_;                /// serializes taking reads
+
+	uint64_t reads_;   /// # reads taken
+	uint64_t stalls_;  /// # times a taker waited for room
+	uint64_t stallUs_; /// microseconds spent waiting for room
+};
+
+#endif /* REORDER_H_ */
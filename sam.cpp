@@ -15,139 +15,92 @@
 using namespace std;
 
 /**
- * Write the SAM header lines.
+ * Append the name of reference 'i' as given in the @SQ lines.
  */
-void SAMHitSink::appendHeaders(OutFileBuf& os,
-                               size_t numRefs,
-                               const vector<string>& refnames,
-                               bool color,
-                               bool nosq,
-                               ReferenceMap *rmap,
-                               const TIndexOffU* plen,
-                               bool fullRef,
-                               bool noQnameTrunc,
-                               const char *cmdline,
-                               const char *rgline)
+void SAMHitSink::appendSqName(StrBuf& o,
+                              size_t i,
+                              const vector<string>& refnames,
+                              ReferenceMap *rmap,
+                              bool fullRef)
 {
-	ostringstream ss;
-	ss << "@HD\tVN:1.0\tSO:unsorted" << endl;
+	if(!refnames.empty() && rmap != NULL) {
+		appendUptoWs(o, rmap->getName(i), !fullRef);
+	} else if(i < refnames.size()) {
+		appendUptoWs(o, refnames[i], !fullRef);
+	} else {
+		o.appendNum(i);
+	}
+}
+
+/**
+ * Append the SAM header lines to the given buffer.
+ */
+void SAMHitSink::appendHeaderText(StrBuf& o,
+                                  size_t numRefs,
+                                  const vector<string>& refnames,
+                                  bool color,
+                                  bool nosq,
+                                  ReferenceMap *rmap,
+                                  const TIndexOffU* plen,
+                                  bool fullRef,
+                                  bool sorted,
+                                  const char *cmdline,
+                                  const char *rgline)
+{
+	o.append(sorted ? "@HD\tVN:1.0\tSO:coordinate\n" : "@HD\tVN:1.0\tSO:unsorted\n");
 	if(!nosq) {
 		for(size_t i = 0; i < numRefs; i++) {
 			// RNAME
-			ss << "@SQ\tSN:";
-			if(!refnames.empty() && rmap != NULL) {
-				printUptoWs(ss, rmap->getName(i), !fullRef);
-			} else if(i < refnames.size()) {
-				printUptoWs(ss, refnames[i], !fullRef);
-			} else {
-				ss << i;
-			}
-			ss << "\tLN:" << (plen[i] + (color ? 1 : 0)) << endl;
+			o.append("@SQ\tSN:");
+			appendSqName(o, i, refnames, rmap, fullRef);
+			o.append("\tLN:");
+			o.appendNum(plen[i] + (color ? 1 : 0));
+			o.append('\n');
 		}
 	}
 	if(rgline != NULL) {
-		ss << "@RG\t" << rgline << endl;
+		o.append("@RG\t");
+		o.append(rgline);
+		o.append('\n');
 	}
-	ss << "@PG\tID:Bowtie\tVN:" << BOWTIE_VERSION << "\tCL:\"" << cmdline << "\"" << endl;
-	os.writeString(ss.str());
+	o.append("@PG\tID:Bowtie\tVN:");
+	o.append(BOWTIE_VERSION);
+	o.append("\tCL:\"");
+	o.append(cmdline);
+	o.append("\"\n");
 }
 
 /**
- * Append a SAM output record for an unaligned read.
+ * Write the SAM header lines, unless 'nohead' is set.
  */
-void SAMHitSink::appendAligned(ostream& ss,
-                               const Hit& h,
-                               int mapq,
-                               int xms, // value for XM:I field
-                               const vector<string>* refnames,
+void SAMHitSink::appendHeaders(OutFileBuf& os,
+                               size_t numRefs,
+                               const vector<string>& refnames,
+                               bool color,
+                               bool nohead,
+                               bool nosq,
                                ReferenceMap *rmap,
-                               AnnotationMap *amap,
+                               const TIndexOffU* plen,
                                bool fullRef,
                                bool noQnameTrunc,
-                               int offBase)
+                               const char *cmdline,
+                               const char *rgline)
 {
-	// QNAME
-	if(h.mate > 0) {
-		// truncate final 2 chars
-		for(int i = 0; i < (int)seqan::length(h.patName)-2; i++) {
-			if(!noQnameTrunc && isspace((int)h.patName[i])) break;
-			ss << h.patName[i];
-		}
-	} else {
-		for(int i = 0; i < (int)seqan::length(h.patName); i++) {
-			if(!noQnameTrunc && isspace((int)h.patName[i])) break;
-			ss << h.patName[i];
-		}
-	}
-	ss << '\t';
-	// FLAG
-	int flags = 0;
-	if(h.mate == 1) {
-		flags |= SAM_FLAG_PAIRED | SAM_FLAG_FIRST_IN_PAIR | SAM_FLAG_MAPPED_PAIRED;
-	} else if(h.mate == 2) {
-		flags |= SAM_FLAG_PAIRED | SAM_FLAG_SECOND_IN_PAIR | SAM_FLAG_MAPPED_PAIRED;
-	}
-	if(!h.fw) flags |= SAM_FLAG_QUERY_STRAND;
-	if(h.mate > 0 && !h.mfw) flags |= SAM_FLAG_MATE_STRAND;
-	ss << flags << "\t";
-	// RNAME
-	if(refnames != NULL && rmap != NULL) {
-		printUptoWs(ss, rmap->getName(h.h.first), !fullRef);
-	} else if(refnames != NULL && h.h.first < refnames->size()) {
-		printUptoWs(ss, (*refnames)[h.h.first], !fullRef);
-	} else {
-		ss << h.h.first;
-	}
-	// POS
-	ss << '\t' << (h.h.second + 1);
-	// MAPQ
-	ss << "\t" << mapq;
-	// CIGAR
-	ss << '\t' << h.length() << 'M';
-	// MRNM
-	if(h.mate > 0) {
-		ss << "\t=";
-	} else {
-		ss << "\t*";
-	}
-	// MPOS
-	if(h.mate > 0) {
-		ss << '\t' << (h.mh.second + 1);
-	} else {
-		ss << "\t0";
-	}
-	// ISIZE
-	ss << '\t';
-	if(h.mate > 0) {
-		assert_eq(h.h.first, h.mh.first);
-		int64_t inslen = 0;
-		if(h.h.second > h.mh.second) {
-			inslen = (int64_t)h.h.second - (int64_t)h.mh.second + (int64_t)h.length();
-			inslen = -inslen;
-		} else {
-			inslen = (int64_t)h.mh.second - (int64_t)h.h.second + (int64_t)h.mlen;
-		}
-		ss << inslen;
-	} else {
-		ss << '0';
-	}
-	// SEQ
-	ss << '\t' << h.patSeq;
-	// QUAL
-	ss << '\t' << h.quals;
-	//
-	// Optional fields
-	//
-	// Always output stratum
-	ss << "\tXA:i:" << (int)h.stratum;
-	// Always output cost
-	//ss << "\tXC:i:" << (int)h.cost;
-	// Look for SNP annotations falling within the alignment
-	// Output MD field
+	if(nohead) return;
+	StrBuf o;
+	appendHeaderText(o, numRefs, refnames, color, nosq, rmap, plen,
+	                 fullRef, sorter_ != NULL, cmdline, rgline);
+	os.writeChars(o.ptr(), o.length());
+}
+
+/**
+ * Append the value of the MD:Z field for h and return the edit
+ * distance (NM:i).
+ */
+int SAMHitSink::appendMD(StrBuf& o, const Hit& h) {
 	size_t len = length(h.patSeq);
 	int nm = 0;
 	int run = 0;
-	ss << "\tMD:Z:";
 	const FixedBitset<1024> *mms = &h.mms;
 	ASSERT_ONLY(const String<Dna5>* pat = &h.patSeq);
 	const vector<char>* refcs = &h.refcs;
@@ -168,7 +121,8 @@ void SAMHitSink::appendAligned(ostream& ss,
 				char refChar = toupper((*refcs)[i]);
 				ASSERT_ONLY(char qryChar = (h.fw ? (*pat)[i] : (*pat)[len-i-1]));
 				assert_neq(refChar, qryChar);
-				ss << run << refChar;
+				o.appendNum(run);
+				o.append(refChar);
 				run = 0;
 			} else {
 				run++;
@@ -183,49 +137,132 @@ void SAMHitSink::appendAligned(ostream& ss,
 				char refChar = toupper((*refcs)[i]);
 				ASSERT_ONLY(char qryChar = (h.fw ? (*pat)[i] : (*pat)[len-i-1]));
 				assert_neq(refChar, qryChar);
-				ss << run << refChar;
+				o.appendNum(run);
+				o.append(refChar);
 				run = 0;
 			} else {
 				run++;
 			}
 		}
 	}
-	ss << run;
+	o.appendNum(run);
+	return nm;
+}
+
+/**
+ * Append a SAM output record for an unaligned read.
+ */
+void SAMHitSink::appendAligned(StrBuf& o,
+                               const Hit& h,
+                               int mapq,
+                               int xms, // value for XM:I field
+                               const vector<string>* refnames,
+                               ReferenceMap *rmap,
+                               AnnotationMap *amap,
+                               bool fullRef,
+                               bool noQnameTrunc,
+                               int offBase)
+{
+	// QNAME (truncate final 2 chars of mate names)
+	size_t nameLen = qnameLen(h.patName, h.mate > 0, noQnameTrunc);
+	for(size_t i = 0; i < nameLen; i++) {
+		o.append(h.patName[i]);
+	}
+	o.append('\t');
+	// FLAG
+	o.appendNum(alignedFlags(h));
+	o.append('\t');
+	// RNAME
+	appendRefName(o, h.h.first, refnames, rmap, fullRef);
+	// POS
+	o.append('\t');
+	o.appendNum(h.h.second + 1);
+	// MAPQ
+	o.append('\t');
+	o.appendNum(mapq);
+	// CIGAR
+	o.append('\t');
+	o.appendNum(h.length());
+	o.append('M');
+	// MRNM
+	if(h.mate > 0) {
+		o.append("\t=", 2);
+	} else {
+		o.append("\t*", 2);
+	}
+	// MPOS
+	if(h.mate > 0) {
+		o.append('\t');
+		o.appendNum(h.mh.second + 1);
+	} else {
+		o.append("\t0", 2);
+	}
+	// ISIZE
+	o.append('\t');
+	if(h.mate > 0) {
+		o.appendNum(insertLen(h));
+	} else {
+		o.append('0');
+	}
+	// SEQ
+	o.append('\t');
+	appendSeq(o, h.patSeq);
+	// QUAL
+	o.append('\t');
+	appendStr(o, h.quals);
+	//
+	// Optional fields
+	//
+	// Always output stratum
+	o.append("\tXA:i:");
+	o.appendNum((int)h.stratum);
+	// Always output cost
+	//ss << "\tXC:i:" << (int)h.cost;
+	// Output MD field
+	o.append("\tMD:Z:");
+	int nm = appendMD(o, h);
 	// Add optional edit distance field
-	ss << "\tNM:i:" << nm;
-	if(h.color) ss << "\tCM:i:" << h.cmms.count();
+	o.append("\tNM:i:");
+	o.appendNum(nm);
+	if(h.color) {
+		o.append("\tCM:i:");
+		o.appendNum(h.cmms.count());
+	}
 	// Add optional fields reporting the primer base and the downstream color,
 	// which, if they were present, were clipped when the read was read in
 	if(h.color && gReportColorPrimer) {
 		if(h.primer != '?') {
-			ss << "\tZP:Z:" << h.primer;
+			o.append("\tZP:Z:");
+			o.append(h.primer);
 			assert(isprint(h.primer));
 		}
 		if(h.trimc != '?') {
-			ss << "\tZp:Z:" << h.trimc;
+			o.append("\tZp:Z:");
+			o.append(h.trimc);
 			assert(isprint(h.trimc));
 		}
 	}
-	if(xms > 0)  ss << "\tXM:i:" << xms;
-	ss << endl;
+	if(xms > 0) {
+		o.append("\tXM:i:");
+		o.appendNum(xms);
+	}
+	o.append('\n');
 }
 
 /**
  * Report a verbose, human-readable alignment to the appropriate
  * output stream.
  */
-void SAMHitSink::reportSamHit(const Hit& h, int mapq, int xms) {
+void SAMHitSink::reportSamHit(const Hit& h, int mapq, int xms, HitSinkLocal& l) {
 	if(xms == 0) {
 		// Otherwise, this is actually a sampled read and belongs in
 		// the same category as maxed reads
-		HitSink::reportHit(h);
+		HitSink::reportHit(h, l);
 	}
-	ostringstream ss;
-	append(ss, h, mapq, xms);
-	// Make sure to grab lock before writing to output stream
-	lock(h.h.first);
-	out(h.h.first).writeString(ss.str());
-	unlock(h.h.first);
+	size_t mark = l.buf.length();
+	append(localBuf(l, h.h.first), h, mapq, xms);
+	keyRecord(l, mark, h);
+	maybeFlush(l);
 }
 
 /**
@@ -236,26 +273,23 @@ void SAMHitSink::reportSamHits(
     size_t start,
     size_t end,
     int mapq,
-    int xms)
+    int xms,
+    HitSinkLocal& l)
 {
 	assert_geq(end, start);
 	if(end-start == 0) return;
 	assert_gt(hs[start].mate, 0);
-	char buf[4096];
-	lock(0);
+	StrBuf& o = localBuf(l, 0);
 	for(size_t i = start; i < end; i++) {
-		ostringstream ss(ssmode_);
-		ss.rdbuf()->pubsetbuf(buf, 4096);
-		append(ss, hs[i], mapq, xms);
-		out(0).writeChars(buf, ss.tellp());
+		size_t mark = o.length();
+		append(o, hs[i], mapq, xms);
+		keyRecord(l, mark, hs[i]);
 	}
-	unlock(0);
-	mainlock();
 	commitHits(hs);
-	first_ = false;
-	numAligned_++;
-	numReportedPaired_ += (end-start);
-	mainunlock();
+	l.first = false;
+	l.numAligned++;
+	l.numReportedPaired += (end-start);
+	maybeFlush(l);
 }
 
 /**
@@ -265,11 +299,12 @@ void SAMHitSink::reportSamHits(
  */
 void SAMHitSink::reportUnOrMax(PatternSourcePerThread& p,
                                vector<Hit>* hs,
-                               bool un) // lower bound on number of other hits
+                               bool un, // lower bound on number of other hits
+                               HitSinkLocal& l)
 {
-	if(un) HitSink::reportUnaligned(p);
-	else   HitSink::reportMaxed(*hs, p);
-	ostringstream ss;
+	if(un) HitSink::reportUnaligned(p, l);
+	else   HitSink::reportMaxed(*hs, p, l);
+	StrBuf& o = localBuf(l, 0);
 	bool paired = !p.bufb().empty();
 	assert(paired || p.bufa().mate == 0);
 	assert(!paired || p.bufa().mate > 0);
@@ -277,69 +312,68 @@ void SAMHitSink::reportUnOrMax(PatternSourcePerThread& p,
 	assert(!un || hs == NULL || hs->size() == 0);
 	size_t hssz = 0;
 	if(hs != NULL) hssz = hs->size();
+	int flags = SAM_FLAG_UNMAPPED;
+	if(paired) flags |= SAM_FLAG_PAIRED | SAM_FLAG_FIRST_IN_PAIR | SAM_FLAG_MATE_UNMAPPED;
+	size_t mark = o.length();
+	appendUnOrMax(o, p.bufa(),
+	              qnameLen(p.bufa().name, paired, noQnameTrunc_),
+	              flags, (int)(paired ? (hssz+1)/2 : hssz));
+	keyRecord(l, mark, 0xffffffff, 0, (uint64_t)p.patid());
 	if(paired) {
-		// truncate final 2 chars
-		for(int i = 0; i < (int)seqan::length(p.bufa().name)-2; i++) {
-			if(!noQnameTrunc_ && isspace((int)p.bufa().name[i])) break;
-			ss << p.bufa().name[i];
-		}
-	} else {
-		for(int i = 0; i < (int)seqan::length(p.bufa().name); i++) {
-			if(!noQnameTrunc_ && isspace((int)p.bufa().name[i])) break;
-			ss << p.bufa().name[i];
-		}
+		// The second mate's name is truncated only by the final 2 chars
+		mark = o.length();
+		appendUnOrMax(o, p.bufb(),
+		              qnameLen(p.bufb().name, true, true),
+		              SAM_FLAG_UNMAPPED | SAM_FLAG_PAIRED | SAM_FLAG_SECOND_IN_PAIR | SAM_FLAG_MATE_UNMAPPED,
+		              (int)((hssz+1)/2));
+		keyRecord(l, mark, 0xffffffff, 0, (uint64_t)p.patid());
 	}
-	ss << "\t"
-	   << (SAM_FLAG_UNMAPPED | (paired ? (SAM_FLAG_PAIRED | SAM_FLAG_FIRST_IN_PAIR | SAM_FLAG_MATE_UNMAPPED) : 0)) << "\t*"
-	   << "\t0\t0\t*\t*\t0\t0\t"
-	   << p.bufa().patFw << "\t" << p.bufa().qual << "\tXM:i:"
-	   << (paired ? (hssz+1)/2 : hssz);
+	maybeFlush(l);
+}
+
+/**
+ * Append a SAM record for read 'r', which is unaligned or exceeded the
+ * -m ceiling.  We output placeholders for most of the fields.
+ */
+void SAMHitSink::appendUnOrMax(
+	StrBuf& o,
+	const ReadBuf& r,
+	size_t nameLen,
+	int flags,
+	int xms)
+{
+	for(size_t i = 0; i < nameLen; i++) {
+		o.append(r.name[i]);
+	}
+	o.append('\t');
+	o.appendNum(flags);
+	o.append("\t*\t0\t0\t*\t*\t0\t0\t");
+	appendSeq(o, r.patFw);
+	o.append('\t');
+	appendStr(o, r.qual);
+	o.append("\tXM:i:");
+	o.appendNum(xms);
 	// Add optional fields reporting the primer base and the downstream color,
 	// which, if they were present, were clipped when the read was read in
-	if(p.bufa().color && gReportColorPrimer) {
-		if(p.bufa().primer != '?') {
-			ss << "\tZP:Z:" << p.bufa().primer;
-			assert(isprint(p.bufa().primer));
-		}
-		if(p.bufa().trimc != '?') {
-			ss << "\tZp:Z:" << p.bufa().trimc;
-			assert(isprint(p.bufa().trimc));
-		}
-	}
-	ss << endl;
-	if(paired) {
-		// truncate final 2 chars
-		for(int i = 0; i < (int)seqan::length(p.bufb().name)-2; i++) {
-			ss << p.bufb().name[i];
+	if(r.color && gReportColorPrimer) {
+		if(r.primer != '?') {
+			o.append("\tZP:Z:");
+			o.append(r.primer);
+			assert(isprint(r.primer));
 		}
-		ss << "\t"
-		   << (SAM_FLAG_UNMAPPED | (paired ? (SAM_FLAG_PAIRED | SAM_FLAG_SECOND_IN_PAIR | SAM_FLAG_MATE_UNMAPPED) : 0)) << "\t*"
-		   << "\t0\t0\t*\t*\t0\t0\t"
-		   << p.bufb().patFw << "\t" << p.bufb().qual << "\tXM:i:"
-		   << (hssz+1)/2;
-		// Add optional fields reporting the primer base and the downstream color,
-		// which, if they were present, were clipped when the read was read in
-		if(p.bufb().color && gReportColorPrimer) {
-			if(p.bufb().primer != '?') {
-				ss << "\tZP:Z:" << p.bufb().primer;
-				assert(isprint(p.bufb().primer));
-			}
-			if(p.bufb().trimc != '?') {
-				ss << "\tZp:Z:" << p.bufb().trimc;
-				assert(isprint(p.bufb().trimc));
-			}
+		if(r.trimc != '?') {
+			o.append("\tZp:Z:");
+			o.append(r.trimc);
+			assert(isprint(r.trimc));
 		}
-		ss << endl;
 	}
-	lock(0);
-	out(0).writeString(ss.str());
-	unlock(0);
+	o.append('\n');
 }
 
 /**
- * Append a SAM alignment to the given output stream.
+ * Append a SAM alignment to the given buffer.
  */
-void SAMHitSink::append(ostream& ss,
+void SAMHitSink::append(StrBuf& o,
                         const Hit& h,
                         int mapq,
                         int xms,
@@ -350,16 +384,16 @@ void SAMHitSink::append(ostream& ss,
                         bool noQnameTrunc,
                         int offBase)
 {
-	appendAligned(ss, h, mapq, xms, refnames, rmap, amap, fullRef, noQnameTrunc, offBase);
+	appendAligned(o, h, mapq, xms, refnames, rmap, amap, fullRef, noQnameTrunc, offBase);
 }
 
 /**
  * Report maxed-out read; if sampleMax_ is set, then report 1 alignment
  * at random.
  */
-void SAMHitSink::reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p) {
+void SAMHitSink::reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p, HitSinkLocal& l) {
 	if(sampleMax_) {
-		HitSink::reportMaxed(hs, p);
+		HitSink::reportMaxed(hs, p, l);
 		RandomSource rand;
 		rand.init(p.bufa().seed);
 		assert_gt(hs.size(), 0);
@@ -384,7 +418,7 @@ void SAMHitSink::reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p) {
 				int strat = min(hs[i].stratum, hs[i+1].stratum);
 				if(strat == bestStratum) {
 					if(num == r) {
-						reportSamHits(hs, i, i+2, 0, (int)(hs.size()/2)+1);
+						reportSamHits(hs, i, i+2, 0, (int)(hs.size()/2)+1, l);
 						break;
 					}
 					num++;
@@ -399,9 +433,237 @@ void SAMHitSink::reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p) {
 			}
 			assert_leq(num, hs.size());
 			uint32_t r = rand.nextU32() % num;
-			reportSamHit(hs[r], /*MAPQ*/0, /*XM:I*/(int)hs.size()+1);
+			reportSamHit(hs[r], /*MAPQ*/0, /*XM:I*/(int)hs.size()+1, l);
 		}
 	} else {
-		reportUnOrMax(p, &hs, false);
+		reportUnOrMax(p, &hs, false, l);
+	}
+}
+
+/// Append v to o as a little-endian 16-bit value
+static inline void bamPut16(StrBuf& o, uint16_t v) {
+	char b[2] = { (char)v, (char)(v >> 8) };
+	o.append(b, 2);
+}
+
+/// Append v to o as a little-endian 32-bit value
+static inline void bamPut32(StrBuf& o, uint32_t v) {
+	char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+	o.append(b, 4);
+}
+
+/**
+ * Append a 2-character tag with an int32 value.
+ */
+static inline void bamPutTagInt(StrBuf& o, const char *tag, int32_t v) {
+	o.append(tag, 2);
+	o.append('i');
+	bamPut32(o, (uint32_t)v);
+}
+
+/**
+ * Append a 2-character tag with a 1-character string value.
+ */
+static inline void bamPutTagChar(StrBuf& o, const char *tag, char c) {
+	o.append(tag, 2);
+	o.append('Z');
+	o.append(c);
+	o.append('\0');
+}
+
+/**
+ * Return the BAI bin of the 0-based half-open region [beg, end), as
+ * in the SAM specification.
+ */
+static inline uint16_t bamReg2bin(int64_t beg, int64_t end) {
+	--end;
+	if(beg >> 14 == end >> 14) return (uint16_t)(((1<<15)-1)/7 + (beg >> 14));
+	if(beg >> 17 == end >> 17) return (uint16_t)(((1<<12)-1)/7 + (beg >> 17));
+	if(beg >> 20 == end >> 20) return (uint16_t)(((1<<9)-1)/7  + (beg >> 20));
+	if(beg >> 23 == end >> 23) return (uint16_t)(((1<<6)-1)/7  + (beg >> 23));
+	if(beg >> 26 == end >> 26) return (uint16_t)(((1<<3)-1)/7  + (beg >> 26));
+	return 0;
+}
+
+/**
+ * Append the fixed-length part of a BAM record, from refID through
+ * tlen, leaving a placeholder for block_size.  Return the offset of
+ * block_size so that bamEnd() can fill it in.
+ */
+static size_t bamBegin(StrBuf& o,
+                       int32_t refID,
+                       int32_t pos,
+                       size_t nameLen,
+                       int mapq,
+                       uint16_t bin,
+                       uint16_t ncigar,
+                       int flags,
+                       size_t seqLen,
+                       int32_t nextRefID,
+                       int32_t nextPos,
+                       int32_t tlen)
+{
+	size_t off = o.length();
+	bamPut32(o, 0);
+	bamPut32(o, (uint32_t)refID);
+	bamPut32(o, (uint32_t)pos);
+	o.append((char)(nameLen + 1));
+	o.append((char)mapq);
+	bamPut16(o, bin);
+	bamPut16(o, ncigar);
+	bamPut16(o, (uint16_t)flags);
+	bamPut32(o, (uint32_t)seqLen);
+	bamPut32(o, (uint32_t)nextRefID);
+	bamPut32(o, (uint32_t)nextPos);
+	bamPut32(o, (uint32_t)tlen);
+	return off;
+}
+
+/**
+ * Append the read name (NUL-terminated), 4-bit packed sequence and
+ * Phred qualities of a BAM record.  If the qualities don't cover the
+ * sequence they are recorded as absent (0xff).
+ */
+static void bamAppendNameSeqQual(StrBuf& o,
+                                 const String<char>& name,
+                                 size_t nameLen,
+                                 const String<Dna5>& seq,
+                                 const String<char>& qual,
+                                 uint32_t cigar,
+                                 bool hasCigar)
+{
+	for(size_t i = 0; i < nameLen; i++) o.append(name[i]);
+	o.append('\0');
+	if(hasCigar) bamPut32(o, cigar);
+	// A, C, G, T, N in BAM's =ACMGRSVTWYHKDBN encoding
+	static const uint8_t codes[] = { 1, 2, 4, 8, 15 };
+	size_t len = seqan::length(seq);
+	for(size_t i = 0; i < len; i += 2) {
+		uint8_t b = codes[(int)seq[i]] << 4;
+		if(i + 1 < len) b |= codes[(int)seq[i+1]];
+		o.append((char)b);
+	}
+	if(seqan::length(qual) == len) {
+		for(size_t i = 0; i < len; i++) o.append((char)(qual[i] - 33));
+	} else {
+		for(size_t i = 0; i < len; i++) o.append((char)0xff);
+	}
+}
+
+/// Fill in the block_size field of the record starting at 'off'
+static inline void bamEnd(StrBuf& o, size_t off) {
+	uint32_t sz = (uint32_t)(o.length() - off - 4);
+	char b[4] = { (char)sz, (char)(sz >> 8), (char)(sz >> 16), (char)(sz >> 24) };
+	o.overwrite(off, b, 4);
+}
+
+/**
+ * Append a BAM record for an aligned read to the given buffer.  The
+ * fields and optional tags are the same as SAMHitSink::appendAligned
+ * produces.
+ */
+void BAMHitSink::appendBam(StrBuf& o,
+                           const Hit& h,
+                           int mapq,
+                           int xms,
+                           bool noQnameTrunc)
+{
+	// BAM read names, with their NUL, must fit in 8 bits
+	size_t nameLen = min<size_t>(qnameLen(h.patName, h.mate > 0, noQnameTrunc), 254);
+	int64_t pos = h.h.second;
+	size_t rlen = h.length();
+	size_t off = bamBegin(o,
+		(int32_t)h.h.first,
+		(int32_t)pos,
+		nameLen,
+		mapq,
+		bamReg2bin(pos, pos + rlen),
+		1, // one CIGAR op
+		alignedFlags(h),
+		seqan::length(h.patSeq),
+		h.mate > 0 ? (int32_t)h.mh.first : -1,
+		h.mate > 0 ? (int32_t)h.mh.second : -1,
+		h.mate > 0 ? (int32_t)insertLen(h) : 0);
+	bamAppendNameSeqQual(o, h.patName, nameLen, h.patSeq, h.quals,
+	                     (uint32_t)(rlen << 4), // <len>M
+	                     true);
+	bamPutTagInt(o, "XA", (int32_t)h.stratum);
+	o.append("MDZ", 3);
+	int nm = appendMD(o, h);
+	o.append('\0');
+	bamPutTagInt(o, "NM", nm);
+	if(h.color) {
+		bamPutTagInt(o, "CM", (int32_t)h.cmms.count());
+	}
+	if(h.color && gReportColorPrimer) {
+		if(h.primer != '?') bamPutTagChar(o, "ZP", h.primer);
+		if(h.trimc != '?')  bamPutTagChar(o, "Zp", h.trimc);
+	}
+	if(xms > 0) {
+		bamPutTagInt(o, "XM", xms);
+	}
+	bamEnd(o, off);
+}
+
+/**
+ * Append a BAM record for read 'r', which is unaligned or exceeded the
+ * -m ceiling.
+ */
+void BAMHitSink::appendUnOrMax(
+	StrBuf& o,
+	const ReadBuf& r,
+	size_t nameLen,
+	int flags,
+	int xms)
+{
+	nameLen = min<size_t>(nameLen, 254);
+	size_t off = bamBegin(o, -1, -1, nameLen, 0,
+		4680, // bin of an unplaced read
+		0, flags, seqan::length(r.patFw), -1, -1, 0);
+	bamAppendNameSeqQual(o, r.name, nameLen, r.patFw, r.qual, 0, false);
+	bamPutTagInt(o, "XM", xms);
+	if(r.color && gReportColorPrimer) {
+		if(r.primer != '?') bamPutTagChar(o, "ZP", r.primer);
+		if(r.trimc != '?')  bamPutTagChar(o, "Zp", r.trimc);
+	}
+	bamEnd(o, off);
+}
+
+/**
+ * Write the BAM header: magic, SAM header text and the binary list of
+ * reference names and lengths.
+ */
+void BAMHitSink::appendHeaders(OutFileBuf& os,
+                               size_t numRefs,
+                               const vector<string>& refnames,
+                               bool color,
+                               bool nohead,
+                               bool nosq,
+                               ReferenceMap *rmap,
+                               const TIndexOffU* plen,
+                               bool fullRef,
+                               bool noQnameTrunc,
+                               const char *cmdline,
+                               const char *rgline)
+{
+	StrBuf text;
+	if(!nohead) {
+		appendHeaderText(text, numRefs, refnames, color, nosq, rmap, plen,
+		                 fullRef, sorter_ != NULL, cmdline, rgline);
+	}
+	StrBuf o;
+	o.append("BAM\1", 4);
+	bamPut32(o, (uint32_t)text.length());
+	o.append(text.ptr(), text.length());
+	bamPut32(o, (uint32_t)numRefs);
+	StrBuf name;
+	for(size_t i = 0; i < numRefs; i++) {
+		name.clear();
+		appendSqName(name, i, refnames, rmap, fullRef);
+		bamPut32(o, (uint32_t)(name.length() + 1));
+		o.append(name.ptr(), name.length());
+		o.append('\0');
+		bamPut32(o, (uint32_t)(plen[i] + (color ? 1 : 0)));
 	}
+	os.writeChars(o.ptr(), o.length());
 }
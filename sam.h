@@ -69,9 +69,9 @@ public:
 	rmap_(rmap), amap_(amap), fullRef_(fullRef) { }
 
 	/**
-	 * Append a SAM alignment to the given output stream.
+	 * Append a SAM alignment to the given buffer.
 	 */
-	static void append(ostream& ss,
+	static void append(StrBuf& o,
 	                   const Hit& h,
 	                   int mapq,
 	                   int xms,
@@ -83,10 +83,9 @@ public:
 	                   int offBase);
 
 	/**
-	 * Append a SAM alignment for an aligned read to the given output
-	 * stream.
+	 * Append a SAM alignment for an aligned read to the given buffer.
 	 */
-	static void appendAligned(ostream& ss,
+	static void appendAligned(StrBuf& o,
 	                          const Hit& h,
 	                          int mapq,
 	                          int xms,
@@ -101,32 +100,116 @@ public:
 	 * Append a verbose, readable hit to the output stream
 	 * corresponding to the hit.
 	 */
-	virtual void append(ostream& ss, const Hit& h) {
-		SAMHitSink::append(ss, h, defaultMapq_, 0, _refnames, rmap_, amap_, fullRef_, noQnameTrunc_, offBase_);
+	virtual void append(StrBuf& o, const Hit& h) {
+		append(o, h, defaultMapq_, 0);
 	}
 
 	/**
 	 * Append a verbose, readable hit to the output stream
 	 * corresponding to the hit.
 	 */
-	virtual void append(ostream& ss, const Hit& h, int mapq, int xms) {
-		SAMHitSink::append(ss, h, mapq, xms, _refnames, rmap_, amap_, fullRef_, noQnameTrunc_, offBase_);
+	virtual void append(StrBuf& o, const Hit& h, int mapq, int xms) {
+		SAMHitSink::append(o, h, mapq, xms, _refnames, rmap_, amap_, fullRef_, noQnameTrunc_, offBase_);
 	}
 
 	/**
-	 * Write the SAM header lines.
+	 * Append a SAM alignment to the given output stream.
 	 */
-	void appendHeaders(OutFileBuf& os,
-	                   size_t numRefs,
-	                   const vector<string>& refnames,
-	                   bool color,
-	                   bool nosq,
-	                   ReferenceMap *rmap,
-	                   const TIndexOffU* plen,
-	                   bool fullRef,
-	                   bool noQnameTrunc,
-	                   const char *cmdline,
-	                   const char *rgline);
+	virtual void append(ostream& ss, const Hit& h) {
+		StrBuf o;
+		append(o, h);
+		ss.write(o.ptr(), o.length());
+	}
+
+	/**
+	 * Write the SAM header lines, unless 'nohead' is set.
+	 */
+	virtual void appendHeaders(OutFileBuf& os,
+	                           size_t numRefs,
+	                           const vector<string>& refnames,
+	                           bool color,
+	                           bool nohead,
+	                           bool nosq,
+	                           ReferenceMap *rmap,
+	                           const TIndexOffU* plen,
+	                           bool fullRef,
+	                           bool noQnameTrunc,
+	                           const char *cmdline,
+	                           const char *rgline);
+
+	/**
+	 * Append the SAM header lines to the given buffer; 'sorted' sets
+	 * the sort order given in the @HD line to "coordinate".
+	 */
+	static void appendHeaderText(StrBuf& o,
+	                             size_t numRefs,
+	                             const vector<string>& refnames,
+	                             bool color,
+	                             bool nosq,
+	                             ReferenceMap *rmap,
+	                             const TIndexOffU* plen,
+	                             bool fullRef,
+	                             bool sorted,
+	                             const char *cmdline,
+	                             const char *rgline);
+
+	/**
+	 * Append the name of reference 'i' as given in the @SQ lines.
+	 */
+	static void appendSqName(StrBuf& o,
+	                         size_t i,
+	                         const vector<string>& refnames,
+	                         ReferenceMap *rmap,
+	                         bool fullRef);
+
+	/**
+	 * Return the length of the QNAME for a read named 'name': mate
+	 * names lose their final 2 characters (/1 or /2), and unless
+	 * noQnameTrunc is set the name ends at the first whitespace.
+	 */
+	static size_t qnameLen(const String<char>& name, bool mate, bool noQnameTrunc) {
+		int len = (int)seqan::length(name) - (mate ? 2 : 0);
+		if(len <= 0) return 0;
+		if(!noQnameTrunc) {
+			for(int i = 0; i < len; i++) {
+				if(isspace((int)name[i])) return (size_t)i;
+			}
+		}
+		return (size_t)len;
+	}
+
+	/**
+	 * Return the SAM FLAG for an aligned read.
+	 */
+	static int alignedFlags(const Hit& h) {
+		int flags = 0;
+		if(h.mate == 1) {
+			flags |= SAM_FLAG_PAIRED | SAM_FLAG_FIRST_IN_PAIR | SAM_FLAG_MAPPED_PAIRED;
+		} else if(h.mate == 2) {
+			flags |= SAM_FLAG_PAIRED | SAM_FLAG_SECOND_IN_PAIR | SAM_FLAG_MAPPED_PAIRED;
+		}
+		if(!h.fw) flags |= SAM_FLAG_QUERY_STRAND;
+		if(h.mate > 0 && !h.mfw) flags |= SAM_FLAG_MATE_STRAND;
+		return flags;
+	}
+
+	/**
+	 * Return the signed insert size (ISIZE) of a paired alignment.
+	 */
+	static int64_t insertLen(const Hit& h) {
+		assert_gt(h.mate, 0);
+		assert_eq(h.h.first, h.mh.first);
+		if(h.h.second > h.mh.second) {
+			return -((int64_t)h.h.second - (int64_t)h.mh.second + (int64_t)h.length());
+		}
+		return (int64_t)h.mh.second - (int64_t)h.h.second + (int64_t)h.mlen;
+	}
+
+	/**
+	 * Append the value of the MD:Z field for h and return the edit
+	 * distance (NM:i).
+	 */
+	static int appendMD(StrBuf& o, const Hit& h);
 
 protected:
 
@@ -136,14 +219,26 @@ protected:
 	void reportUnOrMax(
 		PatternSourcePerThread& p,
 		vector<Hit>* hs,
-		bool un);
+		bool un,
+		HitSinkLocal& l);
+
+	/**
+	 * Append a record for read 'r', which is unaligned or exceeded the
+	 * -m ceiling; the QNAME is its first 'nameLen' name characters.
+	 */
+	virtual void appendUnOrMax(
+		StrBuf& o,
+		const ReadBuf& r,
+		size_t nameLen,
+		int flags,
+		int xms);
 
 	/**
 	 * Report a verbose, human-readable alignment to the appropriate
 	 * output stream.
 	 */
-	virtual void reportHit(const Hit& h) {
-		reportSamHit(h, defaultMapq_, 0);
+	virtual void reportHit(const Hit& h, HitSinkLocal& l) {
+		reportSamHit(h, defaultMapq_, 0, l);
 	}
 
 	/**
@@ -153,7 +248,8 @@ protected:
 	virtual void reportSamHit(
 		const Hit& h,
 		int mapq,
-		int xms);
+		int xms,
+		HitSinkLocal& l);
 
 	/**
 	 * Report a batch of SAM alignments (e.g. two mates that should be
@@ -164,21 +260,22 @@ protected:
 		size_t start,
 		size_t end,
 		int mapq,
-		int xms);
+		int xms,
+		HitSinkLocal& l);
 
 	/**
 	 * See sam.cpp
 	 */
-	virtual void reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p);
+	virtual void reportMaxed(vector<Hit>& hs, PatternSourcePerThread& p, HitSinkLocal& l);
 
 	/**
 	 * See sam.cpp
 	 */
-	virtual void reportUnaligned(PatternSourcePerThread& p) {
-		reportUnOrMax(p, NULL, true);
+	virtual void reportUnaligned(PatternSourcePerThread& p, HitSinkLocal& l) {
+		reportUnOrMax(p, NULL, true, l);
 	}
 
-private:
+protected:
 	int  offBase_;        /// Add this to reference offsets before outputting.
 	                      /// (An easy way to make things 1-based instead of
 	                      /// 0-based)
@@ -190,4 +287,68 @@ private:
 	bool noQnameTrunc_;   /// true -> don't truncate QNAME at first whitespace
 };
 
+/**
+ * Sink that writes alignments as BAM, the binary form of SAM: records
+ * are encoded straight from each Hit, and the output stream should be
+ * passed through a BGZFWriter to compress it (see --bam).
+ */
+class BAMHitSink : public SAMHitSink {
+public:
+	BAMHitSink(OutFileBuf* out,
+	           int offBase,
+	           ReferenceMap *rmap,
+	           AnnotationMap *amap,
+	           bool fullRef,
+	           bool noQnameTrunc,
+	           int defaultMapq,
+	           DECL_HIT_DUMPS2) :
+	SAMHitSink(out, offBase, rmap, amap, fullRef, noQnameTrunc,
+	           defaultMapq, PASS_HIT_DUMPS2) { }
+
+	using SAMHitSink::append;
+
+	/**
+	 * Append a BAM alignment record to the given buffer.
+	 */
+	virtual void append(StrBuf& o, const Hit& h, int mapq, int xms) {
+		appendBam(o, h, mapq, xms, noQnameTrunc_);
+	}
+
+	/**
+	 * Append a BAM record for an aligned read to the given buffer.
+	 */
+	static void appendBam(StrBuf& o,
+	                      const Hit& h,
+	                      int mapq,
+	                      int xms,
+	                      bool noQnameTrunc);
+
+	/**
+	 * Write the BAM header: the SAM header text (empty if 'nohead' is
+	 * set) followed by the binary reference list, which BAM requires
+	 * even when the text has no @SQ lines.
+	 */
+	virtual void appendHeaders(OutFileBuf& os,
+	                           size_t numRefs,
+	                           const vector<string>& refnames,
+	                           bool color,
+	                           bool nohead,
+	                           bool nosq,
+	                           ReferenceMap *rmap,
+	                           const TIndexOffU* plen,
+	                           bool fullRef,
+	                           bool noQnameTrunc,
+	                           const char *cmdline,
+	                           const char *rgline);
+
+protected:
+
+	virtual void appendUnOrMax(
+		StrBuf& o,
+		const ReadBuf& r,
+		size_t nameLen,
+		int flags,
+		int xms);
+};
+
 #endif /* SAM_H_ */
@@ -0,0 +1,89 @@
+#!/bin/sh
+
+#
+# Run this from the bowtie directory to compare --binout with SAM and
+# the default output: the time bowtie-align takes to write each, the
+# size of each, and the time bowtie-convert takes to read the binary
+# file back into the default output and into SAM.  Also checks that
+# what bowtie-convert prints is identical to what bowtie-align printed
+# directly.  The workloads report many alignments per read so that
+# the time is dominated by formatting and writing hits.
+#
+# Usage: scripts/bench_binout.sh <bowtie-align> <bowtie-convert>
+#
+# Set REPS to change the number of runs each time is the best of
+# (default 3).
+#
+
+ALIGN=$1
+CONVERT=$2
+if [ ! -x "$ALIGN" -o ! -x "$CONVERT" ] ; then
+	echo "Usage: $0 <bowtie-align> <bowtie-convert>"
+	exit 1
+fi
+
+IDX=indexes/e_coli
+READS=reads/e_coli_10000snp.fq
+REPS=${REPS:-3}
+TMP=${TMPDIR:-/tmp}/.bench_binout.$$
+FAIL=0
+
+now() {
+	perl -MTime::HiRes=time -e 'printf "%.3f", time'
+}
+
+elapsed() {
+	perl -e "printf '%.2f', $2 - $1"
+}
+
+# Set 'best' to the least time, over REPS runs, of the command given
+# as arguments, whose standard output goes to $out
+best_of() {
+	best=
+	for rep in `seq 1 $REPS` ; do
+		start=`now`
+		"$@" > $out 2>/dev/null
+		end=`now`
+		t=`elapsed $start $end`
+		if [ -z "$best" ] || perl -e "exit !($t < $best)" ; then
+			best=$t
+		fi
+	done
+}
+
+size() {
+	wc -c < $1 | tr -d ' '
+}
+
+bench() {
+	name=$1
+	shift
+	out=$TMP.txt ; best_of $ALIGN "$@" $IDX $READS ; t_txt=$best
+	out=$TMP.sam ; best_of $ALIGN -S "$@" $IDX $READS ; t_sam=$best
+	out=$TMP.bin ; best_of $ALIGN --binout "$@" $IDX $READS ; t_bin=$best
+	out=$TMP.txt2 ; best_of $CONVERT $TMP.bin ; t_cvt=$best
+	out=$TMP.sam2 ; best_of $CONVERT -S $TMP.bin ; t_cvs=$best
+	echo "$name:"
+	echo "  write: default ${t_txt}s `size $TMP.txt` bytes, SAM ${t_sam}s `size $TMP.sam` bytes, binary ${t_bin}s `size $TMP.bin` bytes"
+	# @PG carries the command line, which differs, and the binary file
+	# has no records for unaligned reads
+	grep -v '^@PG' $TMP.sam | perl -ane 'print if /^@/ || !($F[1] & 4)' > $TMP.sam3
+	grep -v '^@PG' $TMP.sam2 > $TMP.sam4
+	if cmp -s $TMP.txt $TMP.txt2 && cmp -s $TMP.sam3 $TMP.sam4 ; then
+		same=identical
+	else
+		same=DIFFERENT
+		FAIL=1
+	fi
+	echo "  read back: to default ${t_cvt}s, to SAM ${t_cvs}s, output $same"
+}
+
+bench "-a -v 2" -p 1 -a -v 2
+bench "-k 1" -p 1
+
+rm -f $TMP.txt $TMP.sam $TMP.bin $TMP.txt2 $TMP.sam2 $TMP.sam3 $TMP.sam4
+if [ $FAIL -ne 0 ] ; then
+	echo "Binary output benchmark FAILED"
+	exit 1
+fi
+echo "Binary output benchmark PASSED"
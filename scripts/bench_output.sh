@@ -0,0 +1,64 @@
+#!/bin/sh
+
+#
+# Run this from the bowtie directory to compare the output formatting
+# speed of two bowtie-align binaries and check that they produce
+# byte-identical alignments.  The workloads report many alignments per
+# read so that the time is dominated by formatting and writing hits.
+#
+# Usage: scripts/bench_output.sh <old bowtie-align> <new bowtie-align>
+#
+
+OLD=$1
+NEW=$2
+if [ ! -x "$OLD" -o ! -x "$NEW" ] ; then
+	echo "Usage: $0 <old bowtie-align> <new bowtie-align>"
+	exit 1
+fi
+
+IDX=indexes/e_coli
+READS=reads/e_coli_10000snp.fq
+TMP=${TMPDIR:-/tmp}/.bench_output.$$
+FAIL=0
+
+now() {
+	perl -MTime::HiRes=time -e 'printf "%.3f", time'
+}
+
+elapsed() {
+	perl -e "printf '%.2f', $2 - $1"
+}
+
+bench() {
+	name=$1
+	shift
+	for bin in old new ; do
+		if [ $bin = old ] ; then exe=$OLD ; else exe=$NEW ; fi
+		start=`now`
+		$exe "$@" $IDX $READS > $TMP.$bin 2>/dev/null
+		end=`now`
+		eval "t_$bin=\`elapsed $start $end\`"
+	done
+	# @PG carries the version string, which may legitimately differ
+	grep -v '^@PG' $TMP.old > $TMP.old2
+	grep -v '^@PG' $TMP.new > $TMP.new2
+	if cmp -s $TMP.old2 $TMP.new2 ; then
+		same=identical
+	else
+		same=DIFFERENT
+		FAIL=1
+	fi
+	echo "$name: old ${t_old}s, new ${t_new}s, output $same"
+}
+
+bench "verbose -a -v 2" -p 1 -a -v 2
+bench "verbose -a -v 2 --partition 1000" -p 1 -a -v 2 --partition 1000
+bench "SAM -a -v 2" -p 1 -S -a -v 2
+bench "SAM -k 1" -p 1 -S
+
+rm -f $TMP.old $TMP.new $TMP.old2 $TMP.new2
+if [ $FAIL -ne 0 ] ; then
+	echo "Output benchmark FAILED"
+	exit 1
+fi
+echo "Output benchmark PASSED"
@@ -0,0 +1,119 @@
+#!/bin/sh
+
+#
+# Run this from the bowtie directory to compare the paired-end speed of
+# two bowtie-align binaries and check that they produce byte-identical
+# alignments.  Pairs are simulated from the E. coli index with
+# fragments of 200-2500 bases, a 1% error rate and varied qualities,
+# and the workloads use wide -X windows so that the time is dominated
+# by searching the window for the opposite mate.
+#
+# Usage: scripts/bench_pe.sh <old bowtie-align> <new bowtie-align>
+#
+# Set PAIRS to change the number of pairs simulated (default 40000)
+# and REPS to change the number of runs each time is the best of
+# (default 3).
+#
+
+OLD=$1
+NEW=$2
+if [ ! -x "$OLD" -o ! -x "$NEW" ] ; then
+	echo "Usage: $0 <old bowtie-align> <new bowtie-align>"
+	exit 1
+fi
+
+IDX=indexes/e_coli
+INSPECT=${INSPECT:-./bowtie-inspect}
+PAIRS=${PAIRS:-40000}
+REPS=${REPS:-3}
+TMP=${TMPDIR:-/tmp}/.bench_pe.$$
+FAIL=0
+
+if [ ! -x "$INSPECT" ] ; then
+	echo "Could not find bowtie-inspect at $INSPECT; set INSPECT"
+	exit 1
+fi
+
+now() {
+	perl -MTime::HiRes=time -e 'printf "%.3f", time'
+}
+
+elapsed() {
+	perl -e "printf '%.2f', $2 - $1"
+}
+
+# Simulate pairs: mate 1 from the forward strand at the fragment's
+# left end, mate 2 reverse-complemented from its right end
+$INSPECT $IDX | perl -e '
+	my ($pairs, $pre) = @ARGV;
+	my $ref = "";
+	while(<STDIN>) { next if /^>/; chomp; $ref .= $_; }
+	srand(1);
+	my $len = 50;
+	open(M1, ">${pre}_1.fq") || die;
+	open(M2, ">${pre}_2.fq") || die;
+	sub mutate {
+		my ($s, $q) = ("", "");
+		for my $c (split(//, $_[0])) {
+			$c = substr("ACGT", int(rand(4)), 1) if rand() < 0.01;
+			$s .= $c;
+			$q .= chr(33 + 5 + int(rand(36)));
+		}
+		return ($s, $q);
+	}
+	for(my $i = 0; $i < $pairs; $i++) {
+		my $frag = 200 + int(rand(2301));
+		my $off = int(rand(length($ref) - $frag));
+		my $m1 = substr($ref, $off, $len);
+		my $m2 = reverse substr($ref, $off + $frag - $len, $len);
+		$m2 =~ tr/ACGT/TGCA/;
+		next if $m1 =~ /[^ACGT]/ || $m2 =~ /[^ACGT]/;
+		my ($s1, $q1) = mutate($m1);
+		my ($s2, $q2) = mutate($m2);
+		print M1 "\@r$i/1\n$s1\n+\n$q1\n";
+		print M2 "\@r$i/2\n$s2\n+\n$q2\n";
+	}
+	close(M1); close(M2);
+' $PAIRS $TMP
+
+bench() {
+	name=$1
+	shift
+	t_old=
+	t_new=
+	for rep in `seq 1 $REPS` ; do
+		for bin in old new ; do
+			if [ $bin = old ] ; then exe=$OLD ; else exe=$NEW ; fi
+			start=`now`
+			$exe "$@" $IDX -1 ${TMP}_1.fq -2 ${TMP}_2.fq > $TMP.$bin 2>/dev/null
+			end=`now`
+			t=`elapsed $start $end`
+			eval "best=\$t_$bin"
+			if [ -z "$best" ] || perl -e "exit !($t < $best)" ; then
+				eval "t_$bin=$t"
+			fi
+		done
+	done
+	if cmp -s $TMP.old $TMP.new ; then
+		same=identical
+	else
+		same=DIFFERENT
+		FAIL=1
+	fi
+	echo "$name: old ${t_old}s, new ${t_new}s, output $same"
+}
+
+bench "-v 0 -X 3000" -p 1 -v 0 -X 3000
+bench "-v 2 -X 3000" -p 1 -v 2 -X 3000
+bench "-v 3 -X 10000" -p 1 -v 3 -X 10000
+bench "-n 1 -X 10000" -p 1 -n 1 -X 10000
+bench "-n 2 -X 10000" -p 1 -n 2 -X 10000
+bench "-n 3 -l 20 -X 10000" -p 1 -n 3 -l 20 -X 10000
+bench "-n 2 --nomaqround -X 10000" -p 1 -n 2 --nomaqround -X 10000
+
+rm -f $TMP.old $TMP.new ${TMP}_1.fq ${TMP}_2.fq
+if [ $FAIL -ne 0 ] ; then
+	echo "Paired-end benchmark FAILED"
+	exit 1
+fi
+echo "Paired-end benchmark PASSED"
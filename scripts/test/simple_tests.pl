@@ -10,6 +10,8 @@ use Getopt::Long;
 use FindBin qw($Bin); 
 use lib $Bin;
 use List::Util qw(max min);
+use Compress::Zlib;
+use IO::Uncompress::Gunzip qw(gunzip $GunzipError);
 
 my $bowtie = "";
 my $bowtie_build = "";
@@ -31,6 +33,15 @@ if(! -x $bowtie || ! -x $bowtie_build) {
 (-x $bowtie)       || die "Cannot run '$bowtie'";
 (-x $bowtie_build) || die "Cannot run '$bowtie_build'";
 
+# bowtie-convert, which reads --binout files back, is built alongside
+my $bowtie_convert = `dirname $bowtie`;
+chomp($bowtie_convert);
+if(! -x "$bowtie_convert/bowtie-convert") {
+	system("make -C $bowtie_convert bowtie-convert") && die;
+}
+$bowtie_convert .= "/bowtie-convert";
+(-x $bowtie_convert) || die "Cannot run '$bowtie_convert'";
+
 my %prog_pairs = ($bowtie => $bowtie_build, $bowtie." --large-index " => $bowtie_build." --large-index ");
  
 my @cases = (
@@ -202,8 +213,82 @@ my @cases = (
 				 "-C -n 0" ],
 	  hits => { 4 => 1 },
 	  color => 1 },
+
+	# Check that --dedup reports the same hits for each copy of a
+	# duplicated read, including a copy given as its reverse complement
+
+	{ ref    => [ "TTGTTCGTTTGTTCGT" ],
+	  reads  =>   "TTGTTCGT,ACGAACAA,TTGTTCGT",
+	  args   => [ "--dedup -v 0",
+	              "--dedup -n 0" ],
+	  hits   => { 0 => 3, 8 => 3 } },
+
+	{ ref    => [ "TTGCCCGT" ],
+	  reads  =>   "TTGTTCGT,TTGTTCGT",
+	  args   => [ "--dedup -v 2",
+	              "--dedup -n 2" ],
+	  hits   => { 0 => 2 },
+	  edits  =>   "3:C>T,4:C>T" },
+
+	{ ref    => [ "TTGTTCGTTTGTTCGTTTGTTCGT" ],
+	  reads  =>   "TTGTTCGT,TTGTTCGT",
+	  args   => [ "--dedup -v 0",
+	              "--dedup -n 0" ],
+	  report =>   "-m 2 -a",
+	  hits   => { } },
+
+	# Check that reads given as unaligned BAM (-b) align as they do
+	# when given with -c; every other record is stored reverse-
+	# complemented and flagged 0x10
+
+	{ ref    => [ "TTGTTCGTTTGTTCGT" ],
+	  reads  =>   "TTGTTCGT,TTGTTCGT,ACGAACAA",
+	  args   => [ "-v 0",
+	              "-n 0" ],
+	  hits   => { 0 => 3, 8 => 3 },
+	  bam    => 1 },
+
+	{ ref    => [ "TTGCCCGT" ],
+	  reads  =>   "TTGTTCGT,TTGTTCGT",
+	  args   => [ "-v 2",
+	              "-n 2" ],
+	  hits   => { 0 => 2 },
+	  edits  =>   "3:C>T,4:C>T",
+	  bam    => 1 },
+
+	{ ref      => [ "AAAACGAAAGCTTTTATAGATGGGG" ],
+	  mate1s   =>   "AACGAAAG,AACGAAAG",
+	  mate2s   =>   "CCATCTA,TATAAAA",
+	  args     => [ "-v 0",
+	                "-n 0" ],
+	  pairhits => { "2,16" => 1, "2,11" => 1 },
+	  bam      => 1 },
 );
 
+##
+# Cases for checking that the alternative output formats carry the
+# same alignments as -S output for the same reads.
+#
+my @fmt_cases = (
+
+	{ ref    => [ "TTGTTCGTTTGTTCGTAAAACGAAAGCTTTTATAGATGGGG",
+	              "CCAGTTACGATTGACCTAGGCAATCGAGT" ],
+	  reads  =>   "TTGTTCGT,AACGAAAG,ACGAACAA,AACGTAAG,TTACGATT,GGGGGGGG",
+	  args   => [ "-v 1 -a",
+	              "-n 1 -k 1 --best",
+	              "-v 0 -m 1" ] },
+
+	{ ref    => [ "AAAACGAAAGCTTTTATAGATGGGG" ],
+	  mate1s =>   "AACGAAAG,AACGAAAG,GGGGGGGG",
+	  mate2s =>   "CCATCTA,TATAAAA,CCATCTA",
+	  args   => [ "-v 0",
+	              "-n 1 -a" ] },
+);
+
+my $tmpfafn = ".simple_tests.pl.fa";
+my $tmpbamfn = ".simple_tests.pl.bam";
+my $tmpoutfn = ".simple_tests.pl.out";
+
 ##
 # Take a list of reference sequences and write them to a temporary
 # FASTA file of the given name.
@@ -219,6 +304,192 @@ sub writeFasta($$) {
 	close(FA);
 }
 
+##
+# Return a BGZF block holding the given data.
+#
+sub bgzfBlock($) {
+	my $data = shift;
+	my ($d, $st) = deflateInit(-WindowBits => -MAX_WBITS());
+	$st == Z_OK || die "Could not initialize zlib";
+	my ($out, $st1) = $d->deflate($data);
+	my ($fl, $st2) = $d->flush();
+	$out .= $fl;
+	my $bsize = 18 + length($out) + 8;
+	return pack("C4 V C2 v a2 v v", 31, 139, 8, 4, 0, 0, 255, 6, "BC", 2, $bsize - 1).
+	       $out.pack("V V", crc32($data), length($data));
+}
+
+##
+# Return an unaligned BAM record for the given read.  If the 0x10 flag
+# is set, the read is stored reverse-complemented.
+#
+sub bamRecord($$$) {
+	my ($name, $seq, $flag) = @_;
+	if($flag & 0x10) {
+		$seq = reverse($seq);
+		$seq =~ tr/ACGT/TGCA/;
+	}
+	my $codes = "=ACMGRSVTWYHKDBN";
+	my $len = length($seq);
+	my $packed = "";
+	for(my $i = 0; $i < $len; $i += 2) {
+		my $hi = index($codes, substr($seq, $i, 1));
+		my $lo = ($i + 1 < $len) ? index($codes, substr($seq, $i + 1, 1)) : 0;
+		$packed .= chr(($hi << 4) | $lo);
+	}
+	# No qualities (0xff), as with -c
+	my $body = pack("l< l< C C v v v V l< l< l<",
+	                -1, -1, length($name) + 1, 0, 4680, 0, $flag, $len, -1, -1, 0).
+	           "$name\0".$packed.("\xff" x $len);
+	return pack("V", length($body)).$body;
+}
+
+##
+# Write the comma-separated reads, paired with the comma-separated
+# mates if given, to an unaligned BAM file.  Every other read (or mate
+# #1) is stored reverse-complemented.
+#
+sub writeBam($$$) {
+	my ($reads, $mates, $fn) = @_;
+	my @r1 = split(/,/, $reads);
+	my @r2 = defined($mates) ? split(/,/, $mates) : ();
+	my $text = "\@HD\tVN:1.0\tSO:unsorted\n";
+	my $data = "BAM\1".pack("V", length($text)).$text.pack("V", 0);
+	for(my $i = 0; $i < scalar(@r1); $i++) {
+		my $rev = ($i % 2 == 1) ? 0x10 : 0;
+		if(defined($mates)) {
+			$data .= bamRecord("r$i", $r1[$i], 0x4d | $rev);
+			$data .= bamRecord("r$i", $r2[$i], 0x8d);
+		} else {
+			$data .= bamRecord("r$i", $r1[$i], 0x4 | $rev);
+		}
+	}
+	open(BAM, ">$fn") || die "Could not open $fn for writing";
+	binmode(BAM);
+	for(my $i = 0; $i < length($data); $i += 0xff00) {
+		print BAM bgzfBlock(substr($data, $i, 0xff00));
+	}
+	print BAM bgzfBlock("");
+	close(BAM);
+}
+
+##
+# Decode a BAM file and return its header and records as lines of
+# SAM text.
+#
+sub readBam($) {
+	my $fn = shift;
+	my $d;
+	gunzip($fn => \$d, MultiStream => 1) || die "Could not inflate $fn: $GunzipError";
+	substr($d, 0, 4) eq "BAM\1" || die "$fn is not a BAM file";
+	my $ltext = unpack("V", substr($d, 4, 4));
+	my @lines = split(/\n/, substr($d, 8, $ltext));
+	my $o = 8 + $ltext;
+	my $nref = unpack("V", substr($d, $o, 4));
+	$o += 4;
+	my @refs = ();
+	for(my $i = 0; $i < $nref; $i++) {
+		my $lname = unpack("V", substr($d, $o, 4));
+		push @refs, substr($d, $o + 4, $lname - 1);
+		$o += 4 + $lname + 4;
+	}
+	my %intfmt = (c => "c", C => "C", s => "s<", S => "v", i => "l<", I => "V");
+	my %intsz  = (c => 1,   C => 1,   s => 2,    S => 2,   i => 4,    I => 4);
+	while($o < length($d)) {
+		my $r = substr($d, $o + 4, unpack("V", substr($d, $o, 4)));
+		$o += 4 + length($r);
+		my ($refid, $pos, $lname, $mapq, $bin, $ncigar, $flag, $len,
+		    $nrefid, $npos, $tlen) = unpack("l< l< C C v v v V l< l< l<", $r);
+		my $p = 32;
+		my $name = substr($r, $p, $lname - 1);
+		$p += $lname;
+		my $cigar = "";
+		for(my $i = 0; $i < $ncigar; $i++) {
+			my $c = unpack("V", substr($r, $p, 4));
+			$cigar .= ($c >> 4).substr("MIDNSHP=X", $c & 15, 1);
+			$p += 4;
+		}
+		my $seq = "";
+		for(my $i = 0; $i < $len; $i++) {
+			my $b = ord(substr($r, $p + ($i >> 1), 1));
+			$seq .= substr("=ACMGRSVTWYHKDBN", ($i & 1) ? ($b & 15) : ($b >> 4), 1);
+		}
+		$p += ($len + 1) >> 1;
+		my $qual = substr($r, $p, $len);
+		$p += $len;
+		if($len == 0 || ord($qual) == 255) {
+			$qual = "*";
+		} else {
+			$qual = join("", map { chr(ord($_) + 33) } split(//, $qual));
+		}
+		my @f = ($name, $flag, $refid < 0 ? "*" : $refs[$refid], $pos + 1, $mapq,
+		         $cigar eq "" ? "*" : $cigar,
+		         $nrefid < 0 ? "*" : ($nrefid == $refid ? "=" : $refs[$nrefid]),
+		         $npos + 1, $tlen, $len == 0 ? "*" : $seq, $qual);
+		while($p < length($r)) {
+			my ($tag, $t) = (substr($r, $p, 2), substr($r, $p + 2, 1));
+			$p += 3;
+			my $v;
+			if($t eq "A") {
+				$v = substr($r, $p++, 1);
+			} elsif(defined($intfmt{$t})) {
+				$v = unpack($intfmt{$t}, substr($r, $p, $intsz{$t}));
+				$p += $intsz{$t};
+				$t = "i";
+			} elsif($t eq "Z" || $t eq "H") {
+				my $e = index($r, "\0", $p);
+				$v = substr($r, $p, $e - $p);
+				$p = $e + 1;
+			} else {
+				die "Unexpected type '$t' for BAM tag $tag";
+			}
+			push @f, "$tag:$t:$v";
+		}
+		push @lines, join("\t", @f);
+	}
+	return @lines;
+}
+
+##
+# Inflate a gzip (or BGZF) file and return its lines.
+#
+sub readGz($) {
+	my $fn = shift;
+	my $d;
+	gunzip($fn => \$d, MultiStream => 1) || die "Could not inflate $fn: $GunzipError";
+	return split(/\n/, $d);
+}
+
+##
+# Run a command and return its output as a list of lines, leaving out
+# the @PG header line, which holds the command line.
+#
+sub capture($) {
+	my $cmd = shift;
+	print "$cmd\n";
+	my @lines = ();
+	open(BT, "$cmd |") || die "Could not open pipe '$cmd |'";
+	while(<BT>) {
+		chomp;
+		push @lines, $_ unless /^\@PG/;
+	}
+	close(BT);
+	($? == 0) || die "'$cmd' exited with level $?\n";
+	return @lines;
+}
+
+##
+# Die unless two lists of output lines are the same.
+#
+sub sameLines($$$) {
+	my ($what, $exp, $got) = @_;
+	for(my $i = 0; $i < max(scalar(@$exp), scalar(@$got)); $i++) {
+		my $e = defined($exp->[$i]) ? $exp->[$i] : "(end of output)";
+		my $g = defined($got->[$i]) ? $got->[$i] : "(end of output)";
+		$e eq $g || die "$what: line ".($i+1)." differs; expected:\n$e\ngot:\n$g\n";
+	}
+}
+
 ##
 # Run bowtie with given arguments
 #
@@ -232,6 +503,7 @@ sub runBowtie {
 		$reads,
 		$mate1s,
 		$mate2s,
+		$bam,
 		$ls,
 		$rawls) = @_;
 	$args .= " --quiet";
@@ -244,9 +516,15 @@ sub runBowtie {
 	system($cmd);
 	($? == 0) || die "Bad exitlevel from bowtie-build: $?";
 	my $pe = (defined($mate1s) && $mate1s ne "");
+	if($bam) {
+		# Give the reads as an unaligned BAM file instead
+		writeBam($pe ? $mate1s : $reads, $pe ? $mate2s : undef, $tmpbamfn);
+		$mate1s = $reads = $tmpbamfn;
+	}
 	if($pe) {
 		# Paired-end case
 		$cmd = "$run_prog $args .simple_tests.tmp -1 $mate1s -2 $mate2s";
+		$cmd = "$run_prog $args .simple_tests.tmp --12 $mate1s" if $bam;
 		print "$cmd\n";
 		open(BT, "$cmd |") || die "Could not open pipe '$cmd |'";
 		while(<BT>) {
@@ -279,7 +557,6 @@ sub runBowtie {
 	($? == 0) || die "bowtie exited with level $?\n";
 }
 
-my $tmpfafn = ".simple_tests.pl.fa";
 for my $c (@cases) {
     while( my ($run_prg, $bld_prg) = each(%prog_pairs)){
 	   writeFasta($c->{ref}, $tmpfafn);
@@ -295,16 +572,18 @@ for my $c (@cases) {
 		   print $c->{name}."\n" if defined($c->{name});
 		   my $color = 0;
 		   $color = $c->{color} if defined($c->{color});
+		   my $bam = defined($c->{bam}) && $c->{bam};
 		   runBowtie(
                $run_prg,
                $bld_prg,
-			   "$a -c",
+			   $bam ? "$a -b" : "$a -c",
 			   $color,
 			   $tmpfafn,
 			   $c->{report},
 			   $c->{reads},
 			   $c->{mate1s},
 			   $c->{mate2s},
+			   $bam,
 			   \@lines,
 			   \@rawlines);
 		   my $pe = defined($c->{mate1s}) && $c->{mate1s} ne "";
@@ -337,4 +616,85 @@ for my $c (@cases) {
 	   }
    }
 }
+
+for my $c (@fmt_cases) {
+	while(my ($run_prg, $bld_prg) = each(%prog_pairs)) {
+		writeFasta($c->{ref}, $tmpfafn);
+		my $cmd = "$bld_prg --quiet $tmpfafn .simple_tests.tmp";
+		print "$cmd\n";
+		system($cmd);
+		($? == 0) || die "Bad exitlevel from bowtie-build: $?";
+		my $pe = defined($c->{mate1s});
+		my $input = $pe ? "-1 $c->{mate1s} -2 $c->{mate2s}" : $c->{reads};
+		for my $a (@{$c->{args}}) {
+			my $idx = ".simple_tests.tmp $input";
+			my $bt = "$run_prg $a -c --quiet";
+			my @sam = capture("$bt -S $idx");
+			# --bam output must decode to the same SAM
+			capture("$bt --bam $idx $tmpoutfn");
+			my @bam = grep { !/^\@PG/ } readBam($tmpoutfn);
+			sameLines("--bam", \@sam, \@bam);
+			# --sorted output must hold the same records, ordered by
+			# reference and then offset, with unaligned reads last
+			my @sorted = capture("$bt -S --sorted $idx");
+			grep { /^\@HD.*SO:coordinate/ } @sorted or die "--sorted: header lacks SO:coordinate\n";
+			my @exp = sort(grep { !/^\@/ } @sam);
+			my @got = grep { !/^\@/ } @sorted;
+			my @gotSorted = sort(@got);
+			sameLines("--sorted records", \@exp, \@gotSorted);
+			my %refRank = ();
+			for my $l (grep { /^\@SQ/ } @sorted) {
+				$l =~ /\tSN:([^\t]*)/;
+				$refRank{$1} = scalar(keys %refRank);
+			}
+			my ($lastRef, $lastPos) = (-1, 0);
+			for my $l (@got) {
+				my @f = split(/\t/, $l);
+				my $ref = ($f[2] eq "*") ? scalar(keys %refRank) : $refRank{$f[2]};
+				($ref > $lastRef || ($ref == $lastRef && $f[3] >= $lastPos)) ||
+					die "--sorted: record out of order:\n$l\n";
+				($lastRef, $lastPos) = ($ref, $f[3]);
+			}
+			capture("$bt --bam --sorted $idx $tmpoutfn");
+			my @sortedBam = grep { !/^\@PG/ } readBam($tmpoutfn);
+			sameLines("--bam --sorted", \@sorted, \@sortedBam);
+			# --binout must convert back to the default output and to
+			# the same SAM, less the records for unaligned reads
+			my @def = capture("$bt $idx");
+			capture("$bt --binout $idx $tmpoutfn");
+			my @conv = capture("$bowtie_convert $tmpoutfn");
+			sameLines("--binout", \@def, \@conv);
+			my @aligned = grep { /^\@/ || ((split(/\t/))[1] & 4) == 0 } @sam;
+			my @convSam = capture("$bowtie_convert -S $tmpoutfn");
+			sameLines("--binout to SAM", \@aligned, \@convSam);
+			# --gzout output must inflate to the plain output
+			capture("$bt --gzout $idx $tmpoutfn");
+			my @gz = readGz($tmpoutfn);
+			sameLines("--gzout", \@def, \@gz);
+			capture("$bt -S --gzout $idx $tmpoutfn");
+			my @gzSam = grep { !/^\@PG/ } readGz($tmpoutfn);
+			sameLines("-S --gzout", \@sam, \@gzSam);
+			# --reorder -p 3 output must come in input order, just as
+			# one thread's does; repeat the reads so the threads overlap
+			my $many = $pe ?
+				"-1 ".join(",", ($c->{mate1s}) x 100)." -2 ".join(",", ($c->{mate2s}) x 100) :
+				join(",", ($c->{reads}) x 100);
+			my @one = capture("$bt -S .simple_tests.tmp $many");
+			my @reord = capture("$bt -S --reorder -p 3 .simple_tests.tmp $many");
+			sameLines("--reorder -p 3", \@one, \@reord);
+			# --learn-ins must find the same concordant pairs; 1800
+			# pairs are enough for it to learn the insert sizes from
+			# the first 1000 and then search the learned window
+			if($pe) {
+				my $learn = "-1 ".join(",", ($c->{mate1s}) x 600)." -2 ".join(",", ($c->{mate2s}) x 600);
+				my @conc = grep { !/^\@/ && ((split(/\t/))[1] & 2) != 0 }
+					capture("$bt -S .simple_tests.tmp $learn");
+				my @concLearn = grep { !/^\@/ && ((split(/\t/))[1] & 2) != 0 }
+					capture("$bt -S --learn-ins .simple_tests.tmp $learn");
+				scalar(@conc) > 0 || die "--learn-ins: no concordant pairs to compare\n";
+				sameLines("--learn-ins", \@conc, \@concLearn);
+			}
+		}
+	}
+}
 print "PASSED\n";
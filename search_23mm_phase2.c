@@ -14,12 +14,10 @@
 		bt2.setQuery(patsrc->bufa());
 		bt2.setOffs(0, 0, s5, s5, two? s : s5, s);
 		if(bt2.backtrack()) {
-			DONEMASK_SET(patid);
 			continue;
 		}
 		// if nofw is true, then we already did this
 		if(sink->finishedWithStratum(0)) { // no more exact hits are possible
-			DONEMASK_SET(patid);
 			continue;
 		}
 	}
@@ -31,13 +29,11 @@
 		bt2.setQuery(patsrc->bufa());
 		bt2.setOffs(0, 0, s3, s3, two? s : s3, s);
 		if(bt2.backtrack()) {
-			DONEMASK_SET(patid);
 			continue;
 		}
 	}
 
 	if(nofw && sink->finishedWithStratum(1)) {
-		DONEMASK_SET(patid);
 		continue;
 	}
 }
@@ -20,6 +20,8 @@ extern bool showSeed;
 extern bool quiet;
 extern bool gAllowMateContainment;
 extern bool gReportColorPrimer;
+extern bool gReadahead;
+extern size_t gReadBufSz;
 
 extern MUTEX_T gLock;
 
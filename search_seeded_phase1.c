@@ -10,7 +10,7 @@
 	bt1.setReportExacts(true);
 
 	if(verbose) {
-		cout << patFw << ":" << qual << ", " << patRc << ":" << qualRev << endl;
+		cout << patFw << ":" << qual << ", " << patsrc->bufa().getPatRc() << ":" << patsrc->bufa().getQualRev() << endl;
 	}
 
 	bool done = false;
@@ -37,7 +37,6 @@
 	if(done) {
 		ASSERT_NO_HITS_FW(true);
 		ASSERT_NO_HITS_RC(true);
-		DONEMASK_SET(patid);
 		skipped = true;
 		sink->finishRead(*patsrc, true, true);
 		continue;
@@ -50,7 +49,6 @@
 		btf1.setQuery(patsrc->bufa());
 		btf1.setOffs(0, plen, plen, plen, plen, plen);
 		if(btf1.backtrack()) {
-			DONEMASK_SET(patid);
 			continue;
 		}
 	}
@@ -74,7 +72,6 @@
 		if(bt1.backtrack()) {
 			// If we reach here, then we obtained a hit for case
 			// 1R, 2R or 3R and can stop considering this read
-			DONEMASK_SET(patid);
 			continue;
 		}
 		// If we reach here, then cases 1R, 2R, and 3R have
@@ -83,7 +80,6 @@
 	}
 
 	if(nofw && sink->finishedWithStratum(0)) { // no more exact hits are possible
-		DONEMASK_SET(patid);
 		continue;
 	}
 }
@@ -34,12 +34,10 @@
 		if(btf2.backtrack()) {
 			// The reverse complement hit, so we're done with this
 			// read
-			DONEMASK_SET(patid);
 			continue;
 		}
 
 		if(sink->finishedWithStratum(0)) { // no more exact hits are possible
-			DONEMASK_SET(patid);
 			continue;
 		}
 	}
@@ -79,17 +77,17 @@
 		for(size_t i = 0; i < partials.size(); i++) {
 			uint32_t pos0 = partials[i].entry.pos0;
 			assert_lt(pos0, s5);
-			uint8_t oldChar = (uint8_t)patRcRev[pos0];
+			uint8_t oldChar = (uint8_t)patsrc->bufa().getPatRcRev()[pos0];
 			assert_neq(oldChar, partials[i].entry.char0);
 			if(partials[i].entry.pos1 != 0xffff) {
 				uint32_t pos1 = partials[i].entry.pos1;
 				assert_lt(pos1, s5);
-				oldChar = (uint8_t)patRcRev[pos1];
+				oldChar = (uint8_t)patsrc->bufa().getPatRcRev()[pos1];
 				assert_neq(oldChar, partials[i].entry.char1);
 				if(partials[i].entry.pos2 != 0xffff) {
 					uint32_t pos2 = partials[i].entry.pos2;
 					assert_lt(pos2, s5);
-					oldChar = (uint8_t)patRcRev[pos2];
+					oldChar = (uint8_t)patsrc->bufa().getPatRcRev()[pos2];
 					assert_neq(oldChar, partials[i].entry.char2);
 				}
 			}
@@ -24,6 +24,8 @@
 		bool done = false;
 		if(pals.size() > 0) {
 			// Partial alignments exist - extend them
+			String<Dna5>& patRc = patsrc->bufa().getPatRc();
+			String<char>& qualRev = patsrc->bufa().getQualRev();
 			// Set up seed bounds
 			if(qs < s) {
 				btr3.setOffs(0, 0, qs, qs, qs, qs);
@@ -47,7 +49,6 @@
 				if(done) {
 					// The reverse complement hit, so we're done with this
 					// read
-					DONEMASK_SET(patid);
 					// Got a hit; stop processing partial
 					// alignments
 					break;
@@ -83,7 +84,6 @@
 			//	gaveUp = true;
 			//}
 			if(done) {
-				DONEMASK_SET(patid);
 				btr23.resetNumBacktracks();
 				continue;
 			}
@@ -92,7 +92,6 @@
 	}
 
 	if(nofw) { // no more 1-mm-in-seed hits are possible
-		//DONEMASK_SET(patid);
 		continue;
 	}
 
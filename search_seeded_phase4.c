@@ -23,6 +23,8 @@
 		bool done = false;
 		if(pals.size() > 0) {
 			// Partial alignments exist - extend them
+			String<Dna5>& patFwRev = patsrc->bufa().getPatFwRev();
+			String<char>& qualRev = patsrc->bufa().getQualRev();
 			// Set up seed bounds
 			if(qs < s) {
 				btf4.setOffs(0, 0, qs, qs, qs, qs);
@@ -0,0 +1,180 @@
+/*
+ * strbuf.h
+ *
+ * A growable character buffer with fast appenders for strings and
+ * integers, used to format output records without going through
+ * iostreams.
+ */
+
+#ifndef STRBUF_H_
+#define STRBUF_H_
+
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include "assert_helpers.h"
+
+/**
+ * Character buffer that starts out in INLINE_SZ bytes of inline
+ * storage and moves to the heap only if a record outgrows it, so that
+ * a StrBuf on the stack formats typical records without allocating.
+ * Integers are formatted the same way operator<< formats them.
+ */
+class StrBuf {
+public:
+
+	static const size_t INLINE_SZ = 4096;
+
+	StrBuf() : buf_(inline_), len_(0), cap_(INLINE_SZ) { }
+
+	~StrBuf() {
+		if(buf_ != inline_) delete[] buf_;
+	}
+
+	/// Discard contents; keep any heap storage for reuse
+	void clear() { len_ = 0; }
+
+	const char *ptr() const { return buf_; }
+	size_t length() const { return len_; }
+	size_t capacity() const { return cap_; }
+	bool empty() const { return len_ == 0; }
+
+	/**
+	 * Replace the contents with o's, leaving o empty and back in its
+	 * inline storage.  Heap storage changes hands without copying.
+	 */
+	void take(StrBuf& o) {
+		len_ = 0;
+		if(o.buf_ == o.inline_) {
+			append(o.buf_, o.len_);
+		} else {
+			if(buf_ != inline_) delete[] buf_;
+			buf_ = o.buf_;
+			len_ = o.len_;
+			cap_ = o.cap_;
+			o.buf_ = o.inline_;
+			o.cap_ = INLINE_SZ;
+		}
+		o.len_ = 0;
+	}
+
+	void append(char c) {
+		if(len_ == cap_) grow(len_ + 1);
+		buf_[len_++] = c;
+	}
+
+	void append(const char *s, size_t n) {
+		if(len_ + n > cap_) grow(len_ + n);
+		memcpy(buf_ + len_, s, n);
+		len_ += n;
+	}
+
+	void append(const char *s) { append(s, strlen(s)); }
+
+	void append(const std::string& s) { append(s.data(), s.length()); }
+
+	/**
+	 * Replace the n bytes starting at 'off', which must already be in
+	 * the buffer, with s (e.g. to fill in a length field once the
+	 * record it covers is complete).
+	 */
+	void overwrite(size_t off, const char *s, size_t n) {
+		assert_leq(off + n, len_);
+		memcpy(buf_ + off, s, n);
+	}
+
+	/**
+	 * Append the decimal representation of v.
+	 */
+	void appendNum(int v)                { appendSigned(v); }
+	void appendNum(long v)               { appendSigned(v); }
+	void appendNum(long long v)          { appendSigned(v); }
+	void appendNum(unsigned int v)       { appendUnsigned(v); }
+	void appendNum(unsigned long v)      { appendUnsigned(v); }
+	void appendNum(unsigned long long v) { appendUnsigned(v); }
+
+	/**
+	 * Append the decimal representation of v, left-padded with '0's
+	 * to at least 'width' characters.
+	 */
+	void appendNumPadded(uint64_t v, size_t width) {
+		char tmp[24];
+		char *p = toDecimal(v, tmp + sizeof(tmp));
+		size_t n = (tmp + sizeof(tmp)) - p;
+		for(; n < width; n++) append('0');
+		append(p, (tmp + sizeof(tmp)) - p);
+	}
+
+private:
+
+	// Not copyable; may own heap storage
+	StrBuf(const StrBuf&);
+	StrBuf& operator=(const StrBuf&);
+
+	void grow(size_t need) {
+		size_t newCap = cap_ << 1;
+		if(newCap < need) newCap = need;
+		char *newBuf = new char[newCap];
+		memcpy(newBuf, buf_, len_);
+		if(buf_ != inline_) delete[] buf_;
+		buf_ = newBuf;
+		cap_ = newCap;
+	}
+
+	/**
+	 * Write the decimal digits of v so that they end just before
+	 * 'end', two digits per division, and return a pointer to the
+	 * first.
+	 */
+	static char *toDecimal(uint64_t v, char *end) {
+		static const char pairs[] =
+			"00010203040506070809"
+			"10111213141516171819"
+			"20212223242526272829"
+			"30313233343536373839"
+			"40414243444546474849"
+			"50515253545556575859"
+			"60616263646566676869"
+			"70717273747576777879"
+			"80818283848586878889"
+			"90919293949596979899";
+		char *p = end;
+		while(v >= 100) {
+			const char *d = pairs + (v % 100) * 2;
+			v /= 100;
+			*--p = d[1];
+			*--p = d[0];
+		}
+		if(v >= 10) {
+			const char *d = pairs + v * 2;
+			*--p = d[1];
+			*--p = d[0];
+		} else {
+			*--p = (char)('0' + v);
+		}
+		return p;
+	}
+
+	void appendUnsigned(uint64_t v) {
+		char tmp[24];
+		char *p = toDecimal(v, tmp + sizeof(tmp));
+		append(p, (tmp + sizeof(tmp)) - p);
+	}
+
+	void appendSigned(int64_t v) {
+		if(v < 0) {
+			append('-');
+			// Negate without overflowing on the most negative value
+			appendUnsigned((uint64_t)(-(v + 1)) + 1);
+		} else {
+			appendUnsigned((uint64_t)v);
+		}
+	}
+
+	char  *buf_;
+	size_t len_;
+	size_t cap_;
+	char   inline_[INLINE_SZ];
+};
+
+#endif /* STRBUF_H_ */
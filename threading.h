@@ -6,6 +6,7 @@
 # include <tbb/mutex.h>
 # include <tbb/spin_mutex.h>
 # include <tbb/task_group.h>
+# include <tbb/compat/condition_variable>
 #else
 # include "tinythread.h"
 # include "fast_mutex.h"
@@ -54,5 +55,54 @@ private:
 	MUTEX_T *ptr_mutex;
 };
 
+/**
+ * A blocking mutex and a condition variable for threads that must
+ * sleep until another thread changes the state the mutex guards.
+ * MUTEX_T may be a spin lock, which can't be waited on.
+ */
+class WaitLock {
+public:
+	void lock()   { m_.lock(); }
+	void unlock() { m_.unlock(); }
+
+	/**
+	 * Release the lock, which the caller holds, sleep until notified,
+	 * and take the lock again.  Wakeups can be spurious, so callers
+	 * wait in a loop that rechecks their condition.
+	 */
+	void wait() {
+#ifdef WITH_TBB
+		std::unique_lock<tbb::mutex> l(m_, std::adopt_lock);
+		cv_.wait(l);
+		l.release();
+#else
+		cv_.wait(m_);
+#endif
+	}
+
+	/// Wake every thread sleeping in wait()
+	void notifyAll() { cv_.notify_all(); }
+
+	/**
+	 * Hold a WaitLock for the life of the guard.
+	 */
+	class Guard {
+	public:
+		Guard(WaitLock& l) : l_(l) { l_.lock(); }
+		~Guard() { l_.unlock(); }
+	private:
+		WaitLock& l_;
+	};
+
+private:
+#ifdef WITH_TBB
+	tbb::mutex m_;
+	std::condition_variable cv_;
+#else
+	tthread::mutex m_;
+	tthread::condition_variable cv_;
+#endif
+};
+
 #endif
 